@@ -0,0 +1,100 @@
+.intel_syntax noprefix
+.section .text
+_print_int:
+    push rbp
+    mov rbp, rsp
+    mov rbx, 10
+    cmp rax, 0
+    jge .L_print_int_to_str_loop
+    push 45
+    neg rax
+.L_print_int_to_str_loop:
+    xor rdx, rdx
+    div rbx
+    add rdx, 48
+    push rdx
+    test rax, rax
+    jnz .L_print_int_to_str_loop
+.L_print_int_print:
+    mov rax, 1
+    mov rdi, 1
+    mov rsi, rsp
+    mov rdx, rbp
+    sub rdx, rsp
+    syscall
+    mov rsp, rbp
+    pop rbp
+    ret
+_print_newline:
+    mov rax, 1
+    mov rdi, 1
+    mov rsi, 0xA
+    push rsi
+    mov rsi, rsp
+    mov rdx, 1
+    syscall
+    pop rsi
+    ret
+add:
+    push rbp
+    mov rbp, rsp
+    push QWORD PTR [rbp + 24]
+    push QWORD PTR [rbp + 16]
+    pop rax
+    pop rbx
+    add rax, rbx
+    push rax
+    pop rax
+    mov rsp, rbp
+    pop rbp
+    ret
+    add rsp, 16
+    mov rsp, rbp
+    pop rbp
+    ret
+.globl _start
+_start:
+    push rbp
+    mov rbp, rsp
+    mov rax, 10
+    push rax
+    mov rax, 20
+    push rax
+    mov rax, 1
+    push rax
+    push QWORD PTR [rbp - 8]
+    push QWORD PTR [rbp - 16]
+    pop rax
+    pop rbx
+    add rax, rbx
+    push rax
+    pop rax
+    pop rbx
+    add rax, rbx
+    push rax
+    pop rax
+    call _print_int
+    call _print_newline
+    mov rax, 1
+    push rax
+    mov rax, 10
+    push rax
+    call add
+    add rsp, 16
+    push rax
+    mov rax, 100
+    push rax
+    call add
+    add rsp, 16
+    push rax
+    pop rax
+    call _print_int
+    call _print_newline
+    mov rax, 10
+    push rax
+    mov rax, 60
+    pop rdi
+    syscall
+    mov rax, 60
+    mov rdi, 0
+    syscall
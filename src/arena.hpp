@@ -1,5 +1,11 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+#include <vector>
+
 class ArenaAllocator {
 public:
     inline explicit ArenaAllocator(size_t bytes)
@@ -12,9 +18,27 @@ public:
     template <typename T>
     inline T* alloc()
     {
+        if (m_offset + sizeof(T) > m_buffer + m_size) {
+            throw std::bad_alloc();
+        }
         void* offset = m_offset;
         m_offset += sizeof(T);
-        return static_cast<T*>(offset);
+        T* object = new (offset) T {};   //construct in place, nodes hold vectors and strings
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            m_destructors.push_back({ object, [](void* p) { static_cast<T*>(p)->~T(); } });
+        }
+        return object;
+    }
+
+    // Destroys everything allocated so far and starts over at the beginning of the buffer,
+    // so one arena can serve many compilations
+    inline void reset()
+    {
+        for (auto it = m_destructors.rbegin(); it != m_destructors.rend(); ++it) {
+            it->destroy(it->object);
+        }
+        m_destructors.clear();
+        m_offset = m_buffer;
     }
 
     inline ArenaAllocator(const ArenaAllocator& other) = delete;
@@ -23,11 +47,18 @@ public:
 
     inline ~ArenaAllocator()
     {
+        reset();
         free(m_buffer);
     }
 
 private:
+    struct Destructor {
+        void* object;
+        void (*destroy)(void*);
+    };
+
     size_t m_size;
     std::byte* m_buffer;
     std::byte* m_offset;
-};
\ No newline at end of file
+    std::vector<Destructor> m_destructors;
+};
@@ -0,0 +1,834 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "error.hpp"
+
+// Assembles the NASM subset the generator emits into x86-64 machine code: the integer
+// instructions it uses with register, immediate and [base + index * scale + disp] or
+// [rel label] operands, labels (.local ones included), db/dw/dd/dq, resb..resq, times
+// and align in .text, .rodata, .data and .bss. Every label reference is encoded with a
+// 32 bit displacement, so one pass is enough and references are patched by whoever
+// places the sections in memory.
+class Assembler {
+public:
+    enum class SectionId { text, rodata, data, bss };
+
+    struct Section {
+        std::vector<uint8_t> bytes;     // empty for .bss
+        size_t size = 0;
+    };
+
+    struct Symbol {
+        SectionId section;
+        size_t offset;
+    };
+
+    // A label reference: rel32 holds label - (offset of the instruction end), abs64 the address.
+    struct Fixup {
+        SectionId section;
+        size_t offset;
+        size_t end;
+        std::string label;
+        bool absolute;
+    };
+
+    // syscall_target, if given, turns every syscall instruction into a call to that label
+    inline explicit Assembler(std::string syscall_target = "")
+        : m_syscall_target(std::move(syscall_target))
+    {
+    }
+
+    // can be called again to add more code, labels of earlier sources stay visible
+    void assemble(const std::string& source)
+    {
+        std::istringstream lines(source);
+        std::string line;
+        while (std::getline(lines, line)) {
+            m_line++;
+            assemble_line(line);
+        }
+    }
+
+    [[nodiscard]] const Section& section(SectionId id) const
+    {
+        return m_sections[static_cast<size_t>(id)];
+    }
+
+    [[nodiscard]] const std::unordered_map<std::string, Symbol>& symbols() const
+    {
+        return m_symbols;
+    }
+
+    [[nodiscard]] const std::vector<Fixup>& fixups() const
+    {
+        return m_fixups;
+    }
+
+private:
+    struct Operand {
+        enum class Kind { reg, imm, mem, label };
+        Kind kind = Kind::imm;
+        int size = 0;           // in bytes, 0 where the operand doesn't tell
+        int reg = -1;
+        int64_t imm = 0;
+        int base = -1;          // memory: base and index register, -1 for none
+        int index = -1;
+        int scale = 1;
+        int64_t disp = 0;
+        std::string label;      // jump target, or the label of a [rel label] operand
+    };
+
+    // one instruction being encoded, with at most one label reference
+    struct Encoding {
+        std::vector<uint8_t> bytes {};
+        std::optional<size_t> rel_at {};
+        std::string label {};
+    };
+
+    [[noreturn]] void error(const std::string& message) const
+    {
+        throw CompileError("Assembler error on line " + std::to_string(m_line) + ": " + message);
+    }
+
+    Section& current()
+    {
+        return m_sections[static_cast<size_t>(m_section)];
+    }
+
+    void emit(const std::vector<uint8_t>& bytes)
+    {
+        if (m_section == SectionId::bss) {
+            if (std::any_of(bytes.begin(), bytes.end(), [](uint8_t byte) { return byte != 0; })) {
+                error("initialized data in .bss");
+            }
+        } else {
+            current().bytes.insert(current().bytes.end(), bytes.begin(), bytes.end());
+        }
+        current().size += bytes.size();
+    }
+
+    static std::string trim(const std::string& text)
+    {
+        size_t begin = text.find_first_not_of(" \t\r");
+        if (begin == std::string::npos) {
+            return "";
+        }
+        size_t end = text.find_last_not_of(" \t\r");
+        return text.substr(begin, end - begin + 1);
+    }
+
+    // splits on commas that are outside of quotes and brackets
+    static std::vector<std::string> split_operands(const std::string& text)
+    {
+        std::vector<std::string> operands;
+        std::string operand;
+        char quote = 0;
+        int depth = 0;
+        for (char c : text) {
+            if (quote) {
+                quote = c == quote ? 0 : quote;
+            } else if (c == '"' || c == '\'') {
+                quote = c;
+            } else if (c == '[') {
+                depth++;
+            } else if (c == ']') {
+                depth--;
+            } else if (c == ',' && depth == 0) {
+                operands.push_back(trim(operand));
+                operand.clear();
+                continue;
+            }
+            operand += c;
+        }
+        if (!trim(operand).empty()) {
+            operands.push_back(trim(operand));
+        }
+        return operands;
+    }
+
+    static std::string lower(std::string text)
+    {
+        for (char& c : text) {
+            c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        }
+        return text;
+    }
+
+    void assemble_line(const std::string& raw)
+    {
+        // drop the comment, a ';' in a string doesn't start one
+        std::string line;
+        char quote = 0;
+        for (char c : raw) {
+            if (!quote && c == ';') {
+                break;
+            }
+            if (quote) {
+                quote = c == quote ? 0 : quote;
+            } else if (c == '"' || c == '\'') {
+                quote = c;
+            }
+            line += c;
+        }
+        line = trim(line);
+        if (line.empty() || line.front() == '%') {
+            return;     // preprocessor lines like %line carry no code
+        }
+
+        size_t name_end = line.find_first_of(" \t:");
+        if (name_end != std::string::npos && line[name_end] == ':') {
+            define_label(line.substr(0, name_end));
+            line = trim(line.substr(name_end + 1));
+            if (line.empty()) {
+                return;
+            }
+        }
+
+        size_t space = line.find_first_of(" \t");
+        std::string mnemonic = lower(line.substr(0, space));
+        std::string rest = space == std::string::npos ? "" : trim(line.substr(space));
+
+        if (mnemonic == "section" || mnemonic == "segment") {
+            std::string name = lower(rest.substr(0, rest.find_first_of(" \t")));
+            if (name == ".text") {
+                m_section = SectionId::text;
+            } else if (name == ".rodata") {
+                m_section = SectionId::rodata;
+            } else if (name == ".data") {
+                m_section = SectionId::data;
+            } else if (name == ".bss") {
+                m_section = SectionId::bss;
+            } else {
+                error("unknown section " + name);
+            }
+        } else if (mnemonic == "global" || mnemonic == "extern" || mnemonic == "default" || mnemonic == "bits") {
+            // nothing to do for code that is placed in memory directly
+        } else if (mnemonic == "times") {
+            size_t count_end = rest.find_first_of(" \t");
+            int64_t count = number(rest.substr(0, count_end)).value_or(-1);
+            if (count < 0 || count_end == std::string::npos) {
+                error("bad times count");
+            }
+            for (int64_t i = 0; i < count; i++) {
+                assemble_line(rest.substr(count_end));
+            }
+        } else if (mnemonic == "align") {
+            size_t alignment = static_cast<size_t>(number(rest).value_or(0));
+            if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+                error("bad alignment " + rest);
+            }
+            uint8_t fill = m_section == SectionId::text ? 0x90 : 0;
+            while (current().size % alignment != 0) {
+                emit({ fill });
+            }
+        } else if (mnemonic == "db" || mnemonic == "dw" || mnemonic == "dd" || mnemonic == "dq") {
+            data(mnemonic, rest);
+        } else if (mnemonic.starts_with("res") && mnemonic.size() == 4) {
+            size_t width = data_width(mnemonic.back());
+            int64_t count = number(rest).value_or(-1);
+            if (width == 0 || count < 0) {
+                error("bad " + mnemonic);
+            }
+            emit(std::vector<uint8_t>(width * static_cast<size_t>(count), 0));
+        } else {
+            std::vector<Operand> operands;
+            for (const std::string& text : split_operands(rest)) {
+                operands.push_back(parse_operand(text));
+            }
+            Encoding encoding = encode(mnemonic, operands);
+            size_t start = current().size;
+            emit(encoding.bytes);
+            if (encoding.rel_at) {
+                m_fixups.push_back({ m_section, start + *encoding.rel_at, current().size, encoding.label, false });
+            }
+        }
+    }
+
+    void define_label(const std::string& name)
+    {
+        std::string full = name;
+        if (name.starts_with(".")) {
+            full = m_scope + name;
+        } else {
+            m_scope = name;
+        }
+        if (!m_symbols.emplace(full, Symbol { m_section, current().size }).second) {
+            error("label defined twice: " + full);
+        }
+    }
+
+    // the name a label reference in the current scope means
+    [[nodiscard]] std::string resolve(const std::string& name) const
+    {
+        return name.starts_with(".") ? m_scope + name : name;
+    }
+
+    static size_t data_width(char suffix)
+    {
+        switch (suffix) {
+            case 'b': return 1;
+            case 'w': return 2;
+            case 'd': return 4;
+            case 'q': return 8;
+            default: return 0;
+        }
+    }
+
+    void data(const std::string& directive, const std::string& rest)
+    {
+        size_t width = data_width(directive.back());
+        for (const std::string& item : split_operands(rest)) {
+            if (item.size() >= 2 && (item.front() == '"' || item.front() == '\'') && item.back() == item.front()
+                && (item.size() != 3 || item.front() == '"')) {
+                // a string: one element per character, padded to the element width
+                for (size_t i = 1; i + 1 < item.size(); i++) {
+                    std::vector<uint8_t> bytes(width, 0);
+                    bytes[0] = static_cast<uint8_t>(item[i]);
+                    emit(bytes);
+                }
+            } else if (auto value = number(item)) {
+                emit(little_endian(*value, width));
+            } else if (width == 8) {
+                m_fixups.push_back({ m_section, current().size, current().size + 8, resolve(item), true });
+                emit(little_endian(0, 8));
+            } else {
+                error("bad data item " + item);
+            }
+        }
+    }
+
+    static std::vector<uint8_t> little_endian(int64_t value, size_t width)
+    {
+        std::vector<uint8_t> bytes;
+        for (size_t i = 0; i < width; i++) {
+            bytes.push_back(static_cast<uint8_t>(static_cast<uint64_t>(value) >> (8 * i)));
+        }
+        return bytes;
+    }
+
+    // decimal, 0x hex or a 'c' character constant. Values wrap to 64 bits like NASM's.
+    static std::optional<int64_t> number(const std::string& raw)
+    {
+        std::string text = trim(raw);
+        if (text.size() == 3 && text.front() == '\'' && text.back() == '\'') {
+            return static_cast<unsigned char>(text[1]);
+        }
+        bool negative = text.starts_with("-");
+        std::string digits = negative ? trim(text.substr(1)) : text;
+        if (digits.empty()) {
+            return {};
+        }
+        int base = 10;
+        if (digits.starts_with("0x") || digits.starts_with("0X")) {
+            base = 16;
+            digits = digits.substr(2);
+        }
+        char* end = nullptr;
+        uint64_t value = std::strtoull(digits.c_str(), &end, base);
+        if (digits.empty() || *end != '\0' || !std::isxdigit(static_cast<unsigned char>(digits.front()))) {
+            return {};
+        }
+        return static_cast<int64_t>(negative ? 0 - value : value);
+    }
+
+    // register number and size in bytes
+    static std::optional<std::pair<int, int>> register_of(const std::string& name)
+    {
+        static const std::unordered_map<std::string, std::pair<int, int>> registers = [] {
+            std::unordered_map<std::string, std::pair<int, int>> table;
+            const char* names64[] = { "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi" };
+            const char* names32[] = { "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi" };
+            const char* names16[] = { "ax", "cx", "dx", "bx", "sp", "bp", "si", "di" };
+            const char* names8[] = { "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil" };
+            for (int i = 0; i < 8; i++) {
+                table[names64[i]] = { i, 8 };
+                table[names32[i]] = { i, 4 };
+                table[names16[i]] = { i, 2 };
+                table[names8[i]] = { i, 1 };
+            }
+            for (int i = 8; i < 16; i++) {
+                std::string name = "r" + std::to_string(i);
+                table[name] = { i, 8 };
+                table[name + "d"] = { i, 4 };
+                table[name + "w"] = { i, 2 };
+                table[name + "b"] = { i, 1 };
+            }
+            return table;
+        }();
+        auto it = registers.find(lower(name));
+        if (it == registers.end()) {
+            return {};
+        }
+        return it->second;
+    }
+
+    Operand parse_operand(const std::string& raw)
+    {
+        Operand operand;
+        std::string text = trim(raw);
+        static const std::pair<const char*, int> size_keywords[] = { { "byte", 1 }, { "word", 2 }, { "dword", 4 }, { "qword", 8 } };
+        for (const auto& [keyword, size] : size_keywords) {
+            std::string prefix = lower(text.substr(0, std::string(keyword).size()));
+            if (prefix == keyword && text.size() > prefix.size() && (text[prefix.size()] == ' ' || text[prefix.size()] == '[')) {
+                operand.size = size;
+                text = trim(text.substr(prefix.size()));
+                break;
+            }
+        }
+
+        if (text.starts_with("[")) {
+            if (!text.ends_with("]")) {
+                error("bad memory operand " + raw);
+            }
+            operand.kind = Operand::Kind::mem;
+            parse_address(trim(text.substr(1, text.size() - 2)), operand);
+        } else if (auto reg = register_of(text)) {
+            operand.kind = Operand::Kind::reg;
+            operand.reg = reg->first;
+            operand.size = reg->second;
+        } else if (auto value = number(text)) {
+            operand.kind = Operand::Kind::imm;
+            operand.imm = *value;
+        } else {
+            operand.kind = Operand::Kind::label;
+            operand.label = resolve(text);
+        }
+        return operand;
+    }
+
+    // base + index * scale + disp in any order, or rel label [+ disp]
+    void parse_address(std::string text, Operand& operand)
+    {
+        bool rip_relative = lower(text).starts_with("rel ");
+        if (rip_relative) {
+            text = trim(text.substr(4));
+        }
+        std::vector<std::pair<bool, std::string>> terms;     // (negated, term)
+        std::string term;
+        bool negated = false;
+        for (char c : text) {
+            if ((c == '+' || c == '-') && !trim(term).empty()) {
+                terms.emplace_back(negated, trim(term));
+                term.clear();
+                negated = c == '-';
+            } else if (c == '-' && trim(term).empty()) {
+                negated = !negated;
+            } else if (c != '+') {
+                term += c;
+            }
+        }
+        if (!trim(term).empty()) {
+            terms.emplace_back(negated, trim(term));
+        }
+
+        for (const auto& [minus, item] : terms) {
+            if (auto value = number(item)) {
+                operand.disp += minus ? -*value : *value;
+                continue;
+            }
+            size_t star = item.find('*');
+            if (star != std::string::npos) {
+                std::string lhs = trim(item.substr(0, star));
+                std::string rhs = trim(item.substr(star + 1));
+                auto reg = register_of(lhs) ? register_of(lhs) : register_of(rhs);
+                auto scale = number(register_of(lhs) ? rhs : lhs);
+                if (!reg || !scale || reg->second != 8 || minus || (*scale != 1 && *scale != 2 && *scale != 4 && *scale != 8)) {
+                    error("bad index " + item);
+                }
+                operand.index = reg->first;
+                operand.scale = static_cast<int>(*scale);
+            } else if (auto reg = register_of(item); reg && reg->second == 8 && !minus) {
+                if (operand.base == -1) {
+                    operand.base = reg->first;
+                } else if (operand.index == -1) {
+                    operand.index = reg->first;
+                } else {
+                    error("too many registers in [" + text + "]");
+                }
+            } else if (rip_relative && operand.label.empty() && !minus) {
+                operand.label = resolve(item);
+            } else {
+                error("bad address term " + item);
+            }
+        }
+        if (rip_relative && (operand.label.empty() || operand.base != -1 || operand.index != -1)) {
+            error("bad rip relative address [rel " + text + "]");
+        }
+        if (operand.index == 4) {
+            if (operand.base != -1 && operand.base != 4 && operand.scale == 1) {
+                std::swap(operand.base, operand.index);
+            } else {
+                error("rsp can't be an index");
+            }
+        }
+    }
+
+    // REX, opcode and ModRM (with SIB and displacement) for an instruction with reg_field
+    // in ModRM.reg and rm as the register or memory operand. rm_size is only needed where
+    // it differs from the operand size, as for movzx.
+    void encode_rm(Encoding& encoding, const std::vector<uint8_t>& opcode, int reg_field, const Operand& rm, int size,
+                   bool byte_reg_field = false, int rm_size = 0) const
+    {
+        rm_size = rm_size ? rm_size : size;
+        if (size == 2) {
+            encoding.bytes.push_back(0x66);
+        }
+        uint8_t rex = size == 8 ? 0x08 : 0;
+        rex |= (reg_field & 8) ? 0x04 : 0;
+        bool force_rex = byte_reg_field && reg_field >= 4 && reg_field < 8;
+        if (rm.kind == Operand::Kind::reg) {
+            rex |= (rm.reg & 8) ? 0x01 : 0;
+            force_rex = force_rex || (rm_size == 1 && rm.reg >= 4 && rm.reg < 8);
+        } else {
+            rex |= (rm.base != -1 && (rm.base & 8)) ? 0x01 : 0;
+            rex |= (rm.index != -1 && (rm.index & 8)) ? 0x02 : 0;
+        }
+        if (rex || force_rex) {
+            encoding.bytes.push_back(0x40 | rex);
+        }
+        encoding.bytes.insert(encoding.bytes.end(), opcode.begin(), opcode.end());
+
+        uint8_t reg_bits = static_cast<uint8_t>((reg_field & 7) << 3);
+        if (rm.kind == Operand::Kind::reg) {
+            encoding.bytes.push_back(0xC0 | reg_bits | (rm.reg & 7));
+            return;
+        }
+        if (!rm.label.empty()) {
+            encoding.bytes.push_back(0x05 | reg_bits);
+            encoding.rel_at = encoding.bytes.size();
+            encoding.label = rm.label;
+            append(encoding, rm.disp, 4);   // the label's address is added when it is placed
+            return;
+        }
+        if (rm.disp < INT32_MIN || rm.disp > INT32_MAX) {
+            error("displacement out of range");
+        }
+        if (rm.base == -1) {
+            // [index * scale + disp32] or [disp32]
+            encoding.bytes.push_back(0x04 | reg_bits);
+            encoding.bytes.push_back(static_cast<uint8_t>((scale_bits(rm.scale) << 6) | ((rm.index == -1 ? 4 : rm.index & 7) << 3) | 5));
+            append(encoding, rm.disp, 4);
+            return;
+        }
+        uint8_t mod = 0x80;
+        if (rm.disp == 0 && (rm.base & 7) != 5) {
+            mod = 0x00;
+        } else if (rm.disp >= INT8_MIN && rm.disp <= INT8_MAX) {
+            mod = 0x40;
+        }
+        if (rm.index != -1 || (rm.base & 7) == 4) {
+            encoding.bytes.push_back(mod | reg_bits | 4);
+            encoding.bytes.push_back(static_cast<uint8_t>((scale_bits(rm.scale) << 6) | ((rm.index == -1 ? 4 : rm.index & 7) << 3) | (rm.base & 7)));
+        } else {
+            encoding.bytes.push_back(mod | reg_bits | (rm.base & 7));
+        }
+        if (mod == 0x40) {
+            append(encoding, rm.disp, 1);
+        } else if (mod == 0x80) {
+            append(encoding, rm.disp, 4);
+        }
+    }
+
+    static uint8_t scale_bits(int scale)
+    {
+        switch (scale) {
+            case 2: return 1;
+            case 4: return 2;
+            case 8: return 3;
+            default: return 0;
+        }
+    }
+
+    static void append(Encoding& encoding, int64_t value, size_t width)
+    {
+        for (size_t i = 0; i < width; i++) {
+            encoding.bytes.push_back(static_cast<uint8_t>(static_cast<uint64_t>(value) >> (8 * i)));
+        }
+    }
+
+    static bool fits_int8(int64_t value) { return value >= INT8_MIN && value <= INT8_MAX; }
+    static bool fits_int32(int64_t value) { return value >= INT32_MIN && value <= INT32_MAX; }
+
+    static bool is_rm(const Operand& operand)
+    {
+        return operand.kind == Operand::Kind::reg || operand.kind == Operand::Kind::mem;
+    }
+
+    // the operand size of an instruction, from its register operand or a size keyword
+    int size_of(const std::vector<Operand>& operands) const
+    {
+        for (const Operand& operand : operands) {
+            if (operand.kind == Operand::Kind::reg) {
+                return operand.size;
+            }
+        }
+        for (const Operand& operand : operands) {
+            if (operand.size) {
+                return operand.size;
+            }
+        }
+        error("operation size not specified");
+    }
+
+    // condition code of a jcc, setcc or cmovcc suffix
+    static std::optional<uint8_t> condition_of(const std::string& suffix)
+    {
+        static const std::unordered_map<std::string, uint8_t> conditions = {
+            { "o", 0 }, { "no", 1 }, { "b", 2 }, { "c", 2 }, { "nae", 2 }, { "ae", 3 }, { "nb", 3 }, { "nc", 3 },
+            { "e", 4 }, { "z", 4 }, { "ne", 5 }, { "nz", 5 }, { "be", 6 }, { "na", 6 }, { "a", 7 }, { "nbe", 7 },
+            { "s", 8 }, { "ns", 9 }, { "p", 10 }, { "pe", 10 }, { "np", 11 }, { "po", 11 }, { "l", 12 }, { "nge", 12 },
+            { "ge", 13 }, { "nl", 13 }, { "le", 14 }, { "ng", 14 }, { "g", 15 }, { "nle", 15 },
+        };
+        auto it = conditions.find(suffix);
+        if (it == conditions.end()) {
+            return {};
+        }
+        return it->second;
+    }
+
+    Encoding branch(const std::vector<uint8_t>& opcode, const std::string& label) const
+    {
+        Encoding encoding { .bytes = opcode };
+        encoding.rel_at = encoding.bytes.size();
+        encoding.label = label;
+        append(encoding, 0, 4);
+        return encoding;
+    }
+
+    Encoding encode(const std::string& mnemonic, const std::vector<Operand>& ops)
+    {
+        using Kind = Operand::Kind;
+        auto shape = [&](std::initializer_list<Kind> kinds) {
+            if (ops.size() != kinds.size()) {
+                return false;
+            }
+            size_t i = 0;
+            for (Kind kind : kinds) {
+                if (ops[i].kind != kind && !(kind == Kind::mem && ops[i].kind == Kind::reg)) {
+                    return false;   // Kind::mem in a shape stands for any r/m operand
+                }
+                i++;
+            }
+            return true;
+        };
+        Encoding encoding;
+
+        static const std::unordered_map<std::string, int> alu = {
+            { "add", 0 }, { "or", 1 }, { "adc", 2 }, { "sbb", 3 }, { "and", 4 }, { "sub", 5 }, { "xor", 6 }, { "cmp", 7 },
+        };
+        static const std::unordered_map<std::string, int> unary = { { "not", 2 }, { "neg", 3 }, { "mul", 4 }, { "div", 6 }, { "idiv", 7 } };
+        static const std::unordered_map<std::string, int> shifts = { { "rol", 0 }, { "ror", 1 }, { "shl", 4 }, { "sal", 4 }, { "shr", 5 }, { "sar", 7 } };
+
+        if (auto it = alu.find(mnemonic); it != alu.end()) {
+            int size = size_of(ops);
+            uint8_t wide = size == 1 ? 0 : 1;
+            if (shape({ Kind::mem, Kind::reg })) {
+                encode_rm(encoding, { static_cast<uint8_t>(it->second * 8 + wide) }, ops[1].reg, ops[0], size, size == 1);
+            } else if (shape({ Kind::reg, Kind::mem })) {
+                encode_rm(encoding, { static_cast<uint8_t>(it->second * 8 + 2 + wide) }, ops[0].reg, ops[1], size, size == 1);
+            } else if (shape({ Kind::mem, Kind::imm })) {
+                if (size == 1) {
+                    encode_rm(encoding, { 0x80 }, it->second, ops[0], size);
+                    append(encoding, ops[1].imm, 1);
+                } else if (fits_int8(ops[1].imm)) {
+                    encode_rm(encoding, { 0x83 }, it->second, ops[0], size);
+                    append(encoding, ops[1].imm, 1);
+                } else {
+                    check_imm32(ops[1].imm, size);
+                    encode_rm(encoding, { 0x81 }, it->second, ops[0], size);
+                    append(encoding, ops[1].imm, size == 2 ? 2 : 4);
+                }
+            } else {
+                error("bad operands for " + mnemonic);
+            }
+        } else if (mnemonic == "test") {
+            int size = size_of(ops);
+            if (shape({ Kind::mem, Kind::reg })) {
+                encode_rm(encoding, { static_cast<uint8_t>(size == 1 ? 0x84 : 0x85) }, ops[1].reg, ops[0], size, size == 1);
+            } else if (shape({ Kind::mem, Kind::imm })) {
+                check_imm32(ops[1].imm, size);
+                encode_rm(encoding, { static_cast<uint8_t>(size == 1 ? 0xF6 : 0xF7) }, 0, ops[0], size);
+                append(encoding, ops[1].imm, size == 1 ? 1 : size == 2 ? 2 : 4);
+            } else {
+                error("bad operands for test");
+            }
+        } else if (mnemonic == "mov") {
+            int size = size_of(ops);
+            if (shape({ Kind::reg, Kind::imm })) {
+                encode_mov_imm(encoding, ops[0], ops[1].imm);
+            } else if (shape({ Kind::mem, Kind::reg })) {
+                encode_rm(encoding, { static_cast<uint8_t>(size == 1 ? 0x88 : 0x89) }, ops[1].reg, ops[0], size, size == 1);
+            } else if (shape({ Kind::reg, Kind::mem })) {
+                encode_rm(encoding, { static_cast<uint8_t>(size == 1 ? 0x8A : 0x8B) }, ops[0].reg, ops[1], size, size == 1);
+            } else if (shape({ Kind::mem, Kind::imm })) {
+                check_imm32(ops[1].imm, size);
+                encode_rm(encoding, { static_cast<uint8_t>(size == 1 ? 0xC6 : 0xC7) }, 0, ops[0], size);
+                append(encoding, ops[1].imm, size == 1 ? 1 : size == 2 ? 2 : 4);
+            } else {
+                error("bad operands for mov");
+            }
+        } else if (mnemonic == "movzx" || mnemonic == "movsx") {
+            if (!shape({ Kind::reg, Kind::mem }) || (ops[1].size != 1 && ops[1].size != 2)) {
+                error("bad operands for " + mnemonic);
+            }
+            uint8_t opcode = mnemonic == "movzx" ? 0xB6 : 0xBE;
+            encode_rm(encoding, { 0x0F, static_cast<uint8_t>(ops[1].size == 1 ? opcode : opcode + 1) }, ops[0].reg, ops[1], ops[0].size,
+                false, ops[1].size);
+        } else if (mnemonic == "lea") {
+            if (!shape({ Kind::reg, Kind::mem }) || ops[1].kind != Kind::mem) {
+                error("bad operands for lea");
+            }
+            encode_rm(encoding, { 0x8D }, ops[0].reg, ops[1], ops[0].size);
+        } else if (mnemonic == "imul" && ops.size() >= 2) {
+            if (shape({ Kind::reg, Kind::mem })) {
+                encode_rm(encoding, { 0x0F, 0xAF }, ops[0].reg, ops[1], ops[0].size);
+            } else if (shape({ Kind::reg, Kind::mem, Kind::imm }) || shape({ Kind::reg, Kind::imm })) {
+                const Operand& source = ops.size() == 3 ? ops[1] : ops[0];
+                int64_t imm = ops.back().imm;
+                if (fits_int8(imm)) {
+                    encode_rm(encoding, { 0x6B }, ops[0].reg, source, ops[0].size);
+                    append(encoding, imm, 1);
+                } else {
+                    check_imm32(imm, ops[0].size);
+                    encode_rm(encoding, { 0x69 }, ops[0].reg, source, ops[0].size);
+                    append(encoding, imm, ops[0].size == 2 ? 2 : 4);
+                }
+            } else {
+                error("bad operands for imul");
+            }
+        } else if (unary.contains(mnemonic) || mnemonic == "imul") {
+            int size = size_of(ops);
+            if (!shape({ Kind::mem })) {
+                error("bad operands for " + mnemonic);
+            }
+            int ext = mnemonic == "imul" ? 5 : unary.at(mnemonic);
+            encode_rm(encoding, { static_cast<uint8_t>(size == 1 ? 0xF6 : 0xF7) }, ext, ops[0], size);
+        } else if (mnemonic == "inc" || mnemonic == "dec") {
+            int size = size_of(ops);
+            if (!shape({ Kind::mem })) {
+                error("bad operands for " + mnemonic);
+            }
+            encode_rm(encoding, { static_cast<uint8_t>(size == 1 ? 0xFE : 0xFF) }, mnemonic == "inc" ? 0 : 1, ops[0], size);
+        } else if (auto it = shifts.find(mnemonic); it != shifts.end()) {
+            int size = ops.empty() ? 0 : ops[0].size;
+            if (size == 0) {
+                error("operation size not specified");
+            }
+            if (shape({ Kind::mem, Kind::imm })) {
+                encode_rm(encoding, { static_cast<uint8_t>(size == 1 ? 0xC0 : 0xC1) }, it->second, ops[0], size);
+                append(encoding, ops[1].imm, 1);
+            } else if (shape({ Kind::mem, Kind::reg }) && ops[1].reg == 1 && ops[1].size == 1) {
+                encode_rm(encoding, { static_cast<uint8_t>(size == 1 ? 0xD2 : 0xD3) }, it->second, ops[0], size);
+            } else {
+                error("bad operands for " + mnemonic);
+            }
+        } else if (mnemonic == "push" || mnemonic == "pop") {
+            bool push = mnemonic == "push";
+            if (shape({ Kind::reg }) && ops[0].size == 8) {
+                if (ops[0].reg & 8) {
+                    encoding.bytes.push_back(0x41);
+                }
+                encoding.bytes.push_back(static_cast<uint8_t>((push ? 0x50 : 0x58) + (ops[0].reg & 7)));
+            } else if (shape({ Kind::mem }) && ops[0].kind == Kind::mem) {
+                encode_rm(encoding, { static_cast<uint8_t>(push ? 0xFF : 0x8F) }, push ? 6 : 0, ops[0], 0);
+            } else if (push && shape({ Kind::imm })) {
+                if (fits_int8(ops[0].imm)) {
+                    encoding.bytes.push_back(0x6A);
+                    append(encoding, ops[0].imm, 1);
+                } else {
+                    check_imm32(ops[0].imm, 8);
+                    encoding.bytes.push_back(0x68);
+                    append(encoding, ops[0].imm, 4);
+                }
+            } else {
+                error("bad operands for " + mnemonic);
+            }
+        } else if (mnemonic == "call" || mnemonic == "jmp") {
+            bool call = mnemonic == "call";
+            if (shape({ Kind::label })) {
+                return branch({ static_cast<uint8_t>(call ? 0xE8 : 0xE9) }, ops[0].label);
+            }
+            if (!shape({ Kind::mem })) {
+                error("bad operands for " + mnemonic);
+            }
+            encode_rm(encoding, { 0xFF }, call ? 2 : 4, ops[0], 0);
+        } else if (mnemonic.starts_with("j") && condition_of(mnemonic.substr(1)) && shape({ Kind::label })) {
+            return branch({ 0x0F, static_cast<uint8_t>(0x80 + *condition_of(mnemonic.substr(1))) }, ops[0].label);
+        } else if (mnemonic.starts_with("set") && condition_of(mnemonic.substr(3))) {
+            if (!shape({ Kind::mem }) || (ops[0].kind == Kind::reg && ops[0].size != 1)) {
+                error("bad operands for " + mnemonic);
+            }
+            encode_rm(encoding, { 0x0F, static_cast<uint8_t>(0x90 + *condition_of(mnemonic.substr(3))) }, 0, ops[0], 1);
+        } else if (mnemonic.starts_with("cmov") && condition_of(mnemonic.substr(4)) && shape({ Kind::reg, Kind::mem })) {
+            encode_rm(encoding, { 0x0F, static_cast<uint8_t>(0x40 + *condition_of(mnemonic.substr(4))) }, ops[0].reg, ops[1], ops[0].size);
+        } else if (mnemonic == "ret" && ops.empty()) {
+            encoding.bytes = { 0xC3 };
+        } else if (mnemonic == "syscall" && ops.empty()) {
+            if (!m_syscall_target.empty()) {
+                return branch({ 0xE8 }, m_syscall_target);
+            }
+            encoding.bytes = { 0x0F, 0x05 };
+        } else if (mnemonic == "rep" && ops.size() == 1 && ops[0].kind == Kind::label && ops[0].label == "movsb") {
+            encoding.bytes = { 0xF3, 0xA4 };
+        } else if (mnemonic == "cqo" && ops.empty()) {
+            encoding.bytes = { 0x48, 0x99 };
+        } else if (mnemonic == "nop" && ops.empty()) {
+            encoding.bytes = { 0x90 };
+        } else {
+            error("unsupported instruction " + mnemonic);
+        }
+        return encoding;
+    }
+
+    void encode_mov_imm(Encoding& encoding, const Operand& reg, int64_t imm) const
+    {
+        uint8_t low = static_cast<uint8_t>(reg.reg & 7);
+        uint8_t rex_b = (reg.reg & 8) ? 0x01 : 0;
+        if (reg.size == 8 && !(imm >= 0 && imm <= UINT32_MAX)) {
+            if (fits_int32(imm)) {
+                encode_rm(encoding, { 0xC7 }, 0, reg, 8);   // sign extended imm32
+                append(encoding, imm, 4);
+                return;
+            }
+            encoding.bytes.push_back(0x48 | rex_b);
+            encoding.bytes.push_back(0xB8 + low);
+            append(encoding, imm, 8);
+            return;
+        }
+        // a 32 bit move clears the upper half, which is exactly a zero extended imm32
+        int size = reg.size == 8 ? 4 : reg.size;
+        if (size == 2) {
+            encoding.bytes.push_back(0x66);
+        }
+        if (rex_b || (size == 1 && reg.reg >= 4 && reg.reg < 8)) {
+            encoding.bytes.push_back(0x40 | rex_b);
+        }
+        encoding.bytes.push_back(static_cast<uint8_t>((size == 1 ? 0xB0 : 0xB8) + low));
+        append(encoding, imm, static_cast<size_t>(size));
+    }
+
+    void check_imm32(int64_t imm, int size) const
+    {
+        if (size == 8 && !fits_int32(imm)) {
+            error("immediate doesn't fit in 32 bits: " + std::to_string(imm));
+        }
+    }
+
+    std::string m_syscall_target;
+    Section m_sections[4];
+    SectionId m_section = SectionId::text;
+    std::unordered_map<std::string, Symbol> m_symbols;
+    std::vector<Fixup> m_fixups;
+    std::string m_scope;    // last non-local label, .labels belong to it
+    size_t m_line = 0;
+};
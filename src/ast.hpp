@@ -0,0 +1,674 @@
+#pragma once
+
+#include <cstdint>
+#include <fcntl.h>
+#include <filesystem>
+#include <optional>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "parser.hpp"
+
+// Binary form of a parsed program (--emit=ast), so a module that rarely changes isn't
+// tokenized and parsed again on every build. The file is a header followed by records
+// made of u32 words. Records refer to each other by their offset from the start of the
+// file, never by pointer, so the file is mapped anywhere and read where it is. Children
+// are written before their parents, every reference points backwards and even a
+// damaged file can't send a reader in circles.
+//
+//   header:     magic, version, source hash (low word first), offset of the program, size
+//   string:     length, then the bytes padded to a whole word
+//   token:      type, string or 0, line, column
+//   list:       count, then the offsets of the elements
+//   node:       kind, then the node's fields, offsets or 0 for none
+//   statement:  kind, line, then the fields like a node
+enum class AstKind : uint32_t {
+    int_lit = 1,    // token
+    ident,          // token
+    paren,          // expr
+    fun_call,       // token, list of exprs
+    log_not,        // expr
+    add,            // lhs, rhs, the same for the other binary expressions
+    mul,
+    sub,
+    div,
+    cmp,            // lhs, rhs, token
+    log_and,
+    log_or,
+    exit,           // expr, this and everything below are statements
+    let,            // token, expr
+    scope,          // list of stmts
+    if_stmt,        // condition, body, elif arms, else body
+    while_stmt,     // condition, body
+    for_stmt,       // let or assign or 0, condition, assign or 0, body
+    assign,         // token, expr
+    fun,            // token, list of parameter tokens, scope
+    print,          // expr
+    return_stmt,    // expr
+    prog,           // list of stmts, list of import tokens
+};
+
+inline constexpr uint32_t ast_magic = 0x5341474F;      // "OGAS"
+inline constexpr uint32_t ast_version = 2;
+inline constexpr size_t ast_header_words = 6;
+
+class AstWriter {
+public:
+    inline explicit AstWriter(uint64_t source_hash)
+    {
+        for (uint32_t word : { ast_magic, ast_version, static_cast<uint32_t>(source_hash), static_cast<uint32_t>(source_hash >> 32), 0U, 0U }) {
+            put(word);
+        }
+    }
+
+    std::string write(const NodeProg& prog)
+    {
+        std::vector<uint32_t> imports;
+        for (const Token& import : prog.imports) {
+            imports.push_back(token(import));
+        }
+        uint32_t imports_list = list(imports);
+        uint32_t root = node(AstKind::prog, { stmts(prog.stmts), imports_list });
+        patch(4, root);
+        patch(5, static_cast<uint32_t>(m_bytes.size()));
+        return m_bytes;
+    }
+
+private:
+    uint32_t put(uint32_t word)
+    {
+        auto offset = static_cast<uint32_t>(m_bytes.size());
+        for (int i = 0; i < 4; i++) {
+            m_bytes.push_back(static_cast<char>(word >> (8 * i)));
+        }
+        return offset;
+    }
+
+    void patch(size_t index, uint32_t word)
+    {
+        for (int i = 0; i < 4; i++) {
+            m_bytes[index * 4 + i] = static_cast<char>(word >> (8 * i));
+        }
+    }
+
+    uint32_t string(const std::string& value)
+    {
+        uint32_t offset = put(static_cast<uint32_t>(value.size()));
+        m_bytes += value;
+        m_bytes.append((4 - value.size() % 4) % 4, '\0');
+        return offset;
+    }
+
+    uint32_t token(const Token& token)
+    {
+        uint32_t value = token.value ? string(token.value.value()) : 0;
+        uint32_t offset = put(static_cast<uint32_t>(token.type));
+        put(value);
+        put(token.line);
+        put(token.column);
+        return offset;
+    }
+
+    uint32_t list(const std::vector<uint32_t>& items)
+    {
+        uint32_t offset = put(static_cast<uint32_t>(items.size()));
+        for (uint32_t item : items) {
+            put(item);
+        }
+        return offset;
+    }
+
+    uint32_t node(AstKind kind, std::initializer_list<uint32_t> fields)
+    {
+        uint32_t offset = put(static_cast<uint32_t>(kind));
+        for (uint32_t field : fields) {
+            put(field);
+        }
+        return offset;
+    }
+
+    uint32_t statement(AstKind kind, uint32_t line, std::initializer_list<uint32_t> fields)
+    {
+        uint32_t offset = put(static_cast<uint32_t>(kind));
+        put(line);
+        for (uint32_t field : fields) {
+            put(field);
+        }
+        return offset;
+    }
+
+    uint32_t expr(const NodeExpr* expr)
+    {
+        struct TermVisitor {
+            AstWriter* writer;
+            uint32_t operator()(const NodeTermIntLit* term) const { return writer->node(AstKind::int_lit, { writer->token(term->int_lit) }); }
+            uint32_t operator()(const NodeTermIdent* term) const { return writer->node(AstKind::ident, { writer->token(term->ident) }); }
+            uint32_t operator()(const NodeTermParen* term) const { return writer->node(AstKind::paren, { writer->expr(term->expr) }); }
+            uint32_t operator()(const NodeTermNot* term) const { return writer->node(AstKind::log_not, { writer->expr(term->expr) }); }
+            uint32_t operator()(const NodeTermFunCall* term) const
+            {
+                std::vector<uint32_t> args;
+                for (const NodeExpr* arg : term->args) {
+                    args.push_back(writer->expr(arg));
+                }
+                uint32_t args_list = writer->list(args);
+                return writer->node(AstKind::fun_call, { writer->token(term->ident), args_list });
+            }
+        };
+        struct BinVisitor {
+            AstWriter* writer;
+            uint32_t operator()(const NodeBinExprAdd* bin) const { return writer->binary(AstKind::add, bin); }
+            uint32_t operator()(const NodeBinExprMulti* bin) const { return writer->binary(AstKind::mul, bin); }
+            uint32_t operator()(const NodeBinExprSub* bin) const { return writer->binary(AstKind::sub, bin); }
+            uint32_t operator()(const NodeBinExprDiv* bin) const { return writer->binary(AstKind::div, bin); }
+            uint32_t operator()(const NodeBinExprAnd* bin) const { return writer->binary(AstKind::log_and, bin); }
+            uint32_t operator()(const NodeBinExprOr* bin) const { return writer->binary(AstKind::log_or, bin); }
+            uint32_t operator()(const NodeBinExprCmp* bin) const
+            {
+                uint32_t lhs = writer->expr(bin->lhs);
+                uint32_t rhs = writer->expr(bin->rhs);
+                return writer->node(AstKind::cmp, { lhs, rhs, writer->token(bin->comparison->comp) });
+            }
+        };
+        if (std::holds_alternative<NodeTerm*>(expr->var)) {
+            return std::visit(TermVisitor { .writer = this }, std::get<NodeTerm*>(expr->var)->var);
+        }
+        return std::visit(BinVisitor { .writer = this }, std::get<NodeBinExpr*>(expr->var)->var);
+    }
+
+    template <typename T>
+    uint32_t binary(AstKind kind, const T* bin)
+    {
+        uint32_t lhs = expr(bin->lhs);
+        return node(kind, { lhs, expr(bin->rhs) });
+    }
+
+    uint32_t stmts(const std::vector<NodeStmt*>& stmts)
+    {
+        std::vector<uint32_t> items;
+        for (const NodeStmt* stmt : stmts) {
+            items.push_back(this->stmt(stmt));
+        }
+        return list(items);
+    }
+
+    uint32_t assign(const NodeStmtAssign* stmt_assign, uint32_t line)
+    {
+        uint32_t ident = token(stmt_assign->lhs->ident);
+        return statement(AstKind::assign, line, { ident, expr(stmt_assign->rhs) });
+    }
+
+    uint32_t let(const NodeStmtLet* stmt_let, uint32_t line)
+    {
+        uint32_t ident = token(stmt_let->ident);
+        return statement(AstKind::let, line, { ident, expr(stmt_let->expr) });
+    }
+
+    uint32_t stmt(const NodeStmt* stmt)
+    {
+        struct StmtVisitor {
+            AstWriter* writer;
+            uint32_t line;
+            uint32_t operator()(const NodeStmtExit* stmt_exit) const { return writer->statement(AstKind::exit, line, { writer->expr(stmt_exit->expr) }); }
+            uint32_t operator()(const NodeStmtLet* stmt_let) const { return writer->let(stmt_let, line); }
+            uint32_t operator()(const NodeStmtScope* scope) const { return writer->statement(AstKind::scope, line, { writer->stmts(scope->stmts) }); }
+            uint32_t operator()(const NodeStmtIf* stmt_if) const
+            {
+                uint32_t condition = writer->expr(stmt_if->condition);
+                uint32_t body = writer->stmts(stmt_if->body);
+                uint32_t elif_body = writer->stmts(stmt_if->elif_body);
+                return writer->statement(AstKind::if_stmt, line, { condition, body, elif_body, writer->stmts(stmt_if->else_body) });
+            }
+            uint32_t operator()(const NodeStmtWhile* stmt_while) const
+            {
+                uint32_t condition = writer->expr(stmt_while->condition);
+                return writer->statement(AstKind::while_stmt, line, { condition, writer->stmts(stmt_while->body) });
+            }
+            uint32_t operator()(const NodeStmtFor* stmt_for) const
+            {
+                uint32_t init = 0;
+                if (std::holds_alternative<NodeStmtAssign*>(stmt_for->init)) {
+                    init = writer->assign(std::get<NodeStmtAssign*>(stmt_for->init), 0);
+                } else if (const NodeStmtLet* stmt_let = std::get<NodeStmtLet*>(stmt_for->init)) {
+                    init = writer->let(stmt_let, 0);
+                }
+                uint32_t condition = writer->expr(stmt_for->condition);
+                uint32_t change = stmt_for->change ? writer->assign(stmt_for->change, 0) : 0;
+                return writer->statement(AstKind::for_stmt, line, { init, condition, change, writer->stmts(stmt_for->body) });
+            }
+            uint32_t operator()(const NodeStmtAssign* stmt_assign) const { return writer->assign(stmt_assign, line); }
+            uint32_t operator()(const NodeStmtFun* stmt_fun) const
+            {
+                uint32_t ident = writer->token(stmt_fun->ident);
+                std::vector<uint32_t> params;
+                for (const Token& param : stmt_fun->params) {
+                    params.push_back(writer->token(param));
+                }
+                uint32_t params_list = writer->list(params);
+                uint32_t body = writer->statement(AstKind::scope, 0, { writer->stmts(stmt_fun->body->stmts) });
+                return writer->statement(AstKind::fun, line, { ident, params_list, body });
+            }
+            uint32_t operator()(const NodeStmtPrint* stmt_print) const { return writer->statement(AstKind::print, line, { writer->expr(stmt_print->expr) }); }
+            uint32_t operator()(const NodeStmtReturn* stmt_return) const { return writer->statement(AstKind::return_stmt, line, { writer->expr(stmt_return->expr) }); }
+        };
+        return std::visit(StmtVisitor { .writer = this, .line = stmt->line }, stmt->var);
+    }
+
+    std::string m_bytes;
+};
+
+// An AST file mapped into memory, or AST bytes that are already there. The header, the
+// imports and the top-level functions are read in place; nodes are only built for a
+// module that gets compiled. Every read is checked, a bad offset makes the file bad and
+// reads as 0.
+class AstFile {
+public:
+    inline explicit AstFile(const std::filesystem::path& path)
+    {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat info {};
+        if (fd < 0 || fstat(fd, &info) < 0 || info.st_size < static_cast<off_t>(ast_header_words * 4)) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            return;
+        }
+        void* data = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            return;
+        }
+        m_data = static_cast<const std::byte*>(data);
+        m_size = static_cast<size_t>(info.st_size);
+        m_mapped = true;
+        validate();
+    }
+
+    // an AST in memory, which has to outlive the object
+    inline explicit AstFile(std::string_view bytes)
+        : m_data(reinterpret_cast<const std::byte*>(bytes.data()))
+        , m_size(bytes.size())
+    {
+        if (m_size >= ast_header_words * 4) {
+            validate();
+        }
+    }
+
+    inline AstFile(const AstFile& other) = delete;
+
+    inline AstFile operator=(const AstFile& other) = delete;
+
+    inline ~AstFile()
+    {
+        if (m_mapped) {
+            munmap(const_cast<std::byte*>(m_data), m_size);
+        }
+    }
+
+    [[nodiscard]] bool ok() const
+    {
+        return m_ok;
+    }
+
+    // for readers that find a record that makes no sense
+    void invalidate() const
+    {
+        m_ok = false;
+    }
+
+    [[nodiscard]] uint64_t source_hash() const
+    {
+        return word(8) | static_cast<uint64_t>(word(12)) << 32;
+    }
+
+    [[nodiscard]] uint32_t root() const
+    {
+        return child(m_size, word(16));
+    }
+
+    // the import paths as written
+    [[nodiscard]] std::vector<std::string> imports() const
+    {
+        std::vector<std::string> paths;
+        for (uint32_t import : list(root(), field(root(), 2))) {
+            paths.emplace_back(string(child(import, word(import + 4))));
+        }
+        return paths;
+    }
+
+    // name and number of parameters of each top-level function, nothing if the top level
+    // has anything besides functions
+    [[nodiscard]] std::optional<std::vector<std::pair<std::string, size_t>>> functions() const
+    {
+        std::vector<std::pair<std::string, size_t>> funs;
+        for (uint32_t stmt : list(root(), field(root(), 1))) {
+            if (word(stmt) != static_cast<uint32_t>(AstKind::fun)) {
+                return {};
+            }
+            uint32_t ident = field(stmt, 2);
+            funs.emplace_back(string(child(ident, word(ident + 4))), list(stmt, field(stmt, 3)).size());
+        }
+        return funs;
+    }
+
+    // the word at offset, 0 and the file bad if it isn't inside
+    [[nodiscard]] uint32_t word(size_t offset) const
+    {
+        if (offset % 4 != 0 || offset + 4 > m_size) {
+            m_ok = false;
+            return 0;
+        }
+        uint32_t value = 0;
+        for (size_t i = 0; i < 4; i++) {
+            value |= static_cast<uint32_t>(m_data[offset + i]) << (8 * i);
+        }
+        return value;
+    }
+
+    // a reference held by the record at parent, which must point before it
+    [[nodiscard]] uint32_t child(size_t parent, uint32_t offset) const
+    {
+        if (offset >= parent || (offset != 0 && offset < ast_header_words * 4)) {
+            m_ok = false;
+            return 0;
+        }
+        return offset;
+    }
+
+    // field index of the node at offset, as a reference
+    [[nodiscard]] uint32_t field(uint32_t offset, size_t index) const
+    {
+        return child(offset, word(offset + 4 * index));
+    }
+
+    [[nodiscard]] std::string_view string(uint32_t offset) const
+    {
+        uint32_t size = word(offset);
+        if (!m_ok || offset == 0 || m_size - offset - 4 < size) {
+            m_ok = false;
+            return {};
+        }
+        return { reinterpret_cast<const char*>(m_data + offset + 4), size };
+    }
+
+    [[nodiscard]] std::vector<uint32_t> list(uint32_t parent, uint32_t offset) const
+    {
+        uint32_t count = word(offset);
+        if (!m_ok || offset == 0 || (m_size - offset) / 4 - 1 < count) {
+            m_ok = false;
+            return {};
+        }
+        std::vector<uint32_t> items;
+        for (uint32_t i = 0; i < count; i++) {
+            items.push_back(child(parent, word(offset + 4 + 4 * i)));
+        }
+        return items;
+    }
+
+private:
+    void validate()
+    {
+        m_ok = true;
+        m_ok = word(0) == ast_magic && word(4) == ast_version && word(20) == m_size && root() != 0 && m_ok;
+    }
+
+    const std::byte* m_data = nullptr;
+    size_t m_size = 0;
+    bool m_mapped = false;
+    mutable bool m_ok = false;
+};
+
+// Builds the nodes of an AST file in allocator, the same ones the parser would have made.
+// Nothing if the file is bad. line_offset moves every position, for an AST of a piece of
+// source that has since moved within its file.
+class AstReader {
+public:
+    inline AstReader(const AstFile& file, ArenaAllocator& allocator, int64_t line_offset = 0)
+        : m_file(file), m_allocator(allocator), m_line_offset(line_offset)
+    {
+    }
+
+    std::optional<NodeProg> read()
+    {
+        NodeProg prog;
+        uint32_t root = m_file.root();
+        if (!m_file.ok() || m_file.word(root) != static_cast<uint32_t>(AstKind::prog)) {
+            return {};
+        }
+        prog.stmts = stmts(root, 1);
+        for (uint32_t import : m_file.list(root, m_file.field(root, 2))) {
+            prog.imports.push_back(token(import));
+        }
+        if (!m_file.ok()) {
+            return {};
+        }
+        return prog;
+    }
+
+private:
+    Token token(uint32_t offset)
+    {
+        Token token { .type = static_cast<TokenType>(m_file.word(offset)) };
+        if (offset == 0 || m_file.word(offset) > static_cast<uint32_t>(TokenType::str_lit)) {
+            m_file.invalidate();
+            return token;
+        }
+        if (uint32_t value = m_file.child(offset, m_file.word(offset + 4))) {
+            token.value = std::string(m_file.string(value));
+        }
+        token.line = line(m_file.word(offset + 8));
+        token.column = m_file.word(offset + 12);
+        return token;
+    }
+
+    // 0 stays unknown
+    uint32_t line(uint32_t value) const
+    {
+        return value == 0 ? 0 : static_cast<uint32_t>(value + m_line_offset);
+    }
+
+    template <typename T>
+    T* make()
+    {
+        return m_allocator.alloc<T>();
+    }
+
+    NodeExpr* term(auto* value)
+    {
+        auto node_term = make<NodeTerm>();
+        node_term->var = value;
+        auto node = make<NodeExpr>();
+        node->var = node_term;
+        return node;
+    }
+
+    template <typename T>
+    NodeExpr* binary(uint32_t offset)
+    {
+        auto bin = make<T>();
+        bin->lhs = expr(m_file.field(offset, 1));
+        bin->rhs = expr(m_file.field(offset, 2));
+        auto bin_expr = make<NodeBinExpr>();
+        bin_expr->var = bin;
+        auto node = make<NodeExpr>();
+        node->var = bin_expr;
+        return node;
+    }
+
+    // a bad file still gets a node everywhere, read() throws the whole program away after
+    NodeExpr* expr(uint32_t offset)
+    {
+        switch (static_cast<AstKind>(offset ? m_file.word(offset) : 0)) {
+        case AstKind::int_lit: {
+            auto term_int_lit = make<NodeTermIntLit>();
+            term_int_lit->int_lit = token(m_file.field(offset, 1));
+            return term(term_int_lit);
+        }
+        case AstKind::ident: {
+            auto term_ident = make<NodeTermIdent>();
+            term_ident->ident = token(m_file.field(offset, 1));
+            return term(term_ident);
+        }
+        case AstKind::paren: {
+            auto term_paren = make<NodeTermParen>();
+            term_paren->expr = expr(m_file.field(offset, 1));
+            return term(term_paren);
+        }
+        case AstKind::log_not: {
+            auto term_not = make<NodeTermNot>();
+            term_not->expr = expr(m_file.field(offset, 1));
+            return term(term_not);
+        }
+        case AstKind::fun_call: {
+            auto fun_call = make<NodeTermFunCall>();
+            fun_call->ident = token(m_file.field(offset, 1));
+            for (uint32_t arg : m_file.list(offset, m_file.field(offset, 2))) {
+                fun_call->args.push_back(expr(arg));
+            }
+            return term(fun_call);
+        }
+        case AstKind::add:
+            return binary<NodeBinExprAdd>(offset);
+        case AstKind::mul:
+            return binary<NodeBinExprMulti>(offset);
+        case AstKind::sub:
+            return binary<NodeBinExprSub>(offset);
+        case AstKind::div:
+            return binary<NodeBinExprDiv>(offset);
+        case AstKind::log_and:
+            return binary<NodeBinExprAnd>(offset);
+        case AstKind::log_or:
+            return binary<NodeBinExprOr>(offset);
+        case AstKind::cmp: {
+            NodeExpr* cmp = binary<NodeBinExprCmp>(offset);
+            auto comparison = make<NodeComparison>();
+            comparison->comp = token(m_file.field(offset, 3));
+            std::get<NodeBinExprCmp*>(std::get<NodeBinExpr*>(cmp->var)->var)->comparison = comparison;
+            return cmp;
+        }
+        default:
+            m_file.invalidate();
+            return term(make<NodeTermIntLit>());
+        }
+    }
+
+    std::vector<NodeStmt*> stmts(uint32_t parent, size_t index)
+    {
+        std::vector<NodeStmt*> stmts;
+        for (uint32_t offset : m_file.list(parent, m_file.field(parent, index))) {
+            stmts.push_back(stmt(offset));
+        }
+        return stmts;
+    }
+
+    NodeStmtLet* let(uint32_t offset)
+    {
+        auto stmt_let = make<NodeStmtLet>();
+        stmt_let->ident = token(m_file.field(offset, 2));
+        stmt_let->expr = expr(m_file.field(offset, 3));
+        return stmt_let;
+    }
+
+    NodeStmtAssign* assign(uint32_t offset)
+    {
+        auto stmt_assign = make<NodeStmtAssign>();
+        stmt_assign->lhs = make<NodeTermIdent>();
+        stmt_assign->lhs->ident = token(m_file.field(offset, 2));
+        stmt_assign->rhs = expr(m_file.field(offset, 3));
+        return stmt_assign;
+    }
+
+    NodeStmt* stmt(uint32_t offset)
+    {
+        auto stmt = make<NodeStmt>();
+        stmt->line = offset ? line(m_file.word(offset + 4)) : 0;
+        switch (static_cast<AstKind>(offset ? m_file.word(offset) : 0)) {
+        case AstKind::exit: {
+            auto stmt_exit = make<NodeStmtExit>();
+            stmt_exit->expr = expr(m_file.field(offset, 2));
+            stmt->var = stmt_exit;
+            break;
+        }
+        case AstKind::let:
+            stmt->var = let(offset);
+            break;
+        case AstKind::scope: {
+            auto scope = make<NodeStmtScope>();
+            scope->stmts = stmts(offset, 2);
+            stmt->var = scope;
+            break;
+        }
+        case AstKind::if_stmt: {
+            auto stmt_if = make<NodeStmtIf>();
+            stmt_if->condition = expr(m_file.field(offset, 2));
+            stmt_if->body = stmts(offset, 3);
+            stmt_if->elif_body = stmts(offset, 4);
+            stmt_if->else_body = stmts(offset, 5);
+            stmt->var = stmt_if;
+            break;
+        }
+        case AstKind::while_stmt: {
+            auto stmt_while = make<NodeStmtWhile>();
+            stmt_while->condition = expr(m_file.field(offset, 2));
+            stmt_while->body = stmts(offset, 3);
+            stmt->var = stmt_while;
+            break;
+        }
+        case AstKind::for_stmt: {
+            auto stmt_for = make<NodeStmtFor>();
+            uint32_t init = m_file.field(offset, 2);
+            if (init && m_file.word(init) == static_cast<uint32_t>(AstKind::assign)) {
+                stmt_for->init = assign(init);
+            } else {
+                stmt_for->init = init ? let(init) : nullptr;
+            }
+            stmt_for->condition = expr(m_file.field(offset, 3));
+            uint32_t change = m_file.field(offset, 4);
+            stmt_for->change = change ? assign(change) : nullptr;
+            stmt_for->body = stmts(offset, 5);
+            stmt->var = stmt_for;
+            break;
+        }
+        case AstKind::assign:
+            stmt->var = assign(offset);
+            break;
+        case AstKind::fun: {
+            auto stmt_fun = make<NodeStmtFun>();
+            stmt_fun->ident = token(m_file.field(offset, 2));
+            for (uint32_t param : m_file.list(offset, m_file.field(offset, 3))) {
+                stmt_fun->params.push_back(token(param));
+            }
+            stmt_fun->body = make<NodeStmtScope>();
+            uint32_t body = m_file.field(offset, 4);
+            if (m_file.word(body) == static_cast<uint32_t>(AstKind::scope)) {
+                stmt_fun->body->stmts = stmts(body, 2);
+            } else {
+                m_file.invalidate();
+            }
+            stmt->var = stmt_fun;
+            break;
+        }
+        case AstKind::print: {
+            auto stmt_print = make<NodeStmtPrint>();
+            stmt_print->expr = expr(m_file.field(offset, 2));
+            stmt->var = stmt_print;
+            break;
+        }
+        case AstKind::return_stmt: {
+            auto stmt_return = make<NodeStmtReturn>();
+            stmt_return->expr = expr(m_file.field(offset, 2));
+            stmt->var = stmt_return;
+            break;
+        }
+        default:
+            m_file.invalidate();
+            stmt->var = make<NodeStmtScope>();
+        }
+        return stmt;
+    }
+
+    const AstFile& m_file;
+    ArenaAllocator& m_allocator;
+    int64_t m_line_offset;
+};
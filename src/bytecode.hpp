@@ -0,0 +1,635 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "parser.hpp"
+
+// Stack based bytecode, an alternative to Generator for programs that run once. Each
+// function has a frame of 64 bit slots for its parameters and locals with an operand
+// stack on top. Instructions are one opcode byte followed by their operands: slots are
+// u16, functions u16, jump targets u32 offsets into the function's code and constants i64.
+enum class Op : uint8_t {
+    push_const,         // i64
+    load,               // slot
+    store,              // slot
+    add,
+    sub,
+    mul,
+    div,                // unsigned, like the generated code
+    eq,                 // comparisons are signed and push 1 or 0
+    ne,
+    lt,
+    gt,
+    le,
+    ge,
+    log_not,
+    jump,               // target
+    jump_if_zero,       // target, pops the condition
+    jump_if_not_zero,   // target
+    call,               // function, the arguments are on the stack in order
+    tail_call,          // function, replaces the current frame
+    ret,
+    print,
+    exit,
+
+    // superinstructions for frequent sequences
+    add_const_store,    // slot, i64: slot += c, for `x = x + c` and `x = x - c`
+    add_slot_store,     // slot, slot: the first += the second, for `x = x + y`
+    sub_slot_store,     // slot, slot: the first -= the second, for `x = x - y`
+    jump_if_eq,         // target: pops b and a, jumps if a == b
+    jump_if_ne,
+    jump_if_lt,
+    jump_if_gt,
+    jump_if_le,
+    jump_if_ge,
+    count
+};
+
+struct BytecodeFunction {
+    std::string name {};
+    uint16_t params = 0;
+    uint32_t slots = 0;         // parameters included
+    uint32_t max_stack = 0;     // deepest the operand stack gets
+    std::vector<uint8_t> code {};
+};
+
+// A compiled program. Function 0 is the top level code.
+struct Bytecode {
+    std::vector<BytecodeFunction> functions;
+
+    static constexpr uint32_t magic = 0x4342474F;   // "OGBC"
+    static constexpr uint32_t version = 1;
+
+    void write(std::ostream& out) const
+    {
+        write_u32(out, magic);
+        write_u32(out, version);
+        write_u32(out, static_cast<uint32_t>(functions.size()));
+        for (const BytecodeFunction& function : functions) {
+            write_u32(out, static_cast<uint32_t>(function.name.size()));
+            out.write(function.name.data(), static_cast<std::streamsize>(function.name.size()));
+            write_u32(out, function.params);
+            write_u32(out, function.slots);
+            write_u32(out, function.max_stack);
+            write_u32(out, static_cast<uint32_t>(function.code.size()));
+            out.write(reinterpret_cast<const char*>(function.code.data()), static_cast<std::streamsize>(function.code.size()));
+        }
+    }
+
+    // nothing if in isn't bytecode of this version
+    static std::optional<Bytecode> read(std::istream& in)
+    {
+        uint32_t count;
+        if (read_u32(in) != magic || read_u32(in) != version || !(count = read_u32(in).value_or(0))) {
+            return {};
+        }
+        Bytecode bytecode;
+        for (uint32_t i = 0; i < count; i++) {
+            BytecodeFunction function;
+            auto name_size = read_u32(in);
+            if (!name_size) {
+                return {};
+            }
+            function.name.resize(*name_size);
+            in.read(function.name.data(), static_cast<std::streamsize>(*name_size));
+            auto params = read_u32(in);
+            auto slots = read_u32(in);
+            auto max_stack = read_u32(in);
+            auto code_size = read_u32(in);
+            if (!code_size || *params > *slots) {
+                return {};
+            }
+            function.params = static_cast<uint16_t>(*params);
+            function.slots = *slots;
+            function.max_stack = *max_stack;
+            function.code.resize(*code_size);
+            in.read(reinterpret_cast<char*>(function.code.data()), static_cast<std::streamsize>(*code_size));
+            if (!in) {
+                return {};
+            }
+            bytecode.functions.push_back(std::move(function));
+        }
+        return bytecode;
+    }
+
+private:
+    static void write_u32(std::ostream& out, uint32_t value)
+    {
+        uint8_t bytes[4] = { static_cast<uint8_t>(value), static_cast<uint8_t>(value >> 8),
+                             static_cast<uint8_t>(value >> 16), static_cast<uint8_t>(value >> 24) };
+        out.write(reinterpret_cast<const char*>(bytes), 4);
+    }
+
+    static std::optional<uint32_t> read_u32(std::istream& in)
+    {
+        uint8_t bytes[4];
+        if (!in.read(reinterpret_cast<char*>(bytes), 4)) {
+            return {};
+        }
+        return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | static_cast<uint32_t>(bytes[3]) << 24;
+    }
+};
+
+// Compiles a program to Bytecode. Variables follow the generator's rules: a function
+// sees its parameters and its own locals, names can't be declared twice while visible.
+class BytecodeCompiler {
+public:
+    inline explicit BytecodeCompiler(const NodeProg& prog)
+        : m_prog(prog)
+    {
+    }
+
+    Bytecode compile()
+    {
+        m_bytecode.functions.push_back({ .name = "_start" });
+        collect_funs(m_prog.stmts);
+
+        begin_function(0);
+        for (const NodeStmt* stmt : m_prog.stmts) {
+            compile_stmt(stmt);
+        }
+        // falling off the end exits with 0
+        emit_const(0);
+        emit(Op::exit, -1);
+        end_function();
+
+        for (const auto& [stmt_fun, index] : m_fun_index) {
+            begin_function(index);
+            for (const Token& param : stmt_fun->params) {
+                declare(param);
+            }
+            for (const NodeStmt* stmt : stmt_fun->body->stmts) {
+                compile_stmt(stmt);
+            }
+            // like a missing return in the generated code, just with a defined value
+            emit_const(0);
+            emit(Op::ret, -1);
+            end_function();
+        }
+        return m_bytecode;
+    }
+
+private:
+    struct Var {
+        std::string name;
+        uint16_t slot;
+    };
+
+    // every function gets an index up front, calls can come before the definition
+    void collect_funs(const std::vector<NodeStmt*>& stmts)
+    {
+        for (const NodeStmt* stmt : stmts) {
+            if (std::holds_alternative<NodeStmtFun*>(stmt->var)) {
+                const NodeStmtFun* stmt_fun = std::get<NodeStmtFun*>(stmt->var);
+                if (m_fun_by_name.contains(stmt_fun->ident.value.value())) {
+                    throw error_at(stmt_fun->ident, std::string("Function defined twice: ") + stmt_fun->ident.value.value());
+                }
+                auto index = static_cast<uint16_t>(m_bytecode.functions.size());
+                m_bytecode.functions.push_back({ .name = stmt_fun->ident.value.value(),
+                                                 .params = static_cast<uint16_t>(stmt_fun->params.size()) });
+                m_fun_by_name[stmt_fun->ident.value.value()] = index;
+                m_fun_index.emplace_back(stmt_fun, index);
+            }
+            for_each_body(stmt, [&](const std::vector<NodeStmt*>& body) { collect_funs(body); });
+        }
+    }
+
+    template <typename F>
+    static void for_each_body(const NodeStmt* stmt, F&& fn)
+    {
+        if (std::holds_alternative<NodeStmtScope*>(stmt->var)) {
+            fn(std::get<NodeStmtScope*>(stmt->var)->stmts);
+        } else if (std::holds_alternative<NodeStmtIf*>(stmt->var)) {
+            const NodeStmtIf* stmt_if = std::get<NodeStmtIf*>(stmt->var);
+            fn(stmt_if->body);
+            fn(stmt_if->elif_body);
+            fn(stmt_if->else_body);
+        } else if (std::holds_alternative<NodeStmtWhile*>(stmt->var)) {
+            fn(std::get<NodeStmtWhile*>(stmt->var)->body);
+        } else if (std::holds_alternative<NodeStmtFor*>(stmt->var)) {
+            fn(std::get<NodeStmtFor*>(stmt->var)->body);
+        } else if (std::holds_alternative<NodeStmtFun*>(stmt->var)) {
+            fn(std::get<NodeStmtFun*>(stmt->var)->body->stmts);
+        }
+    }
+
+    void begin_function(uint16_t index)
+    {
+        m_function = &m_bytecode.functions[index];
+        m_vars.clear();
+        m_scopes.clear();
+        m_depth = 0;
+    }
+
+    void end_function()
+    {
+        m_function->slots = std::max<uint32_t>(m_function->slots, m_function->params);
+    }
+
+    void begin_scope()
+    {
+        m_scopes.push_back(m_vars.size());
+    }
+
+    void end_scope()
+    {
+        m_vars.resize(m_scopes.back());
+        m_scopes.pop_back();
+    }
+
+    uint16_t declare(const Token& ident)
+    {
+        const std::string& name = ident.value.value();
+        if (find(name)) {
+            throw error_at(ident, std::string("Identifier already used: ") + name);
+        }
+        // slots of ended scopes are reused
+        auto slot = static_cast<uint16_t>(m_vars.size());
+        m_vars.push_back({ name, slot });
+        m_function->slots = std::max<uint32_t>(m_function->slots, slot + 1);
+        return slot;
+    }
+
+    [[nodiscard]] std::optional<uint16_t> find(const std::string& name) const
+    {
+        for (auto it = m_vars.rbegin(); it != m_vars.rend(); ++it) {
+            if (it->name == name) {
+                return it->slot;
+            }
+        }
+        return {};
+    }
+
+    uint16_t slot_of(const Token& ident, const char* message) const
+    {
+        auto slot = find(ident.value.value());
+        if (!slot) {
+            throw error_at(ident, std::string(message) + ident.value.value());
+        }
+        return *slot;
+    }
+
+    // appends op, stack_effect is how many values it leaves minus how many it takes
+    void emit(Op op, int stack_effect)
+    {
+        m_function->code.push_back(static_cast<uint8_t>(op));
+        m_depth += stack_effect;
+        m_function->max_stack = std::max<uint32_t>(m_function->max_stack, static_cast<uint32_t>(m_depth));
+    }
+
+    template <typename T>
+    void operand(T value)
+    {
+        uint8_t bytes[sizeof(T)];
+        std::memcpy(bytes, &value, sizeof(T));
+        m_function->code.insert(m_function->code.end(), bytes, bytes + sizeof(T));
+    }
+
+    void emit_const(int64_t value)
+    {
+        emit(Op::push_const, 1);
+        operand(value);
+    }
+
+    // a jump to a target that is patched later, returns where its operand is
+    size_t emit_jump(Op op, int stack_effect)
+    {
+        emit(op, stack_effect);
+        size_t at = m_function->code.size();
+        operand<uint32_t>(0);
+        return at;
+    }
+
+    [[nodiscard]] uint32_t here() const
+    {
+        return static_cast<uint32_t>(m_function->code.size());
+    }
+
+    void patch(size_t at, uint32_t target)
+    {
+        std::memcpy(m_function->code.data() + at, &target, sizeof(target));
+    }
+
+    void compile_body(const std::vector<NodeStmt*>& stmts)
+    {
+        begin_scope();
+        for (const NodeStmt* stmt : stmts) {
+            compile_stmt(stmt);
+        }
+        end_scope();
+    }
+
+    void compile_stmt(const NodeStmt* stmt)
+    {
+        struct StmtVisitor {
+            BytecodeCompiler* compiler;
+            void operator()(const NodeStmtExit* stmt_exit) const
+            {
+                compiler->compile_expr(stmt_exit->expr);
+                compiler->emit(Op::exit, -1);
+            }
+            void operator()(const NodeStmtLet* stmt_let) const
+            {
+                compiler->compile_let(stmt_let);
+            }
+            void operator()(const NodeStmtScope* scope) const
+            {
+                compiler->compile_body(scope->stmts);
+            }
+            void operator()(const NodeStmtIf* stmt_if) const
+            {
+                std::vector<size_t> to_end;
+                size_t to_next = compiler->compile_branch(stmt_if->condition, false);
+                compiler->compile_body(stmt_if->body);
+                for (const NodeStmt* elif_stmt : stmt_if->elif_body) {
+                    const NodeStmtIf* elif = std::get<NodeStmtIf*>(elif_stmt->var);
+                    to_end.push_back(compiler->emit_jump(Op::jump, 0));
+                    compiler->patch(to_next, compiler->here());
+                    to_next = compiler->compile_branch(elif->condition, false);
+                    compiler->compile_body(elif->body);
+                }
+                if (!stmt_if->else_body.empty()) {
+                    to_end.push_back(compiler->emit_jump(Op::jump, 0));
+                    compiler->patch(to_next, compiler->here());
+                    compiler->compile_body(stmt_if->else_body);
+                } else {
+                    to_end.push_back(to_next);
+                }
+                for (size_t at : to_end) {
+                    compiler->patch(at, compiler->here());
+                }
+            }
+            void operator()(const NodeStmtWhile* stmt_while) const
+            {
+                // the condition sits below the body, so each iteration takes one branch
+                size_t to_check = compiler->emit_jump(Op::jump, 0);
+                uint32_t body = compiler->here();
+                compiler->compile_body(stmt_while->body);
+                compiler->patch(to_check, compiler->here());
+                compiler->patch(compiler->compile_branch(stmt_while->condition, true), body);
+            }
+            void operator()(const NodeStmtFor* stmt_for) const
+            {
+                // the initialized variable stays visible after the loop, as in the generated code
+                if (std::holds_alternative<NodeStmtLet*>(stmt_for->init)) {
+                    if (const NodeStmtLet* init = std::get<NodeStmtLet*>(stmt_for->init)) {
+                        compiler->compile_let(init);
+                    }
+                } else if (const NodeStmtAssign* init = std::get<NodeStmtAssign*>(stmt_for->init)) {
+                    compiler->compile_assign(init);
+                }
+                size_t to_check = compiler->emit_jump(Op::jump, 0);
+                uint32_t body = compiler->here();
+                compiler->compile_body(stmt_for->body);
+                if (stmt_for->change) {
+                    compiler->compile_assign(stmt_for->change);
+                }
+                compiler->patch(to_check, compiler->here());
+                compiler->patch(compiler->compile_branch(stmt_for->condition, true), body);
+            }
+            void operator()(const NodeStmtAssign* stmt_assign) const
+            {
+                compiler->compile_assign(stmt_assign);
+            }
+            void operator()(const NodeStmtFun*) const
+            {
+                // compiled as a function of its own
+            }
+            void operator()(const NodeStmtPrint* stmt_print) const
+            {
+                compiler->compile_expr(stmt_print->expr);
+                compiler->emit(Op::print, -1);
+            }
+            void operator()(const NodeStmtReturn* stmt_return) const
+            {
+                const NodeExpr* expr = stmt_return->expr;
+                if (std::holds_alternative<NodeTerm*>(expr->var)
+                    && std::holds_alternative<NodeTermFunCall*>(std::get<NodeTerm*>(expr->var)->var)) {
+                    // every call in return position reuses the frame, deep recursion stays flat
+                    compiler->compile_call(std::get<NodeTermFunCall*>(std::get<NodeTerm*>(expr->var)->var), Op::tail_call);
+                    return;
+                }
+                compiler->compile_expr(expr);
+                compiler->emit(Op::ret, -1);
+            }
+        };
+        std::visit(StmtVisitor { .compiler = this }, stmt->var);
+    }
+
+    void compile_let(const NodeStmtLet* stmt_let)
+    {
+        compile_expr(stmt_let->expr);
+        uint16_t slot = declare(stmt_let->ident);
+        emit(Op::store, -1);
+        operand(slot);
+    }
+
+    void compile_assign(const NodeStmtAssign* stmt_assign)
+    {
+        uint16_t slot = slot_of(stmt_assign->lhs->ident, "Identifier never decleared: ");
+        if (compile_update(slot, stmt_assign->rhs)) {
+            return;
+        }
+        compile_expr(stmt_assign->rhs);
+        emit(Op::store, -1);
+        operand(slot);
+    }
+
+    // `x = x + c`, `x = x - c`, `x = x + y`, `x = y + x` and `x = x - y` as one instruction
+    bool compile_update(uint16_t slot, const NodeExpr* rhs)
+    {
+        if (!std::holds_alternative<NodeBinExpr*>(rhs->var)) {
+            return false;
+        }
+        auto slot_in = [&](const NodeExpr* expr) -> std::optional<uint16_t> {
+            if (std::holds_alternative<NodeTerm*>(expr->var)
+                && std::holds_alternative<NodeTermIdent*>(std::get<NodeTerm*>(expr->var)->var)) {
+                return slot_of(std::get<NodeTermIdent*>(std::get<NodeTerm*>(expr->var)->var)->ident, "Undeclared identifier: ");
+            }
+            return {};
+        };
+        auto literal = [](const NodeExpr* expr) -> std::optional<int64_t> {
+            if (std::holds_alternative<NodeTerm*>(expr->var)
+                && std::holds_alternative<NodeTermIntLit*>(std::get<NodeTerm*>(expr->var)->var)) {
+                return static_cast<int64_t>(std::strtoull(std::get<NodeTermIntLit*>(std::get<NodeTerm*>(expr->var)->var)->int_lit.value.value().c_str(), nullptr, 10));
+            }
+            return {};
+        };
+
+        const NodeBinExpr* bin_expr = std::get<NodeBinExpr*>(rhs->var);
+        bool is_add = std::holds_alternative<NodeBinExprAdd*>(bin_expr->var);
+        if (!is_add && !std::holds_alternative<NodeBinExprSub*>(bin_expr->var)) {
+            return false;
+        }
+        const NodeExpr* lhs = is_add ? std::get<NodeBinExprAdd*>(bin_expr->var)->lhs : std::get<NodeBinExprSub*>(bin_expr->var)->lhs;
+        const NodeExpr* other = is_add ? std::get<NodeBinExprAdd*>(bin_expr->var)->rhs : std::get<NodeBinExprSub*>(bin_expr->var)->rhs;
+        if (slot_in(lhs) != slot) {
+            if (!is_add || slot_in(other) != slot) {
+                return false;
+            }
+            std::swap(lhs, other);
+        }
+        if (auto value = literal(other)) {
+            emit(Op::add_const_store, 0);
+            operand(slot);
+            operand<int64_t>(is_add ? *value : static_cast<int64_t>(0ULL - static_cast<uint64_t>(*value)));
+            return true;
+        }
+        if (auto source = slot_in(other)) {
+            emit(is_add ? Op::add_slot_store : Op::sub_slot_store, 0);
+            operand(slot);
+            operand(*source);
+            return true;
+        }
+        return false;
+    }
+
+    // Jumps if condition is when (true or false). Returns the jump's operand for patching.
+    size_t compile_branch(const NodeExpr* condition, bool when)
+    {
+        if (std::holds_alternative<NodeTerm*>(condition->var)) {
+            const NodeTerm* term = std::get<NodeTerm*>(condition->var);
+            if (std::holds_alternative<NodeTermParen*>(term->var)) {
+                return compile_branch(std::get<NodeTermParen*>(term->var)->expr, when);
+            }
+            if (std::holds_alternative<NodeTermNot*>(term->var)) {
+                return compile_branch(std::get<NodeTermNot*>(term->var)->expr, !when);
+            }
+        } else if (std::holds_alternative<NodeBinExprCmp*>(std::get<NodeBinExpr*>(condition->var)->var)) {
+            // compare and branch in one instruction
+            const NodeBinExprCmp* cmp = std::get<NodeBinExprCmp*>(std::get<NodeBinExpr*>(condition->var)->var);
+            compile_expr(cmp->lhs);
+            compile_expr(cmp->rhs);
+            return emit_jump(compare_jump(cmp->comparison->comp.type, when), -2);
+        }
+        compile_expr(condition);
+        return emit_jump(when ? Op::jump_if_not_zero : Op::jump_if_zero, -1);
+    }
+
+    // the jump taken when `a type b` is when
+    static Op compare_jump(TokenType type, bool when)
+    {
+        switch (type) {
+            case TokenType::eq_eq: return when ? Op::jump_if_eq : Op::jump_if_ne;
+            case TokenType::n_eq: return when ? Op::jump_if_ne : Op::jump_if_eq;
+            case TokenType::less_than: return when ? Op::jump_if_lt : Op::jump_if_ge;
+            case TokenType::greater_than: return when ? Op::jump_if_gt : Op::jump_if_le;
+            case TokenType::less_eq: return when ? Op::jump_if_le : Op::jump_if_gt;
+            default: return when ? Op::jump_if_ge : Op::jump_if_lt;
+        }
+    }
+
+    void compile_call(const NodeTermFunCall* fun_call, Op op)
+    {
+        auto it = m_fun_by_name.find(fun_call->ident.value.value());
+        if (it == m_fun_by_name.end()) {
+            throw error_at(fun_call->ident, std::string("Undefined function: ") + fun_call->ident.value.value());
+        }
+        if (m_bytecode.functions[it->second].params != fun_call->args.size()) {
+            throw error_at(fun_call->ident, std::string("Wrong number of arguments for ") + fun_call->ident.value.value());
+        }
+        for (const NodeExpr* arg : fun_call->args) {
+            compile_expr(arg);
+        }
+        emit(op, 1 - static_cast<int>(fun_call->args.size()));
+        operand(it->second);
+    }
+
+    void compile_expr(const NodeExpr* expr)
+    {
+        if (std::holds_alternative<NodeTerm*>(expr->var)) {
+            compile_term(std::get<NodeTerm*>(expr->var));
+            return;
+        }
+        struct BinExprVisitor {
+            BytecodeCompiler* compiler;
+            void operator()(const NodeBinExprAdd* add) const { compiler->compile_binary(add->lhs, add->rhs, Op::add); }
+            void operator()(const NodeBinExprSub* sub) const { compiler->compile_binary(sub->lhs, sub->rhs, Op::sub); }
+            void operator()(const NodeBinExprMulti* multi) const { compiler->compile_binary(multi->lhs, multi->rhs, Op::mul); }
+            void operator()(const NodeBinExprDiv* div) const { compiler->compile_binary(div->lhs, div->rhs, Op::div); }
+            void operator()(const NodeBinExprCmp* cmp) const
+            {
+                Op op = Op::ge;
+                switch (cmp->comparison->comp.type) {
+                    case TokenType::eq_eq: op = Op::eq; break;
+                    case TokenType::n_eq: op = Op::ne; break;
+                    case TokenType::less_than: op = Op::lt; break;
+                    case TokenType::greater_than: op = Op::gt; break;
+                    case TokenType::less_eq: op = Op::le; break;
+                    default: break;
+                }
+                compiler->compile_binary(cmp->lhs, cmp->rhs, op);
+            }
+            void operator()(const NodeBinExprAnd* log_and) const { compiler->compile_logical(log_and->lhs, log_and->rhs, false); }
+            void operator()(const NodeBinExprOr* log_or) const { compiler->compile_logical(log_or->lhs, log_or->rhs, true); }
+        };
+        std::visit(BinExprVisitor { .compiler = this }, std::get<NodeBinExpr*>(expr->var)->var);
+    }
+
+    void compile_binary(const NodeExpr* lhs, const NodeExpr* rhs, Op op)
+    {
+        compile_expr(lhs);
+        compile_expr(rhs);
+        emit(op, -1);
+    }
+
+    // a && b, a || b as 1 or 0, the rhs is only evaluated if it decides the value
+    void compile_logical(const NodeExpr* lhs, const NodeExpr* rhs, bool is_or)
+    {
+        size_t to_short = compile_branch(lhs, is_or);
+        size_t to_short_rhs = compile_branch(rhs, is_or);
+        emit_const(is_or ? 0 : 1);
+        size_t to_end = emit_jump(Op::jump, 0);
+        patch(to_short, here());
+        patch(to_short_rhs, here());
+        m_depth--;      // only one of the two pushes happens
+        emit_const(is_or ? 1 : 0);
+        patch(to_end, here());
+    }
+
+    void compile_term(const NodeTerm* term)
+    {
+        struct TermVisitor {
+            BytecodeCompiler* compiler;
+            void operator()(const NodeTermIntLit* term_int_lit) const
+            {
+                compiler->emit_const(static_cast<int64_t>(std::strtoull(term_int_lit->int_lit.value.value().c_str(), nullptr, 10)));
+            }
+            void operator()(const NodeTermIdent* term_ident) const
+            {
+                uint16_t slot = compiler->slot_of(term_ident->ident, "Undeclared identifier: ");
+                compiler->emit(Op::load, 1);
+                compiler->operand(slot);
+            }
+            void operator()(const NodeTermParen* term_paren) const
+            {
+                compiler->compile_expr(term_paren->expr);
+            }
+            void operator()(const NodeTermNot* term_not) const
+            {
+                compiler->compile_expr(term_not->expr);
+                compiler->emit(Op::log_not, 0);
+            }
+            void operator()(const NodeTermFunCall* fun_call) const
+            {
+                compiler->compile_call(fun_call, Op::call);
+            }
+        };
+        std::visit(TermVisitor { .compiler = this }, term->var);
+    }
+
+    const NodeProg& m_prog;
+    Bytecode m_bytecode;
+    BytecodeFunction* m_function = nullptr;
+    std::unordered_map<std::string, uint16_t> m_fun_by_name;
+    std::vector<std::pair<const NodeStmtFun*, uint16_t>> m_fun_index;
+    std::vector<Var> m_vars;
+    std::vector<size_t> m_scopes;
+    int m_depth = 0;    // operand stack depth at the current instruction
+};
@@ -0,0 +1,296 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include "xxhash.hpp"
+
+// Persistent compilation cache in $OGEN_CACHE_DIR, else $XDG_CACHE_HOME/ogen, else
+// ~/.cache/ogen. An entry is a directory named after the hash of the source, the
+// compiler binary and the flags, holding the files one compilation produced. Entries
+// are built in a temporary directory and renamed into place, so readers see all of an
+// entry or nothing. A hit touches the entry, and the least recently used entries go
+// once the cache grows past max_size. The cache never fails a compilation: anything
+// that goes wrong is a miss.
+class Cache {
+public:
+    inline explicit Cache(std::string flags)
+        : m_flags(std::move(flags))
+    {
+        if (const char* dir = std::getenv("OGEN_CACHE_DIR")) {
+            m_dir = dir;
+        } else if (const char* xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+            m_dir = std::filesystem::path(xdg) / "ogen";
+        } else if (const char* home = std::getenv("HOME")) {
+            m_dir = std::filesystem::path(home) / ".cache" / "ogen";
+        }
+    }
+
+    // the entry name for source compiled with this compiler and these flags, variant tells
+    // apart entries of the same compilation that hold different files
+    [[nodiscard]] std::string key(const std::string& source, const std::string& variant = "") const
+    {
+        std::string material = compiler_id();
+        material += '\0';
+        material += m_flags;
+        material += '\0';
+        material += variant;
+        material += '\0';
+        material += source;
+        std::stringstream name;
+        name << std::hex;
+        name.width(16);
+        name.fill('0');
+        name << xxh64::hash(material);
+        return name.str();
+    }
+
+    // the name of each file in an entry and where it is outside the cache
+    using Files = std::vector<std::pair<std::string, std::filesystem::path>>;
+
+    // Links (or copies) the files of entry key to their places. Each one is put there by a
+    // rename, so nobody sees it half written. False on a miss.
+    bool restore(const std::string& key, const Files& files)
+    {
+        std::error_code error;
+        std::filesystem::path entry = m_dir / key;
+        bool hit = !m_dir.empty();
+        for (const auto& [name, path] : files) {
+            hit = hit && std::filesystem::exists(entry / name, error);
+        }
+        for (size_t i = 0; hit && i < files.size(); i++) {
+            std::filesystem::path source = entry / files[i].first;
+            std::filesystem::path temp = files[i].second.string() + ".ogen-tmp" + std::to_string(gettid());
+            std::filesystem::create_hard_link(source, temp, error);
+            if (error) {
+                std::filesystem::copy_file(source, temp, std::filesystem::copy_options::overwrite_existing, error);
+            }
+            if (!error) {
+                std::filesystem::rename(temp, files[i].second, error);
+            }
+            if (error) {
+                std::filesystem::remove(temp, error);
+                hit = false;
+            }
+        }
+        count(hit);
+        if (hit) {
+            std::filesystem::last_write_time(entry, std::filesystem::file_time_type::clock::now(), error);
+        }
+        return hit;
+    }
+
+    // The contents of one file of entry key, for --run. Nothing on a miss.
+    std::optional<std::string> load(const std::string& key, const std::string& file)
+    {
+        std::error_code error;
+        std::filesystem::path entry = m_dir / key;
+        std::ifstream input(entry / file, std::ios::in | std::ios::binary);
+        count(!m_dir.empty() && input.is_open());
+        if (m_dir.empty() || !input.is_open()) {
+            return {};
+        }
+        std::stringstream contents;
+        contents << input.rdbuf();
+        std::filesystem::last_write_time(entry, std::filesystem::file_time_type::clock::now(), error);
+        return contents.str();
+    }
+
+    // Stores copies of the files as entry key.
+    void store(const std::string& key, const Files& files)
+    {
+        std::optional<std::filesystem::path> temp = begin_entry(key);
+        if (!temp) {
+            return;
+        }
+        std::error_code error;
+        for (const auto& [name, path] : files) {
+            if (!std::filesystem::copy_file(path, *temp / name, error)) {
+                std::filesystem::remove_all(*temp, error);
+                return;
+            }
+        }
+        commit(*temp, key);
+    }
+
+    // Stores contents as the only file of entry key.
+    void store(const std::string& key, const std::string& file, const std::string& contents)
+    {
+        std::optional<std::filesystem::path> temp = begin_entry(key);
+        if (!temp) {
+            return;
+        }
+        std::ofstream out(*temp / file, std::ios::out | std::ios::binary);
+        out << contents;
+        out.close();
+        if (!out) {
+            std::error_code error;
+            std::filesystem::remove_all(*temp, error);      // a full disk mustn't leave a truncated entry
+            return;
+        }
+        commit(*temp, key);
+    }
+
+    void print_stats(std::ostream& out)
+    {
+        auto [hits, misses] = read_stats();
+        size_t entries = 0;
+        uintmax_t bytes = 0;
+        for (const Entry& entry : entries_by_age()) {
+            entries++;
+            bytes += entry.bytes;
+        }
+        out << "cache: " << m_dir.string() << "\n";
+        out << "hits: " << hits << "\n";
+        out << "misses: " << misses << "\n";
+        out << "entries: " << entries << "\n";
+        out << "size: " << bytes << " bytes (limit " << max_size << ")\n";
+    }
+
+    // Identifies the compiler build: a rebuilt ogen may generate different code for the
+    // same source, so the binary itself is part of every key.
+    static const std::string& compiler_id()
+    {
+        static const std::string id = [] {
+            std::ifstream self("/proc/self/exe", std::ios::in | std::ios::binary);
+            std::stringstream contents;
+            contents << self.rdbuf();
+            return std::to_string(xxh64::hash(contents.str()));
+        }();
+        return id;
+    }
+
+private:
+    struct Entry {
+        std::filesystem::path path;
+        std::filesystem::file_time_type used;
+        uintmax_t bytes;
+    };
+
+    static constexpr uintmax_t max_size = uintmax_t { 256 } << 20;
+
+    // a fresh directory the files of entry key are gathered in
+    std::optional<std::filesystem::path> begin_entry(const std::string& key) const
+    {
+        std::error_code error;
+        if (m_dir.empty() || (!std::filesystem::create_directories(m_dir, error) && error)) {
+            return {};
+        }
+        // unique per thread, the compile server may store the same entry twice at once
+        std::filesystem::path temp = m_dir / (key + ".tmp" + std::to_string(gettid()));
+        std::filesystem::remove_all(temp, error);
+        if (!std::filesystem::create_directory(temp, error)) {
+            return {};
+        }
+        return temp;
+    }
+
+    void commit(const std::filesystem::path& temp, const std::string& key) const
+    {
+        std::error_code error;
+        // a concurrent compilation of the same source may have won, its entry is as good
+        std::filesystem::rename(temp, m_dir / key, error);
+        if (error) {
+            std::filesystem::remove_all(temp, error);
+            return;
+        }
+        evict();
+    }
+
+    [[nodiscard]] std::vector<Entry> entries_by_age() const
+    {
+        std::vector<Entry> entries;
+        std::error_code error;
+        for (const auto& dir : std::filesystem::directory_iterator(m_dir, error)) {
+            if (!dir.is_directory(error) || dir.path().filename().string().find(".tmp") != std::string::npos) {
+                continue;
+            }
+            Entry entry { .path = dir.path(), .used = dir.last_write_time(error), .bytes = 0 };
+            for (const auto& file : std::filesystem::directory_iterator(dir.path(), error)) {
+                entry.bytes += file.file_size(error);
+            }
+            entries.push_back(entry);
+        }
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.used < b.used; });
+        return entries;
+    }
+
+    // drops least recently used entries until the cache fits in max_size
+    void evict() const
+    {
+        std::vector<Entry> entries = entries_by_age();
+        uintmax_t total = 0;
+        for (const Entry& entry : entries) {
+            total += entry.bytes;
+        }
+        std::error_code error;
+        for (const Entry& entry : entries) {
+            if (total <= max_size) {
+                break;
+            }
+            std::filesystem::remove_all(entry.path, error);
+            total -= entry.bytes;
+        }
+    }
+
+    // Hit and miss counters live in the stats file, updated under an flock so parallel
+    // compilations don't lose counts.
+    void count(bool hit) const
+    {
+        std::error_code error;
+        if (m_dir.empty() || (!std::filesystem::create_directories(m_dir, error) && error)) {
+            return;
+        }
+        int fd = open((m_dir / "stats").c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            return;
+        }
+        flock(fd, LOCK_EX);
+        auto [hits, misses] = parse_stats(fd);
+        (hit ? hits : misses)++;
+        std::string text = std::to_string(hits) + " " + std::to_string(misses) + "\n";
+        if (pwrite(fd, text.data(), text.size(), 0) == static_cast<ssize_t>(text.size())) {
+            ftruncate(fd, static_cast<off_t>(text.size()));
+        }
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+
+    [[nodiscard]] std::pair<uint64_t, uint64_t> read_stats() const
+    {
+        int fd = open((m_dir / "stats").c_str(), O_RDONLY);
+        if (fd < 0) {
+            return { 0, 0 };
+        }
+        flock(fd, LOCK_SH);
+        auto stats = parse_stats(fd);
+        flock(fd, LOCK_UN);
+        close(fd);
+        return stats;
+    }
+
+    static std::pair<uint64_t, uint64_t> parse_stats(int fd)
+    {
+        char text[64] = {};
+        ssize_t size = pread(fd, text, sizeof(text) - 1, 0);
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        if (size > 0) {
+            std::stringstream(std::string(text, static_cast<size_t>(size))) >> hits >> misses;
+        }
+        return { hits, misses };
+    }
+
+    std::filesystem::path m_dir;
+    std::string m_flags;
+};
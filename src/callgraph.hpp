@@ -0,0 +1,226 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "parser.hpp"
+
+// Call graph of the top-level functions in a program. The top-level statements
+// (everything that ends up in _start) act as the root of the graph. In a module that
+// exports its functions every one of them is a root too.
+class CallGraph {
+public:
+    inline explicit CallGraph(const NodeProg& prog, bool export_all = false)
+    {
+        for (const NodeStmt* stmt : prog.stmts) {
+            if (std::holds_alternative<NodeStmtFun*>(stmt->var)) {
+                const NodeStmtFun* stmt_fun = std::get<NodeStmtFun*>(stmt->var);
+                Node& node = m_funs[stmt_fun->ident.value.value()];
+                node.fun = stmt_fun;
+                for (const NodeStmt* body_stmt : stmt_fun->body->stmts) {
+                    collect_stmt(body_stmt, node);
+                }
+            } else {
+                collect_stmt(stmt, m_root);
+            }
+        }
+
+        std::vector<const Node*> worklist { &m_root };
+        for (const auto& [name, node] : m_funs) {
+            if (export_all && m_reachable.insert(name).second) {
+                worklist.push_back(&node);
+            }
+        }
+        while (!worklist.empty()) {
+            const Node* node = worklist.back();
+            worklist.pop_back();
+            m_uses_print = m_uses_print || node->uses_print;
+            for (const std::string& callee : node->callees) {
+                auto it = m_funs.find(callee);
+                if (it != m_funs.end() && m_reachable.insert(callee).second) {
+                    worklist.push_back(&it->second);
+                }
+            }
+        }
+
+        // a function is pure until it is shown to print, exit or call something that isn't
+        for (const auto& [name, node] : m_funs) {
+            if (!node.uses_print && !node.uses_exit) {
+                m_pure.insert(name);
+            }
+        }
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (const auto& [name, node] : m_funs) {
+                if (m_pure.contains(name)
+                    && std::any_of(node.callees.begin(), node.callees.end(), [&](const std::string& callee) { return !m_pure.contains(callee); })) {
+                    m_pure.erase(name);
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    [[nodiscard]] bool is_reachable(const std::string& name) const
+    {
+        return m_reachable.contains(name);
+    }
+
+    // true if any reachable code prints, i.e. the print runtime is needed
+    [[nodiscard]] bool uses_print() const
+    {
+        return m_uses_print;
+    }
+
+    // true if a call to name only computes a value from the arguments. Functions can't
+    // see the variables of the top level, so that holds when neither it nor anything
+    // it calls prints or exits.
+    [[nodiscard]] bool is_pure(const std::string& name) const
+    {
+        return m_pure.contains(name);
+    }
+
+    // true if a call to from can lead to a call to name
+    [[nodiscard]] bool can_reach(const std::string& from, const std::string& name) const
+    {
+        std::unordered_set<std::string> seen;
+        std::vector<std::string> worklist { from };
+        while (!worklist.empty()) {
+            auto it = m_funs.find(worklist.back());
+            worklist.pop_back();
+            if (it == m_funs.end()) {
+                continue;
+            }
+            for (const std::string& callee : it->second.callees) {
+                if (callee == name) {
+                    return true;
+                }
+                if (seen.insert(callee).second) {
+                    worklist.push_back(callee);
+                }
+            }
+        }
+        return false;
+    }
+
+private:
+    struct Node {
+        const NodeStmtFun* fun = nullptr;
+        std::unordered_set<std::string> callees;
+        bool uses_print = false;
+        bool uses_exit = false;
+    };
+
+    void collect_expr(const NodeExpr* expr, Node& node)
+    {
+        struct ExprVisitor {
+            CallGraph* graph;
+            Node& node;
+            void operator()(const NodeTerm* term) const
+            {
+                if (std::holds_alternative<NodeTermParen*>(term->var)) {
+                    graph->collect_expr(std::get<NodeTermParen*>(term->var)->expr, node);
+                } else if (std::holds_alternative<NodeTermNot*>(term->var)) {
+                    graph->collect_expr(std::get<NodeTermNot*>(term->var)->expr, node);
+                } else if (std::holds_alternative<NodeTermFunCall*>(term->var)) {
+                    const NodeTermFunCall* fun_call = std::get<NodeTermFunCall*>(term->var);
+                    node.callees.insert(fun_call->ident.value.value());
+                    for (const NodeExpr* arg : fun_call->args) {
+                        graph->collect_expr(arg, node);
+                    }
+                }
+            }
+            void operator()(const NodeBinExpr* bin_expr) const
+            {
+                std::visit([&](const auto* bin) {
+                    graph->collect_expr(bin->lhs, node);
+                    graph->collect_expr(bin->rhs, node);
+                }, bin_expr->var);
+            }
+        };
+        std::visit(ExprVisitor { .graph = this, .node = node }, expr->var);
+    }
+
+    void collect_stmts(const std::vector<NodeStmt*>& stmts, Node& node)
+    {
+        for (const NodeStmt* stmt : stmts) {
+            collect_stmt(stmt, node);
+        }
+    }
+
+    void collect_stmt(const NodeStmt* stmt, Node& node)
+    {
+        struct StmtVisitor {
+            CallGraph* graph;
+            Node& node;
+            void operator()(const NodeStmtExit* stmt_exit) const
+            {
+                node.uses_exit = true;
+                graph->collect_expr(stmt_exit->expr, node);
+            }
+            void operator()(const NodeStmtLet* stmt_let) const
+            {
+                graph->collect_expr(stmt_let->expr, node);
+            }
+            void operator()(const NodeStmtScope* scope) const
+            {
+                graph->collect_stmts(scope->stmts, node);
+            }
+            void operator()(const NodeStmtIf* stmt_if) const
+            {
+                graph->collect_expr(stmt_if->condition, node);
+                graph->collect_stmts(stmt_if->body, node);
+                graph->collect_stmts(stmt_if->elif_body, node);
+                graph->collect_stmts(stmt_if->else_body, node);
+            }
+            void operator()(const NodeStmtWhile* stmt_while) const
+            {
+                graph->collect_expr(stmt_while->condition, node);
+                graph->collect_stmts(stmt_while->body, node);
+            }
+            void operator()(const NodeStmtFor* stmt_for) const
+            {
+                if (std::holds_alternative<NodeStmtLet*>(stmt_for->init)) {
+                    if (const NodeStmtLet* init = std::get<NodeStmtLet*>(stmt_for->init)) {
+                        graph->collect_expr(init->expr, node);
+                    }
+                } else {
+                    graph->collect_expr(std::get<NodeStmtAssign*>(stmt_for->init)->rhs, node);
+                }
+                graph->collect_expr(stmt_for->condition, node);
+                if (stmt_for->change) {
+                    graph->collect_expr(stmt_for->change->rhs, node);
+                }
+                graph->collect_stmts(stmt_for->body, node);
+            }
+            void operator()(const NodeStmtAssign* stmt_assign) const
+            {
+                graph->collect_expr(stmt_assign->rhs, node);
+            }
+            void operator()(const NodeStmtFun*) const
+            {
+                // nested functions are not part of the graph
+            }
+            void operator()(const NodeStmtPrint* stmt_print) const
+            {
+                node.uses_print = true;
+                graph->collect_expr(stmt_print->expr, node);
+            }
+            void operator()(const NodeStmtReturn* stmt_return) const
+            {
+                graph->collect_expr(stmt_return->expr, node);
+            }
+        };
+        std::visit(StmtVisitor { .graph = this, .node = node }, stmt->var);
+    }
+
+    std::unordered_map<std::string, Node> m_funs;
+    Node m_root;
+    std::unordered_set<std::string> m_reachable;
+    std::unordered_set<std::string> m_pure;
+    bool m_uses_print = false;
+};
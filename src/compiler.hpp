@@ -0,0 +1,347 @@
+#pragma once
+
+#include <array>
+#include <filesystem>
+#include <fstream>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "cache.hpp"
+#include "cse.hpp"
+#include "generation.hpp"
+#include "inliner.hpp"
+#include "loops.hpp"
+#include "scev.hpp"
+#include "specialize.hpp"
+
+// The stages of a compilation, shared by the command line and the compile server. Nothing
+// here touches global state, so compilations on different threads don't interfere.
+
+// room for the parsed program and the nodes the optimizer passes add
+inline constexpr size_t arena_size = 1024 * 1024 * 8;
+
+// everything in options that changes the generated code, for the cache key
+inline std::string cache_flags(const Options& options)
+{
+    return std::to_string(options.omit_frame_pointer) + " " + std::to_string(options.unroll_factor) + " "
+        + std::to_string(options.auto_memo) + (options.debug_info ? " -g " + options.source_name : "");
+}
+
+// Tokenizes and parses source, tokenizing large sources on tokenize_threads() threads.
+// The nodes live in allocator. Positions count lines from first_line, for sources cut
+// out of a larger file. The tokenizer's and parser's debug output goes to log, by default
+// nowhere.
+inline NodeProg parse(std::string source, ArenaAllocator& allocator, uint32_t first_line = 1, std::ostream& log = null_log())
+{
+    std::vector<Token> tokens = source.size() >= parallel_tokenize_min_size && first_line == 1
+        ? tokenize_parallel(source, tokenize_threads(), log)
+        : Tokenizer(std::move(source), log, first_line).tokenize();
+
+    Parser parser(std::move(tokens), allocator, log);
+    std::optional<NodeProg> prog = parser.parse_prog();
+    if (!prog.has_value()) {
+        throw CompileError("Invalid program");
+    }
+    return prog.value();
+}
+
+// Runs the optimizer passes over prog. Without the interprocedural ones (the specializer
+// and the inliner) what a function compiles to only depends on the function itself.
+inline void optimize(NodeProg& prog, ArenaAllocator& allocator, bool interprocedural = true)
+{
+    if (interprocedural) {
+        Specializer specializer(prog, allocator);
+        specializer.run();
+        Inliner inliner(prog, allocator);
+        inliner.run();
+    }
+    ScalarEvolution scev(prog, allocator);
+    scev.run();
+    CommonSubexpressions cse(prog, allocator);
+    cse.run();
+    LoopInvariantMotion licm(prog, allocator);
+    licm.run();
+}
+
+// A whole program in one source. Imports need the file the source came from, those
+// programs go through modules.hpp.
+inline NodeProg parse_and_optimize(std::string source, ArenaAllocator& allocator, std::ostream& log = null_log())
+{
+    NodeProg prog = parse(std::move(source), allocator, 1, log);
+    if (!prog.imports.empty()) {
+        throw CompileError("Programs with imports have to be compiled from their file");
+    }
+    optimize(prog, allocator);
+    return prog;
+}
+
+inline std::string compile_to_asm(std::string source, const Options& options, ArenaAllocator& allocator, std::ostream& log = null_log())
+{
+    NodeProg prog = parse_and_optimize(std::move(source), allocator, log);
+    Generator generator(prog, options, {}, log);
+    return generator.gen_prog();
+}
+
+// a message for the user, collected in diagnostics if given
+inline void report(std::string* diagnostics, const std::string& message)
+{
+    if (diagnostics) {
+        diagnostics->append(message);
+    } else {
+        std::cerr << message;
+    }
+}
+
+// Runs a tool and waits for it. Its stdout and stderr go to output if given, else to ours.
+inline bool run_tool(const std::vector<std::string>& args, std::string* output)
+{
+    std::vector<char*> argv;
+    for (const std::string& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    int pipe_fds[2] = { -1, -1 };
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (output && pipe2(pipe_fds, O_CLOEXEC) == 0) {
+        posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDERR_FILENO);
+    }
+    pid_t pid;
+    int error = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (pipe_fds[1] >= 0) {
+        close(pipe_fds[1]);
+        char buffer[4096];
+        ssize_t size;
+        while (error == 0 && (size = read(pipe_fds[0], buffer, sizeof(buffer))) > 0) {
+            output->append(buffer, static_cast<size_t>(size));
+        }
+        close(pipe_fds[0]);
+    }
+    if (error != 0) {
+        report(output, "Could not run " + args.front() + ": " + std::strerror(error) + "\n");
+        return false;
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// the nasm command assembling input into output, with DWARF line info for -g
+inline std::vector<std::string> nasm_command(const std::string& input, const std::string& output, bool debug_info)
+{
+    std::vector<std::string> args = { "nasm", "-felf64" };
+    if (debug_info) {
+        args.insert(args.end(), { "-g", "-F", "dwarf" });
+    }
+    args.insert(args.end(), { input, "-o", output });
+    return args;
+}
+
+// The stages a build can stop after, each one leaves a file
+enum class Emit { assembly, object, executable };
+
+// --emit=asm|obj|exe
+inline std::optional<Emit> parse_emit(const std::string& name)
+{
+    if (name == "asm") {
+        return Emit::assembly;
+    }
+    if (name == "obj") {
+        return Emit::object;
+    }
+    if (name == "exe") {
+        return Emit::executable;
+    }
+    return {};
+}
+
+// Where a build puts the file of each stage it keeps, empty for stages it doesn't
+struct Target {
+    std::array<std::filesystem::path, 3> outputs;
+
+    // -o and --emit. With neither, out.asm, out.o and out in dir, as ogen always wrote.
+    static Target make(std::optional<Emit> emit, const std::filesystem::path& output, const std::filesystem::path& dir)
+    {
+        static const std::array<const char*, 3> default_names = { "out.asm", "out.o", "out" };
+        Target target;
+        if (!emit && output.empty()) {
+            for (size_t i = 0; i < default_names.size(); i++) {
+                target.outputs[i] = dir / default_names[i];
+            }
+            return target;
+        }
+        auto stage = static_cast<size_t>(emit.value_or(Emit::executable));
+        target.outputs[stage] = dir / (output.empty() ? std::filesystem::path(default_names[stage]) : output);
+        return target;
+    }
+
+    [[nodiscard]] Emit last() const
+    {
+        return outputs[2].empty() ? (outputs[1].empty() ? Emit::assembly : Emit::object) : Emit::executable;
+    }
+
+    // the names of the kept files in a cache entry and where they go
+    [[nodiscard]] Cache::Files cache_files() const
+    {
+        static const std::array<const char*, 3> entry_names = { "asm", "o", "exe" };
+        Cache::Files files;
+        for (size_t i = 0; i < outputs.size(); i++) {
+            if (!outputs[i].empty()) {
+                files.emplace_back(entry_names[i], outputs[i]);
+            }
+        }
+        return files;
+    }
+};
+
+inline mode_t process_umask()
+{
+    static const mode_t mask = [] {
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.starts_with("Umask:")) {
+                return static_cast<mode_t>(std::strtoul(line.c_str() + 6, nullptr, 8));
+            }
+        }
+        return static_cast<mode_t>(022);
+    }();
+    return mask;
+}
+
+// A file with a unique name in the directory it's meant for, so compilations running side
+// by side never share one and rename can put it in place atomically. Gone with the object
+// unless it was committed.
+class TempFile {
+public:
+    inline TempFile(const std::filesystem::path& dir, const std::string& suffix)
+    {
+        std::string name = (dir / ".ogen-XXXXXX").string() + suffix;
+        int fd = mkstemps(name.data(), static_cast<int>(suffix.size()));
+        if (fd >= 0) {
+            close(fd);
+            m_path = name;
+        }
+    }
+
+    inline TempFile(const TempFile& other) = delete;
+
+    inline TempFile operator=(const TempFile& other) = delete;
+
+    inline ~TempFile()
+    {
+        if (!m_path.empty()) {
+            unlink(m_path.c_str());
+        }
+    }
+
+    [[nodiscard]] const std::filesystem::path& path() const
+    {
+        return m_path;
+    }
+
+    // moves the file to destination with the permissions a new file gets there
+    bool commit(const std::filesystem::path& destination, mode_t mode)
+    {
+        if (chmod(m_path.c_str(), mode & ~process_umask()) < 0 || rename(m_path.c_str(), destination.c_str()) < 0) {
+            return false;
+        }
+        m_path.clear();
+        return true;
+    }
+
+private:
+    std::filesystem::path m_path;
+};
+
+// Writes asm_source, then assembles and links it into the files target asks for, and
+// stores them in cache under key if given. Intermediates live in temporary files and
+// every output appears by an atomic rename. True if every output was made.
+inline bool emit_outputs(const std::string& asm_source, const Target& target, bool debug_info, Cache* cache,
+    const std::string& key, std::string* diagnostics)
+{
+    auto last = static_cast<size_t>(target.last());
+    std::filesystem::path dir = target.outputs[last].parent_path();
+    if (dir.empty()) {
+        dir = ".";
+    }
+    std::array<std::optional<TempFile>, 3> files;
+    files[0].emplace(dir, ".asm");
+    if (last >= 1) {
+        files[1].emplace(dir, ".o");
+    }
+    if (last >= 2) {
+        files[2].emplace(dir, "");
+    }
+    for (size_t i = 0; i <= last; i++) {
+        if (files[i]->path().empty()) {
+            report(diagnostics, "Could not create a temporary file in " + dir.string() + "\n");
+            return false;
+        }
+    }
+    {
+        std::fstream file(files[0]->path(), std::ios::out);
+        file << asm_source;
+    }
+
+    // the stages that worked, a failed nasm still leaves the assembly as it always did
+    size_t done = 0;
+    #ifdef __linux__                      //Untestd. might not work on windows. actaully def wont work on windows. the syscalls are different
+        if (last >= 1 && run_tool(nasm_command(files[0]->path(), files[1]->path(), debug_info), diagnostics)) {
+            done = 1;
+        }
+        if (last >= 2 && done == 1 && run_tool({ "ld", "-o", files[2]->path(), files[1]->path() }, diagnostics)) {
+            done = 2;
+        }
+    #else
+        std::cout << "Unsupported OS" << std::endl;
+    #endif
+    bool built = done == last;
+
+    if (cache && built) {
+        Cache::Files entry = target.cache_files();
+        for (size_t i = 0, kept = 0; i <= last; i++) {
+            if (!target.outputs[i].empty()) {
+                entry[kept++].second = files[i]->path();
+            }
+        }
+        cache->store(key, entry);
+    }
+    for (size_t i = 0; i <= last; i++) {
+        if (target.outputs[i].empty()) {
+            continue;
+        }
+        if (i <= done) {
+            built = files[i]->commit(target.outputs[i], i == 2 ? 0777 : 0666) && built;
+        } else {
+            // whatever an earlier build left there doesn't belong to this source
+            std::error_code error;
+            std::filesystem::remove(target.outputs[i], error);
+        }
+    }
+    return built;
+}
+
+// Compiles source into the files target asks for, or takes them from cache if it has
+// them. Any number of builds may run in one directory. Tools' messages go to diagnostics
+// if given, the compiler's debug output to log. True if every output was made.
+inline bool build(const std::string& source, const Options& options, const Target& target,
+    Cache* cache, ArenaAllocator& allocator, std::string* diagnostics, std::ostream& log = null_log())
+{
+    std::string stages;
+    for (const auto& [name, path] : target.cache_files()) {
+        stages += name + " ";
+    }
+    std::string key = cache ? cache->key(source, stages) : "";
+    if (cache && cache->restore(key, target.cache_files())) {
+        return true;
+    }
+    std::string asm_source = compile_to_asm(source, options, allocator, log);
+    return emit_outputs(asm_source, target, options.debug_info, cache, key, diagnostics);
+}
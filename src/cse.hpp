@@ -0,0 +1,289 @@
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "loops.hpp"
+
+// Common subexpression elimination over the structured control flow of each function.
+// Arithmetic that was already computed on every path to an expression, with none of its
+// variables written since, is replaced by a variable holding the earlier value. The
+// first occurrence is moved into a `let` in front of its statement once it is reused.
+// A value computed before an if stays available in its arms and after it, one computed
+// in an arm only within that arm. Loops keep the values whose variables they don't
+// write. Calls can't write the caller's variables, only a nested function (which
+// shares them) ends every value.
+class CommonSubexpressions {
+public:
+    inline explicit CommonSubexpressions(NodeProg& prog, ArenaAllocator& allocator)
+        : m_prog(prog), m_allocator(allocator)
+    {
+        for (const NodeStmt* stmt : m_prog.stmts) {
+            if (std::holds_alternative<NodeStmtFun*>(stmt->var)) {
+                m_funs.insert(std::get<NodeStmtFun*>(stmt->var)->ident.value.value());
+            }
+        }
+    }
+
+    void run()
+    {
+        number_stmts(m_prog.stmts, {});
+    }
+
+private:
+    struct Value {
+        NodeExpr* first;                    // first occurrence
+        std::vector<NodeStmt*>* stmts;      // where the `let` for it goes: in stmts, before stmt
+        const NodeStmt* stmt;
+        std::string name {};                // variable holding the value, empty until it is reused
+        std::unordered_set<std::string> reads {};
+    };
+    using Values = std::unordered_map<std::string, Value*>;   // available values by key
+
+    // the statement an expression is evaluated in front of, null where it is evaluated repeatedly
+    struct Site {
+        std::vector<NodeStmt*>* stmts;
+        const NodeStmt* stmt;
+    };
+
+    void number_stmts(std::vector<NodeStmt*>& stmts, Values values)
+    {
+        for (size_t i = 0; i < stmts.size(); i++) {
+            NodeStmt* stmt = stmts[i];
+            number_stmt(stmts, stmt, values);
+            // lets may have been inserted in front of this or an earlier statement
+            i = std::find(stmts.begin(), stmts.end(), stmt) - stmts.begin();
+        }
+    }
+
+    void number_stmt(std::vector<NodeStmt*>& stmts, NodeStmt* stmt, Values& values)
+    {
+        Site site { .stmts = &stmts, .stmt = stmt };
+        if (std::holds_alternative<NodeStmtFun*>(stmt->var)) {
+            number_stmts(std::get<NodeStmtFun*>(stmt->var)->body->stmts, {});
+            return;
+        }
+        if (std::holds_alternative<NodeStmtLet*>(stmt->var)) {
+            // `let v = a + b` makes v itself the holder of a + b
+            NodeStmtLet* stmt_let = std::get<NodeStmtLet*>(stmt->var);
+            bool candidate = is_candidate(stmt_let->expr);
+            std::string key = candidate ? key_of(stmt_let->expr) : "";
+            number_expr(stmt_let->expr, values, &site);
+            if (candidate && values.contains(key) && values[key]->first == stmt_let->expr && values[key]->name.empty()) {
+                values[key]->name = stmt_let->ident.value.value();
+                values[key]->reads.insert(stmt_let->ident.value.value());
+            }
+        } else if (std::holds_alternative<NodeStmtIf*>(stmt->var)) {
+            NodeStmtIf* stmt_if = std::get<NodeStmtIf*>(stmt->var);
+            number_expr(stmt_if->condition, values, &site);
+            number_stmts(stmt_if->body, values);
+            for (NodeStmt* elif_stmt : stmt_if->elif_body) {
+                NodeStmtIf* elif = std::get<NodeStmtIf*>(elif_stmt->var);
+                number_expr(elif->condition, values, nullptr);
+                number_stmts(elif->body, values);
+            }
+            number_stmts(stmt_if->else_body, values);
+        } else if (std::holds_alternative<NodeStmtWhile*>(stmt->var)) {
+            NodeStmtWhile* stmt_while = std::get<NodeStmtWhile*>(stmt->var);
+            invalidate_written({ stmt }, values);
+            number_expr(stmt_while->condition, values, nullptr);
+            number_stmts(stmt_while->body, values);
+        } else if (std::holds_alternative<NodeStmtFor*>(stmt->var)) {
+            NodeStmtFor* stmt_for = std::get<NodeStmtFor*>(stmt->var);
+            if (std::holds_alternative<NodeStmtLet*>(stmt_for->init)) {
+                if (NodeStmtLet* init = std::get<NodeStmtLet*>(stmt_for->init)) {
+                    number_expr(init->expr, values, nullptr);
+                }
+            } else if (NodeStmtAssign* init = std::get<NodeStmtAssign*>(stmt_for->init)) {
+                number_expr(init->rhs, values, nullptr);
+            }
+            invalidate_written({ stmt }, values);
+            number_expr(stmt_for->condition, values, nullptr);
+            if (stmt_for->change) {
+                number_expr(stmt_for->change->rhs, values, nullptr);
+            }
+            number_stmts(stmt_for->body, values);
+        } else if (std::holds_alternative<NodeStmtScope*>(stmt->var)) {
+            number_stmts(std::get<NodeStmtScope*>(stmt->var)->stmts, values);
+        } else {
+            for_each_expr(stmt, [&](NodeExpr* expr) { number_expr(expr, values, &site); });
+        }
+
+        invalidate_written({ stmt }, values);
+        if (has_nested_call({ stmt })) {
+            values.clear();
+        }
+    }
+
+    // Replaces expr, or the largest parts of it, by values already available. Where expr
+    // is evaluated once, at site, its arithmetic becomes available for what follows.
+    void number_expr(NodeExpr* expr, Values& values, const Site* site)
+    {
+        bool candidate = is_candidate(expr);
+        std::string key;
+        if (candidate) {
+            key = key_of(expr);
+            if (auto it = values.find(key); it != values.end()) {
+                reuse(*it->second, expr);
+                return;
+            }
+        }
+        for_each_operand(expr, [&](NodeExpr* operand) { number_expr(operand, values, site); });
+        if (candidate && site) {
+            Value* value = &m_values.emplace_back(Value { .first = expr, .stmts = site->stmts, .stmt = site->stmt });
+            for_each_ident(expr, [&](const std::string& name) { value->reads.insert(name); });
+            values[key] = value;
+        }
+    }
+
+    void reuse(Value& value, NodeExpr* expr)
+    {
+        if (value.name.empty()) {
+            materialize(value);
+        }
+        auto ident = m_allocator.alloc<NodeTermIdent>();
+        ident->ident = { .type = TokenType::ident, .value = value.name };
+        auto term = m_allocator.alloc<NodeTerm>();
+        term->var = ident;
+        expr->var = term;
+    }
+
+    // moves the first occurrence of value into a `let` and reads the variable there instead
+    void materialize(Value& value)
+    {
+        auto stmt_let = m_allocator.alloc<NodeStmtLet>();
+        stmt_let->ident = { .type = TokenType::ident, .value = temp_name("cse", m_counter) };
+        stmt_let->expr = m_allocator.alloc<NodeExpr>();
+        stmt_let->expr->var = value.first->var;
+        value.name = stmt_let->ident.value.value();
+        reuse(value, value.first);
+        auto let_stmt = m_allocator.alloc<NodeStmt>();
+        let_stmt->var = stmt_let;
+
+        // goes in front of the statement, but before a let already made for an expression containing it
+        std::vector<NodeStmt*>& stmts = *value.stmts;
+        auto pos = std::find(stmts.begin(), stmts.end(), value.stmt);
+        auto group = pos;
+        while (group != stmts.begin() && m_lets.contains(*(group - 1))) {
+            --group;
+        }
+        for (; group != pos; ++group) {
+            if (contains(std::get<NodeStmtLet*>((*group)->var)->expr, value.first)) {
+                pos = group;
+                break;
+            }
+        }
+        stmts.insert(pos, let_stmt);
+        m_lets.insert(let_stmt);
+    }
+
+    static bool contains(const NodeExpr* expr, const NodeExpr* target)
+    {
+        bool found = expr == target;
+        for_each_operand(expr, [&](const NodeExpr* operand) { found = found || contains(operand, target); });
+        return found;
+    }
+
+    // arithmetic that can be computed early without a difference: no calls, no division that may trap
+    static bool is_candidate(const NodeExpr* expr)
+    {
+        if (!std::holds_alternative<NodeBinExpr*>(expr->var)) {
+            return false;
+        }
+        const NodeBinExpr* bin_expr = std::get<NodeBinExpr*>(expr->var);
+        return (std::holds_alternative<NodeBinExprAdd*>(bin_expr->var) || std::holds_alternative<NodeBinExprSub*>(bin_expr->var)
+                   || std::holds_alternative<NodeBinExprMulti*>(bin_expr->var) || std::holds_alternative<NodeBinExprDiv*>(bin_expr->var))
+            && !has_side_effects(expr);
+    }
+
+    // The same string for expressions that compute the same value. Operands of + and * are ordered.
+    static std::string key_of(const NodeExpr* expr)
+    {
+        if (std::holds_alternative<NodeTerm*>(expr->var)) {
+            const NodeTerm* term = std::get<NodeTerm*>(expr->var);
+            if (std::holds_alternative<NodeTermIntLit*>(term->var)) {
+                return std::to_string(*const_value(expr));
+            }
+            if (std::holds_alternative<NodeTermIdent*>(term->var)) {
+                return std::get<NodeTermIdent*>(term->var)->ident.value.value();
+            }
+            if (std::holds_alternative<NodeTermParen*>(term->var)) {
+                return key_of(std::get<NodeTermParen*>(term->var)->expr);
+            }
+            if (std::holds_alternative<NodeTermNot*>(term->var)) {
+                return "(! " + key_of(std::get<NodeTermNot*>(term->var)->expr) + ")";
+            }
+            return "(call)";    // never part of a candidate
+        }
+
+        struct BinExprVisitor {
+            std::string operator()(const NodeBinExprAdd* add) const { return ordered("+", add->lhs, add->rhs); }
+            std::string operator()(const NodeBinExprMulti* multi) const { return ordered("*", multi->lhs, multi->rhs); }
+            std::string operator()(const NodeBinExprSub* sub) const { return "(- " + key_of(sub->lhs) + " " + key_of(sub->rhs) + ")"; }
+            std::string operator()(const NodeBinExprDiv* div) const { return "(/ " + key_of(div->lhs) + " " + key_of(div->rhs) + ")"; }
+            std::string operator()(const NodeBinExprCmp* cmp) const
+            {
+                return "(cmp" + std::to_string(static_cast<int>(cmp->comparison->comp.type)) + " " + key_of(cmp->lhs) + " " + key_of(cmp->rhs) + ")";
+            }
+            std::string operator()(const NodeBinExprAnd* log_and) const { return "(&& " + key_of(log_and->lhs) + " " + key_of(log_and->rhs) + ")"; }
+            std::string operator()(const NodeBinExprOr* log_or) const { return "(|| " + key_of(log_or->lhs) + " " + key_of(log_or->rhs) + ")"; }
+
+            static std::string ordered(const std::string& op, const NodeExpr* lhs, const NodeExpr* rhs)
+            {
+                std::string lhs_key = key_of(lhs);
+                std::string rhs_key = key_of(rhs);
+                if (rhs_key < lhs_key) {
+                    std::swap(lhs_key, rhs_key);
+                }
+                return "(" + op + " " + lhs_key + " " + rhs_key + ")";
+            }
+        };
+        return std::visit(BinExprVisitor {}, std::get<NodeBinExpr*>(expr->var)->var);
+    }
+
+    static void invalidate_written(const std::vector<NodeStmt*>& stmts, Values& values)
+    {
+        std::unordered_set<std::string> written;
+        collect_written(stmts, written);
+        std::erase_if(values, [&](const auto& entry) {
+            return std::any_of(entry.second->reads.begin(), entry.second->reads.end(),
+                [&](const std::string& name) { return written.contains(name); });
+        });
+    }
+
+    // true if stmts call a function that isn't top-level, which can see their variables
+    bool has_nested_call(const std::vector<NodeStmt*>& stmts) const
+    {
+        bool found = false;
+        for (const NodeStmt* stmt : stmts) {
+            for_each_expr(stmt, [&](const NodeExpr* expr) { found = found || calls_nested(expr); });
+            if (!std::holds_alternative<NodeStmtFun*>(stmt->var)) {
+                for_each_body(stmt, [&](const std::vector<NodeStmt*>& body) { found = found || has_nested_call(body); });
+            }
+        }
+        return found;
+    }
+
+    bool calls_nested(const NodeExpr* expr) const
+    {
+        if (std::holds_alternative<NodeTerm*>(expr->var)
+            && std::holds_alternative<NodeTermFunCall*>(std::get<NodeTerm*>(expr->var)->var)
+            && !m_funs.contains(std::get<NodeTermFunCall*>(std::get<NodeTerm*>(expr->var)->var)->ident.value.value())) {
+            return true;
+        }
+        bool found = false;
+        for_each_operand(expr, [&](const NodeExpr* operand) { found = found || calls_nested(operand); });
+        return found;
+    }
+
+    NodeProg& m_prog;
+    ArenaAllocator& m_allocator;
+    std::unordered_set<std::string> m_funs;
+    std::deque<Value> m_values;                     // shared by the copies of Values made for nested bodies
+    std::unordered_set<const NodeStmt*> m_lets;     // lets this pass inserted
+    size_t m_counter = 0;
+};
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdexcept>
+
+// A problem with the program being compiled. main prints the message and exits, the
+// compile server sends it back to its client and carries on.
+class CompileError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
@@ -0,0 +1,352 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "parser.hpp"
+
+// Runs calls to top-level functions at compile time, with the semantics of the generated
+// code: 64 bit wrap around, unsigned division and signed comparisons. Only pure code can be
+// evaluated. A call gives up (returns nothing) when it prints, exits, divides by zero, uses an
+// undeclared variable, runs off the end of the function or exceeds its step budget.
+class Evaluator {
+public:
+    inline explicit Evaluator(const NodeProg& prog)
+    {
+        for (const NodeStmt* stmt : prog.stmts) {
+            if (std::holds_alternative<NodeStmtFun*>(stmt->var)) {
+                const NodeStmtFun* stmt_fun = std::get<NodeStmtFun*>(stmt->var);
+                m_funs[stmt_fun->ident.value.value()] = stmt_fun;
+            }
+        }
+    }
+
+    // makes a function created by a pass callable
+    void add(const NodeStmtFun* stmt_fun)
+    {
+        m_funs[stmt_fun->ident.value.value()] = stmt_fun;
+    }
+
+    // value of name(args), with a fresh step budget
+    std::optional<int64_t> call(const std::string& name, const std::vector<int64_t>& args)
+    {
+        m_steps = 0;
+        return call_fun(name, args, 0);
+    }
+
+private:
+    static constexpr size_t step_budget = 100000;
+    static constexpr size_t max_depth = 200;
+
+    enum class Flow { next, returned, failed };
+
+    struct Var {
+        std::string name;
+        int64_t value;
+    };
+
+    // variables of one function invocation, as the generator scopes them
+    struct Frame {
+        std::vector<Var> vars {};
+        std::vector<size_t> scopes {};
+        int64_t result = 0;
+        size_t depth;
+    };
+
+    std::optional<int64_t> call_fun(const std::string& name, const std::vector<int64_t>& args, size_t depth)
+    {
+        auto it = m_funs.find(name);
+        if (it == m_funs.end() || it->second->params.size() != args.size() || depth > max_depth) {
+            return {};
+        }
+        Frame frame { .depth = depth };
+        for (size_t i = 0; i < args.size(); i++) {
+            frame.vars.push_back({ it->second->params[i].value.value(), args[i] });
+        }
+        if (exec_stmts(it->second->body->stmts, frame) != Flow::returned) {
+            return {};
+        }
+        return frame.result;
+    }
+
+    Flow exec_scope(const std::vector<NodeStmt*>& stmts, Frame& frame)
+    {
+        frame.scopes.push_back(frame.vars.size());
+        Flow flow = exec_stmts(stmts, frame);
+        frame.vars.resize(frame.scopes.back());
+        frame.scopes.pop_back();
+        return flow;
+    }
+
+    Flow exec_stmts(const std::vector<NodeStmt*>& stmts, Frame& frame)
+    {
+        for (const NodeStmt* stmt : stmts) {
+            Flow flow = exec_stmt(stmt, frame);
+            if (flow != Flow::next) {
+                return flow;
+            }
+        }
+        return Flow::next;
+    }
+
+    Flow exec_stmt(const NodeStmt* stmt, Frame& frame)
+    {
+        if (++m_steps > step_budget) {
+            return Flow::failed;
+        }
+        struct StmtVisitor {
+            Evaluator* eval;
+            Frame& frame;
+            Flow operator()(const NodeStmtExit*) const { return Flow::failed; }
+            Flow operator()(const NodeStmtPrint*) const { return Flow::failed; }
+            Flow operator()(const NodeStmtFun*) const { return Flow::failed; }
+            Flow operator()(const NodeStmtLet* stmt_let) const
+            {
+                return eval->declare(stmt_let, frame) ? Flow::next : Flow::failed;
+            }
+            Flow operator()(const NodeStmtScope* scope) const
+            {
+                return eval->exec_scope(scope->stmts, frame);
+            }
+            Flow operator()(const NodeStmtIf* stmt_if) const
+            {
+                auto condition = eval->eval_expr(stmt_if->condition, frame);
+                if (!condition) {
+                    return Flow::failed;
+                }
+                if (*condition) {
+                    return eval->exec_scope(stmt_if->body, frame);
+                }
+                for (const NodeStmt* elif_stmt : stmt_if->elif_body) {
+                    const NodeStmtIf* elif = std::get<NodeStmtIf*>(elif_stmt->var);
+                    auto elif_condition = eval->eval_expr(elif->condition, frame);
+                    if (!elif_condition) {
+                        return Flow::failed;
+                    }
+                    if (*elif_condition) {
+                        return eval->exec_scope(elif->body, frame);
+                    }
+                }
+                return eval->exec_scope(stmt_if->else_body, frame);
+            }
+            Flow operator()(const NodeStmtWhile* stmt_while) const
+            {
+                return eval->exec_loop(stmt_while->condition, stmt_while->body, nullptr, frame);
+            }
+            Flow operator()(const NodeStmtFor* stmt_for) const
+            {
+                // the initialized variable stays visible after the loop
+                if (std::holds_alternative<NodeStmtLet*>(stmt_for->init)) {
+                    if (const NodeStmtLet* init = std::get<NodeStmtLet*>(stmt_for->init); init && !eval->declare(init, frame)) {
+                        return Flow::failed;
+                    }
+                } else if (const NodeStmtAssign* init = std::get<NodeStmtAssign*>(stmt_for->init); init && !eval->assign(init, frame)) {
+                    return Flow::failed;
+                }
+                return eval->exec_loop(stmt_for->condition, stmt_for->body, stmt_for->change, frame);
+            }
+            Flow operator()(const NodeStmtAssign* stmt_assign) const
+            {
+                return eval->assign(stmt_assign, frame) ? Flow::next : Flow::failed;
+            }
+            Flow operator()(const NodeStmtReturn* stmt_return) const
+            {
+                auto value = eval->eval_expr(stmt_return->expr, frame);
+                if (!value) {
+                    return Flow::failed;
+                }
+                frame.result = *value;
+                return Flow::returned;
+            }
+        };
+        return std::visit(StmtVisitor { .eval = this, .frame = frame }, stmt->var);
+    }
+
+    Flow exec_loop(const NodeExpr* condition, const std::vector<NodeStmt*>& body, const NodeStmtAssign* change, Frame& frame)
+    {
+        while (true) {
+            auto holds = eval_expr(condition, frame);
+            if (!holds) {
+                return Flow::failed;
+            }
+            if (!*holds) {
+                return Flow::next;
+            }
+            Flow flow = exec_scope(body, frame);
+            if (flow != Flow::next) {
+                return flow;
+            }
+            if (change && !assign(change, frame)) {
+                return Flow::failed;
+            }
+            if (++m_steps > step_budget) {
+                return Flow::failed;
+            }
+        }
+    }
+
+    bool declare(const NodeStmtLet* stmt_let, Frame& frame)
+    {
+        if (lookup(stmt_let->ident.value.value(), frame)) {
+            return false;   // redeclaration, the generator rejects it
+        }
+        auto value = eval_expr(stmt_let->expr, frame);
+        if (!value) {
+            return false;
+        }
+        frame.vars.push_back({ stmt_let->ident.value.value(), *value });
+        return true;
+    }
+
+    bool assign(const NodeStmtAssign* stmt_assign, Frame& frame)
+    {
+        auto value = eval_expr(stmt_assign->rhs, frame);
+        Var* var = lookup(stmt_assign->lhs->ident.value.value(), frame);
+        if (!value || !var) {
+            return false;
+        }
+        var->value = *value;
+        return true;
+    }
+
+    static Var* lookup(const std::string& name, Frame& frame)
+    {
+        for (auto it = frame.vars.rbegin(); it != frame.vars.rend(); ++it) {
+            if (it->name == name) {
+                return &*it;
+            }
+        }
+        return nullptr;
+    }
+
+    std::optional<int64_t> eval_expr(const NodeExpr* expr, Frame& frame)
+    {
+        if (++m_steps > step_budget) {
+            return {};
+        }
+        if (std::holds_alternative<NodeTerm*>(expr->var)) {
+            return eval_term(std::get<NodeTerm*>(expr->var), frame);
+        }
+
+        struct BinExprVisitor {
+            Evaluator* eval;
+            Frame& frame;
+            std::optional<int64_t> operator()(const NodeBinExprAdd* add) const
+            {
+                return eval->arith(add->lhs, add->rhs, frame, [](uint64_t lhs, uint64_t rhs) { return lhs + rhs; });
+            }
+            std::optional<int64_t> operator()(const NodeBinExprSub* sub) const
+            {
+                return eval->arith(sub->lhs, sub->rhs, frame, [](uint64_t lhs, uint64_t rhs) { return lhs - rhs; });
+            }
+            std::optional<int64_t> operator()(const NodeBinExprMulti* multi) const
+            {
+                return eval->arith(multi->lhs, multi->rhs, frame, [](uint64_t lhs, uint64_t rhs) { return lhs * rhs; });
+            }
+            std::optional<int64_t> operator()(const NodeBinExprDiv* div) const
+            {
+                auto lhs = eval->eval_expr(div->lhs, frame);
+                auto rhs = eval->eval_expr(div->rhs, frame);
+                if (!lhs || !rhs || *rhs == 0) {
+                    return {};
+                }
+                return static_cast<int64_t>(static_cast<uint64_t>(*lhs) / static_cast<uint64_t>(*rhs));
+            }
+            std::optional<int64_t> operator()(const NodeBinExprCmp* cmp) const
+            {
+                auto lhs = eval->eval_expr(cmp->lhs, frame);
+                auto rhs = eval->eval_expr(cmp->rhs, frame);
+                if (!lhs || !rhs) {
+                    return {};
+                }
+                switch (cmp->comparison->comp.type) {
+                    case TokenType::eq_eq: return *lhs == *rhs;
+                    case TokenType::n_eq: return *lhs != *rhs;
+                    case TokenType::greater_than: return *lhs > *rhs;
+                    case TokenType::less_than: return *lhs < *rhs;
+                    case TokenType::greater_eq: return *lhs >= *rhs;
+                    case TokenType::less_eq: return *lhs <= *rhs;
+                    default: return {};
+                }
+            }
+            std::optional<int64_t> operator()(const NodeBinExprAnd* log_and) const
+            {
+                auto lhs = eval->eval_expr(log_and->lhs, frame);
+                if (!lhs || *lhs == 0) {
+                    return lhs;
+                }
+                auto rhs = eval->eval_expr(log_and->rhs, frame);
+                return rhs ? std::optional<int64_t>(*rhs != 0) : std::nullopt;
+            }
+            std::optional<int64_t> operator()(const NodeBinExprOr* log_or) const
+            {
+                auto lhs = eval->eval_expr(log_or->lhs, frame);
+                if (!lhs) {
+                    return {};
+                }
+                if (*lhs != 0) {
+                    return 1;
+                }
+                auto rhs = eval->eval_expr(log_or->rhs, frame);
+                return rhs ? std::optional<int64_t>(*rhs != 0) : std::nullopt;
+            }
+        };
+        return std::visit(BinExprVisitor { .eval = this, .frame = frame }, std::get<NodeBinExpr*>(expr->var)->var);
+    }
+
+    template <typename Op>
+    std::optional<int64_t> arith(const NodeExpr* lhs_expr, const NodeExpr* rhs_expr, Frame& frame, Op op)
+    {
+        auto lhs = eval_expr(lhs_expr, frame);
+        auto rhs = eval_expr(rhs_expr, frame);
+        if (!lhs || !rhs) {
+            return {};
+        }
+        return static_cast<int64_t>(op(static_cast<uint64_t>(*lhs), static_cast<uint64_t>(*rhs)));
+    }
+
+    std::optional<int64_t> eval_term(const NodeTerm* term, Frame& frame)
+    {
+        struct TermVisitor {
+            Evaluator* eval;
+            Frame& frame;
+            std::optional<int64_t> operator()(const NodeTermIntLit* term_int_lit) const
+            {
+                return static_cast<int64_t>(std::strtoull(term_int_lit->int_lit.value.value().c_str(), nullptr, 10));
+            }
+            std::optional<int64_t> operator()(const NodeTermIdent* term_ident) const
+            {
+                Var* var = lookup(term_ident->ident.value.value(), frame);
+                return var ? std::optional<int64_t>(var->value) : std::nullopt;
+            }
+            std::optional<int64_t> operator()(const NodeTermParen* term_paren) const
+            {
+                return eval->eval_expr(term_paren->expr, frame);
+            }
+            std::optional<int64_t> operator()(const NodeTermNot* term_not) const
+            {
+                auto value = eval->eval_expr(term_not->expr, frame);
+                return value ? std::optional<int64_t>(*value == 0) : std::nullopt;
+            }
+            std::optional<int64_t> operator()(const NodeTermFunCall* fun_call) const
+            {
+                std::vector<int64_t> args;
+                for (const NodeExpr* arg : fun_call->args) {
+                    auto value = eval->eval_expr(arg, frame);
+                    if (!value) {
+                        return {};
+                    }
+                    args.push_back(*value);
+                }
+                return eval->call_fun(fun_call->ident.value.value(), args, frame.depth + 1);
+            }
+        };
+        return std::visit(TermVisitor { .eval = this, .frame = frame }, term->var);
+    }
+
+    std::unordered_map<std::string, const NodeStmtFun*> m_funs;
+    size_t m_steps = 0;
+};
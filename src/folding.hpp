@@ -0,0 +1,194 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+
+#include "./arena.hpp"
+#include "walk.hpp"
+
+// Value of expr if it is an integer literal, possibly in parentheses.
+inline std::optional<int64_t> const_value(const NodeExpr* expr)
+{
+    if (!std::holds_alternative<NodeTerm*>(expr->var)) {
+        return {};
+    }
+    const NodeTerm* term = std::get<NodeTerm*>(expr->var);
+    if (std::holds_alternative<NodeTermParen*>(term->var)) {
+        return const_value(std::get<NodeTermParen*>(term->var)->expr);
+    }
+    if (std::holds_alternative<NodeTermIntLit*>(term->var)) {
+        // literals wrap like the registers they are loaded into
+        return static_cast<int64_t>(std::strtoull(std::get<NodeTermIntLit*>(term->var)->int_lit.value.value().c_str(), nullptr, 10));
+    }
+    return {};
+}
+
+// true if evaluating expr can do more than produce a value: call a function, or divide by something that may be 0.
+inline bool has_side_effects(const NodeExpr* expr)
+{
+    if (has_call(expr)) {
+        return true;
+    }
+    if (std::holds_alternative<NodeBinExpr*>(expr->var)
+        && std::holds_alternative<NodeBinExprDiv*>(std::get<NodeBinExpr*>(expr->var)->var)) {
+        auto divisor = const_value(std::get<NodeBinExprDiv*>(std::get<NodeBinExpr*>(expr->var)->var)->rhs);
+        if (!divisor || *divisor == 0) {
+            return true;
+        }
+    }
+    bool effects = false;
+    for_each_operand(expr, [&](const NodeExpr* operand) { effects = effects || has_side_effects(operand); });
+    return effects;
+}
+
+// Folds arithmetic on literals with the same semantics as the generated code:
+// 64 bit wrap around and unsigned division. Division by zero is left for the runtime.
+class ConstantFolder {
+public:
+    inline explicit ConstantFolder(ArenaAllocator& allocator)
+        : m_allocator(allocator)
+    {
+    }
+
+    void fold_prog(NodeProg& prog)
+    {
+        fold_stmts(prog.stmts);
+    }
+
+    void fold_stmts(std::vector<NodeStmt*>& stmts)
+    {
+        for (NodeStmt* stmt : stmts) {
+            for_each_expr(stmt, [&](NodeExpr* expr) { fold_expr(expr); });
+            for_each_body(stmt, [&](std::vector<NodeStmt*>& body) { fold_stmts(body); });
+        }
+    }
+
+    // rewrites expr in place
+    void fold_expr(NodeExpr* expr)
+    {
+        for_each_operand(expr, [&](NodeExpr* operand) { fold_expr(operand); });
+
+        if (std::holds_alternative<NodeTerm*>(expr->var)) {
+            NodeTerm* term = std::get<NodeTerm*>(expr->var);
+            if (std::holds_alternative<NodeTermParen*>(term->var)) {
+                NodeExpr* inner = std::get<NodeTermParen*>(term->var)->expr;
+                if (std::holds_alternative<NodeTerm*>(inner->var)) {
+                    expr->var = inner->var;     // (x), (5), (f(x)) need no parentheses
+                }
+            } else if (std::holds_alternative<NodeTermNot*>(term->var)) {
+                if (auto value = const_value(std::get<NodeTermNot*>(term->var)->expr)) {
+                    replace_with_int_lit(expr, *value == 0);
+                }
+            }
+            return;
+        }
+
+        struct BinExprVisitor {
+            ConstantFolder* folder;
+            NodeExpr* expr;
+            void operator()(const NodeBinExprAdd* add) const
+            {
+                auto lhs = const_value(add->lhs);
+                auto rhs = const_value(add->rhs);
+                if (lhs && rhs) {
+                    folder->replace_with_int_lit(expr, static_cast<uint64_t>(*lhs) + static_cast<uint64_t>(*rhs));
+                } else if (lhs == 0) {
+                    expr->var = add->rhs->var;
+                } else if (rhs == 0) {
+                    expr->var = add->lhs->var;
+                }
+            }
+            void operator()(const NodeBinExprSub* sub) const
+            {
+                auto lhs = const_value(sub->lhs);
+                auto rhs = const_value(sub->rhs);
+                if (lhs && rhs) {
+                    folder->replace_with_int_lit(expr, static_cast<uint64_t>(*lhs) - static_cast<uint64_t>(*rhs));
+                } else if (rhs == 0) {
+                    expr->var = sub->lhs->var;
+                }
+            }
+            void operator()(const NodeBinExprMulti* multi) const
+            {
+                auto lhs = const_value(multi->lhs);
+                auto rhs = const_value(multi->rhs);
+                if (lhs && rhs) {
+                    folder->replace_with_int_lit(expr, static_cast<uint64_t>(*lhs) * static_cast<uint64_t>(*rhs));
+                } else if (lhs == 1) {
+                    expr->var = multi->rhs->var;
+                } else if (rhs == 1) {
+                    expr->var = multi->lhs->var;
+                }
+            }
+            void operator()(const NodeBinExprDiv* div) const
+            {
+                auto lhs = const_value(div->lhs);
+                auto rhs = const_value(div->rhs);
+                if (lhs && rhs && *rhs != 0) {
+                    folder->replace_with_int_lit(expr, static_cast<uint64_t>(*lhs) / static_cast<uint64_t>(*rhs));
+                } else if (rhs == 1) {
+                    expr->var = div->lhs->var;
+                }
+            }
+            void operator()(const NodeBinExprCmp* cmp) const
+            {
+                auto lhs = const_value(cmp->lhs);
+                auto rhs = const_value(cmp->rhs);
+                if (!lhs || !rhs) {
+                    return;
+                }
+                switch (cmp->comparison->comp.type) {
+                    case TokenType::eq_eq: folder->replace_with_int_lit(expr, *lhs == *rhs); break;
+                    case TokenType::n_eq: folder->replace_with_int_lit(expr, *lhs != *rhs); break;
+                    case TokenType::greater_than: folder->replace_with_int_lit(expr, *lhs > *rhs); break;
+                    case TokenType::less_than: folder->replace_with_int_lit(expr, *lhs < *rhs); break;
+                    case TokenType::greater_eq: folder->replace_with_int_lit(expr, *lhs >= *rhs); break;
+                    case TokenType::less_eq: folder->replace_with_int_lit(expr, *lhs <= *rhs); break;
+                    default: break;
+                }
+            }
+            // a constant lhs that decides the result makes rhs dead code
+            void operator()(const NodeBinExprAnd* log_and) const
+            {
+                auto lhs = const_value(log_and->lhs);
+                auto rhs = const_value(log_and->rhs);
+                if (lhs == 0) {
+                    folder->replace_with_int_lit(expr, 0);
+                } else if (lhs && rhs) {
+                    folder->replace_with_int_lit(expr, *rhs != 0);
+                }
+            }
+            void operator()(const NodeBinExprOr* log_or) const
+            {
+                auto lhs = const_value(log_or->lhs);
+                auto rhs = const_value(log_or->rhs);
+                if (lhs && *lhs != 0) {
+                    folder->replace_with_int_lit(expr, 1);
+                } else if (lhs && rhs) {
+                    folder->replace_with_int_lit(expr, *rhs != 0);
+                }
+            }
+        };
+        std::visit(BinExprVisitor { .folder = this, .expr = expr }, std::get<NodeBinExpr*>(expr->var)->var);
+    }
+
+    NodeExpr* make_int_lit(int64_t value)
+    {
+        auto expr = m_allocator.alloc<NodeExpr>();
+        replace_with_int_lit(expr, static_cast<uint64_t>(value));
+        return expr;
+    }
+
+private:
+    void replace_with_int_lit(NodeExpr* expr, uint64_t value)
+    {
+        auto term_int_lit = m_allocator.alloc<NodeTermIntLit>();
+        term_int_lit->int_lit = { .type = TokenType::int_lit, .value = std::to_string(static_cast<int64_t>(value)) };
+        auto term = m_allocator.alloc<NodeTerm>();
+        term->var = term_int_lit;
+        expr->var = term;
+    }
+
+    ArenaAllocator& m_allocator;
+};
@@ -1,17 +1,47 @@
 #pragma once
 
 #include "parser.hpp"
+#include "callgraph.hpp"
+#include "options.hpp"
+#include "folding.hpp"
+#include "loops.hpp"
+#include "walk.hpp"
 #include <cassert>
 #include <algorithm>
+#include <array>
 
 
+// How the generated code is linked. By default it is the whole program. A module of a
+// program built from several is an object of its own: the main module has _start and the
+// print runtime, which the others call, the others export every top-level function. An
+// incremental program (--watch) is generated in chunks that are spliced together.
+struct Linkage {
+    bool module = false;
+    bool main = true;
+    std::vector<std::string> externs {};    // functions of imported modules the code calls
+    bool incremental = false;
+};
+
 class Generator {
 public:
-    inline explicit Generator(NodeProg prog)
+    // the debug output goes to log
+    inline explicit Generator(NodeProg prog, Options options = {}, Linkage linkage = {}, std::ostream& log = std::cout)
         : m_prog(std::move(prog))
+        , m_call_graph(m_prog, linkage.module && !linkage.main)
+        , m_options(options)
+        , m_linkage(std::move(linkage))
+        , m_log(log)
+        , m_uses_print(m_call_graph.uses_print() || m_linkage.module || m_linkage.incremental)
     {
     }
 
+    // A piece of an incremental program, generated on its own
+    struct Chunk {
+        std::string text;
+        std::string rodata;
+        std::string bss;
+    };
+
     void gen_term(const NodeTerm* term) {
         struct TermVisitor {
             Generator* gen;
@@ -27,37 +57,47 @@ public:
                 });
 
                 if (it == gen->m_vars.rend()) {
-                    std::cerr << "Undeclared identifier: " << ident_name << std::endl;
-                    exit(EXIT_FAILURE);
+                    throw error_at(term_ident->ident, std::string("Undeclared identifier: ") + ident_name);
                 }
 
-                std::stringstream offset;
-                // Check if this is a function parameter (negative stack_loc indicates parameter)
-                if ((*it).stack_loc < 0) {
-                    // Parameter: positive offset from rbp
-                    int param_index = -(*it).stack_loc - 1;
-                    offset << "QWORD [rbp + " << (param_index + 2) * 8 << "]";
-                } else {
-                    // Local variable: negative offset from rbp
-                    offset << "QWORD [rbp - " << ((*it).stack_loc + 1) * 8 << "]";
-                }
-                gen->push(offset.str());
+                gen->push(gen->var_operand(*it));
             }
 
             void operator()(const NodeTermParen* term_paren) const {
                 gen->gen_expr(term_paren->expr);
             }
 
+            void operator()(const NodeTermNot* term_not) const {
+                gen->gen_expr(term_not->expr);
+                gen->pop("rax");
+                gen->m_output << "    test rax, rax\n";
+                gen->m_output << "    sete al\n";
+                gen->m_output << "    movzx eax, al\n";
+                gen->push("rax");
+            }
+
             void operator()(const NodeTermFunCall *fun_call) const {
+                // System V: first six args in registers, the rest on the stack, rsp 16 byte aligned at the call
+                size_t reg_args = std::min(fun_call->args.size(), arg_regs.size());
+                size_t stack_args = fun_call->args.size() - reg_args;
+                size_t padding = (gen->m_temp_depth + stack_args) % 2;
+                if (padding) {
+                    gen->m_output << "    sub rsp, 8\n";
+                    gen->m_temp_depth++;
+                }
+
                 for (auto it = fun_call->args.rbegin(); it != fun_call->args.rend(); ++it) {
                     gen->gen_expr(*it);
                 }
+                for (size_t i = 0; i < reg_args; i++) {
+                    gen->pop(arg_regs[i]);
+                }
 
                 gen->m_output << "    call " << fun_call->ident.value.value() << "\n";
-             
-                if (!fun_call->args.empty()) {
-                    gen->m_output << "    add rsp, " << fun_call->args.size() * 8 << "\n";
-                    gen->m_stack_size -= fun_call->args.size();
+
+                if (stack_args + padding > 0) {
+                    gen->m_output << "    add rsp, " << (stack_args + padding) * 8 << "\n";
+                    gen->m_temp_depth -= stack_args + padding;
                 }
 
                 //return val is in rax. we push it on the stack
@@ -77,8 +117,8 @@ public:
                 gen->gen_expr(sub->rhs);
                 gen->gen_expr(sub->lhs);
                 gen->pop("rax");
-                gen->pop("rbx");
-                gen->m_output << "    sub rax, rbx\n";
+                gen->pop("rcx");
+                gen->m_output << "    sub rax, rcx\n";
                 gen->push("rax");
             }
             void operator()(const NodeBinExprAdd* add) const {
@@ -86,8 +126,8 @@ public:
                 gen->gen_expr(add->lhs);
                 
                 gen->pop("rax");
-                gen->pop("rbx");
-                gen->m_output << "    add rax, rbx\n";
+                gen->pop("rcx");
+                gen->m_output << "    add rax, rcx\n";
                 gen->push("rax");
             }
 
@@ -96,8 +136,8 @@ public:
                 gen->gen_expr(multi->lhs);
                 
                 gen->pop("rax");
-                gen->pop("rbx");
-                gen->m_output << "    mul rbx\n";
+                gen->pop("rcx");
+                gen->m_output << "    mul rcx\n";
                 gen->push("rax");
             }
 
@@ -106,11 +146,26 @@ public:
                 gen->gen_expr(div->lhs);
                 
                 gen->pop("rax");
-                gen->pop("rbx");
+                gen->pop("rcx");
                 gen->m_output << "    mov rdx, 0\n";
-                gen->m_output << "    div rbx\n";
+                gen->m_output << "    div rcx\n";
+                gen->push("rax");
+            }
+
+            void operator()(const NodeBinExprCmp* cmp) const {
+                gen->gen_compare(cmp);
+                gen->m_output << "    set" << condition_code(cmp->comparison, true) << " al\n";
+                gen->m_output << "    movzx eax, al\n";
                 gen->push("rax");
             }
+
+            void operator()(const NodeBinExprAnd* log_and) const {
+                gen->gen_logical(log_and->lhs, log_and->rhs, "and");
+            }
+
+            void operator()(const NodeBinExprOr* log_or) const {
+                gen->gen_logical(log_or->lhs, log_or->rhs, "or");
+            }
         };
 
         BinExprVisitor visitor { .gen = this };
@@ -136,59 +191,306 @@ public:
     }
 
 //func to handle elif in if statement
-    void resolveElif(const NodeStmtIf *if_condition, const std::string &end_if_else,
-                     Generator *gen, const std::string &end_label, const std::string &elif_end_label) {
-
+    void resolveElif(const NodeStmtIf *if_condition, const std::string &end_if_else) {
         for (const NodeStmt *elif_stmt : if_condition->elif_body) {
             const NodeStmtIf *elif_condition = std::get<NodeStmtIf *>(elif_stmt->var);
-            std::string elif_end_label = gen->generate_label("end_elif");
-            if(!elif_condition->rhs){
-                gen->gen_expr(elif_condition->lhs);
-                gen->pop("rax");
-                gen->m_output << "    cmp rax, 0\n";
-                gen->m_output << "    je " << elif_end_label << "\n";
-                gen->begin_scope();
-                for (const NodeStmt *stmt : elif_condition->body) {
-                    gen->gen_stmt(stmt);
-                }
-                gen->end_scope();
-                gen->m_output << "    jmp " << end_if_else << "\n";
-                gen->m_output << "    " << elif_end_label << ":\n";
+            std::string elif_end_label = generate_label("end_elif");
+            gen_branch(elif_condition->condition, elif_end_label, false);
+            begin_scope();
+            for (const NodeStmt *stmt : elif_condition->body) {
+                gen_stmt(stmt);
             }
-            else{
-                gen->gen_expr(elif_condition->lhs);
-                gen->gen_expr(elif_condition->rhs);
-                gen->pop("rbx");
-                gen->pop("rax");
-                gen->m_output << "    cmp rax, rbx\n";
-                if (elif_condition->comparison->comp.type == TokenType::eq_eq) {
-                    gen->m_output << "    jne " << elif_end_label << "\n";
-                } else if (elif_condition->comparison->comp.type == TokenType::greater_than) {
-                    gen->m_output << "    jle " << elif_end_label << "\n";
-                } else if (elif_condition->comparison->comp.type == TokenType::less_than) {
-                    gen->m_output << "    jge " << elif_end_label << "\n";
-                } else if (elif_condition->comparison->comp.type == TokenType::greater_eq) {
-                    gen->m_output << "    jl " << elif_end_label << "\n";
-                } else if (elif_condition->comparison->comp.type == TokenType::less_eq) {
-                    gen->m_output << "    jg " << elif_end_label << "\n";
-                } else if (elif_condition->comparison->comp.type == TokenType::n_eq) {
-                    gen->m_output << "    je " << elif_end_label << "\n";
+            end_scope();
+            m_output << "    jmp " << end_if_else << "\n"; // jump to end of else cuz elif condition is true
+            m_output << "    " << elif_end_label << ":\n"; // end of elif
+        }
+    }
+
+    // Condition code (as in jcc, setcc) that holds after `cmp lhs, rhs` if `lhs comp rhs` does,
+    // or if it doesn't when `when` is false
+    static std::string condition_code(const NodeComparison* comparison, bool when)
+    {
+        switch (comparison->comp.type) {
+            case TokenType::eq_eq: return when ? "e" : "ne";
+            case TokenType::n_eq: return when ? "ne" : "e";
+            case TokenType::greater_than: return when ? "g" : "le";
+            case TokenType::less_than: return when ? "l" : "ge";
+            case TokenType::greater_eq: return when ? "ge" : "l";
+            case TokenType::less_eq: return when ? "le" : "g";
+            default:
+                throw error_at(comparison->comp, "Invalid comparison");
+        }
+    }
+
+    static std::string cond_jump(const NodeComparison* comparison, bool when)
+    {
+        return "j" + condition_code(comparison, when);
+    }
+
+    // Operand for a small literal or a variable, which can be used without evaluating it through the stack.
+    std::optional<std::string> simple_operand(const NodeExpr* expr) const
+    {
+        if (auto value = const_value(expr)) {
+            if (*value >= INT32_MIN && *value <= INT32_MAX) {
+                return std::to_string(*value);
+            }
+            return {};
+        }
+        if (std::holds_alternative<NodeTerm*>(expr->var)
+            && std::holds_alternative<NodeTermIdent*>(std::get<NodeTerm*>(expr->var)->var)) {
+            const std::string& name = std::get<NodeTermIdent*>(std::get<NodeTerm*>(expr->var)->var)->ident.value.value();
+            auto it = std::find_if(m_vars.rbegin(), m_vars.rend(), [&](const auto &var) { return var.name == name; });
+            if (it != m_vars.rend()) {
+                return var_operand(*it);
+            }
+        }
+        return {};
+    }
+
+    // Emits the cmp for a comparison. A variable or small literal on the right is
+    // compared directly instead of going through the stack.
+    void gen_compare(const NodeBinExprCmp* cmp)
+    {
+        if (!simple_operand(cmp->rhs)) {
+            gen_expr(cmp->lhs);
+            gen_expr(cmp->rhs);
+            pop("rcx");
+            pop("rax");
+            m_output << "    cmp rax, rcx\n";
+        } else {
+            std::optional<std::string> lhs_operand = simple_operand(cmp->lhs);
+            if (!lhs_operand || std::find(iv_regs.begin(), iv_regs.end(), *lhs_operand) == iv_regs.end()) {
+                gen_expr(cmp->lhs);
+                pop("rax");
+                lhs_operand = "rax";
+            }
+            m_output << "    cmp " << *lhs_operand << ", " << *simple_operand(cmp->rhs) << "\n";
+        }
+    }
+
+    // Jumps to label if the truth of condition (non-zero) equals `when`, falls through otherwise.
+    // `&&`, `||` and `!` become chains of jumps that skip what doesn't need evaluating,
+    // no truth value is ever materialized.
+    void gen_branch(const NodeExpr* condition, const std::string& label, bool when)
+    {
+        if (auto value = const_value(condition)) {
+            if ((*value != 0) == when) {
+                m_output << "    jmp " << label << "\n";
+            }
+            return;
+        }
+        if (std::holds_alternative<NodeTerm*>(condition->var)) {
+            const NodeTerm* term = std::get<NodeTerm*>(condition->var);
+            if (std::holds_alternative<NodeTermParen*>(term->var)) {
+                gen_branch(std::get<NodeTermParen*>(term->var)->expr, label, when);
+                return;
+            }
+            if (std::holds_alternative<NodeTermNot*>(term->var)) {
+                gen_branch(std::get<NodeTermNot*>(term->var)->expr, label, !when);
+                return;
+            }
+        } else {
+            const NodeBinExpr* bin_expr = std::get<NodeBinExpr*>(condition->var);
+            if (std::holds_alternative<NodeBinExprCmp*>(bin_expr->var)) {
+                const NodeBinExprCmp* cmp = std::get<NodeBinExprCmp*>(bin_expr->var);
+                gen_compare(cmp);
+                m_output << "    " << cond_jump(cmp->comparison, when) << " " << label << "\n";
+                return;
+            }
+            bool is_and = std::holds_alternative<NodeBinExprAnd*>(bin_expr->var);
+            if (is_and || std::holds_alternative<NodeBinExprOr*>(bin_expr->var)) {
+                const NodeExpr* lhs = is_and ? std::get<NodeBinExprAnd*>(bin_expr->var)->lhs : std::get<NodeBinExprOr*>(bin_expr->var)->lhs;
+                const NodeExpr* rhs = is_and ? std::get<NodeBinExprAnd*>(bin_expr->var)->rhs : std::get<NodeBinExprOr*>(bin_expr->var)->rhs;
+                // lhs alone decides when it is false for `&&` or true for `||`
+                if (is_and != when) {
+                    gen_branch(lhs, label, when);
+                    gen_branch(rhs, label, when);
                 } else {
-                    std::cerr << "Invalid comparison" << std::endl;
-                    exit(EXIT_FAILURE);
+                    std::string skip_label = generate_label("short_circuit");
+                    gen_branch(lhs, skip_label, !when);
+                    gen_branch(rhs, label, when);
+                    m_output << "    " << skip_label << ":\n";
                 }
+                return;
+            }
+        }
 
-                gen->begin_scope();
-                for (const NodeStmt *stmt : elif_condition->body) {
-                    gen->gen_stmt(stmt);
+        std::optional<std::string> operand = simple_operand(condition);
+        if (operand && std::find(iv_regs.begin(), iv_regs.end(), *operand) != iv_regs.end()) {
+            m_output << "    test " << *operand << ", " << *operand << "\n";
+        } else if (operand) {
+            m_output << "    cmp " << *operand << ", 0\n";
+        } else {
+            gen_expr(condition);
+            pop("rax");
+            m_output << "    test rax, rax\n";
+        }
+        m_output << "    " << (when ? "jnz " : "jz ") << label << "\n";
+    }
+
+    // Value of `lhs && rhs` or `lhs || rhs` (op is "and" or "or"). If rhs can't have side
+    // effects both sides are evaluated and combined with setcc, without branches. Otherwise
+    // rhs must be skipped when lhs decides and it goes through gen_branch.
+    void gen_logical(const NodeExpr* lhs, const NodeExpr* rhs, const std::string& op)
+    {
+        if (!has_side_effects(rhs)) {
+            gen_expr(lhs);
+            gen_expr(rhs);
+            pop("rcx");
+            pop("rax");
+            m_output << "    test rax, rax\n";
+            m_output << "    setne al\n";
+            m_output << "    test rcx, rcx\n";
+            m_output << "    setne cl\n";
+            m_output << "    " << op << " al, cl\n";
+            m_output << "    movzx eax, al\n";
+            push("rax");
+            return;
+        }
+
+        std::string false_label = generate_label("logical_false");
+        std::string end_label = generate_label("logical_end");
+        if (op == "and") {
+            gen_branch(lhs, false_label, false);
+            gen_branch(rhs, false_label, false);
+        } else {
+            std::string true_label = generate_label("logical_true");
+            gen_branch(lhs, true_label, true);
+            gen_branch(rhs, false_label, false);
+            m_output << "    " << true_label << ":\n";
+        }
+        m_output << "    mov eax, 1\n";
+        m_output << "    jmp " << end_label << "\n";
+        m_output << "    " << false_label << ":\n";
+        m_output << "    xor eax, eax\n";
+        m_output << "    " << end_label << ":\n";
+        push("rax");
+    }
+
+    // An if/elif chain that tests one variable against constants, `if (x == 0) {..} elif (x == 1) {..}`,
+    // dispatches with a bounds check and an indirect jump through a table in .rodata when the
+    // constants are dense, or a binary search over them when they aren't. Returns false if the
+    // chain is too short or tests anything else, it is then generated arm by arm.
+    bool gen_switch(const NodeStmtIf* stmt_if, const std::string& end_if_else)
+    {
+        std::vector<const NodeStmtIf*> arms { stmt_if };
+        for (const NodeStmt* elif_stmt : stmt_if->elif_body) {
+            arms.push_back(std::get<NodeStmtIf*>(elif_stmt->var));
+        }
+        if (arms.size() < min_switch_arms) {
+            return false;
+        }
+
+        std::optional<std::string> name;
+        std::vector<std::pair<int64_t, size_t>> cases;     // constant and the arm it selects
+        for (size_t i = 0; i < arms.size(); i++) {
+            auto test = equality_test(arms[i]->condition);
+            if (!test || (name && test->first != *name) || test->second < INT32_MIN || test->second > INT32_MAX) {
+                return false;
+            }
+            name = test->first;
+            // a repeated constant only ever reaches its first arm
+            if (std::none_of(cases.begin(), cases.end(), [&](const auto& c) { return c.first == test->second; })) {
+                cases.push_back({ test->second, i });
+            }
+        }
+        auto var = std::find_if(m_vars.rbegin(), m_vars.rend(), [&](const auto& var) { return var.name == *name; });
+        if (var == m_vars.rend()) {
+            return false;
+        }
+        std::sort(cases.begin(), cases.end());
+
+        std::vector<std::string> arm_labels;
+        for (size_t i = 0; i < arms.size(); i++) {
+            arm_labels.push_back(generate_label("switch_arm"));
+        }
+        std::string default_label = generate_label("switch_default");
+        m_output << "    mov rax, " << var_operand(*var) << "\n";
+
+        int64_t low = cases.front().first;
+        uint64_t range = static_cast<uint64_t>(cases.back().first - low) + 1;
+        if (range <= cases.size() * 2 && range <= max_jump_table) {
+            std::string table_label = generate_label("switch_table");
+            if (low != 0) {
+                m_output << "    sub rax, " << low << "\n";
+            }
+            m_output << "    cmp rax, " << range - 1 << "\n";
+            m_output << "    ja " << default_label << "\n";     // unsigned, catches values below low too
+            m_output << "    lea rcx, [rel " << table_label << "]\n";
+            m_output << "    jmp [rcx + rax * 8]\n";
+
+            m_rodata << table_label << ":\n";
+            auto it = cases.begin();
+            for (uint64_t i = 0; i < range; i++) {
+                if (it != cases.end() && static_cast<uint64_t>(it->first - low) == i) {
+                    m_rodata << "    dq " << arm_labels[(it++)->second] << "\n";
+                } else {
+                    m_rodata << "    dq " << default_label << "\n";
                 }
-                gen->end_scope();
+            }
+        } else {
+            gen_switch_search(cases, 0, cases.size(), arm_labels, default_label);
+        }
+
+        for (size_t i = 0; i < arms.size(); i++) {
+            m_output << "    " << arm_labels[i] << ":\n";
+            begin_scope();
+            for (const NodeStmt* stmt : arms[i]->body) {
+                gen_stmt(stmt);
+            }
+            end_scope();
+            m_output << "    jmp " << end_if_else << "\n";
+        }
+        m_output << "    " << default_label << ":\n";
+        begin_scope();
+        for (const NodeStmt* stmt : stmt_if->else_body) {
+            gen_stmt(stmt);
+        }
+        end_scope();
+        m_output << "    " << end_if_else << ":\n";
+        return true;
+    }
 
-                gen->m_output << "    jmp " << end_if_else << "\n"; // jump to end of else cuz elif condition is true
+    // Lowers `return f(..);` inside a function to a jump. A call to the function itself
+    // overwrites the parameters and jumps back to the start of the body, the temporaries
+    // are all popped by then so the frame is as the body expects it. The recursion
+    // becomes a loop. Any other call with only register arguments tears down the frame
+    // first and jumps, the callee then returns straight to our caller. Returns false if
+    // expr is not such a call.
+    bool gen_tail_call(const NodeExpr* expr)
+    {
+        if (!m_fun || !std::holds_alternative<NodeTerm*>(expr->var)
+            || !std::holds_alternative<NodeTermFunCall*>(std::get<NodeTerm*>(expr->var)->var)) {
+            return false;
+        }
+        const NodeTermFunCall* fun_call = std::get<NodeTermFunCall*>(std::get<NodeTerm*>(expr->var)->var);
+        const std::string& name = fun_call->ident.value.value();
+        bool self_call = name == m_fun->ident.value.value() && fun_call->args.size() == m_fun->params.size();
+        if (!self_call && fun_call->args.size() > arg_regs.size()) {
+            return false;
+        }
 
-                gen->m_output << "    " << elif_end_label << ":\n"; // end of elif
+        // every argument is evaluated before the first one is written
+        for (auto it = fun_call->args.rbegin(); it != fun_call->args.rend(); ++it) {
+            gen_expr(*it);
+        }
+        if (self_call) {
+            for (const Token& param : m_fun->params) {
+                auto it = std::find_if(m_vars.begin(), m_vars.end(), [&](const auto &var) {
+                    return var.name == param.value.value();
+                });
+                pop("rax");
+                m_output << "    mov " << var_addr(*it) << ", rax\n";
             }
+            m_output << "    jmp " << name << ".body\n";
+        } else {
+            for (size_t i = 0; i < fun_call->args.size(); i++) {
+                pop(arg_regs[i]);
+            }
+            end_frame();
+            m_output << "    jmp " << name << "\n";
         }
+        return true;
     }
 
     void gen_stmt(const NodeStmt* stmt)
@@ -198,6 +500,7 @@ public:
             void operator()(const NodeStmtExit* stmt_exit) const
             {
                 gen->gen_expr(stmt_exit->expr);
+                gen->gen_flush();
                 gen->m_output << "    mov rax, 60\n";
                 gen->pop("rdi");
                 gen->m_output << "    syscall\n";
@@ -208,11 +511,12 @@ public:
                     return var.name == stmt_let->ident.value.value();
                 });
                 if (it != gen->m_vars.cend()) {
-                    std::cerr << "Identifier already used: " << stmt_let->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
+                    throw error_at(stmt_let->ident, std::string("Identifier already used: ") + stmt_let->ident.value.value());
                 }
-                gen->m_vars.push_back({ .name = stmt_let->ident.value.value(), .stack_loc = static_cast<int>(gen->m_stack_size) });
                 gen->gen_expr(stmt_let->expr);
+                gen->pop("rax");
+                gen->m_vars.push_back({ .name = stmt_let->ident.value.value(), .stack_loc = static_cast<int>(gen->next_slot()) });
+                gen->m_output << "    mov " << gen->var_addr(gen->m_vars.back()) << ", rax\n";
             }
             void operator()(const NodeStmtScope* scope) const
             {
@@ -224,119 +528,50 @@ public:
             } 
             void operator()(const NodeStmtIf* if_condition) const
             {
-                std::cout << "If statement" << std::endl; //debug
+                gen->m_log << "If statement" << std::endl; //debug
                 std::string end_label = gen->generate_label("end_if");
                 std::string end_if_else = gen->generate_label("end_if_else");
-                if(!if_condition->rhs){
-                    gen->gen_expr(if_condition->lhs);
-                    gen->pop("rax");
-                    gen->m_output << "    cmp rax, 0\n";
-                    gen->m_output << "    je " << end_label << "\n";
-                    gen->begin_scope();
-                    for(const NodeStmt* stmt : if_condition->body){
-                        gen->gen_stmt(stmt);
-                    }
-                    gen->end_scope();
-                    gen->m_output << "    jmp " << end_if_else << "\n";
-                    gen->m_output << "    " << end_label << ":\n";
-                    
-                    gen->resolveElif(if_condition, end_if_else, gen, end_label, "");
-
-                    gen->begin_scope();
-                    for (const NodeStmt *stmt : if_condition->else_body) {
-                        gen->gen_stmt(stmt);
-                    }
-                    gen->end_scope();
-
+                if (gen->gen_switch(if_condition, end_if_else)) {
+                    return;
                 }
-                else{
-                    gen->gen_expr(if_condition->lhs);
-                    gen->gen_expr(if_condition->rhs);
-                    gen->pop("rbx");
-                    gen->pop("rax");
-                    gen->m_output << "    cmp rax, rbx\n";
-
-                    
-                    if(if_condition->comparison->comp.type == TokenType::eq_eq){
-                        gen->m_output << "    jne " << end_label << "\n";
-                    }
-                    else if(if_condition->comparison->comp.type == TokenType::greater_than){
-                        gen->m_output << "    jle " << end_label << "\n";
-                    }
-                    else if(if_condition->comparison->comp.type == TokenType::less_than){
-                        gen->m_output << "    jge " << end_label << "\n";
-                    }
-                    else if(if_condition->comparison->comp.type == TokenType::greater_eq){
-                        gen->m_output << "    jl " << end_label << "\n";
-                    }
-                    else if(if_condition->comparison->comp.type == TokenType::less_eq){
-                        gen->m_output << "    jg " << end_label << "\n";
-                    }
-                    else if(if_condition->comparison->comp.type == TokenType::n_eq){
-                        gen->m_output << "    je " << end_label << "\n";
-                    }
-                    else{
-                        std::cerr << "Invalid comparison" << std::endl;
-                        exit(EXIT_FAILURE);
-                    }
+                gen->gen_branch(if_condition->condition, end_label, false);
+                gen->begin_scope();
+                for(const NodeStmt* stmt : if_condition->body){
+                    gen->gen_stmt(stmt);
+                }
+                gen->end_scope();
 
-                    gen->begin_scope();
-                    for(const NodeStmt* stmt : if_condition->body){
-                        gen->gen_stmt(stmt);
-                    }
-                    gen->end_scope();
+                gen->m_output << "    jmp " << end_if_else << "\n";         //jump to end of else cuz if condition is true
 
-                    gen->m_output << "    jmp " << end_if_else << "\n";         //jump to end of else cuz if condition is true
-                    
-                    gen->m_output << "    " <<  end_label << ":\n";             //end of if
+                gen->m_output << "    " <<  end_label << ":\n";             //end of if
 
-                    gen->resolveElif(if_condition, end_if_else, gen, end_label, "");
+                gen->resolveElif(if_condition, end_if_else);
 
-                    gen->begin_scope();
-                    for(const NodeStmt* stmt : if_condition->else_body){
-                        gen->gen_stmt(stmt);
-                    }
-                    gen->end_scope();
-                    
+                gen->begin_scope();
+                for(const NodeStmt* stmt : if_condition->else_body){
+                    gen->gen_stmt(stmt);
                 }
+                gen->end_scope();
                 gen->m_output << "    " << end_if_else << ":\n"; // end of else
             }
+            // Loops are rotated: the condition guards the entry once and then sits at
+            // the bottom as the only branch of an iteration.
             void operator()(const NodeStmtWhile* while_condition) const {
-                std::cout << "While statement" << std::endl; // debug
+                gen->m_log << "While statement" << std::endl; // debug
                 std::string start_label = gen->generate_label("start_while");
                 std::string end_label = gen->generate_label("end_while");
+                gen->gen_branch(while_condition->condition, end_label, false);
                 gen->m_output << "    " << start_label << ":\n";
-                gen->gen_expr(while_condition->lhs);
-                gen->gen_expr(while_condition->rhs);
-                gen->pop("rbx");
-                gen->pop("rax");
-                gen->m_output << "    cmp rax, rbx\n";
-                if (while_condition->comparison->comp.type == TokenType::eq_eq) {
-                    gen->m_output << "    jne " << end_label << "\n";
-                } else if (while_condition->comparison->comp.type == TokenType::greater_than) {
-                    gen->m_output << "    jle " << end_label << "\n";
-                } else if (while_condition->comparison->comp.type == TokenType::less_than) {
-                    gen->m_output << "    jge " << end_label << "\n";
-                } else if (while_condition->comparison->comp.type == TokenType::greater_eq) {
-                    gen->m_output << "    jl " << end_label << "\n";
-                } else if (while_condition->comparison->comp.type == TokenType::less_eq) {
-                    gen->m_output << "    jg " << end_label << "\n";
-                } else if (while_condition->comparison->comp.type == TokenType::n_eq) {
-                    gen->m_output << "    je " << end_label << "\n";
-                } else {
-                    std::cerr << "Invalid comparison" << std::endl;
-                    exit(EXIT_FAILURE);
-                }
                 gen->begin_scope();
                 for (const NodeStmt *stmt : while_condition->body) {
                     gen->gen_stmt(stmt);
                 }
                 gen->end_scope();
-                gen->m_output << "    jmp " << start_label << "\n";
+                gen->gen_branch(while_condition->condition, start_label, true);
                 gen->m_output << "    " << end_label << ":\n";
             }
             void operator()(const NodeStmtFor* stmt_for) const {
-                std::cout << "For statement" << std::endl; // debug
+                gen->m_log << "For statement" << std::endl; // debug
                 std::string start_label = gen->generate_label("start_for");
                 std::string end_label = gen->generate_label("end_for");
 
@@ -346,82 +581,103 @@ public:
                     gen->gen_stmt(&stmt);
                 }, stmt_for->init);
 
-                gen->m_output << "    " << start_label << ":\n";
-                gen->gen_expr(stmt_for->condition_lhs);
-                gen->gen_expr(stmt_for->condition_rhs);
-                gen->pop("rbx");
-                gen->pop("rax");
-                gen->m_output << "    cmp rax, rbx\n";
-                if (stmt_for->comparision->comp.type == TokenType::eq_eq) {
-                    gen->m_output << "    jne " << end_label << "\n";
-                } else if (stmt_for->comparision->comp.type == TokenType::greater_than) {
-                    gen->m_output << "    jle " << end_label << "\n";
-                } else if (stmt_for->comparision->comp.type == TokenType::less_than) {
-                    gen->m_output << "    jge " << end_label << "\n";
-                } else if (stmt_for->comparision->comp.type == TokenType::greater_eq) {
-                    gen->m_output << "    jl " << end_label << "\n";
-                } else if (stmt_for->comparision->comp.type == TokenType::less_eq) {
-                    gen->m_output << "    jg " << end_label << "\n";
-                } else if (stmt_for->comparision->comp.type == TokenType::n_eq) {
-                    gen->m_output << "    je " << end_label << "\n";
-                } else {
-                    std::cerr << "Invalid comparision" << std::endl;
-                    exit(EXIT_FAILURE);
+                // the induction variable of a counted loop lives in a register until the loop ends
+                size_t iv_index = gen->m_vars.size() - 1;
+                bool iv_in_reg = loop_step(stmt_for) && gen->m_iv_depth < gen->m_frame.iv_regs;
+                if (iv_in_reg) {
+                    gen->m_output << "    mov " << iv_regs[gen->m_iv_depth] << ", " << gen->var_addr(gen->m_vars[iv_index]) << "\n";
+                    gen->m_vars[iv_index].reg = iv_regs[gen->m_iv_depth++];
                 }
 
-                gen->begin_scope();
-                for (const NodeStmt *stmt : stmt_for->body) {
-                    gen->gen_stmt(stmt);
-                }
-                gen->end_scope();
+                size_t body_size = stmts_size(stmt_for->body) + 1;
+                std::optional<uint64_t> trips = gen->trip_count(stmt_for);
+                if (trips && *trips * body_size <= unroll_budget) {
+                    // known and small trip count, no loop control left at all
+                    for (uint64_t i = 0; i < *trips; i++) {
+                        gen->gen_for_iteration(stmt_for);
+                    }
+                } else {
+                    // unrolled main loop that runs while `factor` more iterations are certain,
+                    // the plain loop after it does the remainder
+                    size_t factor = std::min(gen->unroll_factor(stmt_for), unroll_budget / body_size);
+                    if (factor > 1) {
+                        std::string unrolled_label = gen->generate_label("unrolled_for");
+                        std::string check_label = gen->generate_label("unrolled_check");
+                        int64_t step = loop_step(stmt_for).value();
+                        gen->m_output << "    jmp " << check_label << "\n";
+                        gen->m_output << "    " << unrolled_label << ":\n";
+                        for (size_t i = 0; i < factor; i++) {
+                            gen->gen_for_iteration(stmt_for);
+                        }
+                        gen->m_output << "    " << check_label << ":\n";
+                        gen->m_output << "    mov rax, " << gen->var_operand(gen->m_vars[iv_index]) << "\n";
+                        gen->m_output << "    add rax, " << static_cast<int64_t>(factor - 1) * step << "\n";
+                        const NodeBinExprCmp* condition = as_comparison(stmt_for->condition);
+                        gen->m_output << "    cmp rax, " << *gen->simple_operand(condition->rhs) << "\n";
+                        gen->m_output << "    " << cond_jump(condition->comparison, true) << " " << unrolled_label << "\n";
+                    }
 
-                auto it = std::find_if(gen->m_vars.begin(), gen->m_vars.end(), [&](const auto &var) {
-                    return var.name == stmt_for->change->lhs->ident.value.value();
-                });
-                if (it == gen->m_vars.cend()) {
-                    std::cerr << "Identifier never declared: " << stmt_for->change->lhs->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
+                    gen->gen_branch(stmt_for->condition, end_label, false);
+                    gen->m_output << "    " << start_label << ":\n";
+                    gen->gen_for_iteration(stmt_for);
+                    gen->gen_branch(stmt_for->condition, start_label, true);
+                    gen->m_output << "    " << end_label << ":\n";
                 }
-                gen->gen_expr(stmt_for->change->rhs);
-                gen->pop("rax");
-                gen->m_output << "    mov QWORD [rsp + " << (gen->m_stack_size - it->stack_loc - 1) * 8 << "], rax\n";
 
-                gen->m_output << "    jmp " << start_label << "\n";
-                gen->m_output << "    " << end_label << ":\n";
+                // the variable stays visible after the loop, give it back its slot
+                if (iv_in_reg) {
+                    gen->m_output << "    mov " << gen->var_addr(gen->m_vars[iv_index]) << ", " << gen->m_vars[iv_index].reg << "\n";
+                    gen->m_vars[iv_index].reg.clear();
+                    gen->m_iv_depth--;
+                }
             }
             void operator()(const NodeStmtAssign* stmt_assign) const {
                 auto it = std::find_if(gen->m_vars.begin(), gen->m_vars.end(), [&](const auto &var) {
                     return var.name == stmt_assign->lhs->ident.value.value();
                 });
                 if (it == gen->m_vars.cend()) {
-                    std::cerr << "Identifier never decleared: " << stmt_assign->lhs->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                gen->gen_expr(stmt_assign->rhs);
-                gen->pop("rax");
-                
-                // negative stack_loc indicates parameter
-                if (it->stack_loc < 0) {
-                    int param_index = -it->stack_loc - 1;
-                    gen->m_output << "    mov QWORD [rbp + " << (param_index + 2) * 8 << "], rax\n";
-                } else {
-                    gen->m_output << "    mov QWORD [rbp - " << (it->stack_loc + 1) * 8 << "], rax\n";
+                    throw error_at(stmt_assign->lhs->ident, std::string("Identifier never decleared: ") + stmt_assign->lhs->ident.value.value());
                 }
+                gen->gen_assign(*it, stmt_assign->rhs);
             }
 
             void operator()(const NodeStmtFun *stmt_fun) const {
-                gen->m_output << stmt_fun->ident.value.value() << ":\n";
+                if (gen->memoizes(stmt_fun)) {
+                    // callers enter through the table lookup, misses run the body below
+                    gen->gen_memo_entry(stmt_fun);
+                    gen->m_output << stmt_fun->ident.value.value() << ".compute:\n";
+                } else {
+                    gen->m_output << stmt_fun->ident.value.value() << ":\n";
+                }
+                Frame outer_frame = gen->m_frame;
+                size_t outer_temp_depth = gen->m_temp_depth;
+                const NodeStmtFun* outer_fun = gen->m_fun;
+                gen->m_fun = stmt_fun;
 
-                gen->push("rbp");
-                gen->m_output << "    mov rbp, rsp\n";
+                size_t reg_params = std::min(stmt_fun->params.size(), arg_regs.size());
+                bool frame_pointer = !gen->m_options.omit_frame_pointer || !is_leaf(stmt_fun->body->stmts);
+                size_t outer_iv_depth = gen->m_iv_depth;
+                gen->m_iv_depth = 0;
+                // the induction variable registers are callee-saved, a function saves the ones it uses
+                size_t iv_regs_used = count_loop_regs(stmt_fun->body->stmts);
+                gen->begin_frame(reg_params + count_slots(stmt_fun->body->stmts), iv_regs_used, iv_regs_used, frame_pointer, false);
 
                 gen->begin_scope();
 
-                // params are neg stack_loc
-                for (int i = 0; i < stmt_fun->params.size(); ++i) {
-                    gen->m_vars.push_back({.name = stmt_fun->params[i].value.value(),
-                                           .stack_loc = -i - 1});
+                // register params are spilled into the frame like locals, the rest
+                // stay where the caller pushed them and get a negative stack_loc
+                for (size_t i = 0; i < stmt_fun->params.size(); ++i) {
+                    if (i < arg_regs.size()) {
+                        gen->m_vars.push_back({.name = stmt_fun->params[i].value.value(),
+                                               .stack_loc = static_cast<int>(gen->next_slot())});
+                        gen->m_output << "    mov " << gen->var_addr(gen->m_vars.back()) << ", " << arg_regs[i] << "\n";
+                    } else {
+                        gen->m_vars.push_back({.name = stmt_fun->params[i].value.value(),
+                                               .stack_loc = -static_cast<int>(i - arg_regs.size()) - 1});
+                    }
                 }
+                // self tail calls jump back here with the parameters rewritten
+                gen->m_output << stmt_fun->ident.value.value() << ".body:\n";
 
                 for (const NodeStmt *stmt : stmt_fun->body->stmts) {
                     gen->gen_stmt(stmt);
@@ -429,16 +685,21 @@ public:
 
                 gen->end_scope();
 
-                gen->m_output << "    mov rsp, rbp\n";
-                gen->pop("rbp");
+                gen->end_frame();
                 gen->m_output << "    ret\n";
+                gen->m_frame = outer_frame;
+                gen->m_temp_depth = outer_temp_depth;
+                gen->m_iv_depth = outer_iv_depth;
+                gen->m_fun = outer_fun;
             }
 
             void operator()(const NodeStmtReturn *stmt_return) const {
+                if (gen->gen_tail_call(stmt_return->expr)) {
+                    return;
+                }
                 gen->gen_expr(stmt_return->expr);
-                gen->pop("rax"); 
-                gen->m_output << "    mov rsp, rbp\n";
-                gen->pop("rbp");
+                gen->pop("rax");
+                gen->end_frame();
                 gen->m_output << "    ret\n";
             }
 
@@ -450,128 +711,723 @@ public:
             }
         };
 
+        // -g: nasm maps the code that follows to the statement's line
+        if (m_options.debug_info && stmt->line != 0) {
+            m_output << "%line " << stmt->line << "+0 " << m_options.source_name << "\n";
+        }
         StmtVisitor visitor { .gen = this };
         std::visit(visitor, stmt->var);
     }
 
     [[nodiscard]] std::string gen_prog()
     {
-        //im copy pasting this. this converts  number to string on the stack
+        for (const std::string& name : m_linkage.externs) {
+            m_output << "extern " << name << "\n";
+        }
         m_output << "section .text\n";
 
-        m_output << "_print_int:\n";
-        m_output << "    push rbp          ; 1. Save the old base pointer\n";
-        m_output << "    mov rbp, rsp      ; 2. Set our new base pointer (this saves the stack position)\n";
-        m_output << "    mov rbx, 10       ; Divisor\n";
-        m_output << "    cmp rax, 0\n";
-        m_output << "    jge .to_str_loop\n";
-        m_output << "    push '-'          ; Push '-' for negative numbers\n";
-        m_output << "    neg rax           ; Make rax positive\n";
-        m_output << ".to_str_loop:\n";
-        m_output << "    xor rdx, rdx      ; Clear rdx for division\n";
-        m_output << "    div rbx           ; rax = rax / 10, rdx = remainder\n";
-        m_output << "    add rdx, '0'      ; Convert digit to ASCII\n";
-        m_output << "    push rdx          ; Push ASCII digit onto stack\n";
-        m_output << "    test rax, rax     ; Is quotient zero?\n";
-        m_output << "    jnz .to_str_loop  ; If not, loop again\n";
-        m_output << ".print:\n";
-        m_output << "    mov rax, 1        ; sys_write syscall\n";
-        m_output << "    mov rdi, 1        ; stdout file descriptor\n";
-        m_output << "    mov rsi, rsp      ; Address of string to print\n";
-        m_output << "    mov rdx, rbp      ; Calculate length using our saved base pointer\n";
-        m_output << "    sub rdx, rsp\n";
-        m_output << "    syscall           ; This clobbers rcx, but we are using rbp, so it's OK\n";
-        m_output << "    mov rsp, rbp      ; 3. Restore stack pointer from our saved value\n";
-        m_output << "    pop rbp           ; 4. Restore the old base pointer\n";
-        m_output << "    ret\n\n";
-
-        m_output << "_print_newline:\n";
-        m_output << "    mov rax, 1\n";
-        m_output << "    mov rdi, 1\n";
-        m_output << "    mov rsi, 0xA\n"; // ASCII newline
-        m_output << "    push rsi\n";
-        m_output << "    mov rsi, rsp\n";
-        m_output << "    mov rdx, 1\n";
-        m_output << "    syscall\n";
-        m_output << "    pop rsi\n";
-        m_output << "    ret\n\n";
-
-
+        // runtime helpers are only emitted when reachable code prints, a module program
+        // always has them in the main module
+        if (m_uses_print && m_linkage.main) {
+            if (m_linkage.module) {
+                m_output << "global _print_int\nglobal _print_newline\nglobal _flush\n";
+            }
+            gen_print_runtime();
+        } else if (m_uses_print) {
+            m_output << "extern _print_int\nextern _print_newline\nextern _flush\n";
+        }
 
-        //gen all functions
+        //gen only the functions reachable from _start, or all of them in a module other than main
         for (const NodeStmt *stmt : m_prog.stmts) {
-            if (std::holds_alternative<NodeStmtFun *>(stmt->var)) {
+            if (std::holds_alternative<NodeStmtFun *>(stmt->var)
+                && m_call_graph.is_reachable(std::get<NodeStmtFun *>(stmt->var)->ident.value.value())) {
+                if (!m_linkage.main) {
+                    m_output << "global " << std::get<NodeStmtFun *>(stmt->var)->ident.value.value() << "\n";
+                }
                 gen_stmt(stmt);
             }
         }
+        if (!m_linkage.main) {
+            return finish();
+        }
 
+        std::vector<NodeStmt*> top_level;
+        std::copy_if(m_prog.stmts.begin(), m_prog.stmts.end(), std::back_inserter(top_level), [](const NodeStmt* stmt) {
+            return !std::holds_alternative<NodeStmtFun *>(stmt->var);
+        });
+        gen_start(top_level);
+
+        if (m_uses_print) {
+            m_bss << "_out_buf: resb " << output_buffer_size << "\n";
+            m_bss << "_out_len: resq 1\n";
+        }
+        return finish();
+    }
+
+    void gen_start(const std::vector<NodeStmt*>& top_level)
+    {
         m_output << "global _start\n\n";
         m_output << "_start:\n";
-        
-        // setting up stack frame
-        push("rbp");
-        m_output << "    mov rbp, rsp\n";
 
-        for (const NodeStmt *stmt : m_prog.stmts) {
-            if (!std::holds_alternative<NodeStmtFun *>(stmt->var)) {
-                gen_stmt(stmt);
-            }
+        // rsp is 16 byte aligned on entry and _start never returns, so it needs no frame pointer
+        begin_frame(count_slots(top_level), iv_regs.size(), 0, false, true);
+
+        for (const NodeStmt *stmt : top_level) {
+            gen_stmt(stmt);
         }
 
         //in case no exit stmt, exit with code 60.
+        gen_flush();
         m_output << "    mov rax, 60\n";
         m_output << "    mov rdi, 0\n";
         m_output << "    syscall\n";
+    }
+
+    // appends the data sections to the code
+    [[nodiscard]] std::string finish()
+    {
+        if (!m_bss.str().empty()) {
+            m_output << "section .bss\n";
+            m_output << m_bss.str();
+        }
+        if (!m_rodata.str().empty()) {
+            m_output << "section .rodata\n";
+            m_output << m_rodata.str();
+        }
         return m_output.str();
     }
 
+    // The chunks of an incremental program. Labels of a function start with its name, so
+    // chunks made at different times never define the same one.
+    Chunk gen_runtime_chunk()
+    {
+        gen_print_runtime();
+        m_bss << "_out_buf: resb " << output_buffer_size << "\n";
+        m_bss << "_out_len: resq 1\n";
+        return take_chunk();
+    }
+
+    Chunk gen_fun_chunk(const NodeStmt* stmt)
+    {
+        m_label_prefix = std::get<NodeStmtFun *>(stmt->var)->ident.value.value() + ".";
+        m_label_counter = 0;
+        gen_stmt(stmt);
+        return take_chunk();
+    }
+
+    Chunk gen_start_chunk(const std::vector<NodeStmt*>& top_level)
+    {
+        m_label_prefix = "_start.";
+        m_label_counter = 0;
+        gen_start(top_level);
+        return take_chunk();
+    }
+
+    // the program made of chunks, in order: the runtime, the functions and _start
+    static std::string splice(const std::vector<const Chunk*>& chunks)
+    {
+        std::string output = "section .text\n";
+        for (const Chunk* chunk : chunks) {
+            output += chunk->text;
+        }
+        output += "section .bss\n";
+        for (const Chunk* chunk : chunks) {
+            output += chunk->bss;
+        }
+        output += "section .rodata\n";
+        for (const Chunk* chunk : chunks) {
+            output += chunk->rodata;
+        }
+        return output;
+    }
+
+    // --auto-memo caches the results of pure recursive functions whose arguments all come in registers
+    [[nodiscard]] bool memoizes(const NodeStmtFun* stmt_fun) const
+    {
+        const std::string& name = stmt_fun->ident.value.value();
+        return m_options.auto_memo && !stmt_fun->params.empty() && stmt_fun->params.size() <= arg_regs.size()
+            && m_call_graph.is_pure(name) && has_non_tail_recursion(stmt_fun->body->stmts, name);
+    }
+
 private:
+    Chunk take_chunk()
+    {
+        Chunk chunk { .text = m_output.str(), .rodata = m_rodata.str(), .bss = m_bss.str() };
+        m_output.str("");
+        m_rodata.str("");
+        m_bss.str("");
+        return chunk;
+    }
+
+    // true if stmts call back into name other than as the whole value of a return. Recursion
+    // through tail calls already runs in constant stack, a memo table in front would break that.
+    bool has_non_tail_recursion(const std::vector<NodeStmt*>& stmts, const std::string& name) const
+    {
+        bool found = false;
+        for (const NodeStmt* stmt : stmts) {
+            if (std::holds_alternative<NodeStmtReturn*>(stmt->var)) {
+                const NodeExpr* expr = std::get<NodeStmtReturn*>(stmt->var)->expr;
+                if (std::holds_alternative<NodeTerm*>(expr->var)
+                    && std::holds_alternative<NodeTermFunCall*>(std::get<NodeTerm*>(expr->var)->var)) {
+                    for_each_operand(expr, [&](const NodeExpr* arg) { found = found || calls_into(arg, name); });
+                    continue;
+                }
+            }
+            for_each_expr(stmt, [&](const NodeExpr* expr) { found = found || calls_into(expr, name); });
+            for_each_body(stmt, [&](const std::vector<NodeStmt*>& body) { found = found || has_non_tail_recursion(body, name); });
+        }
+        return found;
+    }
+
+    // true if evaluating expr can lead to a call to name
+    bool calls_into(const NodeExpr* expr, const std::string& name) const
+    {
+        if (std::holds_alternative<NodeTerm*>(expr->var)
+            && std::holds_alternative<NodeTermFunCall*>(std::get<NodeTerm*>(expr->var)->var)) {
+            const std::string& callee = std::get<NodeTermFunCall*>(std::get<NodeTerm*>(expr->var)->var)->ident.value.value();
+            if (callee == name || m_call_graph.can_reach(callee, name)) {
+                return true;
+            }
+        }
+        bool found = false;
+        for_each_operand(expr, [&](const NodeExpr* operand) { found = found || calls_into(operand, name); });
+        return found;
+    }
+
+    // Entry of a memoized function. Its results live in a direct mapped table in .bss whose
+    // slots hold [filled, args.., result]. A single argument indexes the table itself, so a
+    // small domain like fib's never collides, several arguments are hashed. A hit returns
+    // right away, a miss calls the body and fills the slot, replacing what was there.
+    void gen_memo_entry(const NodeStmtFun* stmt_fun)
+    {
+        const std::string& name = stmt_fun->ident.value.value();
+        size_t params = stmt_fun->params.size();
+        size_t result_offset = (params + 1) * 8;
+        std::string table = "_memo_" + name;
+        std::string miss_label = generate_label("memo_miss");
+        m_bss << table << ": resq " << (params + 2) * memo_slots << "\n";
+
+        // rax, r10 and r11 are the scratch registers that don't carry arguments
+        m_output << name << ":\n";
+        m_output << "    mov rax, " << arg_regs[0] << "\n";
+        if (params == 1) {
+            m_output << "    and rax, " << memo_slots - 1 << "\n";
+        } else {
+            m_output << "    mov r10, 0x9E3779B97F4A7C15\n";
+            for (size_t i = 1; i < params; i++) {
+                m_output << "    imul rax, r10\n";
+                m_output << "    xor rax, " << arg_regs[i] << "\n";
+            }
+            m_output << "    imul rax, r10\n";
+            m_output << "    shr rax, " << 64 - memo_slot_bits << "\n";
+        }
+        m_output << "    imul rax, rax, " << (params + 2) * 8 << "\n";
+        m_output << "    lea r11, [rel " << table << "]\n";
+        m_output << "    add r11, rax\n";
+        m_output << "    cmp QWORD [r11], 0\n";
+        m_output << "    je " << miss_label << "\n";
+        for (size_t i = 0; i < params; i++) {
+            m_output << "    cmp [r11 + " << (i + 1) * 8 << "], " << arg_regs[i] << "\n";
+            m_output << "    jne " << miss_label << "\n";
+        }
+        m_output << "    mov rax, [r11 + " << result_offset << "]\n";
+        m_output << "    ret\n";
+
+        // the slot address and the arguments are kept on the stack across the call, which
+        // must leave rsp 16 byte aligned
+        m_output << "    " << miss_label << ":\n";
+        m_output << "    push r11\n";
+        for (size_t i = 0; i < params; i++) {
+            m_output << "    push " << arg_regs[i] << "\n";
+        }
+        bool padding = params % 2 == 1;
+        if (padding) {
+            m_output << "    sub rsp, 8\n";
+        }
+        m_output << "    call " << name << ".compute\n";
+        if (padding) {
+            m_output << "    add rsp, 8\n";
+        }
+        for (size_t i = params; i-- > 0;) {
+            m_output << "    pop " << arg_regs[i] << "\n";
+        }
+        m_output << "    pop r11\n";
+        for (size_t i = 0; i < params; i++) {
+            m_output << "    mov [r11 + " << (i + 1) * 8 << "], " << arg_regs[i] << "\n";
+        }
+        m_output << "    mov [r11 + " << result_offset << "], rax\n";
+        m_output << "    mov QWORD [r11], 1\n";
+        m_output << "    ret\n";
+    }
+
+    // Binary search for the value in rax among cases[lo, hi), which are sorted. The last
+    // few cases at the bottom of the tree are compared one after the other.
+    void gen_switch_search(const std::vector<std::pair<int64_t, size_t>>& cases, size_t lo, size_t hi,
+                           const std::vector<std::string>& arm_labels, const std::string& default_label)
+    {
+        if (hi - lo <= 3) {
+            for (size_t i = lo; i < hi; i++) {
+                m_output << "    cmp rax, " << cases[i].first << "\n";
+                m_output << "    je " << arm_labels[cases[i].second] << "\n";
+            }
+            m_output << "    jmp " << default_label << "\n";
+            return;
+        }
+        size_t mid = lo + (hi - lo) / 2;
+        std::string lower_label = generate_label("switch_lower");
+        m_output << "    cmp rax, " << cases[mid].first << "\n";
+        m_output << "    je " << arm_labels[cases[mid].second] << "\n";
+        m_output << "    jl " << lower_label << "\n";
+        gen_switch_search(cases, mid + 1, hi, arm_labels, default_label);
+        m_output << "    " << lower_label << ":\n";
+        gen_switch_search(cases, lo, mid, arm_labels, default_label);
+    }
+
+    // (x, c) if condition is `x == c` or `c == x` for a variable x and a constant c
+    static std::optional<std::pair<std::string, int64_t>> equality_test(const NodeExpr* condition)
+    {
+        const NodeBinExprCmp* cmp = as_comparison(condition);
+        if (!cmp || cmp->comparison->comp.type != TokenType::eq_eq) {
+            return {};
+        }
+        auto ident_of = [](const NodeExpr* expr) -> std::optional<std::string> {
+            if (std::holds_alternative<NodeTerm*>(expr->var)
+                && std::holds_alternative<NodeTermIdent*>(std::get<NodeTerm*>(expr->var)->var)) {
+                return std::get<NodeTermIdent*>(std::get<NodeTerm*>(expr->var)->var)->ident.value.value();
+            }
+            return {};
+        };
+        if (auto ident = ident_of(cmp->lhs); ident && const_value(cmp->rhs)) {
+            return std::pair { *ident, *const_value(cmp->rhs) };
+        }
+        if (auto ident = ident_of(cmp->rhs); ident && const_value(cmp->lhs)) {
+            return std::pair { *ident, *const_value(cmp->lhs) };
+        }
+        return {};
+    }
+
+    // print() appends to a buffer in .bss that is only written out when it is full and before
+    // the program exits, instead of making a write syscall for every number and newline.
+    void gen_print_runtime()
+    {
+        // formats rax as a signed decimal: a '-' for negative numbers, then the magnitude as
+        // unsigned, which is right for the smallest number too. Two digits at a time are split
+        // off with a multiply by the reciprocal of 100 and looked up in _digit_pairs. They are
+        // built backwards in a scratch area on the stack and then copied to the buffer.
+        m_output << "_print_int:\n";
+        m_output << "    mov rcx, [rel _out_len]\n";
+        m_output << "    cmp rcx, " << output_buffer_size - 21 << "     ; room for 20 digits and a sign\n";
+        m_output << "    jbe .room\n";
+        m_output << "    push rax\n";
+        m_output << "    call _flush\n";
+        m_output << "    pop rax\n";
+        m_output << "    xor ecx, ecx\n";
+        m_output << ".room:\n";
+        m_output << "    sub rsp, 24\n";
+        m_output << "    lea rsi, [rsp + 24]    ; digits are written backwards from here\n";
+        m_output << "    mov rdi, rax\n";
+        m_output << "    test rax, rax\n";
+        m_output << "    jns .positive\n";
+        m_output << "    neg rax\n";
+        m_output << ".positive:\n";
+        m_output << "    lea r11, [rel _digit_pairs]\n";
+        m_output << "    mov r10, 0x28F5C28F5C28F5C3   ; (n >> 2) * r10 >> 66 is n / 100 for any unsigned n\n";
+        m_output << ".pairs:\n";
+        m_output << "    cmp rax, 100\n";
+        m_output << "    jb .last\n";
+        m_output << "    mov r8, rax\n";
+        m_output << "    shr rax, 2\n";
+        m_output << "    mul r10\n";
+        m_output << "    mov rax, rdx\n";
+        m_output << "    shr rax, 2        ; rax = n / 100\n";
+        m_output << "    imul r9, rax, 100\n";
+        m_output << "    sub r8, r9        ; r8 = n % 100\n";
+        m_output << "    movzx r9d, WORD [r11 + r8 * 2]\n";
+        m_output << "    sub rsi, 2\n";
+        m_output << "    mov [rsi], r9w\n";
+        m_output << "    jmp .pairs\n";
+        m_output << ".last:\n";
+        m_output << "    cmp rax, 10\n";
+        m_output << "    jb .one\n";
+        m_output << "    movzx r9d, WORD [r11 + rax * 2]\n";
+        m_output << "    sub rsi, 2\n";
+        m_output << "    mov [rsi], r9w\n";
+        m_output << "    jmp .sign\n";
+        m_output << ".one:\n";
+        m_output << "    add al, '0'\n";
+        m_output << "    dec rsi\n";
+        m_output << "    mov [rsi], al\n";
+        m_output << ".sign:\n";
+        m_output << "    test rdi, rdi\n";
+        m_output << "    jns .copy\n";
+        m_output << "    dec rsi\n";
+        m_output << "    mov BYTE [rsi], '-'\n";
+        m_output << ".copy:\n";
+        m_output << "    lea rdi, [rel _out_buf]\n";
+        m_output << "    add rdi, rcx\n";
+        m_output << "    lea rcx, [rsp + 24]\n";
+        m_output << "    sub rcx, rsi\n";
+        m_output << "    add [rel _out_len], rcx\n";
+        m_output << "    rep movsb\n";
+        m_output << "    add rsp, 24\n";
+        m_output << "    ret\n\n";
+
+        m_rodata << "_digit_pairs: db \"";
+        for (int i = 0; i < 100; i++) {
+            m_rodata << static_cast<char>('0' + i / 10) << static_cast<char>('0' + i % 10);
+        }
+        m_rodata << "\"\n";
+
+        m_output << "_print_newline:\n";
+        m_output << "    mov rcx, [rel _out_len]\n";
+        m_output << "    cmp rcx, " << output_buffer_size << "\n";
+        m_output << "    jb .room\n";
+        m_output << "    call _flush\n";
+        m_output << "    xor ecx, ecx\n";
+        m_output << ".room:\n";
+        m_output << "    lea rdx, [rel _out_buf]\n";
+        m_output << "    mov BYTE [rdx + rcx], 10\n";
+        m_output << "    inc rcx\n";
+        m_output << "    mov [rel _out_len], rcx\n";
+        m_output << "    ret\n\n";
+
+        // writes out and empties the buffer. write may take less than asked, so it loops
+        m_output << "_flush:\n";
+        m_output << "    mov rdx, [rel _out_len]\n";
+        m_output << "    lea rsi, [rel _out_buf]\n";
+        m_output << ".write:\n";
+        m_output << "    test rdx, rdx\n";
+        m_output << "    jz .done\n";
+        m_output << "    mov rax, 1        ; sys_write\n";
+        m_output << "    mov rdi, 1        ; stdout\n";
+        m_output << "    syscall\n";
+        m_output << "    test rax, rax\n";
+        m_output << "    jle .done         ; nothing more can be written, drop the rest\n";
+        m_output << "    add rsi, rax\n";
+        m_output << "    sub rdx, rax\n";
+        m_output << "    jmp .write\n";
+        m_output << ".done:\n";
+        m_output << "    mov QWORD [rel _out_len], 0\n";
+        m_output << "    ret\n\n";
+    }
+
+    // everything printed so far has to be written before an exit syscall
+    void gen_flush()
+    {
+        if (m_uses_print) {
+            m_output << "    call _flush\n";
+        }
+    }
+
     void push(const std::string& reg)
     {
         m_output << "    push " << reg << "\n";
-        m_stack_size++;
+        m_temp_depth++;
     }
 
     void pop(const std::string& reg)
     {
         m_output << "    pop " << reg << "\n";
-        m_stack_size--;
+        m_temp_depth--;
     }
 
+    // Locals don't move rsp, a scope only decides which slots are free again
     void begin_scope()
     {
         m_scopes.push_back(m_vars.size());
     }
     void end_scope()
     {
-        size_t pop_count = m_vars.size() - m_scopes.back();
-        m_output << "    add rsp, " << pop_count * 8 << "\n";
-
-        //  integer underflow protection
-        if (pop_count <= m_stack_size) {
-            m_stack_size -= pop_count;
-        } else {
-            m_stack_size = 0;
-        }
-        for(int i = 0; i<pop_count; i++){
-            m_vars.pop_back();
-        }
+        m_vars.resize(m_scopes.back());
         m_scopes.pop_back();
     }
 
     struct Var {
         std::string name;
         int stack_loc; 
+        std::string reg {};     // set while the variable lives in a register instead of its slot
+    };
+
+    // Layout of the current frame, from rsp up: the expression temporaries pushed so
+    // far, `slots` local variables, the saved callee-saved registers, the saved rbp if
+    // there is a frame pointer, the return address and the parameters the caller
+    // passed on the stack.
+    struct Frame {
+        size_t slots = 0;
+        size_t iv_regs = 0;     // induction variable registers the code may use
+        size_t saved_regs = 0;
+        bool frame_pointer = false;
     };
 
+    // allocates the whole frame with one sub, padded so rsp is 16 byte aligned afterwards
+    void begin_frame(size_t slots, size_t iv_regs_usable, size_t saved_regs, bool frame_pointer, bool entry_aligned)
+    {
+        size_t pushed = (entry_aligned ? 0 : 1) + (frame_pointer ? 1 : 0) + saved_regs;  // return address, rbp, saved regs
+        m_frame = { .slots = slots + (slots + pushed) % 2, .iv_regs = iv_regs_usable, .saved_regs = saved_regs, .frame_pointer = frame_pointer };
+        m_temp_depth = 0;
+        if (frame_pointer) {
+            m_output << "    push rbp\n";
+            m_output << "    mov rbp, rsp\n";
+        }
+        for (size_t i = 0; i < saved_regs; i++) {
+            m_output << "    push " << iv_regs[i] << "\n";
+        }
+        if (m_frame.slots > 0) {
+            m_output << "    sub rsp, " << m_frame.slots * 8 << "\n";
+        }
+    }
+
+    // releases the frame before a ret or a tail jump. Only valid between statements
+    void end_frame()
+    {
+        if (m_frame.slots > 0) {
+            m_output << "    add rsp, " << m_frame.slots * 8 << "\n";
+        }
+        for (size_t i = m_frame.saved_regs; i > 0; i--) {
+            m_output << "    pop " << iv_regs[i - 1] << "\n";
+        }
+        if (m_frame.frame_pointer) {
+            m_output << "    pop rbp\n";
+        }
+    }
+
+    // frame slot for the next local, slots are reused once their scope ends
+    size_t next_slot() const
+    {
+        return std::count_if(m_vars.begin(), m_vars.end(), [](const Var& var) { return var.stack_loc >= 0; });
+    }
+
+    // memory operand of a variable, relative to rsp. A negative stack_loc is a parameter the caller pushed
+    std::string var_addr(const Var& var) const
+    {
+        std::stringstream offset;
+        if (var.stack_loc < 0) {
+            size_t param_index = -var.stack_loc - 1;
+            size_t above = m_frame.slots + m_frame.saved_regs + (m_frame.frame_pointer ? 1 : 0) + 1;
+            offset << "QWORD [rsp + " << (m_temp_depth + above + param_index) * 8 << "]";
+        } else {
+            offset << "QWORD [rsp + " << (m_temp_depth + var.stack_loc) * 8 << "]";
+        }
+        return offset.str();
+    }
+
+    // register or memory operand holding the variable's current value
+    std::string var_operand(const Var& var) const
+    {
+        return var.reg.empty() ? var_addr(var) : var.reg;
+    }
+
+    // Stores rhs into var. `x = x + c` and `x = x - c` update x in place with one add.
+    void gen_assign(const Var& var, const NodeExpr* rhs)
+    {
+        if (auto step = increment_of(var.name, rhs); step && *step >= INT32_MIN && *step <= INT32_MAX) {
+            if (*step == 1) {
+                m_output << "    inc " << var_operand(var) << "\n";
+            } else if (*step == -1) {
+                m_output << "    dec " << var_operand(var) << "\n";
+            } else {
+                m_output << "    add " << var_operand(var) << ", " << *step << "\n";
+            }
+            return;
+        }
+        gen_expr(rhs);
+        pop("rax");
+        m_output << "    mov " << var_operand(var) << ", rax\n";
+    }
+
+    // one pass through a for-loop's body followed by its update
+    void gen_for_iteration(const NodeStmtFor* stmt_for)
+    {
+        begin_scope();
+        for (const NodeStmt *stmt : stmt_for->body) {
+            gen_stmt(stmt);
+        }
+        end_scope();
+
+        if (stmt_for->change) {
+            auto it = std::find_if(m_vars.begin(), m_vars.end(), [&](const auto &var) {
+                return var.name == stmt_for->change->lhs->ident.value.value();
+            });
+            if (it == m_vars.cend()) {
+                throw error_at(stmt_for->change->lhs->ident, std::string("Identifier never declared: ") + stmt_for->change->lhs->ident.value.value());
+            }
+            gen_assign(*it, stmt_for->change->rhs);
+        }
+    }
+
+    // true if the loop is counted, compares its induction variable against a bound
+    // that is a variable or small literal, and its body writes neither of them
+    static bool has_fixed_bound(const NodeStmtFor* stmt_for)
+    {
+        auto step = loop_step(stmt_for);
+        if (!step || *step == 0) {
+            return false;
+        }
+        const std::string& iv = stmt_for->change->lhs->ident.value.value();
+        const NodeBinExprCmp* condition = as_comparison(stmt_for->condition);
+        if (!condition || count_uses(condition->lhs, iv) != 1 || expr_size(condition->lhs) != 1) {
+            return false;
+        }
+        std::unordered_set<std::string> written;
+        collect_written(stmt_for->body, written);
+        bool bound_fixed = expr_size(condition->rhs) == 1 && !has_call(condition->rhs);
+        for_each_ident(condition->rhs, [&](const std::string& ident) {
+            bound_fixed = bound_fixed && !written.contains(ident) && ident != iv;
+        });
+        return bound_fixed && !written.contains(iv);
+    }
+
+    // Iterations of a loop whose start and bound are both constants, if there are few enough to unroll fully.
+    std::optional<uint64_t> trip_count(const NodeStmtFor* stmt_for) const
+    {
+        if (!has_fixed_bound(stmt_for)) {
+            return {};
+        }
+        auto start = const_value(std::get<NodeStmtLet*>(stmt_for->init)->expr);
+        const NodeBinExprCmp* condition = as_comparison(stmt_for->condition);
+        auto bound = const_value(condition->rhs);
+        if (!start || !bound) {
+            return {};
+        }
+        int64_t step = loop_step(stmt_for).value();
+        uint64_t trips = 0;
+        for (int64_t i = *start; trips <= max_full_unroll; i += step, trips++) {
+            bool holds;
+            switch (condition->comparison->comp.type) {
+                case TokenType::less_than: holds = i < *bound; break;
+                case TokenType::less_eq: holds = i <= *bound; break;
+                case TokenType::greater_than: holds = i > *bound; break;
+                case TokenType::greater_eq: holds = i >= *bound; break;
+                case TokenType::n_eq: holds = i != *bound; break;
+                case TokenType::eq_eq: holds = i == *bound; break;
+                default: return {};
+            }
+            if (!holds) {
+                return trips;
+            }
+        }
+        return {};
+    }
+
+    // How many iterations the unrolled main loop of a for-loop may do at once, 1 if it can't be unrolled.
+    // Needs an ordered comparison that moves towards the bound, so the remaining count is known to be >= factor.
+    size_t unroll_factor(const NodeStmtFor* stmt_for) const
+    {
+        if (!has_fixed_bound(stmt_for) || !simple_operand(as_comparison(stmt_for->condition)->rhs)) {
+            return 1;
+        }
+        int64_t step = loop_step(stmt_for).value();
+        TokenType comp = as_comparison(stmt_for->condition)->comparison->comp.type;
+        bool upwards = comp == TokenType::less_than || comp == TokenType::less_eq;
+        bool downwards = comp == TokenType::greater_than || comp == TokenType::greater_eq;
+        if (!(upwards && step > 0) && !(downwards && step < 0)) {
+            return 1;
+        }
+        size_t factor = std::max<size_t>(m_options.unroll_factor, 1);
+        if ((static_cast<int64_t>(factor) - 1) * step > INT32_MAX || (static_cast<int64_t>(factor) - 1) * step < INT32_MIN) {
+            return 1;
+        }
+        return factor;
+    }
+
+    // Deepest nesting of counted for-loops, i.e. how many induction variable registers the code uses.
+    static size_t count_loop_regs(const std::vector<NodeStmt*>& stmts)
+    {
+        size_t max = 0;
+        for (const NodeStmt* stmt : stmts) {
+            if (std::holds_alternative<NodeStmtFun*>(stmt->var)) {
+                continue;
+            }
+            size_t own = std::holds_alternative<NodeStmtFor*>(stmt->var) && loop_step(std::get<NodeStmtFor*>(stmt->var)) ? 1 : 0;
+            for_each_body(stmt, [&](const std::vector<NodeStmt*>& body) {
+                max = std::max(max, own + count_loop_regs(body));
+            });
+            max = std::max(max, own);
+        }
+        return std::min(max, iv_regs.size());
+    }
+
+    // Number of slots a statement list needs at most at the same time. Mirrors the
+    // scopes the generator opens: every body gets its own, a for-loop's `let` lives
+    // in the enclosing one.
+    static size_t count_slots(const std::vector<NodeStmt*>& stmts)
+    {
+        size_t live = 0;
+        size_t max = 0;
+        for (const NodeStmt* stmt : stmts) {
+            if (std::holds_alternative<NodeStmtLet*>(stmt->var)) {
+                live++;
+            } else if (std::holds_alternative<NodeStmtFor*>(stmt->var)
+                       && std::holds_alternative<NodeStmtLet*>(std::get<NodeStmtFor*>(stmt->var)->init)) {
+                live++;
+            }
+            max = std::max(max, live);
+            if (std::holds_alternative<NodeStmtIf*>(stmt->var)) {
+                // elif arms are NodeStmtIf themselves, only their body opens a scope
+                for (const NodeStmt* elif : std::get<NodeStmtIf*>(stmt->var)->elif_body) {
+                    max = std::max(max, live + count_slots(std::get<NodeStmtIf*>(elif->var)->body));
+                }
+                max = std::max(max, live + count_slots(std::get<NodeStmtIf*>(stmt->var)->body));
+                max = std::max(max, live + count_slots(std::get<NodeStmtIf*>(stmt->var)->else_body));
+            } else if (!std::holds_alternative<NodeStmtFun*>(stmt->var)) {
+                for_each_body(stmt, [&](const std::vector<NodeStmt*>& body) {
+                    max = std::max(max, live + count_slots(body));
+                });
+            }
+        }
+        return max;
+    }
+
+    // true if the statements never call, a leaf function may run without frame pointer
+    static bool is_leaf(const std::vector<NodeStmt*>& stmts)
+    {
+        bool leaf = true;
+        for (const NodeStmt* stmt : stmts) {
+            leaf = leaf && !std::holds_alternative<NodeStmtPrint*>(stmt->var);
+            for_each_expr(stmt, [&](const NodeExpr* expr) { leaf = leaf && !has_call(expr); });
+            for_each_body(stmt, [&](const std::vector<NodeStmt*>& body) { leaf = leaf && is_leaf(body); });
+        }
+        return leaf;
+    }
+
+    // System V integer argument registers. rbx, rbp and r12-r15 are callee-saved, generated
+    // code only uses r12-r15 for loop induction variables and saves them when it does
+    inline static const std::array<std::string, 6> arg_regs = { "rdi", "rsi", "rdx", "rcx", "r8", "r9" };
+    inline static const std::array<std::string, 4> iv_regs = { "r12", "r13", "r14", "r15" };
+
+    // size limits, in statement and expression nodes, for the copies of a loop body unrolling makes
+    static constexpr size_t unroll_budget = 128;
+    static constexpr uint64_t max_full_unroll = 32;
+
+    static constexpr size_t output_buffer_size = 64 * 1024;
+
+    // if/elif chains shorter than this are tested arm by arm, the largest table a dense one may get
+    static constexpr size_t min_switch_arms = 4;
+    static constexpr uint64_t max_jump_table = 1024;
+
+    // slots in the result table of each memoized function
+    static constexpr size_t memo_slot_bits = 12;
+    static constexpr size_t memo_slots = size_t { 1 } << memo_slot_bits;
+
     std::string generate_label(const std::string& base) {
-        static int label_counter = 0;
-        return base + "_" + std::to_string(label_counter++);
+        return m_label_prefix + base + "_" + std::to_string(m_label_counter++);
     }
 
     const NodeProg m_prog;
+    const CallGraph m_call_graph;
+    const Options m_options;
+    const Linkage m_linkage;
+    std::ostream& m_log;
+    const bool m_uses_print;        // the code prints, or is a module and shares the output buffer with others that might
+    const NodeStmtFun* m_fun = nullptr;     // function being generated, null in _start
+    Frame m_frame;
     std::stringstream m_output;
-    size_t m_stack_size = 0;
+    std::stringstream m_rodata;     // jump tables
+    std::stringstream m_bss;        // output buffer, memo tables
+    size_t m_temp_depth = 0;    // expression temporaries currently pushed on top of the frame
+    size_t m_iv_depth = 0;      // induction variable registers in use by the enclosing loops
+    size_t m_label_counter = 0;
+    std::string m_label_prefix;     // the function of an incremental chunk
     std::vector<Var> m_vars {};
     std::vector<size_t> m_scopes {};
 };
\ No newline at end of file
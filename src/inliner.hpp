@@ -0,0 +1,195 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "folding.hpp"
+
+// Replaces calls to small functions of the form `fun f(..) { return expr; }` with
+// expr, parameters substituted by the call arguments. Calls are inlined bottom up
+// and folded right away, so add(100, add(10,1)) becomes 111.
+class Inliner {
+public:
+    inline explicit Inliner(NodeProg& prog, ArenaAllocator& allocator)
+        : m_prog(prog), m_allocator(allocator), m_folder(allocator)
+    {
+        for (NodeStmt* stmt : m_prog.stmts) {
+            if (std::holds_alternative<NodeStmtFun*>(stmt->var)) {
+                NodeStmtFun* stmt_fun = std::get<NodeStmtFun*>(stmt->var);
+                m_funs[stmt_fun->ident.value.value()] = stmt_fun;
+            }
+        }
+    }
+
+    void run()
+    {
+        inline_stmts(m_prog.stmts);
+    }
+
+private:
+    // Upper bound for the size (in expression nodes) of an inlined body after
+    // parameters are substituted. A call costs about that much in pushes, the
+    // call itself and the callee's frame setup.
+    static constexpr size_t inline_budget = 16;
+
+    void inline_stmts(std::vector<NodeStmt*>& stmts)
+    {
+        for (NodeStmt* stmt : stmts) {
+            if (std::holds_alternative<NodeStmtFun*>(stmt->var)) {
+                m_stack.push_back(std::get<NodeStmtFun*>(stmt->var)->ident.value.value());
+            }
+            for_each_expr(stmt, [&](NodeExpr* expr) { inline_expr(expr); });
+            for_each_body(stmt, [&](std::vector<NodeStmt*>& body) { inline_stmts(body); });
+            if (std::holds_alternative<NodeStmtFun*>(stmt->var)) {
+                m_stack.pop_back();
+            }
+        }
+    }
+
+    void inline_expr(NodeExpr* expr)
+    {
+        for_each_operand(expr, [&](NodeExpr* operand) { inline_expr(operand); });
+
+        if (!std::holds_alternative<NodeTerm*>(expr->var)
+            || !std::holds_alternative<NodeTermFunCall*>(std::get<NodeTerm*>(expr->var)->var)) {
+            m_folder.fold_expr(expr);
+            return;
+        }
+        const NodeTermFunCall* fun_call = std::get<NodeTermFunCall*>(std::get<NodeTerm*>(expr->var)->var);
+        const std::string& name = fun_call->ident.value.value();
+
+        // recursion guard, covers self and mutual recursion through inlined bodies
+        if (std::find(m_stack.begin(), m_stack.end(), name) != m_stack.end()) {
+            return;
+        }
+        auto it = m_funs.find(name);
+        if (it == m_funs.end()) {
+            return;
+        }
+        const NodeStmtFun* stmt_fun = it->second;
+        if (stmt_fun->params.size() != fun_call->args.size() || stmt_fun->body->stmts.size() != 1
+            || !std::holds_alternative<NodeStmtReturn*>(stmt_fun->body->stmts.front()->var)) {
+            return;
+        }
+        const NodeExpr* body = std::get<NodeStmtReturn*>(stmt_fun->body->stmts.front()->var)->expr;
+        bool only_params = true;
+        for_each_ident(body, [&](const std::string& ident) {
+            only_params = only_params && std::any_of(stmt_fun->params.begin(), stmt_fun->params.end(),
+                [&](const Token& param) { return param.value.value() == ident; });
+        });
+        if (!only_params) {
+            return;     // the callee can't see the caller's variables, leave the error to the generator
+        }
+
+        std::unordered_map<std::string, const NodeExpr*> args;
+        size_t inlined_size = expr_size(body);
+        size_t args_with_effects = 0;
+        for (size_t i = 0; i < stmt_fun->params.size(); i++) {
+            const std::string& param = stmt_fun->params[i].value.value();
+            const NodeExpr* arg = fun_call->args[i];
+            size_t uses = count_uses(body, param);
+            if (has_side_effects(arg)) {
+                // calls and traps must still happen exactly once, and before anything the body does
+                if (uses != 1 || count_unconditional_uses(body, param) != 1 || ++args_with_effects > 1
+                    || has_side_effects(body)) {
+                    return;
+                }
+            }
+            inlined_size += uses * expr_size(arg) - uses;
+            args[param] = arg;
+        }
+        if (inlined_size > inline_budget) {
+            return;
+        }
+
+        NodeExpr* inlined = clone_expr(body, args);
+        m_stack.push_back(name);
+        inline_expr(inlined);
+        m_stack.pop_back();
+        expr->var = inlined->var;
+    }
+
+    // uses of name that are evaluated whenever expr is: not on the right of && or ||, and not under !
+    static size_t count_unconditional_uses(const NodeExpr* expr, const std::string& name)
+    {
+        if (std::holds_alternative<NodeBinExpr*>(expr->var)) {
+            const NodeBinExpr* bin_expr = std::get<NodeBinExpr*>(expr->var);
+            if (std::holds_alternative<NodeBinExprAnd*>(bin_expr->var)) {
+                return count_unconditional_uses(std::get<NodeBinExprAnd*>(bin_expr->var)->lhs, name);
+            }
+            if (std::holds_alternative<NodeBinExprOr*>(bin_expr->var)) {
+                return count_unconditional_uses(std::get<NodeBinExprOr*>(bin_expr->var)->lhs, name);
+            }
+        } else if (std::holds_alternative<NodeTermNot*>(std::get<NodeTerm*>(expr->var)->var)) {
+            return 0;
+        } else if (std::holds_alternative<NodeTermIdent*>(std::get<NodeTerm*>(expr->var)->var)) {
+            return std::get<NodeTermIdent*>(std::get<NodeTerm*>(expr->var)->var)->ident.value.value() == name;
+        }
+        size_t uses = 0;
+        for_each_operand(expr, [&](const NodeExpr* operand) { uses += count_unconditional_uses(operand, name); });
+        return uses;
+    }
+
+    NodeExpr* clone_expr(const NodeExpr* expr, const std::unordered_map<std::string, const NodeExpr*>& args)
+    {
+        auto clone = m_allocator.alloc<NodeExpr>();
+        if (std::holds_alternative<NodeBinExpr*>(expr->var)) {
+            auto bin_expr = m_allocator.alloc<NodeBinExpr>();
+            std::visit([&](const auto* bin) {
+                auto bin_clone = m_allocator.alloc<std::remove_const_t<std::remove_pointer_t<decltype(bin)>>>();
+                *bin_clone = *bin;
+                bin_clone->lhs = clone_expr(bin->lhs, args);
+                bin_clone->rhs = clone_expr(bin->rhs, args);
+                bin_expr->var = bin_clone;
+            }, std::get<NodeBinExpr*>(expr->var)->var);
+            clone->var = bin_expr;
+            return clone;
+        }
+
+        const NodeTerm* term = std::get<NodeTerm*>(expr->var);
+        auto term_clone = m_allocator.alloc<NodeTerm>();
+        if (std::holds_alternative<NodeTermIdent*>(term->var)) {
+            auto it = args.find(std::get<NodeTermIdent*>(term->var)->ident.value.value());
+            if (it != args.end()) {
+                // arguments are parenthesised so they keep binding as one operand
+                auto paren = m_allocator.alloc<NodeTermParen>();
+                paren->expr = clone_expr(it->second, {});
+                term_clone->var = paren;
+            } else {
+                auto ident = m_allocator.alloc<NodeTermIdent>();
+                *ident = *std::get<NodeTermIdent*>(term->var);
+                term_clone->var = ident;
+            }
+        } else if (std::holds_alternative<NodeTermIntLit*>(term->var)) {
+            auto int_lit = m_allocator.alloc<NodeTermIntLit>();
+            *int_lit = *std::get<NodeTermIntLit*>(term->var);
+            term_clone->var = int_lit;
+        } else if (std::holds_alternative<NodeTermParen*>(term->var)) {
+            auto paren = m_allocator.alloc<NodeTermParen>();
+            paren->expr = clone_expr(std::get<NodeTermParen*>(term->var)->expr, args);
+            term_clone->var = paren;
+        } else if (std::holds_alternative<NodeTermNot*>(term->var)) {
+            auto term_not = m_allocator.alloc<NodeTermNot>();
+            term_not->expr = clone_expr(std::get<NodeTermNot*>(term->var)->expr, args);
+            term_clone->var = term_not;
+        } else {
+            const NodeTermFunCall* fun_call = std::get<NodeTermFunCall*>(term->var);
+            auto call_clone = m_allocator.alloc<NodeTermFunCall>();
+            call_clone->ident = fun_call->ident;
+            for (const NodeExpr* arg : fun_call->args) {
+                call_clone->args.push_back(clone_expr(arg, args));
+            }
+            term_clone->var = call_clone;
+        }
+        clone->var = term_clone;
+        return clone;
+    }
+
+    NodeProg& m_prog;
+    ArenaAllocator& m_allocator;
+    ConstantFolder m_folder;
+    std::unordered_map<std::string, NodeStmtFun*> m_funs;
+    std::vector<std::string> m_stack;   // functions currently being inlined into
+};
@@ -0,0 +1,422 @@
+#pragma once
+
+#include <cstdio>
+#include <memory>
+
+#include "bytecode.hpp"
+
+// Runs Bytecode (--interpret and .ogb files). Dispatch is threaded: every handler ends
+// in its own indirect jump through a table of label addresses (GNU computed goto), so
+// the branch predictor sees one jump per instruction pair instead of one shared switch.
+// Frames and operand stacks share one preallocated stack of 64 bit values.
+class Interpreter {
+public:
+    inline explicit Interpreter(const Bytecode& bytecode)
+        : m_bytecode(bytecode)
+    {
+        for (const BytecodeFunction& function : m_bytecode.functions) {
+            check(function);
+        }
+    }
+
+    // runs the program and returns its exit status, output goes to stdout
+    int run()
+    {
+        static constexpr void* dispatch[] = {
+            &&op_push_const, &&op_load, &&op_store, &&op_add, &&op_sub, &&op_mul, &&op_div,
+            &&op_eq, &&op_ne, &&op_lt, &&op_gt, &&op_le, &&op_ge, &&op_log_not,
+            &&op_jump, &&op_jump_if_zero, &&op_jump_if_not_zero,
+            &&op_call, &&op_tail_call, &&op_ret, &&op_print, &&op_exit,
+            &&op_add_const_store, &&op_add_slot_store, &&op_sub_slot_store,
+            &&op_jump_if_eq, &&op_jump_if_ne, &&op_jump_if_lt, &&op_jump_if_gt, &&op_jump_if_le, &&op_jump_if_ge,
+        };
+        static_assert(std::size(dispatch) == static_cast<size_t>(Op::count));
+
+        std::unique_ptr<int64_t[]> stack(new int64_t[stack_size]);
+        int64_t* const limit = stack.get() + stack_size;
+        std::vector<Frame> frames;
+
+        const BytecodeFunction* function = &m_bytecode.functions[0];
+        const uint8_t* code = function->code.data();
+        const uint8_t* pc = code;
+        int64_t* fp = stack.get();
+        int64_t* sp = fp + function->slots;
+        if (sp + function->max_stack > limit) {
+            overflow();
+        }
+        int64_t a;
+        int64_t b;
+        int status;
+
+#define NEXT() goto* dispatch[*pc++]
+#define BINARY(expr) \
+    b = *--sp;       \
+    a = sp[-1];      \
+    sp[-1] = (expr); \
+    NEXT()
+#define COMPARE_JUMP(cond)                                    \
+    b = *--sp;                                                \
+    a = *--sp;                                                \
+    pc = (cond) ? code + read<uint32_t>(pc) : pc + sizeof(uint32_t); \
+    NEXT()
+
+        NEXT();
+
+    op_push_const:
+        *sp++ = read<int64_t>(pc);
+        pc += sizeof(int64_t);
+        NEXT();
+    op_load:
+        *sp++ = fp[read<uint16_t>(pc)];
+        pc += sizeof(uint16_t);
+        NEXT();
+    op_store:
+        fp[read<uint16_t>(pc)] = *--sp;
+        pc += sizeof(uint16_t);
+        NEXT();
+    op_add:
+        BINARY(static_cast<int64_t>(static_cast<uint64_t>(a) + static_cast<uint64_t>(b)));
+    op_sub:
+        BINARY(static_cast<int64_t>(static_cast<uint64_t>(a) - static_cast<uint64_t>(b)));
+    op_mul:
+        BINARY(static_cast<int64_t>(static_cast<uint64_t>(a) * static_cast<uint64_t>(b)));
+    op_div:
+        b = *--sp;
+        if (b == 0) {
+            flush();
+            std::cerr << "Division by zero" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        sp[-1] = static_cast<int64_t>(static_cast<uint64_t>(sp[-1]) / static_cast<uint64_t>(b));
+        NEXT();
+    op_eq:
+        BINARY(a == b);
+    op_ne:
+        BINARY(a != b);
+    op_lt:
+        BINARY(a < b);
+    op_gt:
+        BINARY(a > b);
+    op_le:
+        BINARY(a <= b);
+    op_ge:
+        BINARY(a >= b);
+    op_log_not:
+        sp[-1] = sp[-1] == 0;
+        NEXT();
+    op_jump:
+        pc = code + read<uint32_t>(pc);
+        NEXT();
+    op_jump_if_zero:
+        pc = *--sp == 0 ? code + read<uint32_t>(pc) : pc + sizeof(uint32_t);
+        NEXT();
+    op_jump_if_not_zero:
+        pc = *--sp != 0 ? code + read<uint32_t>(pc) : pc + sizeof(uint32_t);
+        NEXT();
+    op_call:
+        frames.push_back({ function, pc + sizeof(uint16_t), fp });
+        function = &m_bytecode.functions[read<uint16_t>(pc)];
+        fp = sp - function->params;
+        goto enter;
+    op_tail_call:
+        // the arguments replace the current frame
+        function = &m_bytecode.functions[read<uint16_t>(pc)];
+        std::memmove(fp, sp - function->params, function->params * sizeof(int64_t));
+        goto enter;
+    enter:
+        sp = fp + function->slots;
+        if (sp + function->max_stack > limit) {
+            overflow();
+        }
+        code = function->code.data();
+        pc = code;
+        NEXT();
+    op_ret:
+        a = sp[-1];
+        if (frames.empty()) {
+            // a return at the top level ends the program
+            status = static_cast<int>(a & 0xFF);
+            goto done;
+        }
+        sp = fp;
+        *sp++ = a;
+        function = frames.back().function;
+        code = function->code.data();
+        pc = frames.back().return_pc;
+        fp = frames.back().fp;
+        frames.pop_back();
+        NEXT();
+    op_print:
+        print(*--sp);
+        NEXT();
+    op_exit:
+        status = static_cast<int>(sp[-1] & 0xFF);
+        goto done;
+    op_add_const_store:
+        a = read<int64_t>(pc + sizeof(uint16_t));
+        fp[read<uint16_t>(pc)] = static_cast<int64_t>(static_cast<uint64_t>(fp[read<uint16_t>(pc)]) + static_cast<uint64_t>(a));
+        pc += sizeof(uint16_t) + sizeof(int64_t);
+        NEXT();
+    op_add_slot_store:
+        b = fp[read<uint16_t>(pc + sizeof(uint16_t))];
+        fp[read<uint16_t>(pc)] = static_cast<int64_t>(static_cast<uint64_t>(fp[read<uint16_t>(pc)]) + static_cast<uint64_t>(b));
+        pc += 2 * sizeof(uint16_t);
+        NEXT();
+    op_sub_slot_store:
+        b = fp[read<uint16_t>(pc + sizeof(uint16_t))];
+        fp[read<uint16_t>(pc)] = static_cast<int64_t>(static_cast<uint64_t>(fp[read<uint16_t>(pc)]) - static_cast<uint64_t>(b));
+        pc += 2 * sizeof(uint16_t);
+        NEXT();
+    op_jump_if_eq:
+        COMPARE_JUMP(a == b);
+    op_jump_if_ne:
+        COMPARE_JUMP(a != b);
+    op_jump_if_lt:
+        COMPARE_JUMP(a < b);
+    op_jump_if_gt:
+        COMPARE_JUMP(a > b);
+    op_jump_if_le:
+        COMPARE_JUMP(a <= b);
+    op_jump_if_ge:
+        COMPARE_JUMP(a >= b);
+
+#undef COMPARE_JUMP
+#undef BINARY
+#undef NEXT
+
+    done:
+        flush();
+        return status;
+    }
+
+private:
+    struct Frame {
+        const BytecodeFunction* function;
+        const uint8_t* return_pc;
+        int64_t* fp;
+    };
+
+    static constexpr size_t stack_size = 1 << 20;     // values, 8MB like a default thread stack
+    static constexpr size_t output_buffer_size = 1 << 16;
+
+    template <typename T>
+    static T read(const uint8_t* at)
+    {
+        T value;
+        std::memcpy(&value, at, sizeof(T));
+        return value;
+    }
+
+    // Bytecode from a file is only trusted as far as this goes: every instruction must be
+    // complete, jumps must land on instructions and slots and functions must exist. Then
+    // every path from the entry is followed to find the operand stack depth at each
+    // instruction, which must never go below what the instruction takes or above
+    // max_stack, and must be the same on every path into a join point.
+    void check(const BytecodeFunction& function) const
+    {
+        std::vector<uint8_t> sizes(function.code.size() + 1, 0);     // non-zero where an instruction starts
+        std::vector<uint32_t> targets;
+        size_t at = 0;
+        Op last = Op::count;
+        auto fail = [&] {
+            std::cerr << "Invalid bytecode in " << function.name << std::endl;
+            exit(EXIT_FAILURE);
+        };
+        auto slot = [&](size_t offset) {
+            if (read<uint16_t>(function.code.data() + offset) >= function.slots) {
+                fail();
+            }
+        };
+        while (at < function.code.size()) {
+            auto op = static_cast<Op>(function.code[at]);
+            size_t size = 1;
+            switch (op) {
+                case Op::push_const: size += sizeof(int64_t); break;
+                case Op::load:
+                case Op::store:
+                case Op::call:
+                case Op::tail_call: size += sizeof(uint16_t); break;
+                case Op::jump:
+                case Op::jump_if_zero:
+                case Op::jump_if_not_zero:
+                case Op::jump_if_eq:
+                case Op::jump_if_ne:
+                case Op::jump_if_lt:
+                case Op::jump_if_gt:
+                case Op::jump_if_le:
+                case Op::jump_if_ge: size += sizeof(uint32_t); break;
+                case Op::add_const_store: size += sizeof(uint16_t) + sizeof(int64_t); break;
+                case Op::add_slot_store:
+                case Op::sub_slot_store: size += 2 * sizeof(uint16_t); break;
+                default:
+                    if (op >= Op::count) {
+                        fail();
+                    }
+                    break;
+            }
+            if (at + size > function.code.size()) {
+                fail();
+            }
+            sizes[at] = static_cast<uint8_t>(size);
+            switch (op) {
+                case Op::load:
+                case Op::store:
+                case Op::add_const_store: slot(at + 1); break;
+                case Op::add_slot_store:
+                case Op::sub_slot_store:
+                    slot(at + 1);
+                    slot(at + 1 + sizeof(uint16_t));
+                    break;
+                case Op::call:
+                case Op::tail_call:
+                    if (read<uint16_t>(function.code.data() + at + 1) >= m_bytecode.functions.size()) {
+                        fail();
+                    }
+                    break;
+                default:
+                    if (size == 1 + sizeof(uint32_t)) {
+                        targets.push_back(read<uint32_t>(function.code.data() + at + 1));
+                    }
+                    break;
+            }
+            at += size;
+            last = op;
+        }
+        // the code has to end in something that doesn't fall through
+        if (last != Op::jump && last != Op::ret && last != Op::tail_call && last != Op::exit) {
+            fail();
+        }
+        for (uint32_t target : targets) {
+            if (target >= function.code.size() || !sizes[target]) {
+                fail();
+            }
+        }
+
+        std::vector<int64_t> depths(function.code.size(), -1);
+        std::vector<size_t> pending;
+        auto reach = [&](size_t to, int64_t depth) {
+            if (depths[to] == -1) {
+                depths[to] = depth;
+                pending.push_back(to);
+            } else if (depths[to] != depth) {
+                fail();
+            }
+        };
+        reach(0, 0);
+        while (!pending.empty()) {
+            at = pending.back();
+            pending.pop_back();
+            auto op = static_cast<Op>(function.code[at]);
+            int64_t takes = 0;
+            int64_t leaves = 0;
+            bool jumps = false;
+            bool falls_through = true;
+            switch (op) {
+                case Op::push_const:
+                case Op::load: leaves = 1; break;
+                case Op::store:
+                case Op::print: takes = 1; break;
+                case Op::jump_if_zero:
+                case Op::jump_if_not_zero:
+                    takes = 1;
+                    jumps = true;
+                    break;
+                case Op::add:
+                case Op::sub:
+                case Op::mul:
+                case Op::div:
+                case Op::eq:
+                case Op::ne:
+                case Op::lt:
+                case Op::gt:
+                case Op::le:
+                case Op::ge:
+                    takes = 2;
+                    leaves = 1;
+                    break;
+                case Op::log_not:
+                    takes = 1;
+                    leaves = 1;
+                    break;
+                case Op::jump:
+                    jumps = true;
+                    falls_through = false;
+                    break;
+                case Op::call:
+                    takes = m_bytecode.functions[read<uint16_t>(function.code.data() + at + 1)].params;
+                    leaves = 1;
+                    break;
+                case Op::tail_call:
+                    takes = m_bytecode.functions[read<uint16_t>(function.code.data() + at + 1)].params;
+                    falls_through = false;
+                    break;
+                case Op::ret:
+                case Op::exit:
+                    takes = 1;
+                    falls_through = false;
+                    break;
+                case Op::jump_if_eq:
+                case Op::jump_if_ne:
+                case Op::jump_if_lt:
+                case Op::jump_if_gt:
+                case Op::jump_if_le:
+                case Op::jump_if_ge:
+                    takes = 2;
+                    jumps = true;
+                    break;
+                default: break;     // the other superinstructions only touch slots
+            }
+            int64_t depth = depths[at];
+            if (depth < takes) {
+                fail();
+            }
+            depth += leaves - takes;
+            if (depth > function.max_stack) {
+                fail();
+            }
+            if (jumps) {
+                reach(read<uint32_t>(function.code.data() + at + 1), depth);
+            }
+            if (falls_through) {
+                reach(at + sizes[at], depth);
+            }
+        }
+    }
+
+    [[noreturn]] void overflow()
+    {
+        flush();
+        std::cerr << "Stack overflow" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    void print(int64_t value)
+    {
+        char digits[21];
+        char* end = digits + sizeof(digits);
+        char* begin = end;
+        uint64_t magnitude = value < 0 ? 0ULL - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+        do {
+            *--begin = static_cast<char>('0' + magnitude % 10);
+            magnitude /= 10;
+        } while (magnitude);
+        if (value < 0) {
+            *--begin = '-';
+        }
+        m_output.append(begin, end);
+        m_output.push_back('\n');
+        if (m_output.size() >= output_buffer_size) {
+            flush();
+        }
+    }
+
+    void flush()
+    {
+        std::fwrite(m_output.data(), 1, m_output.size(), stdout);
+        std::fflush(stdout);
+        m_output.clear();
+    }
+
+    const Bytecode& m_bytecode;
+    std::string m_output;
+};
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <cerrno>
+#include <csetjmp>
+#include <csignal>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "assembler.hpp"
+
+// Runs generated code inside the compiler (--run). The assembly is encoded into mmap'ed
+// memory together with some glue: _jit_enter saves the host's callee-saved registers and
+// stack pointer and jumps to _start, and every syscall instruction calls _jit_syscall
+// instead. That hands writes to the host, which passes them on to its stream as they
+// come, and turns exit into a return from _jit_enter with the exit code. Nothing touches
+// the file system. A division by zero or a stack overflow is caught and reported the way
+// the interpreter does, after the output the program still had buffered.
+class Jit {
+public:
+    // the program's stdout goes to out
+    inline explicit Jit(std::ostream& out)
+        : m_out(out)
+    {
+    }
+
+    // assembles asm_source, runs it and returns its exit status
+    int run(const std::string& asm_source)
+    {
+        Assembler assembler("_jit_syscall");
+        assembler.assemble(asm_source);
+        assembler.assemble(glue());
+
+        using SectionId = Assembler::SectionId;
+        const SectionId order[] = { SectionId::text, SectionId::rodata, SectionId::data, SectionId::bss };
+        const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        size_t offsets[4] = {};
+        size_t total = 0;
+        for (SectionId id : order) {
+            offsets[static_cast<size_t>(id)] = total;
+            total += (assembler.section(id).size + page - 1) / page * page;
+        }
+        void* memory = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            std::cerr << "Could not map memory for the program" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        auto* base = static_cast<uint8_t*>(memory);
+        for (SectionId id : order) {
+            const Assembler::Section& section = assembler.section(id);
+            std::memcpy(base + offsets[static_cast<size_t>(id)], section.bytes.data(), section.bytes.size());
+        }
+
+        auto find = [&](const std::string& label) -> uint8_t* {
+            auto it = assembler.symbols().find(label);
+            if (it == assembler.symbols().end()) {
+                return nullptr;
+            }
+            return base + offsets[static_cast<size_t>(it->second.section)] + it->second.offset;
+        };
+        auto address_of = [&](const std::string& label) {
+            uint8_t* address = find(label);
+            if (!address) {
+                std::cerr << "Undefined label: " << label << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            return address;
+        };
+        for (const Assembler::Fixup& fixup : assembler.fixups()) {
+            uint8_t* at = base + offsets[static_cast<size_t>(fixup.section)] + fixup.offset;
+            uint8_t* target = address_of(fixup.label);
+            if (fixup.absolute) {
+                auto value = reinterpret_cast<uint64_t>(target);
+                std::memcpy(at, &value, sizeof(value));
+                continue;
+            }
+            int32_t addend;
+            std::memcpy(&addend, at, sizeof(addend));
+            int64_t value = (target + addend) - (base + offsets[static_cast<size_t>(fixup.section)] + fixup.end);
+            auto rel = static_cast<int32_t>(value);
+            std::memcpy(at, &rel, sizeof(rel));
+        }
+
+        // code may run but not be written, constants may only be read
+        if (mprotect(base + offsets[static_cast<size_t>(SectionId::text)], offsets[static_cast<size_t>(SectionId::rodata)], PROT_READ | PROT_EXEC) != 0
+            || mprotect(base + offsets[static_cast<size_t>(SectionId::rodata)],
+                   offsets[static_cast<size_t>(SectionId::data)] - offsets[static_cast<size_t>(SectionId::rodata)], PROT_READ) != 0) {
+            std::cerr << "Could not protect the program's memory: " << std::strerror(errno) << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        Jit* outer = t_current;
+        t_current = this;
+        auto enter = reinterpret_cast<int64_t (*)()>(address_of("_jit_enter"));
+        int64_t code;
+        {
+            FaultHandlers handlers;
+            int signal = sigsetjmp(m_fault, 1);
+            if (signal == 0) {
+                code = enter();
+            } else {
+                // what print had buffered, which the program would have written at exit
+                uint8_t* buffer = find("_out_buf");
+                uint8_t* length = find("_out_len");
+                if (buffer && length) {
+                    int64_t size;
+                    std::memcpy(&size, length, sizeof(size));
+                    m_out.write(reinterpret_cast<const char*>(buffer), size);
+                }
+                m_out.flush();
+                std::cerr << (signal == SIGFPE ? "Division by zero" : "Stack overflow") << std::endl;
+                code = EXIT_FAILURE;
+            }
+        }
+        t_current = outer;
+        munmap(memory, total);
+        return static_cast<int>(code & 0xFF);
+    }
+
+private:
+    // Turns SIGFPE and SIGSEGV into a jump back into run() for as long as it exists. The
+    // handler runs on a stack of its own, the program's may be the one that overflowed.
+    class FaultHandlers {
+    public:
+        FaultHandlers()
+        {
+            stack_t stack { .ss_sp = m_stack.data(), .ss_flags = 0, .ss_size = m_stack.size() };
+            sigaltstack(&stack, &m_old_stack);
+            struct sigaction action {};
+            action.sa_handler = on_fault;
+            action.sa_flags = SA_ONSTACK;
+            sigemptyset(&action.sa_mask);
+            sigaction(SIGFPE, &action, &m_old_fpe);
+            sigaction(SIGSEGV, &action, &m_old_segv);
+        }
+
+        ~FaultHandlers()
+        {
+            sigaction(SIGFPE, &m_old_fpe, nullptr);
+            sigaction(SIGSEGV, &m_old_segv, nullptr);
+            sigaltstack(&m_old_stack, nullptr);
+        }
+
+        FaultHandlers(const FaultHandlers&) = delete;
+        FaultHandlers& operator=(const FaultHandlers&) = delete;
+
+    private:
+        static void on_fault(int signal)
+        {
+            siglongjmp(t_current->m_fault, signal);
+        }
+
+        std::vector<char> m_stack = std::vector<char>(64 * 1024);
+        stack_t m_old_stack {};
+        struct sigaction m_old_fpe {};
+        struct sigaction m_old_segv {};
+    };
+
+    static constexpr int64_t sys_write = 1;
+    static constexpr int64_t sys_exit = 60;
+
+    // the syscalls generated code makes, on behalf of the running program
+    static int64_t host_syscall(int64_t number, int64_t arg0, int64_t arg1, int64_t arg2)
+    {
+        if (number == sys_write && arg0 == STDOUT_FILENO) {
+            // the program only writes when its buffer is full or it exits, so pass it on now
+            t_current->m_out.write(reinterpret_cast<const char*>(arg1), arg2);
+            t_current->m_out.flush();
+            return arg2;
+        }
+        if (number == sys_write) {
+            return -EBADF;
+        }
+        return -ENOSYS;
+    }
+
+    // _jit_syscall keeps every register a syscall keeps, the host function may clobber all
+    // caller-saved ones. exit never reaches the host, it unwinds to _jit_enter's caller.
+    static std::string glue()
+    {
+        std::stringstream glue;
+        glue << "section .text\n";
+        glue << "_jit_enter:\n";
+        for (const char* reg : { "rbx", "rbp", "r12", "r13", "r14", "r15" }) {
+            glue << "    push " << reg << "\n";
+        }
+        glue << "    sub rsp, 8\n";     // _start expects rsp 16 byte aligned like at process start
+        glue << "    mov [rel _jit_host_rsp], rsp\n";
+        glue << "    jmp _start\n";
+
+        glue << "_jit_syscall:\n";
+        glue << "    cmp rax, " << sys_exit << "\n";
+        glue << "    je _jit_exit\n";
+        glue << "    push rbp\n";
+        glue << "    mov rbp, rsp\n";
+        glue << "    and rsp, -16\n";
+        for (const char* reg : { "rdi", "rsi", "rdx", "r8", "r9", "r10" }) {
+            glue << "    push " << reg << "\n";
+        }
+        glue << "    mov rcx, rdx\n";
+        glue << "    mov rdx, rsi\n";
+        glue << "    mov rsi, rdi\n";
+        glue << "    mov rdi, rax\n";
+        glue << "    mov rax, " << reinterpret_cast<uint64_t>(&host_syscall) << "\n";
+        glue << "    call rax\n";
+        for (const char* reg : { "r10", "r9", "r8", "rdx", "rsi", "rdi" }) {
+            glue << "    pop " << reg << "\n";
+        }
+        glue << "    mov rsp, rbp\n";
+        glue << "    pop rbp\n";
+        glue << "    ret\n";
+
+        glue << "_jit_exit:\n";
+        glue << "    mov rax, rdi\n";
+        glue << "    mov rsp, [rel _jit_host_rsp]\n";
+        glue << "    add rsp, 8\n";
+        for (const char* reg : { "r15", "r14", "r13", "r12", "rbp", "rbx" }) {
+            glue << "    pop " << reg << "\n";
+        }
+        glue << "    ret\n";
+
+        glue << "section .bss\n";
+        glue << "_jit_host_rsp: resq 1\n";
+        return glue.str();
+    }
+
+    inline static thread_local Jit* t_current = nullptr;    // the Jit whose program is running
+    std::ostream& m_out;
+    sigjmp_buf m_fault {};      // where a fault in the program goes
+};
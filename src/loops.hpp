@@ -0,0 +1,180 @@
+#pragma once
+
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "folding.hpp"
+
+// Names assigned or declared anywhere inside stmts, including nested loops.
+inline void collect_written(const std::vector<NodeStmt*>& stmts, std::unordered_set<std::string>& written)
+{
+    for (const NodeStmt* stmt : stmts) {
+        if (std::holds_alternative<NodeStmtLet*>(stmt->var)) {
+            written.insert(std::get<NodeStmtLet*>(stmt->var)->ident.value.value());
+        } else if (std::holds_alternative<NodeStmtAssign*>(stmt->var)) {
+            written.insert(std::get<NodeStmtAssign*>(stmt->var)->lhs->ident.value.value());
+        } else if (std::holds_alternative<NodeStmtFor*>(stmt->var)) {
+            const NodeStmtFor* stmt_for = std::get<NodeStmtFor*>(stmt->var);
+            if (std::holds_alternative<NodeStmtLet*>(stmt_for->init)) {
+                if (const NodeStmtLet* init = std::get<NodeStmtLet*>(stmt_for->init)) {
+                    written.insert(init->ident.value.value());
+                }
+            } else if (const NodeStmtAssign* init = std::get<NodeStmtAssign*>(stmt_for->init)) {
+                written.insert(init->lhs->ident.value.value());
+            }
+            if (stmt_for->change) {
+                written.insert(stmt_for->change->lhs->ident.value.value());
+            }
+        } else if (std::holds_alternative<NodeStmtFun*>(stmt->var)) {
+            continue;   // a nested function has its own variables
+        }
+        for_each_body(stmt, [&](const std::vector<NodeStmt*>& body) { collect_written(body, written); });
+    }
+}
+
+// c if expr is `name + c`, `c + name` or `name - c` (as -c) for a constant c
+inline std::optional<int64_t> increment_of(const std::string& name, const NodeExpr* expr)
+{
+    auto is_var = [&](const NodeExpr* operand) {
+        return std::holds_alternative<NodeTerm*>(operand->var)
+            && std::holds_alternative<NodeTermIdent*>(std::get<NodeTerm*>(operand->var)->var)
+            && std::get<NodeTermIdent*>(std::get<NodeTerm*>(operand->var)->var)->ident.value.value() == name;
+    };
+    if (!std::holds_alternative<NodeBinExpr*>(expr->var)) {
+        return {};
+    }
+    const NodeBinExpr* bin_expr = std::get<NodeBinExpr*>(expr->var);
+    if (std::holds_alternative<NodeBinExprAdd*>(bin_expr->var)) {
+        const NodeBinExprAdd* add = std::get<NodeBinExprAdd*>(bin_expr->var);
+        if (is_var(add->lhs)) {
+            return const_value(add->rhs);
+        }
+        if (is_var(add->rhs)) {
+            return const_value(add->lhs);
+        }
+    } else if (std::holds_alternative<NodeBinExprSub*>(bin_expr->var)) {
+        const NodeBinExprSub* sub = std::get<NodeBinExprSub*>(bin_expr->var);
+        auto step = const_value(sub->rhs);
+        if (is_var(sub->lhs) && step) {
+            return static_cast<int64_t>(0ULL - static_cast<uint64_t>(*step));
+        }
+    }
+    return {};
+}
+
+// Step of a counted for-loop `for(let i = ..; ..; i = i + c)`, with a constant c
+// (or i - c). These keep i in a register and update it with a single add.
+inline std::optional<int64_t> loop_step(const NodeStmtFor* stmt_for)
+{
+    if (!std::holds_alternative<NodeStmtLet*>(stmt_for->init) || !std::get<NodeStmtLet*>(stmt_for->init)
+        || !stmt_for->change || stmt_for->change->lhs->ident.value != std::get<NodeStmtLet*>(stmt_for->init)->ident.value) {
+        return {};
+    }
+    return increment_of(stmt_for->change->lhs->ident.value.value(), stmt_for->change->rhs);
+}
+
+// Moves loop invariant subexpressions of while and for loops into a `let` in front
+// of the loop. An expression is invariant if it makes no calls and reads no variable
+// the loop writes. Hoisted code runs even if the loop body never does, so division is
+// only hoisted by non-zero constants and can't introduce a trap.
+class LoopInvariantMotion {
+public:
+    inline explicit LoopInvariantMotion(NodeProg& prog, ArenaAllocator& allocator)
+        : m_prog(prog), m_allocator(allocator)
+    {
+    }
+
+    void run()
+    {
+        hoist_stmts(m_prog.stmts);
+    }
+
+private:
+    void hoist_stmts(std::vector<NodeStmt*>& stmts)
+    {
+        for (size_t i = 0; i < stmts.size(); i++) {
+            NodeStmt* stmt = stmts[i];
+            // inner loops first, what they hoist can then move further out
+            for_each_body(stmt, [&](std::vector<NodeStmt*>& body) { hoist_stmts(body); });
+
+            std::unordered_set<std::string> written;
+            std::vector<NodeStmt*> hoisted;
+            if (std::holds_alternative<NodeStmtWhile*>(stmt->var)) {
+                NodeStmtWhile* stmt_while = std::get<NodeStmtWhile*>(stmt->var);
+                collect_written(stmt_while->body, written);
+                hoist_expr(stmt_while->condition, written, hoisted);
+                hoist_body(stmt_while->body, written, hoisted);
+            } else if (std::holds_alternative<NodeStmtFor*>(stmt->var)) {
+                NodeStmtFor* stmt_for = std::get<NodeStmtFor*>(stmt->var);
+                collect_written({ stmt }, written);
+                hoist_expr(stmt_for->condition, written, hoisted);
+                if (stmt_for->change) {
+                    hoist_expr(stmt_for->change->rhs, written, hoisted);
+                }
+                hoist_body(stmt_for->body, written, hoisted);
+            }
+            stmts.insert(stmts.begin() + i, hoisted.begin(), hoisted.end());
+            i += hoisted.size();
+        }
+    }
+
+    void hoist_body(std::vector<NodeStmt*>& stmts, const std::unordered_set<std::string>& written, std::vector<NodeStmt*>& hoisted)
+    {
+        for (NodeStmt* stmt : stmts) {
+            if (std::holds_alternative<NodeStmtFun*>(stmt->var)) {
+                continue;
+            }
+            for_each_expr(stmt, [&](NodeExpr* expr) { hoist_expr(expr, written, hoisted); });
+            for_each_body(stmt, [&](std::vector<NodeStmt*>& body) { hoist_body(body, written, hoisted); });
+        }
+    }
+
+    // replaces the largest invariant subexpressions of expr by a hoisted variable
+    void hoist_expr(NodeExpr* expr, const std::unordered_set<std::string>& written, std::vector<NodeStmt*>& hoisted)
+    {
+        if (!std::holds_alternative<NodeBinExpr*>(expr->var) || !is_invariant(expr, written)) {
+            for_each_operand(expr, [&](NodeExpr* operand) { hoist_expr(operand, written, hoisted); });
+            return;
+        }
+
+        auto stmt_let = m_allocator.alloc<NodeStmtLet>();
+        stmt_let->ident = { .type = TokenType::ident, .value = temp_name("licm", m_counter) };
+        stmt_let->expr = m_allocator.alloc<NodeExpr>();
+        stmt_let->expr->var = expr->var;
+        auto stmt = m_allocator.alloc<NodeStmt>();
+        stmt->var = stmt_let;
+        hoisted.push_back(stmt);
+
+        auto ident = m_allocator.alloc<NodeTermIdent>();
+        ident->ident = stmt_let->ident;
+        auto term = m_allocator.alloc<NodeTerm>();
+        term->var = ident;
+        expr->var = term;
+    }
+
+    static bool is_invariant(const NodeExpr* expr, const std::unordered_set<std::string>& written)
+    {
+        if (std::holds_alternative<NodeTerm*>(expr->var)) {
+            const NodeTerm* term = std::get<NodeTerm*>(expr->var);
+            if (std::holds_alternative<NodeTermFunCall*>(term->var)) {
+                return false;
+            }
+            if (std::holds_alternative<NodeTermIdent*>(term->var)) {
+                return !written.contains(std::get<NodeTermIdent*>(term->var)->ident.value.value());
+            }
+        } else if (std::holds_alternative<NodeBinExprDiv*>(std::get<NodeBinExpr*>(expr->var)->var)) {
+            auto divisor = const_value(std::get<NodeBinExprDiv*>(std::get<NodeBinExpr*>(expr->var)->var)->rhs);
+            if (!divisor || *divisor == 0) {
+                return false;
+            }
+        }
+        bool invariant = true;
+        for_each_operand(expr, [&](const NodeExpr* operand) { invariant = invariant && is_invariant(operand, written); });
+        return invariant;
+    }
+
+    NodeProg& m_prog;
+    ArenaAllocator& m_allocator;
+    size_t m_counter = 0;
+};
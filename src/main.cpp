@@ -4,51 +4,201 @@
 #include <sstream>
 #include <vector>
 
-#include "./generation.hpp"
+#include "./compiler.hpp"
+#include "./interpreter.hpp"
+#include "./jit.hpp"
+#include "./modules.hpp"
+#include "./server.hpp"
+#include "./watch.hpp"
 
-#ifdef __linux__
-    #define OS_LINUX
-#endif
-
-int main(int argc, char* argv[])
+int main(int argc, char* argv[]) try
 {
-    if (argc != 2) {
+    Options options;
+    const char* input_path = nullptr;
+    bool run = false;
+    bool interpret = false;
+    const char* bytecode_path = nullptr;
+    bool use_cache = true;
+    bool cache_stats = false;
+    bool server = false;
+    bool client = false;
+    bool watch = false;
+    std::string socket_path = default_socket_path();
+    size_t workers = std::thread::hardware_concurrency();
+    std::vector<std::string> server_args;      // the flags a --client passes on
+    std::optional<Emit> emit;
+    bool emit_ast = false;
+    std::string output_path;
+    bool bad_arg = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (options.parse(arg)) {
+            server_args.push_back(arg);
+        } else if (arg == "--run") {
+            run = true;
+        } else if (arg == "--interpret") {
+            interpret = true;
+        } else if (arg.starts_with("--emit-bytecode=")) {
+            bytecode_path = argv[i] + 16;
+        } else if (arg == "--no-cache") {
+            use_cache = false;
+            server_args.push_back(arg);
+        } else if (arg == "--cache-stats") {
+            cache_stats = true;
+        } else if (arg == "--server") {
+            server = true;
+        } else if (arg == "--client") {
+            client = true;
+        } else if (arg == "--watch") {
+            watch = true;
+        } else if (arg.starts_with("--socket=")) {
+            socket_path = arg.substr(9);
+        } else if (arg == "-o" && i + 1 < argc) {
+            output_path = argv[++i];
+            server_args.insert(server_args.end(), { arg, output_path });
+        } else if (arg == "--emit=ast") {
+            emit_ast = true;
+        } else if (arg.starts_with("--emit=")) {
+            emit = parse_emit(arg.substr(7));
+            bad_arg = bad_arg || !emit;
+            server_args.push_back(arg);
+        } else if (arg.starts_with("--workers=")) {
+            workers = std::strtoul(arg.c_str() + 10, nullptr, 10);
+        } else if (arg.starts_with("-") || input_path) {
+            input_path = nullptr;
+            server = false;
+            break;
+        } else {
+            input_path = argv[i];
+        }
+    }
+    // -g line info names the source by its absolute path, on the server too
+    if (options.debug_info && options.source_name.empty() && input_path) {
+        std::error_code error;
+        options.source_name = std::filesystem::absolute(input_path, error).string();
+        server_args.push_back("--source-name=" + options.source_name);
+    }
+    // --run entries only hold the assembly
+    Cache cache(cache_flags(options) + (run ? " run" : ""));
+    if (cache_stats && !input_path) {
+        cache.print_stats(std::cout);
+        return EXIT_SUCCESS;
+    }
+    if (server && !input_path) {
+        return Server(socket_path, workers).run();
+    }
+    if (!input_path || bad_arg) {
         std::cerr << "Incorrect usage. Correct usage is..." << std::endl;
-        std::cerr << "ogen <input.og>" << std::endl;
+        std::cerr << "ogen [-fomit-frame-pointer] [-g] [--unroll=<n>] [--auto-memo] [--run] [--interpret] [--no-cache] [--cache-stats] [--emit=asm|obj|exe|ast] [-o <output>] [--emit-bytecode=<out.ogb>] [--client] [--socket=<path>] [--watch] <input.og|input.ogb>" << std::endl;
+        std::cerr << "ogen --server [--socket=<path>] [--workers=<n>]" << std::endl;
         return EXIT_FAILURE;
     }
 
+    if (watch) {
+        return Watcher(input_path, options, Target::make(emit, output_path, ".")).run();
+    }
+
+    // compiled bytecode runs without parsing anything
+    if (std::string_view(input_path).ends_with(".ogb")) {
+        std::ifstream input(input_path, std::ios::in | std::ios::binary);
+        std::optional<Bytecode> bytecode = Bytecode::read(input);
+        if (!bytecode.has_value()) {
+            std::cerr << "Not ogen bytecode: " << input_path << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        Interpreter interpreter(bytecode.value());
+        return interpreter.run();
+    }
+
     std::string contents;
     {
         std::stringstream contents_stream;
-        std::fstream input(argv[1], std::ios::in);
+        std::fstream input(input_path, std::ios::in);
         contents_stream << input.rdbuf();
         contents = contents_stream.str();
     }
 
-    Tokenizer tokenizer(std::move(contents));
-    std::vector<Token> tokens = tokenizer.tokenize();
+    ArenaAllocator allocator(arena_size);
 
-    Parser parser(std::move(tokens));
-    std::optional<NodeProg> prog = parser.parse_prog();
+    // the parsed program for other builds to import, next to the source unless -o says otherwise
+    if (emit_ast) {
+        std::filesystem::path ast_path = output_path.empty() ? std::filesystem::path(input_path).replace_extension(".ast") : std::filesystem::path(output_path);
+        AstWriter writer(xxh64::hash(contents));
+        if (!write_file(ast_path, writer.write(parse(contents, allocator)))) {
+            std::cerr << "Could not write " << ast_path.string() << std::endl;
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+    // the cache and the server only know single files, imports are built module by module
+    bool modular = has_imports(contents);
 
-    if (!prog.has_value()) {
-        std::cerr << "Invalid program" << std::endl;
-        exit(EXIT_FAILURE);
+    // the server only builds executables, --run and the bytecode modes stay local
+    if (!run && !interpret && !bytecode_path) {
+        if (modular) {
+            std::vector<Module> modules = ModuleLoader(allocator, std::cout).load(input_path, contents);
+            bool built = build_modules(modules, options, Target::make(emit, output_path, "."), allocator, nullptr, std::cout);
+            return built ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        if (client) {
+            if (std::optional<int> status = compile_on_server(socket_path, contents, server_args)) {
+                return *status;
+            }
+        }
+        bool built = build(contents, options, Target::make(emit, output_path, "."), use_cache ? &cache : nullptr, allocator, nullptr, std::cout);
+        return built ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 
-    Generator generator(prog.value());
-    {
-        std::fstream file("out.asm", std::ios::out);
-        file << generator.gen_prog();
+    // the cache holds the assembly of --run programs, bytecode isn't cached
+    use_cache = use_cache && run && !modular;
+    std::string cache_key = use_cache ? cache.key(contents) : "";
+    if (use_cache) {
+        if (std::optional<std::string> asm_source = cache.load(cache_key, "asm")) {
+            return Jit(std::cout).run(asm_source.value());
+        }
     }
 
-    #ifdef OS_LINUX                       //Untestd. might not work on windows. actaully def wont work on windows. the syscalls are different
-        system("nasm -felf64 out.asm");
-        system("ld -o out out.o");
-    #else
-        std::cout << "Unsupported OS" << std::endl;
-    #endif
+    // with --run and --interpret stdout belongs to the program, the compiler's debug output is dropped
+    NodeProg prog;
+    if (modular) {
+        std::vector<Module> modules = ModuleLoader(allocator).load(input_path, contents);
+        prog = merge_modules(modules, allocator);
+        optimize(prog, allocator);
+    } else {
+        prog = parse_and_optimize(std::move(contents), allocator);
+    }
 
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    if (interpret || bytecode_path) {
+        Bytecode bytecode = BytecodeCompiler(prog).compile();
+        if (bytecode_path) {
+            std::ofstream file(bytecode_path, std::ios::out | std::ios::binary);
+            bytecode.write(file);
+            file.close();
+            if (!file) {
+                std::cerr << "Could not write " << bytecode_path << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        if (!interpret) {
+            return EXIT_SUCCESS;
+        }
+        Interpreter interpreter(bytecode);
+        return interpreter.run();
+    }
+
+    Generator generator(prog, options, {}, null_log());
+    std::string asm_source = generator.gen_prog();
+    if (use_cache) {
+        cache.store(cache_key, "asm", asm_source);
+    }
+    return Jit(std::cout).run(asm_source);
+} catch (const CompileError& error) {
+    std::cerr << error.what() << std::endl;
+    return EXIT_FAILURE;
+} catch (const std::bad_alloc&) {
+    std::cerr << "Program too large" << std::endl;
+    return EXIT_FAILURE;
+} catch (const std::exception& error) {
+    std::cerr << error.what() << std::endl;
+    return EXIT_FAILURE;
+}
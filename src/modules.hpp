@@ -0,0 +1,459 @@
+#pragma once
+
+#include <cctype>
+#include <map>
+#include <set>
+#include <unordered_set>
+
+#include "ast.hpp"
+#include "compiler.hpp"
+
+// Separate compilation. A program whose file imports others (`import "lib.og";`) is
+// built module by module: each file becomes an object of its own in .ogen/ next to the
+// output, along with a fingerprint of everything its code depends on: its source, the
+// compiler, the flags and the interfaces (exported functions and their arities) of the
+// modules it imports. A rebuild only compiles the modules whose fingerprint changed,
+// and links again if any did.
+//
+// Imported files may only hold imports and functions, all of which they export. The
+// imported file is the only one that sees its functions, and imports can't form a cycle.
+
+// true if source imports anything. Looks at the words the way the tokenizer does, without
+// tokenizing, so a cache hit still costs no parse.
+inline bool has_imports(const std::string& source)
+{
+    size_t i = 0;
+    while (i < source.size()) {
+        char c = source[i];
+        if (c == '#') {
+            i = std::min(source.find('\n', i), source.size());
+        } else if (c == '"') {
+            i = std::min(source.find('"', i + 1), source.size()) + 1;
+        } else if (std::isalpha(static_cast<unsigned char>(c))) {
+            size_t start = i;
+            while (i < source.size() && (std::isalnum(static_cast<unsigned char>(source[i])) || source[i] == '_')) {
+                i++;
+            }
+            if (source.compare(start, i - start, "import") == 0) {
+                return true;
+            }
+        } else {
+            i++;
+        }
+    }
+    return false;
+}
+
+inline std::string hash_hex(uint64_t hash)
+{
+    std::stringstream hex;
+    hex << std::hex;
+    hex.width(16);
+    hex.fill('0');
+    hex << hash;
+    return hex.str();
+}
+
+inline std::string hash_hex(std::string_view data)
+{
+    return hash_hex(xxh64::hash(data));
+}
+
+struct Module {
+    std::filesystem::path path;     // canonical
+    uint64_t source_hash = 0;
+    std::optional<NodeProg> prog {};            // parsed, or built from ast when first needed
+    std::shared_ptr<const AstFile> ast {};      // set if it was loaded from its AST file
+    std::vector<size_t> imports {};             // the modules it imports, they come before it
+    std::map<std::string, size_t> interface {}; // exported function -> number of parameters
+    std::vector<std::string> externs {};        // functions of imported modules it calls
+};
+
+inline std::optional<std::string> read_file(const std::filesystem::path& path)
+{
+    std::ifstream input(path, std::ios::in | std::ios::binary);
+    if (!input) {
+        return {};
+    }
+    std::stringstream contents;
+    contents << input.rdbuf();
+    return contents.str();
+}
+
+// Calls fn(const NodeTermFunCall*) for every call in stmts, nested bodies included
+template <typename F>
+inline void for_each_call(const std::vector<NodeStmt*>& stmts, F&& fn)
+{
+    struct Walker {
+        F& fn;
+        void expr(const NodeExpr* expr) const
+        {
+            if (std::holds_alternative<NodeTerm*>(expr->var)
+                && std::holds_alternative<NodeTermFunCall*>(std::get<NodeTerm*>(expr->var)->var)) {
+                fn(std::get<NodeTermFunCall*>(std::get<NodeTerm*>(expr->var)->var));
+            }
+            for_each_operand(expr, [&](const NodeExpr* operand) { this->expr(operand); });
+        }
+        void stmts(const std::vector<NodeStmt*>& stmts) const
+        {
+            for (const NodeStmt* stmt : stmts) {
+                for_each_expr(stmt, [&](const NodeExpr* expr) { this->expr(expr); });
+                for_each_body(stmt, [&](const std::vector<NodeStmt*>& body) { this->stmts(body); });
+            }
+        }
+    };
+    Walker { .fn = fn }.stmts(stmts);
+}
+
+// Calls fn(const NodeStmtFun*) for every function defined in stmts, nested ones included
+template <typename F>
+inline void for_each_fun(const std::vector<NodeStmt*>& stmts, F&& fn)
+{
+    for (const NodeStmt* stmt : stmts) {
+        if (std::holds_alternative<NodeStmtFun*>(stmt->var)) {
+            fn(std::get<NodeStmtFun*>(stmt->var));
+        }
+        for_each_body(stmt, [&](const std::vector<NodeStmt*>& body) { for_each_fun(body, fn); });
+    }
+}
+
+// error about a file other than the one being compiled, with the file in front as in
+// "path:line:column: message"
+inline CompileError error_in(const std::filesystem::path& path, const CompileError& error)
+{
+    std::string message = error.what();
+    return CompileError(path.string() + (!message.empty() && std::isdigit(static_cast<unsigned char>(message.front())) ? ":" : ": ") + message);
+}
+
+// Reads and parses a program's file and everything it imports, directly or not. The
+// modules come in dependency order, the program's own file last. An imported file with
+// an AST file (--emit=ast) newer than itself isn't parsed, its imports and interface are
+// read from the mapped AST.
+class ModuleLoader {
+public:
+    // the debug output of parsing goes to log
+    inline explicit ModuleLoader(ArenaAllocator& allocator, std::ostream& log = null_log())
+        : m_allocator(allocator)
+        , m_log(log)
+    {
+    }
+
+    std::vector<Module> load(const std::filesystem::path& path, const std::string& source)
+    {
+        load_source(canonical(path), source);
+        return std::move(m_modules);
+    }
+
+private:
+    using Functions = std::vector<std::pair<std::string, size_t>>;
+
+    static std::filesystem::path canonical(const std::filesystem::path& path)
+    {
+        std::error_code error;
+        std::filesystem::path result = std::filesystem::weakly_canonical(path, error);
+        return error ? std::filesystem::absolute(path) : result;
+    }
+
+    size_t load_source(const std::filesystem::path& path, const std::string& source)
+    {
+        Module module { .path = path, .source_hash = xxh64::hash(source) };
+        try {
+            module.prog = parse(source, m_allocator, 1, m_log);
+        } catch (const CompileError& error) {
+            throw m_loading.empty() ? error : error_in(path, error);
+        }
+        std::vector<std::string> imports;
+        for (const Token& import : module.prog->imports) {
+            imports.push_back(import.value.value());
+        }
+        std::optional<Functions> functions = Functions {};
+        for (const NodeStmt* stmt : module.prog->stmts) {
+            if (!std::holds_alternative<NodeStmtFun*>(stmt->var)) {
+                functions.reset();
+                break;
+            }
+            const NodeStmtFun* stmt_fun = std::get<NodeStmtFun*>(stmt->var);
+            functions->emplace_back(stmt_fun->ident.value.value(), stmt_fun->params.size());
+        }
+        return add(std::move(module), imports, functions);
+    }
+
+    std::optional<size_t> load_ast(const std::filesystem::path& path)
+    {
+        std::filesystem::path ast_path = path;
+        ast_path.replace_extension(".ast");
+        std::error_code error;
+        auto ast_time = std::filesystem::last_write_time(ast_path, error);
+        if (error) {
+            return {};
+        }
+        auto source_time = std::filesystem::last_write_time(path, error);
+        if (error || ast_time <= source_time) {
+            return {};
+        }
+        auto ast = std::make_shared<const AstFile>(ast_path);
+        std::vector<std::string> imports = ast->imports();
+        std::optional<Functions> functions = ast->functions();
+        if (!ast->ok()) {
+            return {};
+        }
+        return add({ .path = path, .source_hash = ast->source_hash(), .ast = ast }, imports, functions);
+    }
+
+    size_t load_import(const std::filesystem::path& path, const std::filesystem::path& importer)
+    {
+        if (std::optional<size_t> index = load_ast(path)) {
+            return index.value();
+        }
+        std::optional<std::string> source = read_file(path);
+        if (!source) {
+            throw CompileError("Could not read " + path.string() + ", imported by " + importer.string());
+        }
+        return load_source(path, source.value());
+    }
+
+    // loads what module imports, then adds it. functions are its top-level functions,
+    // nothing if it has other statements there
+    size_t add(Module module, const std::vector<std::string>& imports, const std::optional<Functions>& functions)
+    {
+        const std::filesystem::path& path = module.path;
+        m_loading.push_back(path);
+        for (const std::string& import : imports) {
+            std::filesystem::path imported = canonical(path.parent_path() / import);
+            if (std::find(m_loading.begin(), m_loading.end(), imported) != m_loading.end()) {
+                throw CompileError("Import cycle: " + path.string() + " imports " + imported.string());
+            }
+            auto it = m_index.find(imported);
+            if (it == m_index.end()) {
+                it = m_index.emplace(imported, load_import(imported, path)).first;
+            }
+            module.imports.push_back(it->second);
+        }
+        m_loading.pop_back();
+
+        if (!m_loading.empty()) {
+            if (!functions) {
+                throw CompileError("Only functions can be imported, " + path.string() + " has other statements at the top level");
+            }
+            for (const auto& [name, arity] : functions.value()) {
+                if (auto [owner, added] = m_exporters.emplace(name, path); !added) {
+                    throw CompileError("Function " + name + " is defined in both " + owner->second.string() + " and " + path.string());
+                }
+                module.interface[name] = arity;
+            }
+        }
+        m_modules.push_back(std::move(module));
+        return m_modules.size() - 1;
+    }
+
+    ArenaAllocator& m_allocator;
+    std::ostream& m_log;
+    std::vector<Module> m_modules;
+    std::map<std::filesystem::path, size_t> m_index;
+    std::vector<std::filesystem::path> m_loading;               // the chain of imports being read
+    std::map<std::string, std::filesystem::path> m_exporters;   // exported function -> its module
+};
+
+// The nodes of modules[i], built from its AST file the first time they are needed. Its
+// calls are resolved: a call goes to a function of the module itself, else to one of a
+// module it imports. The program's file can't define what it imports, a merged program
+// would have both.
+inline NodeProg& resolve(std::vector<Module>& modules, size_t i, ArenaAllocator& allocator)
+{
+    Module& module = modules[i];
+    if (!module.prog) {
+        module.prog = AstReader(*module.ast, allocator).read();
+        if (!module.prog) {
+            throw CompileError("Damaged AST file for " + module.path.string() + ", emit it again or remove it");
+        }
+    }
+
+    bool main = i == modules.size() - 1;
+    std::unordered_set<std::string> own;
+    for_each_fun(module.prog->stmts, [&](const NodeStmtFun* stmt_fun) {
+        const std::string& name = stmt_fun->ident.value.value();
+        own.insert(name);
+        for (size_t other = 0; main && other < i; other++) {
+            if (modules[other].interface.contains(name)) {
+                throw CompileError("Function " + name + " is defined in both " + modules[other].path.string() + " and " + module.path.string());
+            }
+        }
+    });
+    std::set<std::string> externs;
+    for_each_call(module.prog->stmts, [&](const NodeTermFunCall* fun_call) {
+        const std::string& name = fun_call->ident.value.value();
+        if (own.contains(name)) {
+            return;
+        }
+        for (size_t import : module.imports) {
+            auto it = modules[import].interface.find(name);
+            if (it == modules[import].interface.end()) {
+                continue;
+            }
+            if (it->second != fun_call->args.size()) {
+                throw error_at(fun_call->ident, "Wrong number of arguments for " + name);
+            }
+            externs.insert(name);
+            return;
+        }
+        throw error_at(fun_call->ident, "Unknown function " + name + " in " + module.path.string());
+    });
+    module.externs.assign(externs.begin(), externs.end());
+    return module.prog.value();
+}
+
+// One program out of all modules, for --run and --interpret. No two modules define the
+// same function, so their functions can share one program.
+inline NodeProg merge_modules(std::vector<Module>& modules, ArenaAllocator& allocator)
+{
+    NodeProg prog;
+    for (size_t i = 0; i < modules.size(); i++) {
+        const NodeProg& module_prog = resolve(modules, i, allocator);
+        prog.stmts.insert(prog.stmts.end(), module_prog.stmts.begin(), module_prog.stmts.end());
+    }
+    return prog;
+}
+
+// writes contents to a new temporary file in dir and renames it to path
+inline bool write_file(const std::filesystem::path& path, const std::string& contents)
+{
+    TempFile file(path.parent_path(), "");
+    {
+        std::ofstream output(file.path(), std::ios::out | std::ios::binary);
+        output << contents;
+        if (!output) {
+            return false;
+        }
+    }
+    return file.commit(path, 0666);
+}
+
+// Builds what target asks for from the modules load() returned. The assembly and the
+// object of the program's own file are the .asm and .o outputs. Tools' messages go to
+// diagnostics if given, the generator's debug output to log. True if every output was made.
+inline bool build_modules(std::vector<Module>& modules, const Options& options, const Target& target,
+    ArenaAllocator& allocator, std::string* diagnostics, std::ostream& log = null_log())
+{
+    auto last = static_cast<size_t>(target.last());
+    std::filesystem::path dir = target.outputs[last].parent_path();
+    if (dir.empty()) {
+        dir = ".";
+    }
+    std::filesystem::path work = dir / ".ogen";
+    std::error_code error;
+    std::filesystem::create_directories(work, error);
+    if (error) {
+        report(diagnostics, "Could not create " + work.string() + ": " + error.message() + "\n");
+        return false;
+    }
+
+    // the executable needs every module, the other outputs only the program's file
+    size_t first = last == 2 ? 0 : modules.size() - 1;
+    std::vector<std::string> fingerprints(modules.size());
+    std::vector<std::filesystem::path> stems(modules.size());
+    std::vector<size_t> stale;
+    for (size_t i = first; i < modules.size(); i++) {
+        const Module& module = modules[i];
+        bool main = i == modules.size() - 1;
+        // -g line info points into each module's own file
+        Options module_options = options;
+        module_options.source_name = module.path.string();
+        std::string& fingerprint = fingerprints[i];
+        fingerprint = "compiler " + Cache::compiler_id() + "\nflags " + cache_flags(module_options) + "\n"
+            + (main ? "main\n" : "module\n") + "source " + hash_hex(module.source_hash) + "\n";
+        for (size_t import : module.imports) {
+            std::string interface;
+            for (const auto& [name, arity] : modules[import].interface) {
+                interface += name + " " + std::to_string(arity) + "\n";
+            }
+            fingerprint += "import " + modules[import].path.string() + " " + hash_hex(interface) + "\n";
+        }
+        // a file may be built as the program and as an import, the objects differ
+        stems[i] = work / (module.path.stem().string() + "-" + hash_hex(module.path.string() + (main ? " main" : "")));
+        std::filesystem::path fingerprint_path = stems[i].string() + ".fp";
+        if (read_file(fingerprint_path) == fingerprint && std::filesystem::exists(stems[i].string() + ".asm", error)
+            && std::filesystem::exists(stems[i].string() + ".o", error)) {
+            continue;
+        }
+
+        // until the object is rebuilt the fingerprint no longer describes it
+        std::filesystem::remove(fingerprint_path, error);
+        std::string asm_source;
+        try {
+            NodeProg& prog = resolve(modules, i, allocator);
+            optimize(prog, allocator);
+            Generator generator(prog, module_options, { .module = true, .main = main, .externs = module.externs }, log);
+            asm_source = generator.gen_prog();
+        } catch (const CompileError& error) {
+            throw main ? error : error_in(module.path, error);
+        }
+        if (!write_file(stems[i].string() + ".asm", asm_source)) {
+            report(diagnostics, "Could not write " + stems[i].string() + ".asm\n");
+            return false;
+        }
+        stale.push_back(i);
+    }
+
+    // the stages that worked, a failed nasm still leaves the assembly
+    size_t done = 0;
+    #ifdef __linux__
+        bool assembled = last >= 1;
+        for (size_t i : stale) {
+            if (!assembled) {
+                break;
+            }
+            TempFile object(work, ".o");
+            assembled = run_tool(nasm_command(stems[i].string() + ".asm", object.path(), options.debug_info), diagnostics)
+                && object.commit(stems[i].string() + ".o", 0666) && write_file(stems[i].string() + ".fp", fingerprints[i]);
+        }
+        if (assembled) {
+            done = 1;
+        }
+        if (last >= 2 && done == 1) {
+            // linked again when a module changed, or the executable isn't the one last linked
+            std::string link = target.outputs[2].string() + "\n";
+            std::vector<std::string> args = { "ld", "-o" };
+            for (size_t i = 0; i < modules.size(); i++) {
+                link += fingerprints[i];
+            }
+            std::filesystem::path link_path = work / ("link-" + hash_hex(std::filesystem::absolute(target.outputs[2]).string()));
+            if (stale.empty() && read_file(link_path) == link && std::filesystem::exists(target.outputs[2], error)) {
+                done = 2;
+            } else {
+                std::filesystem::remove(link_path, error);
+                TempFile executable(dir, "");
+                args.push_back(executable.path());
+                for (const std::filesystem::path& stem : stems) {
+                    args.push_back(stem.string() + ".o");
+                }
+                if (run_tool(args, diagnostics) && executable.commit(target.outputs[2], 0777)) {
+                    write_file(link_path, link);
+                    done = 2;
+                }
+            }
+        }
+    #else
+        std::cout << "Unsupported OS" << std::endl;
+    #endif
+    bool built = done == last;
+
+    // the program's own assembly and object are copied out
+    const std::filesystem::path& main_stem = stems.back();
+    for (size_t i = 0; i < 2 && i <= last; i++) {
+        if (target.outputs[i].empty()) {
+            continue;
+        }
+        if (i <= done) {
+            TempFile copy(dir, "");
+            std::filesystem::copy_file(main_stem.string() + (i == 0 ? ".asm" : ".o"), copy.path(),
+                std::filesystem::copy_options::overwrite_existing, error);
+            built = !error && copy.commit(target.outputs[i], 0666) && built;
+        } else {
+            std::filesystem::remove(target.outputs[i], error);
+        }
+    }
+    if (last == 2 && done < 2) {
+        std::filesystem::remove(target.outputs[2], error);
+    }
+    return built;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <string>
+
+// Command line options that change how a program is compiled.
+struct Options {
+    bool omit_frame_pointer = false;    // leaf functions run without rbp frame
+    size_t unroll_factor = 4;           // copies of a counted loop's body per iteration, 1 disables unrolling
+    bool auto_memo = false;             // pure recursive functions cache their results
+    bool debug_info = false;            // -g: the objects map their code back to source lines
+    std::string source_name {};         // the file name the line info points at
+
+    // applies arg if it is one of these options, the compile server parses its clients' flags with it too
+    bool parse(const std::string& arg)
+    {
+        if (arg == "-fomit-frame-pointer") {
+            omit_frame_pointer = true;
+        } else if (arg == "--auto-memo") {
+            auto_memo = true;
+        } else if (arg.starts_with("--unroll=")) {
+            unroll_factor = std::strtoul(arg.c_str() + 9, nullptr, 10);
+        } else if (arg == "-g") {
+            debug_info = true;
+        } else if (arg.starts_with("--source-name=")) {
+            source_name = arg.substr(14);
+        } else {
+            return false;
+        }
+        return true;
+    }
+};
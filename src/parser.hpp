@@ -22,6 +22,11 @@ struct NodeTermParen {
     NodeExpr *expr;
 };
 
+// `!expr`, 1 if expr is 0 and 0 otherwise
+struct NodeTermNot {
+    NodeExpr *expr;
+};
+
 struct NodeStmtFun {
     Token ident;
     std::vector<Token> params;
@@ -38,7 +43,7 @@ struct NodeStmtReturn {
 };
 
 struct NodeTerm {
-    std::variant<NodeTermIntLit *, NodeTermIdent *, NodeTermParen *, NodeTermFunCall *> var;
+    std::variant<NodeTermIntLit *, NodeTermIdent *, NodeTermParen *, NodeTermFunCall *, NodeTermNot *> var;
 };
 
 struct NodeBinExprAdd {
@@ -61,18 +66,37 @@ struct NodeBinExprDiv {
     NodeExpr *rhs;
 };
 
+struct NodeComparison {
+    Token comp;
+};
+
+// signed comparison, 1 if it holds and 0 otherwise
+struct NodeBinExprCmp {
+    NodeExpr *lhs;
+    NodeExpr *rhs;
+    NodeComparison *comparison;
+};
+
+// `&&` and `||` are 0 or 1 and only evaluate rhs if lhs doesn't decide the result
+struct NodeBinExprAnd {
+    NodeExpr *lhs;
+    NodeExpr *rhs;
+};
+
+struct NodeBinExprOr {
+    NodeExpr *lhs;
+    NodeExpr *rhs;
+};
+
 struct NodeBinExpr {
-    std::variant<NodeBinExprAdd *, NodeBinExprMulti *, NodeBinExprSub *, NodeBinExprDiv *> var;
+    std::variant<NodeBinExprAdd *, NodeBinExprMulti *, NodeBinExprSub *, NodeBinExprDiv *,
+                 NodeBinExprCmp *, NodeBinExprAnd *, NodeBinExprOr *> var;
 };
 
 struct NodeExpr {
     std::variant<NodeTerm *, NodeBinExpr *> var;
 };
 
-struct NodeComparison {
-    Token comp;
-};
-
 struct NodeStmtExit {
     NodeExpr *expr;
 };
@@ -92,26 +116,20 @@ struct NodeStmtScope {
 };
 
 struct NodeStmtIf {
-    NodeExpr *lhs;
-    NodeExpr *rhs;
-    NodeComparison *comparison;
+    NodeExpr *condition;
     std::vector<NodeStmt *> body;
     std::vector<NodeStmt *> elif_body;
     std::vector<NodeStmt *> else_body;
 };
 
 struct NodeStmtWhile {
-    NodeExpr *lhs;
-    NodeExpr *rhs;
-    NodeComparison *comparison;
+    NodeExpr *condition;
     std::vector<NodeStmt *> body;
 };
 
 struct NodeStmtFor {
     std::variant<NodeStmtLet *, NodeStmtAssign *> init;
-    NodeExpr *condition_lhs;
-    NodeExpr *condition_rhs;
-    NodeComparison *comparision;
+    NodeExpr *condition;
     NodeStmtAssign *change;
     std::vector<NodeStmt *> body;
 };
@@ -125,20 +143,24 @@ struct NodeStmt {
     std::variant<NodeStmtExit *, NodeStmtLet *, NodeStmtScope *, NodeStmtIf *,
                  NodeStmtWhile *, NodeStmtFor *, NodeStmtAssign *, NodeStmtFun *,
                  NodeStmtPrint *, NodeStmtReturn *> var;
+    uint32_t line = 0;      // the source line the statement starts on, 0 if the optimizer made it up
 };
 
 struct NodeProg {
     std::vector<NodeStmt *> stmts;
+    std::vector<Token> imports {};  // `import "path";` at the top level, the paths as written
 };
 
 class Parser {
 public:
-    inline explicit Parser(std::vector<Token> tokens)
-        : m_tokens(std::move(tokens)), m_allocator(1024 * 1024 * 4) // 4 mb
+    // nodes are allocated in allocator and live as long as it does, the debug output goes to log
+    inline Parser(std::vector<Token> tokens, ArenaAllocator& allocator, std::ostream& log = std::cout)
+        : m_tokens(std::move(tokens)), m_allocator(allocator), m_log(log)
     {
     }
 
     std::optional<NodeTerm *> parse_term() {
+        Nesting nesting(*this);
         if (auto int_lit = try_consume(TokenType::int_lit)) {
             auto term_int_lit = m_allocator.alloc<NodeTermIntLit>();
             term_int_lit->int_lit = int_lit.value();
@@ -155,8 +177,7 @@ public:
                     if (auto arg_expr = parse_expr()) {
                         fun_call->args.push_back(arg_expr.value());
                     } else {
-                        std::cerr << "Invalid expression as function argument" << std::endl;
-                        exit(EXIT_FAILURE);
+                        throw error("Invalid expression as function argument");
                     }
                     if (peek().value().type != TokenType::close_paren) {
                         try_consume(TokenType::comma, "Expected ',' to separate arguments");
@@ -177,8 +198,7 @@ public:
         } else if (auto open_paren = try_consume(TokenType::open_paren)) {
             auto expr = parse_expr();
             if (!expr.has_value()) {
-                std::cerr << "Expected expression" << std::endl;
-                exit(EXIT_FAILURE);
+                throw error("Expected expression");
             }
             try_consume(TokenType::close_paren, "Expected `)`");
             auto term_paren = m_allocator.alloc<NodeTermParen>();
@@ -186,6 +206,17 @@ public:
             auto term = m_allocator.alloc<NodeTerm>();
             term->var = term_paren;
             return term;
+        } else if (auto log_not = try_consume(TokenType::log_not)) {
+            auto operand = parse_term();
+            if (!operand.has_value()) {
+                throw error("Expected expression after `!`");
+            }
+            auto term_not = m_allocator.alloc<NodeTermNot>();
+            term_not->expr = m_allocator.alloc<NodeExpr>();
+            term_not->expr->var = operand.value();
+            auto term = m_allocator.alloc<NodeTerm>();
+            term->var = term_not;
+            return term;
         } else {
             return {};
         }
@@ -196,7 +227,7 @@ public:
 
         std::optional<NodeTerm *> term_lhs = parse_term();
         if (!term_lhs.has_value()) {
-            std::cout << "Term LHS has no value" << std::endl; // debug
+            m_log << "Term LHS has no value" << std::endl; // debug
             return {};
         }
 
@@ -219,8 +250,7 @@ public:
             int next_min_prec = prec.value() + 1;
             auto expr_rhs = parse_expr(next_min_prec);
             if (!expr_rhs.has_value()) {
-                std::cerr << "Expected expression" << std::endl;
-                exit(EXIT_FAILURE);
+                throw error("Expected expression");
             }
 
             auto expr = m_allocator.alloc<NodeBinExpr>();
@@ -249,11 +279,30 @@ public:
                 div->lhs = expr_lhs2;
                 div->rhs = expr_rhs.value();
                 expr->var = div;
+            } else if (op.type == TokenType::log_and) {
+                auto log_and = m_allocator.alloc<NodeBinExprAnd>();
+                expr_lhs2->var = expr_lhs->var;
+                log_and->lhs = expr_lhs2;
+                log_and->rhs = expr_rhs.value();
+                expr->var = log_and;
+            } else if (op.type == TokenType::log_or) {
+                auto log_or = m_allocator.alloc<NodeBinExprOr>();
+                expr_lhs2->var = expr_lhs->var;
+                log_or->lhs = expr_lhs2;
+                log_or->rhs = expr_rhs.value();
+                expr->var = log_or;
+            } else if (bin_prec(op.type) == bin_prec(TokenType::eq_eq)) {
+                auto cmp = m_allocator.alloc<NodeBinExprCmp>();
+                expr_lhs2->var = expr_lhs->var;
+                cmp->lhs = expr_lhs2;
+                cmp->rhs = expr_rhs.value();
+                cmp->comparison = m_allocator.alloc<NodeComparison>();
+                cmp->comparison->comp = op;
+                expr->var = cmp;
             }
 
             else {
-                std::cerr << "Invalid operator" << std::endl;
-                exit(EXIT_FAILURE);
+                throw error("Invalid operator");
             }
             expr_lhs->var = expr;
         }
@@ -276,62 +325,50 @@ public:
 //function to parse elif in the if-statement
     void resolveElif(NodeStmtIf* stmt_if){
         while (peek().has_value() && peek().value().type == TokenType::elif) {
-            consume();
+            uint32_t line = consume().line;
             try_consume(TokenType::open_paren, "Expected `(`");
             auto elif_stmt = m_allocator.alloc<NodeStmtIf>();
-            if (auto lhs = parse_expr()) {
-                elif_stmt->lhs = lhs.value();
+            if (auto condition = parse_expr()) {
+                elif_stmt->condition = condition.value();
             } else {
-                std::cerr << "Invalid expression" << std::endl;
-                exit(EXIT_FAILURE);
-            }
-            if(peek().has_value() && peek().value().type == TokenType::close_paren){
-                consume();
-                if(auto scope = parse_scope()){
-                    elif_stmt->body = scope.value()->stmts;
-                }
-                else{
-                    std::cerr << "Invalid scope on if statement" << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                auto elif_stmt_node = m_allocator.alloc<NodeStmt>();
-                elif_stmt_node->var = elif_stmt;
-                stmt_if->elif_body.push_back(elif_stmt_node);
+                throw error("Invalid expression");
             }
-            else{
-                elif_stmt->comparison = m_allocator.alloc<NodeComparison>();
-                elif_stmt->comparison->comp = consume(); // consumes comparison
-                if (auto rhs = parse_expr()) {
-                    elif_stmt->rhs = rhs.value();
-                } else {
-                    std::cerr << "Invalid expression" << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                try_consume(TokenType::close_paren, "Expected `)`");
-                if (auto scope = parse_scope()) {
-                    elif_stmt->body = scope.value()->stmts;
-                } else {
-                    std::cerr << "Invalid scope on elif statement" << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                auto elif_stmt_node = m_allocator.alloc<NodeStmt>();
-                elif_stmt_node->var = elif_stmt;
-                stmt_if->elif_body.push_back(elif_stmt_node);
+            try_consume(TokenType::close_paren, "Expected `)`");
+            if (auto scope = parse_scope()) {
+                elif_stmt->body = scope.value()->stmts;
+            } else {
+                throw error("Invalid scope on elif statement");
             }
+            auto elif_stmt_node = m_allocator.alloc<NodeStmt>();
+            elif_stmt_node->var = elif_stmt;
+            elif_stmt_node->line = line;
+            stmt_if->elif_body.push_back(elif_stmt_node);
         }
     }
 
     std::optional<NodeStmt *> parse_stmt() {
+        Nesting nesting(*this);
+        uint32_t line = peek().has_value() ? peek().value().line : 0;
+        std::optional<NodeStmt *> stmt = parse_stmt_node();
+        if (stmt.has_value()) {
+            stmt.value()->line = line;
+        }
+        return stmt;
+    }
+
+    std::optional<NodeStmt *> parse_stmt_node() {
+        if (!peek().has_value()) {
+            return {};
+        }
         if (peek().value().type == TokenType::exit && peek(1).has_value() && peek(1).value().type == TokenType::open_paren) {
             consume();
             consume();
-            std::cout << "Exit" << std::endl;
+            m_log << "Exit" << std::endl;
             auto stmt_exit = m_allocator.alloc<NodeStmtExit>();
             if (auto node_expr = parse_expr()) {
                 stmt_exit->expr = node_expr.value();
             } else {
-                std::cerr << "Invalid expression" << std::endl;
-                exit(EXIT_FAILURE);
+                throw error("Invalid expression");
             }
             try_consume(TokenType::close_paren, "Expected `)`");
             try_consume(TokenType::semi, "Expected `;`");
@@ -344,15 +381,14 @@ public:
         else if (
             peek().has_value() && peek().value().type == TokenType::let && peek(1).has_value() && peek(1).value().type == TokenType::ident && peek(2).has_value() && peek(2).value().type == TokenType::eq) {
             consume();
-            std::cout << "Let" << std::endl;
+            m_log << "Let" << std::endl;
             auto stmt_let = m_allocator.alloc<NodeStmtLet>();
             stmt_let->ident = consume(); // consumes indet
             consume();                   // consumes =
             if (auto expr = parse_expr()) {
                 stmt_let->expr = expr.value();
             } else {
-                std::cerr << "Invalid expression" << std::endl;
-                exit(EXIT_FAILURE);
+                throw error("Invalid expression");
             }
             try_consume(TokenType::semi, "Expected `;`");
             auto stmt = m_allocator.alloc<NodeStmt>();
@@ -370,8 +406,7 @@ public:
                 stmt_assign->rhs = rhs.value();
             }
             else {
-                std::cerr << "Invalid expression" << std::endl;
-                exit(EXIT_FAILURE);
+                throw error("Invalid expression");
                 }
             try_consume(TokenType::semi, "Expected `;`");
             auto stmt = m_allocator.alloc<NodeStmt>();
@@ -384,55 +419,31 @@ public:
         else if (peek().has_value() && peek().value().type == TokenType::if_condition) {
             consume();
             try_consume(TokenType::open_paren, "Expected `(`");
-            std::cout << "If" << std::endl; // debug
+            m_log << "If" << std::endl; // debug
             auto stmt_if = m_allocator.alloc<NodeStmtIf>();
-            if (auto lhs = parse_expr()) {
-                stmt_if->lhs = lhs.value();
+            if (auto condition = parse_expr()) {
+                stmt_if->condition = condition.value();
+            } else {
+                throw error("Invalid expression");
+            }
+            try_consume(TokenType::close_paren, "Expected `)`");
+            if (auto scope = parse_scope()) {
+                stmt_if->body = scope.value()->stmts;
             } else {
-                std::cerr << "Invalid expression" << std::endl;
-                exit(EXIT_FAILURE);
+                throw error("Invalid scope on if statement");
             }
-            if(peek().has_value() && peek().value().type == TokenType::close_paren){
+            resolveElif(stmt_if);
+            if (peek().has_value() && peek().value().type == TokenType::else_condition) {
                 consume();
-                if(auto scope = parse_scope()){
-                    stmt_if->body = scope.value()->stmts;
-                }
-                else{
-                    std::cerr << "Invalid scope on if statement" << std::endl;
-                    exit(EXIT_FAILURE);
+                if (auto scope = parse_scope()) {
+                    stmt_if->else_body = scope.value()->stmts;
+                } else {
+                    throw error("Invalid scope on else statement");
                 }
-                resolveElif(stmt_if);
             }
-                else {
-                    stmt_if->comparison = m_allocator.alloc<NodeComparison>();
-                    stmt_if->comparison->comp = consume(); // consumes comparison
-                    if (auto rhs = parse_expr()) {
-                        stmt_if->rhs = rhs.value();
-                    } else {
-                        std::cerr << "Invalid expression" << std::endl;
-                        exit(EXIT_FAILURE);
-                    }
-                    try_consume(TokenType::close_paren, "Expected `)`");
-                    if (auto scope = parse_scope()) {
-                        stmt_if->body = scope.value()->stmts;
-                    } else {
-                        std::cerr << "Invalid scope on if statement" << std::endl;
-                        exit(EXIT_FAILURE);
-                    }
-                    resolveElif(stmt_if);
-                }
-                if (peek().has_value() && peek().value().type == TokenType::else_condition) {
-                    consume();
-                    if (auto scope = parse_scope()) {
-                        stmt_if->else_body = scope.value()->stmts;
-                    } else {
-                        std::cerr << "Invalid scope on else statement" << std::endl;
-                        exit(EXIT_FAILURE);
-                    }
-                }
-                auto stmt = m_allocator.alloc<NodeStmt>();
-                stmt->var = stmt_if;
-                return stmt;
+            auto stmt = m_allocator.alloc<NodeStmt>();
+            stmt->var = stmt_if;
+            return stmt;
         }
 
         else if (peek().has_value() && peek().value().type == TokenType::print && peek(1).has_value() && peek(1).value().type == TokenType::open_paren) {
@@ -442,8 +453,7 @@ public:
             if (auto node_expr = parse_expr()) {
                 stmt_print->expr = node_expr.value();
             } else {
-                std::cerr << "Invalid expression in print statement" << std::endl;
-                exit(EXIT_FAILURE);
+                throw error("Invalid expression in print statement");
             }
             try_consume(TokenType::close_paren, "Expected `)`");
             try_consume(TokenType::semi, "Expected `;`");
@@ -457,19 +467,10 @@ public:
             consume();
             try_consume(TokenType::open_paren, "Expected '('");
             auto stmt_while = m_allocator.alloc<NodeStmtWhile>();
-            if(auto lhs = parse_expr()){
-                stmt_while->lhs = lhs.value();
+            if(auto condition = parse_expr()){
+                stmt_while->condition = condition.value();
             } else {
-                std::cerr << "Invalid expression" << std::endl;
-                exit(EXIT_FAILURE);
-            }
-            stmt_while->comparison = m_allocator.alloc<NodeComparison>();
-            stmt_while->comparison->comp = consume();
-            if (auto rhs = parse_expr()) {
-                stmt_while->rhs = rhs.value();
-            } else {
-                std::cerr << "Invalid expression" << std::endl;
-                exit(EXIT_FAILURE);
+                throw error("Invalid expression");
             }
             try_consume(TokenType::close_paren, "Expected ')");
             if(auto scope = parse_scope()){
@@ -490,20 +491,18 @@ public:
             if (peek().has_value() && peek().value().type == TokenType::let) {
                 consume();
                 if (peek().has_value() && peek().value().type == TokenType::ident && peek(1).has_value() && peek(1).value().type == TokenType::eq) {
-                    std::cout << "Let" << std::endl;
+                    m_log << "Let" << std::endl;
                     auto stmt_let = m_allocator.alloc<NodeStmtLet>();
                     stmt_let->ident = consume(); // consumes indet
                     consume();                   // consumes =
                     if (auto expr = parse_expr()) {
                         stmt_let->expr = expr.value();
                     } else {
-                        std::cerr << "Invalid expression" << std::endl;
-                        exit(EXIT_FAILURE);
+                        throw error("Invalid expression");
                     }
                     stmt_for->init = stmt_let;
                 } else {
-                    std::cerr << "Incorrect identifier initialization in for loop" << std::endl;
-                    exit(EXIT_FAILURE);
+                    throw error("Incorrect identifier initialization in for loop");
                 }
             } else if (peek().has_value() && peek().value().type == TokenType::ident) {
                 auto stmt_assign = m_allocator.alloc<NodeStmtAssign>();
@@ -514,27 +513,17 @@ public:
                 if (auto rhs = parse_expr()) {
                     stmt_assign->rhs = rhs.value();
                 } else {
-                    std::cerr << "Invalid expression" << std::endl;
-                    exit(EXIT_FAILURE);
+                    throw error("Invalid expression");
                 }
                 stmt_for->init = stmt_assign;
             }
 
             try_consume(TokenType::semi, "Expected `;`");
 
-            if (auto lhs = parse_expr()) {
-                stmt_for->condition_lhs = lhs.value();
+            if (auto condition = parse_expr()) {
+                stmt_for->condition = condition.value();
             } else {
-                std::cerr << "Invalid expression" << std::endl;
-                exit(EXIT_FAILURE);
-            }
-            stmt_for->comparision = m_allocator.alloc<NodeComparison>();
-            stmt_for->comparision->comp = consume();
-            if (auto rhs = parse_expr()) {
-                stmt_for->condition_rhs = rhs.value();
-            } else {
-                std::cerr << "Invalid expression" << std::endl;
-                exit(EXIT_FAILURE);
+                throw error("Invalid expression");
             }
             try_consume(TokenType::semi, "Expected `;`");
 
@@ -547,8 +536,7 @@ public:
                 if (auto rhs = parse_expr()) {
                     stmt_assign->rhs = rhs.value();
                 } else {
-                    std::cerr << "Invalid expression" << std::endl;
-                    exit(EXIT_FAILURE);
+                    throw error("Invalid expression");
                 }
                 stmt_for->change = stmt_assign;
             }
@@ -581,8 +569,7 @@ public:
             if (auto scope = parse_scope()) {
                 stmt_fun->body = scope.value();
             } else {
-                std::cerr << "Expected function body with {}" << std::endl;
-                exit(EXIT_FAILURE);
+                throw error("Expected function body with {}");
             }
             auto stmt = m_allocator.alloc<NodeStmt>();
             stmt->var = stmt_fun;
@@ -596,8 +583,7 @@ public:
             if (auto expr = parse_expr()) {
                 stmt_return->expr = expr.value();
             } else {
-                std::cerr << "Expected expression after 'return'" << std::endl;
-                exit(EXIT_FAILURE);
+                throw error("Expected expression after 'return'");
             }
             try_consume(TokenType::semi, "Expected ';' after return statement");
             auto stmt = m_allocator.alloc<NodeStmt>();
@@ -608,7 +594,7 @@ public:
         // SCOPE
 
         else if (auto open_curly = try_consume(TokenType::open_curly)) {
-            std::cout << "Scope Open" << std::endl; // debug
+            m_log << "Scope Open" << std::endl; // debug
             auto scope = m_allocator.alloc<NodeStmtScope>();
             while (auto stmt = parse_stmt()) {
                 scope->stmts.push_back(stmt.value());
@@ -625,17 +611,36 @@ public:
     std::optional<NodeProg> parse_prog() {
         NodeProg prog;
         while (peek().has_value()) {
-            if (auto stmt = parse_stmt()) {
+            if (try_consume(TokenType::import_kw)) {
+                prog.imports.push_back(try_consume(TokenType::str_lit, "Expected a path in quotes after 'import'"));
+                try_consume(TokenType::semi, "Expected `;`");
+            } else if (auto stmt = parse_stmt()) {
                 prog.stmts.push_back(stmt.value());
             } else {
-                std::cerr << "Exited with error: Invalid statement" << std::endl;
-                exit(EXIT_FAILURE);
+                throw error("Exited with error: Invalid statement");
             }
         }
         return prog;
     }
 
 private:
+    // Terms and statements nested deeper than this are an error, not a stack overflow. The
+    // passes after the parser recurse over the tree as well.
+    static constexpr size_t max_nesting = 1000;
+
+    struct Nesting {
+        Parser& parser;
+        explicit Nesting(Parser& parser)
+            : parser(parser)
+        {
+            if (parser.m_nesting == max_nesting) {
+                throw parser.error("Nested too deeply");
+            }
+            parser.m_nesting++;
+        }
+        ~Nesting() { parser.m_nesting--; }
+    };
+
     [[nodiscard]] inline std::optional<Token> peek(int offset = 0) const {
         if (m_index + offset >= m_tokens.size()) {
             return {};
@@ -652,9 +657,16 @@ private:
         if (peek().has_value() && peek().value().type == type) {
             return consume();
         } else {
-            std::cerr << err_msg << std::endl;
-            exit(EXIT_FAILURE);
+            throw error(err_msg);
+        }
+    }
+
+    // message at the token the parser is looking at, or at the last one when the input ended early
+    [[nodiscard]] CompileError error(const std::string& message) const {
+        if (peek().has_value()) {
+            return error_at(peek().value(), message);
         }
+        return m_tokens.empty() ? CompileError(message) : error_at(m_tokens.back(), message);
     }
 
     inline std::optional<Token> try_consume(TokenType type) {
@@ -667,5 +679,7 @@ private:
 
     const std::vector<Token> m_tokens;
     size_t m_index = 0;
-    ArenaAllocator m_allocator;
+    size_t m_nesting = 0;       // parse_term and parse_stmt calls under way
+    ArenaAllocator& m_allocator;
+    std::ostream& m_log;
 };
\ No newline at end of file
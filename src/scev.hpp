@@ -0,0 +1,459 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "loops.hpp"
+
+// Replaces loops that only sum up arithmetic series by the closed form of their result.
+// A loop qualifies if it counts an induction variable i by a constant step towards a
+// bound it doesn't write, and its body is nothing but updates `v = v + e` / `v = v - e`
+// where e is a polynomial of degree <= 1 in the iteration number k. e may read i, values
+// the loop doesn't write, and accumulators that themselves only add loop invariant
+// values. After T iterations v is then v + T * a + T * (T - 1) / 2 * b, so
+//
+//     for (let i = 0; i < n; i = i + 1) { s = s + i; }
+//
+// runs in constant time. Like the loop, the closed form wraps at 64 bits. It assumes
+// i reaches the bound without wrapping around, which a step of 1 always does.
+class ScalarEvolution {
+public:
+    inline explicit ScalarEvolution(NodeProg& prog, ArenaAllocator& allocator)
+        : m_prog(prog), m_allocator(allocator), m_folder(allocator)
+    {
+    }
+
+    void run()
+    {
+        replace_stmts(m_prog.stmts);
+    }
+
+private:
+    // start + step * k, the value of an expression in iteration k. nullptr stands for 0.
+    struct Evolution {
+        NodeExpr* start = nullptr;
+        NodeExpr* step = nullptr;
+    };
+
+    // `while (iv comparison bound) { body; iv = iv + step; }`
+    struct CountedLoop {
+        std::string iv;
+        std::optional<int64_t> start {};   // value of iv before the loop, if it is a constant
+        int64_t step = 0;
+        TokenType comparison {};
+        NodeExpr* bound = nullptr;
+        std::vector<NodeStmt*> body {};
+    };
+
+    void replace_stmts(std::vector<NodeStmt*>& stmts)
+    {
+        for (size_t i = 0; i < stmts.size(); i++) {
+            for_each_body(stmts[i], [&](std::vector<NodeStmt*>& body) { replace_stmts(body); });
+
+            std::vector<NodeStmt*> closed_form;
+            if (std::holds_alternative<NodeStmtFor*>(stmts[i]->var)) {
+                closed_form = for_closed_form(std::get<NodeStmtFor*>(stmts[i]->var));
+            } else if (std::holds_alternative<NodeStmtWhile*>(stmts[i]->var)) {
+                closed_form = while_closed_form(std::get<NodeStmtWhile*>(stmts[i]->var));
+            }
+            if (!closed_form.empty()) {
+                stmts.erase(stmts.begin() + i);
+                stmts.insert(stmts.begin() + i, closed_form.begin(), closed_form.end());
+                i += closed_form.size() - 1;
+            }
+        }
+    }
+
+    std::vector<NodeStmt*> for_closed_form(NodeStmtFor* stmt_for)
+    {
+        const NodeBinExprCmp* condition = as_comparison(stmt_for->condition);
+        if (!stmt_for->change || !condition || !is_ident(condition->lhs, stmt_for->change->lhs->ident.value.value())) {
+            return {};
+        }
+        CountedLoop loop { .iv = stmt_for->change->lhs->ident.value.value() };
+        auto step = increment_of(loop.iv, stmt_for->change->rhs);
+        if (!step) {
+            return {};
+        }
+        loop.step = *step;
+        loop.comparison = condition->comparison->comp.type;
+        loop.bound = condition->rhs;
+        loop.body = stmt_for->body;
+
+        auto init = m_allocator.alloc<NodeStmt>();
+        if (std::holds_alternative<NodeStmtLet*>(stmt_for->init) && std::get<NodeStmtLet*>(stmt_for->init)) {
+            NodeStmtLet* stmt_let = std::get<NodeStmtLet*>(stmt_for->init);
+            if (stmt_let->ident.value != loop.iv) {
+                return {};
+            }
+            loop.start = const_value(stmt_let->expr);
+            init->var = stmt_let;
+        } else if (std::holds_alternative<NodeStmtAssign*>(stmt_for->init) && std::get<NodeStmtAssign*>(stmt_for->init)) {
+            NodeStmtAssign* stmt_assign = std::get<NodeStmtAssign*>(stmt_for->init);
+            if (stmt_assign->lhs->ident.value != loop.iv) {
+                return {};
+            }
+            loop.start = const_value(stmt_assign->rhs);
+            init->var = stmt_assign;
+        } else {
+            return {};
+        }
+
+        std::vector<NodeStmt*> closed_form = gen_closed_form(loop);
+        if (!closed_form.empty()) {
+            closed_form.insert(closed_form.begin(), init);   // i is still visible after the loop
+        }
+        return closed_form;
+    }
+
+    std::vector<NodeStmt*> while_closed_form(NodeStmtWhile* stmt_while)
+    {
+        if (stmt_while->body.empty() || !std::holds_alternative<NodeStmtAssign*>(stmt_while->body.back()->var)) {
+            return {};
+        }
+        const NodeStmtAssign* update = std::get<NodeStmtAssign*>(stmt_while->body.back()->var);
+        const NodeBinExprCmp* condition = as_comparison(stmt_while->condition);
+        CountedLoop loop { .iv = update->lhs->ident.value.value() };
+        auto step = increment_of(loop.iv, update->rhs);
+        if (!step || !condition || !is_ident(condition->lhs, loop.iv)) {
+            return {};
+        }
+        loop.step = *step;
+        loop.comparison = condition->comparison->comp.type;
+        loop.bound = condition->rhs;
+        loop.body.assign(stmt_while->body.begin(), stmt_while->body.end() - 1);
+        return gen_closed_form(loop);
+    }
+
+    std::vector<NodeStmt*> gen_closed_form(const CountedLoop& loop)
+    {
+        bool upwards = loop.comparison == TokenType::less_than || loop.comparison == TokenType::less_eq;
+        bool downwards = loop.comparison == TokenType::greater_than || loop.comparison == TokenType::greater_eq;
+        if (!(upwards && loop.step > 0) && !(downwards && loop.step < 0)) {
+            return {};
+        }
+
+        // every statement must be an accumulation, with no calls anywhere
+        std::vector<std::string> accumulators;
+        std::vector<NodeExpr*> increments;     // what each statement adds, nullptr for nothing
+        std::unordered_set<std::string> written { loop.iv };
+        for (const NodeStmt* stmt : loop.body) {
+            if (!std::holds_alternative<NodeStmtAssign*>(stmt->var)) {
+                return {};
+            }
+            const NodeStmtAssign* stmt_assign = std::get<NodeStmtAssign*>(stmt->var);
+            const std::string& name = stmt_assign->lhs->ident.value.value();
+            auto increment = accumulation(stmt_assign->rhs, name);
+            if (name == loop.iv || !increment || has_call(stmt_assign->rhs)) {
+                return {};
+            }
+            increments.push_back(*increment);
+            if (written.insert(name).second) {
+                accumulators.push_back(name);
+            }
+        }
+        bool bound_invariant = !has_call(loop.bound);
+        for_each_ident(loop.bound, [&](const std::string& ident) { bound_invariant = bound_invariant && !written.contains(ident); });
+        if (!bound_invariant) {
+            return {};
+        }
+
+        // accumulators adding the same invariant value every iteration, which others may read
+        std::unordered_map<std::string, NodeExpr*> linear_step;
+        for (const std::string& name : accumulators) {
+            NodeExpr* step = nullptr;
+            bool linear = true;
+            for (size_t i = 0; i < loop.body.size(); i++) {
+                if (std::get<NodeStmtAssign*>(loop.body[i]->var)->lhs->ident.value != name || !increments[i]) {
+                    continue;
+                }
+                for_each_ident(increments[i], [&](const std::string& ident) { linear = linear && !written.contains(ident); });
+                step = make_add(step, increments[i]);
+            }
+            if (linear) {
+                linear_step[name] = step;
+            }
+        }
+
+        // sum of what each accumulator gains in iteration k, as an evolution in k
+        std::unordered_map<std::string, Evolution> gains;
+        std::unordered_map<std::string, NodeExpr*> gained_so_far;  // of linear accumulators, within the iteration
+        bool reads_accumulator = false;
+        for (size_t i = 0; i < loop.body.size(); i++) {
+            const std::string& name = std::get<NodeStmtAssign*>(loop.body[i]->var)->lhs->ident.value.value();
+            if (!increments[i]) {
+                continue;
+            }
+            auto evolution = evolve(increments[i], loop, linear_step, gained_so_far, reads_accumulator);
+            if (!evolution) {
+                return {};
+            }
+            Evolution& gain = gains[name];
+            gain = { make_add(gain.start, evolution->start), make_add(gain.step, evolution->step) };
+            if (linear_step.contains(name)) {
+                gained_so_far[name] = make_add(gained_so_far[name], increments[i]);
+            }
+        }
+
+        std::vector<NodeStmt*> closed_form;
+        std::string prefix = temp_name("scev", m_counter);
+        NodeExpr* trips = trip_count(loop, prefix, closed_form);
+        NodeExpr* pairs = nullptr;     // T * (T - 1) / 2 without overflowing before the division
+        bool needs_pairs = std::any_of(gains.begin(), gains.end(), [](const auto& gain) { return gain.second.step; });
+        if (needs_pairs) {
+            NodeExpr* half = make_bin<NodeBinExprDiv>(trips, m_folder.make_int_lit(2));
+            NodeExpr* odd = make_sub(trips, make_mul(half, m_folder.make_int_lit(2)));
+            pairs = make_let(prefix + "_pairs", make_mul(half, make_add(make_sub(trips, m_folder.make_int_lit(1)), odd)), closed_form);
+        }
+
+        // accumulators read each other's old values, so they are all computed before any is assigned
+        std::vector<NodeStmt*> assigns;
+        for (const std::string& name : accumulators) {
+            const Evolution& gain = gains[name];
+            NodeExpr* result = make_add(make_ident(name), make_add(make_mul(trips, gain.start), make_mul(pairs, gain.step)));
+            if (reads_accumulator) {
+                result = make_let(prefix + "_" + name, result, closed_form);
+            }
+            assigns.push_back(make_assign(name, result));
+        }
+        closed_form.insert(closed_form.end(), assigns.begin(), assigns.end());
+        closed_form.push_back(make_assign(loop.iv, make_add(make_ident(loop.iv), make_mul(trips, m_folder.make_int_lit(loop.step)))));
+        return closed_form;
+    }
+
+    // Number of iterations, a literal if the start and the bound are constants. Otherwise
+    // `let T = 0; if (bound > i) { T = (bound - i - 1) / step + 1; }` and the like is added
+    // to stmts. The difference can't be negative there, so the unsigned division is exact.
+    NodeExpr* trip_count(const CountedLoop& loop, const std::string& prefix, std::vector<NodeStmt*>& stmts)
+    {
+        bool exclusive = loop.comparison == TokenType::less_than || loop.comparison == TokenType::greater_than;
+        uint64_t distance = loop.step > 0 ? static_cast<uint64_t>(loop.step) : 0ULL - static_cast<uint64_t>(loop.step);
+
+        auto bound = const_value(loop.bound);
+        if (loop.start && bound) {
+            int64_t from = loop.step > 0 ? *loop.start : *bound;
+            int64_t to = loop.step > 0 ? *bound : *loop.start;
+            uint64_t trips = 0;
+            if (exclusive ? from < to : from <= to) {
+                trips = (static_cast<uint64_t>(to) - static_cast<uint64_t>(from) - exclusive) / distance + 1;
+            }
+            return m_folder.make_int_lit(static_cast<int64_t>(trips));
+        }
+
+        NodeExpr* from = loop.step > 0 ? make_ident(loop.iv) : loop.bound;
+        NodeExpr* to = loop.step > 0 ? loop.bound : make_ident(loop.iv);
+        NodeExpr* trips = make_let(prefix, m_folder.make_int_lit(0), stmts);
+
+        auto cmp = m_allocator.alloc<NodeBinExprCmp>();
+        cmp->lhs = to;
+        cmp->rhs = from;
+        cmp->comparison = m_allocator.alloc<NodeComparison>();
+        cmp->comparison->comp = { .type = exclusive ? TokenType::greater_than : TokenType::greater_eq };
+        auto bin_expr = m_allocator.alloc<NodeBinExpr>();
+        bin_expr->var = cmp;
+        auto stmt_if = m_allocator.alloc<NodeStmtIf>();
+        stmt_if->condition = m_allocator.alloc<NodeExpr>();
+        stmt_if->condition->var = bin_expr;
+        NodeExpr* difference = make_sub(to, from);
+        if (exclusive) {
+            difference = make_sub(difference, m_folder.make_int_lit(1));
+        }
+        NodeExpr* count = make_add(make_bin<NodeBinExprDiv>(difference, m_folder.make_int_lit(static_cast<int64_t>(distance))), m_folder.make_int_lit(1));
+        stmt_if->body.push_back(make_assign(prefix, count));
+        auto stmt = m_allocator.alloc<NodeStmt>();
+        stmt->var = stmt_if;
+        stmts.push_back(stmt);
+        return trips;
+    }
+
+    // Evolution of expr in iteration k, if it is a polynomial of degree <= 1 in k.
+    std::optional<Evolution> evolve(
+        NodeExpr* expr,
+        const CountedLoop& loop,
+        const std::unordered_map<std::string, NodeExpr*>& linear_step,
+        std::unordered_map<std::string, NodeExpr*>& gained_so_far,
+        bool& reads_accumulator)
+    {
+        if (std::holds_alternative<NodeTerm*>(expr->var)) {
+            NodeTerm* term = std::get<NodeTerm*>(expr->var);
+            if (std::holds_alternative<NodeTermParen*>(term->var)) {
+                return evolve(std::get<NodeTermParen*>(term->var)->expr, loop, linear_step, gained_so_far, reads_accumulator);
+            }
+            if (std::holds_alternative<NodeTermFunCall*>(term->var) || std::holds_alternative<NodeTermNot*>(term->var)) {
+                return {};
+            }
+            if (std::holds_alternative<NodeTermIdent*>(term->var)) {
+                const std::string& name = std::get<NodeTermIdent*>(term->var)->ident.value.value();
+                if (name == loop.iv) {
+                    return Evolution { expr, m_folder.make_int_lit(loop.step) };
+                }
+                auto it = linear_step.find(name);
+                if (it != linear_step.end()) {
+                    reads_accumulator = true;
+                    return Evolution { make_add(expr, gained_so_far[name]), it->second };
+                }
+                bool written = std::any_of(loop.body.begin(), loop.body.end(), [&](const NodeStmt* stmt) {
+                    return std::get<NodeStmtAssign*>(stmt->var)->lhs->ident.value == name;
+                });
+                if (written) {
+                    return {};
+                }
+            }
+            return Evolution { expr, nullptr };
+        }
+
+        struct BinExprVisitor {
+            ScalarEvolution* scev;
+            std::optional<Evolution> lhs;
+            std::optional<Evolution> rhs;
+            std::optional<Evolution> operator()(const NodeBinExprAdd*) const
+            {
+                return Evolution { scev->make_add(lhs->start, rhs->start), scev->make_add(lhs->step, rhs->step) };
+            }
+            std::optional<Evolution> operator()(const NodeBinExprSub*) const
+            {
+                return Evolution { scev->make_sub(lhs->start, rhs->start), scev->make_sub(lhs->step, rhs->step) };
+            }
+            std::optional<Evolution> operator()(const NodeBinExprMulti*) const
+            {
+                if (!lhs->step) {
+                    return Evolution { scev->make_mul(lhs->start, rhs->start), scev->make_mul(lhs->start, rhs->step) };
+                }
+                if (!rhs->step) {
+                    return Evolution { scev->make_mul(lhs->start, rhs->start), scev->make_mul(lhs->step, rhs->start) };
+                }
+                return {};
+            }
+            std::optional<Evolution> operator()(const NodeBinExprDiv*) const
+            {
+                // the loop might not run at all, so only divisions that can't trap
+                auto divisor = const_value(rhs->start);
+                if (lhs->step || rhs->step || !divisor || *divisor == 0) {
+                    return {};
+                }
+                return Evolution { scev->make_bin<NodeBinExprDiv>(lhs->start, rhs->start), nullptr };
+            }
+            // truth values aren't polynomials
+            std::optional<Evolution> operator()(const NodeBinExprCmp*) const { return {}; }
+            std::optional<Evolution> operator()(const NodeBinExprAnd*) const { return {}; }
+            std::optional<Evolution> operator()(const NodeBinExprOr*) const { return {}; }
+        };
+        std::optional<Evolution> lhs;
+        std::optional<Evolution> rhs;
+        std::visit([&](const auto* bin) {
+            lhs = evolve(bin->lhs, loop, linear_step, gained_so_far, reads_accumulator);
+            rhs = evolve(bin->rhs, loop, linear_step, gained_so_far, reads_accumulator);
+        }, std::get<NodeBinExpr*>(expr->var)->var);
+        if (!lhs || !rhs) {
+            return {};
+        }
+        return std::visit(BinExprVisitor { .scev = this, .lhs = lhs, .rhs = rhs }, std::get<NodeBinExpr*>(expr->var)->var);
+    }
+
+    // What `name = expr` adds to name, if expr is name plus or minus some terms: a - b
+    // for `name + a - b`, a for `a + name`. The optional is empty if it's no such sum.
+    std::optional<NodeExpr*> accumulation(NodeExpr* expr, const std::string& name)
+    {
+        if (is_ident(expr, name)) {
+            return nullptr;
+        }
+        if (!std::holds_alternative<NodeBinExpr*>(expr->var)) {
+            return {};
+        }
+        const NodeBinExpr* bin_expr = std::get<NodeBinExpr*>(expr->var);
+        if (std::holds_alternative<NodeBinExprAdd*>(bin_expr->var)) {
+            const NodeBinExprAdd* add = std::get<NodeBinExprAdd*>(bin_expr->var);
+            if (auto increment = accumulation(add->lhs, name)) {
+                return make_add(*increment, add->rhs);
+            }
+            if (is_ident(add->rhs, name)) {
+                return add->lhs;
+            }
+        } else if (std::holds_alternative<NodeBinExprSub*>(bin_expr->var)) {
+            const NodeBinExprSub* sub = std::get<NodeBinExprSub*>(bin_expr->var);
+            if (auto increment = accumulation(sub->lhs, name)) {
+                return make_sub(*increment, sub->rhs);
+            }
+        }
+        return {};
+    }
+
+    static bool is_ident(const NodeExpr* expr, const std::string& name)
+    {
+        return std::holds_alternative<NodeTerm*>(expr->var)
+            && std::holds_alternative<NodeTermIdent*>(std::get<NodeTerm*>(expr->var)->var)
+            && std::get<NodeTermIdent*>(std::get<NodeTerm*>(expr->var)->var)->ident.value == name;
+    }
+
+    // Node builders. They take nullptr as 0 and fold what they build.
+    template <typename Bin>
+    NodeExpr* make_bin(NodeExpr* lhs, NodeExpr* rhs)
+    {
+        auto bin = m_allocator.alloc<Bin>();
+        bin->lhs = lhs;
+        bin->rhs = rhs;
+        auto bin_expr = m_allocator.alloc<NodeBinExpr>();
+        bin_expr->var = bin;
+        auto expr = m_allocator.alloc<NodeExpr>();
+        expr->var = bin_expr;
+        m_folder.fold_expr(expr);
+        return expr;
+    }
+
+    NodeExpr* make_add(NodeExpr* lhs, NodeExpr* rhs)
+    {
+        return !lhs ? rhs : !rhs ? lhs : make_bin<NodeBinExprAdd>(lhs, rhs);
+    }
+
+    NodeExpr* make_sub(NodeExpr* lhs, NodeExpr* rhs)
+    {
+        return !rhs ? lhs : make_bin<NodeBinExprSub>(lhs ? lhs : m_folder.make_int_lit(0), rhs);
+    }
+
+    NodeExpr* make_mul(NodeExpr* lhs, NodeExpr* rhs)
+    {
+        return !lhs || !rhs ? nullptr : make_bin<NodeBinExprMulti>(lhs, rhs);
+    }
+
+    NodeExpr* make_ident(const std::string& name)
+    {
+        auto ident = m_allocator.alloc<NodeTermIdent>();
+        ident->ident = { .type = TokenType::ident, .value = name };
+        auto term = m_allocator.alloc<NodeTerm>();
+        term->var = ident;
+        auto expr = m_allocator.alloc<NodeExpr>();
+        expr->var = term;
+        return expr;
+    }
+
+    NodeStmt* make_assign(const std::string& name, NodeExpr* rhs)
+    {
+        auto stmt_assign = m_allocator.alloc<NodeStmtAssign>();
+        stmt_assign->lhs = m_allocator.alloc<NodeTermIdent>();
+        stmt_assign->lhs->ident = { .type = TokenType::ident, .value = name };
+        stmt_assign->rhs = rhs ? rhs : m_folder.make_int_lit(0);
+        auto stmt = m_allocator.alloc<NodeStmt>();
+        stmt->var = stmt_assign;
+        return stmt;
+    }
+
+    // appends `let name = expr;` to stmts and returns a read of name
+    NodeExpr* make_let(const std::string& name, NodeExpr* expr, std::vector<NodeStmt*>& stmts)
+    {
+        auto stmt_let = m_allocator.alloc<NodeStmtLet>();
+        stmt_let->ident = { .type = TokenType::ident, .value = name };
+        stmt_let->expr = expr ? expr : m_folder.make_int_lit(0);
+        auto stmt = m_allocator.alloc<NodeStmt>();
+        stmt->var = stmt_let;
+        stmts.push_back(stmt);
+        return make_ident(name);
+    }
+
+    NodeProg& m_prog;
+    ArenaAllocator& m_allocator;
+    ConstantFolder m_folder;
+    size_t m_counter = 0;
+};
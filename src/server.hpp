@@ -0,0 +1,332 @@
+#pragma once
+
+#include <condition_variable>
+#include <csignal>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "compiler.hpp"
+
+// A request or response on the compile server's socket. On the wire it is a u32 length
+// and that many bytes, made of u32 numbers and strings with a u32 length in front.
+class Message {
+public:
+    Message() = default;
+
+    void put(uint32_t value)
+    {
+        for (int i = 0; i < 4; i++) {
+            m_bytes.push_back(static_cast<char>(value >> (8 * i)));
+        }
+    }
+
+    void put(const std::string& value)
+    {
+        put(static_cast<uint32_t>(value.size()));
+        m_bytes += value;
+    }
+
+    // a field past the end, or a string longer than what's left, makes the message bad
+    uint32_t get_u32()
+    {
+        if (m_bytes.size() - m_at < 4) {
+            m_ok = false;
+            return 0;
+        }
+        uint32_t value = 0;
+        for (int i = 0; i < 4; i++) {
+            value |= static_cast<uint32_t>(static_cast<uint8_t>(m_bytes[m_at++])) << (8 * i);
+        }
+        return value;
+    }
+
+    std::string get_string()
+    {
+        uint32_t size = get_u32();
+        if (!m_ok || m_bytes.size() - m_at < size) {
+            m_ok = false;
+            return "";
+        }
+        m_at += size;
+        return m_bytes.substr(m_at - size, size);
+    }
+
+    [[nodiscard]] bool ok() const
+    {
+        return m_ok;
+    }
+
+    bool send(int fd) const
+    {
+        Message framed;
+        framed.put(m_bytes);
+        return write_all(fd, framed.m_bytes.data(), framed.m_bytes.size());
+    }
+
+    static std::optional<Message> receive(int fd)
+    {
+        char header[4];
+        if (!read_all(fd, header, sizeof(header))) {
+            return {};
+        }
+        Message message;
+        message.m_bytes.assign(header, sizeof(header));
+        uint32_t size = message.get_u32();
+        if (size > max_size) {
+            return {};
+        }
+        message.m_bytes.resize(size);
+        message.m_at = 0;
+        if (!read_all(fd, message.m_bytes.data(), size)) {
+            return {};
+        }
+        return message;
+    }
+
+private:
+    static constexpr uint32_t max_size = 64 << 20;
+
+    static bool write_all(int fd, const char* data, size_t size)
+    {
+        while (size > 0) {
+            ssize_t written = ::send(fd, data, size, MSG_NOSIGNAL);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                return false;
+            }
+            data += written;
+            size -= static_cast<size_t>(written);
+        }
+        return true;
+    }
+
+    static bool read_all(int fd, char* data, size_t size)
+    {
+        while (size > 0) {
+            ssize_t got = ::read(fd, data, size);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                return false;
+            }
+            data += got;
+            size -= static_cast<size_t>(got);
+        }
+        return true;
+    }
+
+    std::string m_bytes;
+    size_t m_at = 0;
+    bool m_ok = true;
+};
+
+// $XDG_RUNTIME_DIR/ogen.sock, or one per user in /tmp
+inline std::string default_socket_path()
+{
+    if (const char* runtime = std::getenv("XDG_RUNTIME_DIR"); runtime && *runtime) {
+        return std::string(runtime) + "/ogen.sock";
+    }
+    return "/tmp/ogen-" + std::to_string(getuid()) + ".sock";
+}
+
+inline std::optional<sockaddr_un> socket_address(const std::string& path)
+{
+    sockaddr_un address {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        return {};
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return address;
+}
+
+// Compile server (--server). A request carries the client's working directory, the
+// source and the client's flags. The server builds what -o and --emit ask for (out.asm,
+// out.o and out without them) relative to that directory and answers with a status, the
+// diagnostics and the paths it wrote. Each worker thread keeps its arena between
+// requests, so a compilation costs no process start, no arena allocation and no keyword
+// table set up.
+class Server {
+public:
+    inline Server(std::string socket_path, size_t workers)
+        : m_socket_path(std::move(socket_path))
+        , m_workers(std::max<size_t>(workers, 1))
+    {
+    }
+
+    // serves until the process is killed, returns only if the socket can't be set up
+    int run()
+    {
+        std::optional<sockaddr_un> address = socket_address(m_socket_path);
+        if (!address) {
+            std::cerr << "Socket path too long: " << m_socket_path << std::endl;
+            return EXIT_FAILURE;
+        }
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (connect(probe, reinterpret_cast<const sockaddr*>(&*address), sizeof(*address)) == 0) {
+            std::cerr << "A server is already listening on " << m_socket_path << std::endl;
+            close(probe);
+            return EXIT_FAILURE;
+        }
+        close(probe);
+        unlink(m_socket_path.c_str());     // left behind by a server that was killed
+
+        int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listener < 0 || bind(listener, reinterpret_cast<const sockaddr*>(&*address), sizeof(*address)) < 0
+            || chmod(m_socket_path.c_str(), 0600) < 0 || listen(listener, 64) < 0) {
+            std::cerr << "Could not listen on " << m_socket_path << ": " << std::strerror(errno) << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::signal(SIGPIPE, SIG_IGN);
+        std::cerr << "ogen server listening on " << m_socket_path << " with " << m_workers << " workers" << std::endl;
+
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < m_workers; i++) {
+            threads.emplace_back([this] { work(); });
+        }
+        while (true) {
+            int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0) {
+                continue;
+            }
+            // a client that stops talking mustn't hold a worker forever
+            timeval timeout { .tv_sec = client_timeout_seconds, .tv_usec = 0 };
+            setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            {
+                std::lock_guard lock(m_mutex);
+                m_pending.push_back(client);
+            }
+            m_ready.notify_one();
+        }
+    }
+
+private:
+    static constexpr time_t client_timeout_seconds = 30;
+
+    void work()
+    {
+        ArenaAllocator allocator(arena_size);
+        while (true) {
+            int client;
+            {
+                std::unique_lock lock(m_mutex);
+                m_ready.wait(lock, [this] { return !m_pending.empty(); });
+                client = m_pending.front();
+                m_pending.pop_front();
+            }
+            if (std::optional<Message> request = Message::receive(client)) {
+                handle(*request, allocator).send(client);
+            }
+            close(client);
+        }
+    }
+
+    static Message handle(Message& request, ArenaAllocator& allocator)
+    {
+        std::filesystem::path dir = request.get_string();
+        std::string source = request.get_string();
+        uint32_t arg_count = request.get_u32();
+        Options options;
+        bool use_cache = true;
+        std::optional<Emit> emit;
+        std::string output_path;
+        std::string diagnostics;
+        for (uint32_t i = 0; i < arg_count && request.ok(); i++) {
+            std::string arg = request.get_string();
+            if (arg == "--no-cache") {
+                use_cache = false;
+            } else if (arg == "-o" && i + 1 < arg_count) {
+                output_path = request.get_string();
+                i++;
+            } else if (arg.starts_with("--emit=") && parse_emit(arg.substr(7))) {
+                emit = parse_emit(arg.substr(7));
+            } else if (!options.parse(arg)) {
+                diagnostics += "Option not supported by the compile server: " + arg + "\n";
+            }
+        }
+        if (!request.ok() || !dir.is_absolute()) {
+            diagnostics += "Malformed request\n";
+        }
+
+        // relative paths are the client's, the target resolves them against its directory
+        Target target = Target::make(emit, output_path, dir);
+        bool built = false;
+        if (diagnostics.empty()) {
+            std::optional<Cache> cache;
+            if (use_cache) {
+                cache.emplace(cache_flags(options));
+            }
+            allocator.reset();
+            try {
+                built = build(source, options, target, cache ? &*cache : nullptr, allocator, &diagnostics);
+            } catch (const CompileError& error) {
+                diagnostics += std::string(error.what()) + "\n";
+            } catch (const std::bad_alloc&) {
+                diagnostics += "Program too large\n";
+            } catch (const std::exception& error) {
+                diagnostics += std::string(error.what()) + "\n";     // anything else fails this request, not the server
+            }
+            allocator.reset();
+        }
+
+        Message response;
+        response.put(built ? 0U : 1U);
+        response.put(diagnostics);
+        Cache::Files outputs = built ? target.cache_files() : Cache::Files {};
+        response.put(static_cast<uint32_t>(outputs.size()));
+        for (const auto& [name, path] : outputs) {
+            response.put(path.string());
+        }
+        return response;
+    }
+
+    std::string m_socket_path;
+    size_t m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_ready;
+    std::deque<int> m_pending;      // accepted clients waiting for a worker
+};
+
+// Client side (--client): has the server at socket_path build source for the working
+// directory. Prints the diagnostics and returns the exit status, or nothing if no server
+// answered and the caller should compile by itself.
+inline std::optional<int> compile_on_server(const std::string& socket_path, const std::string& source, const std::vector<std::string>& args)
+{
+    std::optional<sockaddr_un> address = socket_address(socket_path);
+    if (!address) {
+        return {};
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<const sockaddr*>(&*address), sizeof(*address)) < 0) {
+        close(fd);
+        return {};
+    }
+
+    std::error_code error;
+    Message request;
+    request.put(std::filesystem::current_path(error).string());
+    request.put(source);
+    request.put(static_cast<uint32_t>(args.size()));
+    for (const std::string& arg : args) {
+        request.put(arg);
+    }
+    std::optional<Message> response;
+    if (request.send(fd)) {
+        response = Message::receive(fd);
+    }
+    close(fd);
+    if (!response) {
+        return {};
+    }
+    uint32_t status = response->get_u32();
+    std::cerr << response->get_string() << std::flush;
+    return response->ok() ? static_cast<int>(status) : EXIT_FAILURE;
+}
@@ -0,0 +1,358 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "evaluator.hpp"
+#include "loops.hpp"
+
+// Interprocedural constant propagation. Calls whose arguments are all constants are
+// evaluated at compile time when the callee is pure. Calls with some constant arguments
+// go to a clone of the callee with those parameters replaced by the constants, so its
+// body can be folded. Call sites in loops are specialized first, and the clones together
+// may only add a bounded amount of code. Originals that end up without callers are not
+// emitted by the generator.
+class Specializer {
+public:
+    inline explicit Specializer(NodeProg& prog, ArenaAllocator& allocator)
+        : m_prog(prog), m_allocator(allocator), m_folder(allocator), m_evaluator(prog)
+    {
+        for (NodeStmt* stmt : m_prog.stmts) {
+            if (std::holds_alternative<NodeStmtFun*>(stmt->var)) {
+                NodeStmtFun* stmt_fun = std::get<NodeStmtFun*>(stmt->var);
+                m_funs[stmt_fun->ident.value.value()] = stmt_fun;
+            }
+        }
+    }
+
+    void run()
+    {
+        std::vector<Site> sites;
+        visit_stmts(m_prog.stmts, 0, "", sites);
+        // the deepest loop nests run their calls most often
+        std::stable_sort(sites.begin(), sites.end(), [](const Site& a, const Site& b) { return a.loop_depth > b.loop_depth; });
+        // specializing can expose more sites in the clone, they are appended
+        for (size_t i = 0; i < sites.size(); i++) {
+            specialize(sites[i], sites);
+        }
+    }
+
+private:
+    // Upper bound for the nodes (as counted by stmts_size) all clones add together.
+    static constexpr size_t growth_budget = 512;
+    static constexpr size_t max_clones_per_fun = 4;
+
+    struct Site {
+        NodeTermFunCall* fun_call;
+        size_t loop_depth;
+        std::string clone_of;   // original of the clone the call is in, if any
+    };
+
+    void visit_stmts(std::vector<NodeStmt*>& stmts, size_t loop_depth, const std::string& clone_of, std::vector<Site>& sites)
+    {
+        for (NodeStmt* stmt : stmts) {
+            bool is_fun = std::holds_alternative<NodeStmtFun*>(stmt->var);
+            size_t depth = loop_depth + (std::holds_alternative<NodeStmtWhile*>(stmt->var) || std::holds_alternative<NodeStmtFor*>(stmt->var));
+            for_each_expr(stmt, [&](NodeExpr* expr) {
+                visit_expr(expr, depth, clone_of, sites);
+                m_folder.fold_expr(expr);
+            });
+            for_each_body(stmt, [&](std::vector<NodeStmt*>& body) { visit_stmts(body, is_fun ? 0 : depth, clone_of, sites); });
+        }
+    }
+
+    void visit_expr(NodeExpr* expr, size_t loop_depth, const std::string& clone_of, std::vector<Site>& sites)
+    {
+        for_each_operand(expr, [&](NodeExpr* operand) { visit_expr(operand, loop_depth, clone_of, sites); });
+
+        if (!std::holds_alternative<NodeTerm*>(expr->var)
+            || !std::holds_alternative<NodeTermFunCall*>(std::get<NodeTerm*>(expr->var)->var)) {
+            return;
+        }
+        NodeTermFunCall* fun_call = std::get<NodeTermFunCall*>(std::get<NodeTerm*>(expr->var)->var);
+        std::vector<int64_t> args;
+        for (NodeExpr* arg : fun_call->args) {
+            m_folder.fold_expr(arg);
+            if (auto value = const_value(arg)) {
+                args.push_back(*value);
+            }
+        }
+        if (args.size() == fun_call->args.size()) {
+            if (auto value = evaluate(fun_call->ident.value.value(), args)) {
+                expr->var = m_folder.make_int_lit(*value)->var;
+                return;
+            }
+        }
+        if (!args.empty()) {
+            sites.push_back({ fun_call, loop_depth, clone_of });
+        }
+    }
+
+    std::optional<int64_t> evaluate(const std::string& name, const std::vector<int64_t>& args)
+    {
+        std::string key = name;
+        for (int64_t arg : args) {
+            key += "," + std::to_string(arg);
+        }
+        auto it = m_evaluated.find(key);
+        if (it == m_evaluated.end()) {
+            it = m_evaluated.emplace(key, m_evaluator.call(name, args)).first;
+        }
+        return it->second;
+    }
+
+    void specialize(Site site, std::vector<Site>& sites)
+    {
+        NodeTermFunCall* fun_call = site.fun_call;
+        auto it = m_funs.find(fun_call->ident.value.value());
+        if (it == m_funs.end() || it->second->params.size() != fun_call->args.size() || has_nested_fun(it->second->body->stmts)) {
+            return;
+        }
+        const NodeStmtFun* stmt_fun = it->second;
+        std::string key = stmt_fun->ident.value.value();
+        for (const NodeExpr* arg : fun_call->args) {
+            auto value = const_value(arg);
+            key += value ? "," + std::to_string(*value) : ",_";
+        }
+
+        auto clone = m_clones.find(key);
+        if (clone == m_clones.end()) {
+            if (site.clone_of == stmt_fun->ident.value.value()) {
+                return;     // recursion with changing constants would clone once per value
+            }
+            size_t growth = stmts_size(stmt_fun->body->stmts);
+            size_t& clones = m_clone_count[stmt_fun->ident.value.value()];
+            if (m_growth + growth > growth_budget || clones >= max_clones_per_fun) {
+                return;
+            }
+            m_growth += growth;
+            std::string name = stmt_fun->ident.value.value() + "$" + std::to_string(clones++);
+            clone = m_clones.emplace(key, name).first;
+            NodeStmtFun* specialized = clone_fun(stmt_fun, fun_call->args, name);
+            visit_stmts(specialized->body->stmts, 0, stmt_fun->ident.value.value(), sites);
+        }
+
+        fun_call->ident.value = clone->second;
+        std::erase_if(fun_call->args, [](const NodeExpr* arg) { return const_value(arg).has_value(); });
+    }
+
+    // clone of stmt_fun with every parameter that has a constant argument replaced by it
+    NodeStmtFun* clone_fun(const NodeStmtFun* stmt_fun, const std::vector<NodeExpr*>& args, const std::string& name)
+    {
+        std::unordered_set<std::string> written;
+        collect_written(stmt_fun->body->stmts, written);
+
+        auto specialized = m_allocator.alloc<NodeStmtFun>();
+        specialized->ident = stmt_fun->ident;
+        specialized->ident.value = name;
+        specialized->body = m_allocator.alloc<NodeStmtScope>();
+        std::unordered_map<std::string, int64_t> constants;
+        for (size_t i = 0; i < args.size(); i++) {
+            const Token& param = stmt_fun->params[i];
+            auto value = const_value(args[i]);
+            if (!value) {
+                specialized->params.push_back(param);
+            } else if (written.contains(param.value.value())) {
+                // the body changes it, so it stays a variable, initialized to the constant
+                auto stmt_let = m_allocator.alloc<NodeStmtLet>();
+                stmt_let->ident = param;
+                stmt_let->expr = m_folder.make_int_lit(*value);
+                auto stmt = m_allocator.alloc<NodeStmt>();
+                stmt->var = stmt_let;
+                specialized->body->stmts.push_back(stmt);
+            } else {
+                constants[param.value.value()] = *value;
+            }
+        }
+        for (const NodeStmt* stmt : stmt_fun->body->stmts) {
+            specialized->body->stmts.push_back(clone_stmt(stmt, constants));
+        }
+
+        auto stmt = m_allocator.alloc<NodeStmt>();
+        stmt->var = specialized;
+        m_prog.stmts.push_back(stmt);
+        m_funs[name] = specialized;
+        m_evaluator.add(specialized);
+        return specialized;
+    }
+
+    static bool has_nested_fun(const std::vector<NodeStmt*>& stmts)
+    {
+        bool found = false;
+        for (const NodeStmt* stmt : stmts) {
+            found = found || std::holds_alternative<NodeStmtFun*>(stmt->var);
+            for_each_body(stmt, [&](const std::vector<NodeStmt*>& body) { found = found || has_nested_fun(body); });
+        }
+        return found;
+    }
+
+    std::vector<NodeStmt*> clone_stmts(const std::vector<NodeStmt*>& stmts, const std::unordered_map<std::string, int64_t>& constants)
+    {
+        std::vector<NodeStmt*> clones;
+        for (const NodeStmt* stmt : stmts) {
+            clones.push_back(clone_stmt(stmt, constants));
+        }
+        return clones;
+    }
+
+    NodeStmt* clone_stmt(const NodeStmt* stmt, const std::unordered_map<std::string, int64_t>& constants)
+    {
+        struct StmtVisitor {
+            Specializer* spec;
+            const std::unordered_map<std::string, int64_t>& constants;
+            NodeStmt* clone;
+            void operator()(const NodeStmtExit* stmt_exit) const
+            {
+                auto stmt_clone = spec->m_allocator.alloc<NodeStmtExit>();
+                stmt_clone->expr = spec->clone_expr(stmt_exit->expr, constants);
+                clone->var = stmt_clone;
+            }
+            void operator()(const NodeStmtLet* stmt_let) const
+            {
+                clone->var = spec->clone_let(stmt_let, constants);
+            }
+            void operator()(const NodeStmtScope* scope) const
+            {
+                auto stmt_clone = spec->m_allocator.alloc<NodeStmtScope>();
+                stmt_clone->stmts = spec->clone_stmts(scope->stmts, constants);
+                clone->var = stmt_clone;
+            }
+            void operator()(const NodeStmtIf* stmt_if) const
+            {
+                auto stmt_clone = spec->m_allocator.alloc<NodeStmtIf>();
+                stmt_clone->condition = spec->clone_expr(stmt_if->condition, constants);
+                stmt_clone->body = spec->clone_stmts(stmt_if->body, constants);
+                stmt_clone->elif_body = spec->clone_stmts(stmt_if->elif_body, constants);
+                stmt_clone->else_body = spec->clone_stmts(stmt_if->else_body, constants);
+                clone->var = stmt_clone;
+            }
+            void operator()(const NodeStmtWhile* stmt_while) const
+            {
+                auto stmt_clone = spec->m_allocator.alloc<NodeStmtWhile>();
+                stmt_clone->condition = spec->clone_expr(stmt_while->condition, constants);
+                stmt_clone->body = spec->clone_stmts(stmt_while->body, constants);
+                clone->var = stmt_clone;
+            }
+            void operator()(const NodeStmtFor* stmt_for) const
+            {
+                auto stmt_clone = spec->m_allocator.alloc<NodeStmtFor>();
+                if (std::holds_alternative<NodeStmtLet*>(stmt_for->init)) {
+                    const NodeStmtLet* init = std::get<NodeStmtLet*>(stmt_for->init);
+                    stmt_clone->init = init ? spec->clone_let(init, constants) : nullptr;
+                } else {
+                    const NodeStmtAssign* init = std::get<NodeStmtAssign*>(stmt_for->init);
+                    stmt_clone->init = init ? spec->clone_assign(init, constants) : nullptr;
+                }
+                stmt_clone->condition = spec->clone_expr(stmt_for->condition, constants);
+                stmt_clone->change = stmt_for->change ? spec->clone_assign(stmt_for->change, constants) : nullptr;
+                stmt_clone->body = spec->clone_stmts(stmt_for->body, constants);
+                clone->var = stmt_clone;
+            }
+            void operator()(const NodeStmtAssign* stmt_assign) const
+            {
+                clone->var = spec->clone_assign(stmt_assign, constants);
+            }
+            void operator()(const NodeStmtFun*) const
+            {
+                // has_nested_fun keeps these out of cloned bodies
+            }
+            void operator()(const NodeStmtPrint* stmt_print) const
+            {
+                auto stmt_clone = spec->m_allocator.alloc<NodeStmtPrint>();
+                stmt_clone->expr = spec->clone_expr(stmt_print->expr, constants);
+                clone->var = stmt_clone;
+            }
+            void operator()(const NodeStmtReturn* stmt_return) const
+            {
+                auto stmt_clone = spec->m_allocator.alloc<NodeStmtReturn>();
+                stmt_clone->expr = spec->clone_expr(stmt_return->expr, constants);
+                clone->var = stmt_clone;
+            }
+        };
+        auto clone = m_allocator.alloc<NodeStmt>();
+        clone->line = stmt->line;
+        std::visit(StmtVisitor { .spec = this, .constants = constants, .clone = clone }, stmt->var);
+        return clone;
+    }
+
+    NodeStmtLet* clone_let(const NodeStmtLet* stmt_let, const std::unordered_map<std::string, int64_t>& constants)
+    {
+        auto clone = m_allocator.alloc<NodeStmtLet>();
+        clone->ident = stmt_let->ident;
+        clone->expr = clone_expr(stmt_let->expr, constants);
+        return clone;
+    }
+
+    NodeStmtAssign* clone_assign(const NodeStmtAssign* stmt_assign, const std::unordered_map<std::string, int64_t>& constants)
+    {
+        auto clone = m_allocator.alloc<NodeStmtAssign>();
+        clone->lhs = m_allocator.alloc<NodeTermIdent>();
+        *clone->lhs = *stmt_assign->lhs;
+        clone->rhs = clone_expr(stmt_assign->rhs, constants);
+        return clone;
+    }
+
+    NodeExpr* clone_expr(const NodeExpr* expr, const std::unordered_map<std::string, int64_t>& constants)
+    {
+        auto clone = m_allocator.alloc<NodeExpr>();
+        if (std::holds_alternative<NodeBinExpr*>(expr->var)) {
+            auto bin_expr = m_allocator.alloc<NodeBinExpr>();
+            std::visit([&](const auto* bin) {
+                auto bin_clone = m_allocator.alloc<std::remove_const_t<std::remove_pointer_t<decltype(bin)>>>();
+                *bin_clone = *bin;
+                bin_clone->lhs = clone_expr(bin->lhs, constants);
+                bin_clone->rhs = clone_expr(bin->rhs, constants);
+                bin_expr->var = bin_clone;
+            }, std::get<NodeBinExpr*>(expr->var)->var);
+            clone->var = bin_expr;
+            return clone;
+        }
+
+        const NodeTerm* term = std::get<NodeTerm*>(expr->var);
+        auto term_clone = m_allocator.alloc<NodeTerm>();
+        if (std::holds_alternative<NodeTermIdent*>(term->var)) {
+            auto it = constants.find(std::get<NodeTermIdent*>(term->var)->ident.value.value());
+            if (it != constants.end()) {
+                return m_folder.make_int_lit(it->second);
+            }
+            auto ident = m_allocator.alloc<NodeTermIdent>();
+            *ident = *std::get<NodeTermIdent*>(term->var);
+            term_clone->var = ident;
+        } else if (std::holds_alternative<NodeTermIntLit*>(term->var)) {
+            auto int_lit = m_allocator.alloc<NodeTermIntLit>();
+            *int_lit = *std::get<NodeTermIntLit*>(term->var);
+            term_clone->var = int_lit;
+        } else if (std::holds_alternative<NodeTermParen*>(term->var)) {
+            auto paren = m_allocator.alloc<NodeTermParen>();
+            paren->expr = clone_expr(std::get<NodeTermParen*>(term->var)->expr, constants);
+            term_clone->var = paren;
+        } else if (std::holds_alternative<NodeTermNot*>(term->var)) {
+            auto term_not = m_allocator.alloc<NodeTermNot>();
+            term_not->expr = clone_expr(std::get<NodeTermNot*>(term->var)->expr, constants);
+            term_clone->var = term_not;
+        } else {
+            const NodeTermFunCall* fun_call = std::get<NodeTermFunCall*>(term->var);
+            auto call_clone = m_allocator.alloc<NodeTermFunCall>();
+            call_clone->ident = fun_call->ident;
+            for (const NodeExpr* arg : fun_call->args) {
+                call_clone->args.push_back(clone_expr(arg, constants));
+            }
+            term_clone->var = call_clone;
+        }
+        clone->var = term_clone;
+        return clone;
+    }
+
+    NodeProg& m_prog;
+    ArenaAllocator& m_allocator;
+    ConstantFolder m_folder;
+    Evaluator m_evaluator;
+    std::unordered_map<std::string, NodeStmtFun*> m_funs;
+    std::unordered_map<std::string, std::optional<int64_t>> m_evaluated;  // "name,arg,.." -> value
+    std::unordered_map<std::string, std::string> m_clones;                 // "name,arg|_,.." -> clone
+    std::unordered_map<std::string, size_t> m_clone_count;
+    size_t m_growth = 0;
+};
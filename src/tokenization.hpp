@@ -1,9 +1,16 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
 #include <string>
+#include <thread>
 #include <vector>
 #include <unordered_map>
 
+#include "error.hpp"
+
 enum class TokenType { 
     exit,
     int_lit,
@@ -35,7 +42,12 @@ enum class TokenType {
     fun,
     comma,
     return_kw,
-    print
+    print,
+    log_and,
+    log_or,
+    log_not,
+    import_kw,
+    str_lit
     };
 
 // Converts a string to its corresponding TokenType for Switch case below.
@@ -51,7 +63,8 @@ TokenType getStringToTokenType(const std::string& inString){
         {"for", TokenType::for_loop},
         {"fun", TokenType::fun},
         {"return", TokenType::return_kw},
-        {"print", TokenType::print}};
+        {"print", TokenType::print},
+        {"import", TokenType::import_kw}};
 
     auto it = tokenMap.find(inString);
     if (it != tokenMap.end()) {
@@ -63,15 +76,26 @@ TokenType getStringToTokenType(const std::string& inString){
 // Returns the precedence of a binary operator.
 std::optional<int> bin_prec(TokenType type) {
     switch (type) {
+        case TokenType::log_or:
+            return 0;
+        case TokenType::log_and:
+            return 1;
+        case TokenType::eq_eq:
+        case TokenType::n_eq:
+        case TokenType::greater_than:
+        case TokenType::less_than:
+        case TokenType::greater_eq:
+        case TokenType::less_eq:
+            return 2;
         case TokenType::plus:
         case TokenType::sub:
-            return 0;
+            return 3;
         case TokenType::div:
         case TokenType::star:
-            return 1;
+            return 4;
         case TokenType::uni_plus:
         case TokenType::uni_sub:    //unused as of yet. unary operators
-            return 2;
+            return 5;
         default:
             return {};
     }
@@ -105,6 +129,11 @@ std::optional<int> bin_prec(TokenType type) {
             case TokenType::for_loop: os << "for_loop"; break;
             case TokenType::fun:os << "function"; break;
             case TokenType::print: os << "print"; break;
+            case TokenType::log_and: os << "log_and"; break;
+            case TokenType::log_or: os << "log_or"; break;
+            case TokenType::log_not: os << "log_not"; break;
+            case TokenType::import_kw: os << "import"; break;
+            case TokenType::str_lit: os << "str_lit"; break;
          }
          return os;
      }
@@ -112,23 +141,53 @@ std::optional<int> bin_prec(TokenType type) {
 struct Token {
     TokenType type;
     std::optional<std::string> value {};
+    uint32_t line = 0;          // where the token starts, from 1. 0 for tokens the optimizer made up
+    uint32_t column = 0;
 };
 
+// message with the place in the source it is about in front, as "line:column: "
+inline CompileError error_at(uint32_t line, uint32_t column, const std::string& message)
+{
+    if (line == 0) {
+        return CompileError(message);
+    }
+    return CompileError(std::to_string(line) + ":" + std::to_string(column) + ": " + message);
+}
+
+inline CompileError error_at(const Token& token, const std::string& message)
+{
+    return error_at(token.line, token.column, message);
+}
+
+// a stream that drops everything, for the debug output of compilations nobody reads
+inline std::ostream& null_log()
+{
+    thread_local std::ostream quiet(nullptr);
+    return quiet;
+}
+
 class Tokenizer {
     public:
-        inline explicit Tokenizer(std::string src)
+        // the debug output goes to log, src starts at line first_line of the file
+        inline explicit Tokenizer(std::string src, std::ostream& log = std::cout, uint32_t first_line = 1)
             : m_src(std::move(src))                 //member initializer list
+            , m_log(log)
+            , m_first_line(first_line)
+            , m_line(first_line)
         {
         }
 
         inline std::vector<Token> tokenize()
         {
-            std::cout << "Tokenizing...\n" << m_src <<std::endl; //debug
+            m_log << "Tokenizing...\n" << m_src <<std::endl; //debug
             std::vector<Token> tokens; //type, value. value is optional 
             std::string buf;
             while (peek().has_value()) {
 
                 char currentChar = peek().value();
+                m_token_line = m_line;
+                m_token_column = m_column;
+                size_t count = tokens.size();
                 
 
                 if (std::isalpha(currentChar)) {  //keywords or ident(x, y, etc)
@@ -139,52 +198,52 @@ class Tokenizer {
                     }
                     switch(getStringToTokenType(buf)){
                         case TokenType::exit:
-                            std::cout << "Buffer is exit" << std::endl; //debug
+                            m_log << "Buffer is exit" << std::endl; //debug
                             tokens.push_back({ .type = TokenType::exit });
                             buf.clear();
                             break;
                         case TokenType::let:
-                            std::cout << "Buffer is let" << std::endl; //debug
+                            m_log << "Buffer is let" << std::endl; //debug
                             tokens.push_back({ .type = TokenType::let });
                             buf.clear();
                             break;
                         case TokenType::eq:
-                            std::cout << "Buffer is eq" << std::endl; //debug
+                            m_log << "Buffer is eq" << std::endl; //debug
                             tokens.push_back({ .type = TokenType::eq });
                             buf.clear();
                             break;
                         case TokenType::if_condition:
-                            std::cout << "Buffer is if" << std::endl; //debug
+                            m_log << "Buffer is if" << std::endl; //debug
                             tokens.push_back({ .type = TokenType::if_condition });
                             buf.clear();
                             break;
                         case TokenType::elif:
-                            std::cout << "Buffer is elif" << std::endl; //debug
+                            m_log << "Buffer is elif" << std::endl; //debug
                             tokens.push_back({ .type = TokenType::elif });
                             buf.clear();
                             break;
                          case TokenType::else_condition:
-                            std::cout << "Buffer is else" << std::endl; //debug
+                            m_log << "Buffer is else" << std::endl; //debug
                             tokens.push_back({ .type = TokenType::else_condition });
                             buf.clear();
                             break;
                         case TokenType::while_condition:
-                            std::cout << "Buffer is while" << std::endl; //debug
+                            m_log << "Buffer is while" << std::endl; //debug
                             tokens.push_back({ .type = TokenType::while_condition });
                             buf.clear();
                             break;
                         case TokenType::for_loop:
-                            std::cout << "Buffer is for" << std::endl; // debug
+                            m_log << "Buffer is for" << std::endl; // debug
                             tokens.push_back({.type = TokenType::for_loop});
                             buf.clear();
                             break;
                         case TokenType::ident:
-                            std::cout << "Buffer is ident" << std::endl; //debug
+                            m_log << "Buffer is ident" << std::endl; //debug
                             tokens.push_back({ .type = TokenType::ident, .value = buf });
                             buf.clear();
                             break;
                         case TokenType::fun:
-                            std::cout << "Buffer is fun" << std::endl; // debug
+                            m_log << "Buffer is fun" << std::endl; // debug
                             tokens.push_back({.type = TokenType::fun});
                             buf.clear();
                             break;
@@ -193,13 +252,16 @@ class Tokenizer {
                             buf.clear();
                             break;
                         case TokenType::print:
-                            std::cout << "Buffer is print" << std::endl; // debug
+                            m_log << "Buffer is print" << std::endl; // debug
                             tokens.push_back({.type = TokenType::print});
                             buf.clear();
                             break;
+                        case TokenType::import_kw:
+                            tokens.push_back({.type = TokenType::import_kw});
+                            buf.clear();
+                            break;
                         default:
-                            std::cerr << "Unknown token type: " << buf << std::endl;
-                            exit(EXIT_FAILURE);
+                            throw error_at(m_token_line, m_token_column, std::string("Unknown token type: ") + buf);
                     }
                 }
                 else if (std::isdigit(peek().value())) {
@@ -216,24 +278,24 @@ class Tokenizer {
                         case '(':
                             consume();
                             tokens.push_back({ .type = TokenType::open_paren});
-                            std::cout << "Buffer is (" << std::endl;
+                            m_log << "Buffer is (" << std::endl;
                             break;
                         case ')':
                             consume();
                             tokens.push_back({ .type = TokenType::close_paren});
-                            std::cout << "Buffer is )" << std::endl;
+                            m_log << "Buffer is )" << std::endl;
                             break;
                         case ';':
                             consume();
                             tokens.push_back({ .type = TokenType::semi});
-                            std::cout << "Buffer is ;" << std::endl;
+                            m_log << "Buffer is ;" << std::endl;
                             break;
                         case '=':                                       //comparison eq. assignment is 'be'
                             if(peek(1).has_value() && peek(1).value() == '='){
                                 consume();
                                 consume();
                                 tokens.push_back({ .type = TokenType::eq_eq});
-                                std::cout << "Buffer is ==" << std::endl;
+                                m_log << "Buffer is ==" << std::endl;
                                 break;
                             }
                             consume();
@@ -244,51 +306,72 @@ class Tokenizer {
                                 consume();
                                 consume();
                                 tokens.push_back({ .type = TokenType::greater_eq});
-                                std::cout << "Buffer is >=" << std::endl;
+                                m_log << "Buffer is >=" << std::endl;
                                 break;
                             }
                             consume();
                             tokens.push_back({ .type = TokenType::greater_than});
-                            std::cout << "Buffer is >" << std::endl;
+                            m_log << "Buffer is >" << std::endl;
                             break;
                         case '<':
                             if(peek(1).has_value() && peek(1).value()=='='){
                                 consume();
                                 consume();
                                 tokens.push_back({ .type = TokenType::less_eq});
-                                std::cout << "Buffer is <=" << std::endl;
+                                m_log << "Buffer is <=" << std::endl;
                                 break;
                             }
                             consume();
                             tokens.push_back({ .type = TokenType::less_than});
-                            std::cout << "Buffer is <" << std::endl;
+                            m_log << "Buffer is <" << std::endl;
                             break;
                         case '!':
                             if(peek(1).has_value() && peek(1).value()=='='){
                                 consume();
                                 consume();
                                 tokens.push_back({ .type = TokenType::n_eq});
-                                std::cout << "Buffer is !=" << std::endl;
+                                m_log << "Buffer is !=" << std::endl;
                                 break;
                             }
+                            consume();
+                            tokens.push_back({ .type = TokenType::log_not});
+                            m_log << "Buffer is !" << std::endl;
                             break;
+                        case '&':
+                            if(peek(1).has_value() && peek(1).value()=='&'){
+                                consume();
+                                consume();
+                                tokens.push_back({ .type = TokenType::log_and});
+                                m_log << "Buffer is &&" << std::endl;
+                                break;
+                            }
+                            throw error_at(m_token_line, m_token_column, std::string("Unknown token: ") + currentChar);
+                        case '|':
+                            if(peek(1).has_value() && peek(1).value()=='|'){
+                                consume();
+                                consume();
+                                tokens.push_back({ .type = TokenType::log_or});
+                                m_log << "Buffer is ||" << std::endl;
+                                break;
+                            }
+                            throw error_at(m_token_line, m_token_column, std::string("Unknown token: ") + currentChar);
                         case '+':
                             if(peek(1).has_value() && peek(1).value() == '+' && peek(2).has_value() 
                                 && peek(2).value() == '+'){
                                 consume();
                                 consume();
                                 tokens.push_back({ .type = TokenType::uni_plus});
-                                std::cout << "Buffer is ++" << std::endl;
+                                m_log << "Buffer is ++" << std::endl;
                                 break;
                             }
                             consume();
                             tokens.push_back({ .type = TokenType::plus});
-                            std::cout << "Buffer is +" << std::endl;
+                            m_log << "Buffer is +" << std::endl;
                             break;
                         case '*':
                             consume();
                             tokens.push_back({ .type = TokenType::star});
-                            std::cout << "Buffer is *" << std::endl;
+                            m_log << "Buffer is *" << std::endl;
                             break;
                         case '-':
                             if(peek(1).has_value() && peek(1).value() == '-' &&
@@ -296,33 +379,33 @@ class Tokenizer {
                                 consume();
                                 consume();
                                 tokens.push_back({ .type = TokenType::uni_sub});
-                                std::cout << "Buffer is --" << std::endl;
+                                m_log << "Buffer is --" << std::endl;
                                 break;
                             }
                             consume();
                             tokens.push_back({ .type = TokenType::sub});
-                            std::cout << "Buffer is -" << std::endl;
+                            m_log << "Buffer is -" << std::endl;
                             break;
                         case '/':
                             consume();
                             tokens.push_back({ .type = TokenType::div});
-                            std::cout << "Buffer is div" << std::endl;
+                            m_log << "Buffer is div" << std::endl;
                             break;
                         case '{':
                             consume();
                             tokens.push_back({ .type = TokenType::open_curly});
-                            std::cout << "Buffer is {" << std::endl;
+                            m_log << "Buffer is {" << std::endl;
                             break;
                         case '}':
                             consume();
                             tokens.push_back({ .type = TokenType::close_curly});
-                            std::cout << "Buffer is }" << std::endl;
+                            m_log << "Buffer is }" << std::endl;
                             break;
                         case ' ':
                         case '\n':   //isspace() returns true for new line. here i have to handle it myself
                         case '\t':
                             consume();
-                            std::cout << "Space" << std::endl;
+                            m_log << "Space" << std::endl;
                             break;
                         case '#':
                             while(peek().has_value() && peek().value()!='\n'){
@@ -332,21 +415,38 @@ class Tokenizer {
                         case ',':
                             consume();
                             tokens.push_back({.type = TokenType::comma});
-                            std::cout << "Buffer is ," << std::endl;
+                            m_log << "Buffer is ," << std::endl;
+                            break;
+                        case '"':                                       //only import paths so far, no escapes
+                            consume();
+                            while(peek().has_value() && peek().value()!='"' && peek().value()!='\n'){
+                                buf.push_back(consume());
+                            }
+                            if(!peek().has_value() || peek().value()!='"'){
+                                throw error_at(m_token_line, m_token_column, "Unterminated string");
+                            }
+                            consume();
+                            tokens.push_back({ .type = TokenType::str_lit, .value = buf });
+                            buf.clear();
                             break;
                         default:
-                            std::cerr << "Unknown token: " << currentChar << std::endl;
-                            exit(EXIT_FAILURE);
+                            throw error_at(m_token_line, m_token_column, std::string("Unknown token: ") + currentChar);
                             
                     }
                 }
+                if (tokens.size() > count) {
+                    tokens.back().line = m_token_line;
+                    tokens.back().column = m_token_column;
+                }
             }
 
-        std::cout << "\n" << std::endl;            //debug for printing tokens
+        m_log << "\n" << std::endl;            //debug for printing tokens
         for(const auto& token : tokens){
-                std::cout <<"Token: " << token.type << " " << token.value.value_or("") << std::endl; //debug
+                m_log <<"Token: " << token.type << " " << token.value.value_or("") << std::endl; //debug
             }
             m_index = 0;
+            m_line = m_first_line;
+            m_column = 1;
             return tokens;
         }
 
@@ -363,9 +463,93 @@ class Tokenizer {
 
         inline char consume()
         {
-            return m_src.at(m_index++);
+            char c = m_src.at(m_index++);
+            if (c == '\n') {
+                m_line++;
+                m_column = 1;
+            } else {
+                m_column++;
+            }
+            return c;
         }
 
         const std::string m_src;
         size_t m_index = 0;
-};
\ No newline at end of file
+        std::ostream& m_log;
+        const uint32_t m_first_line;
+        uint32_t m_line;
+        uint32_t m_column = 1;
+        uint32_t m_token_line = 0;      // where the token being read starts
+        uint32_t m_token_column = 0;
+};
+
+// Sources at least this large are tokenized on several threads
+inline constexpr size_t parallel_tokenize_min_size = 1024 * 1024;
+
+// How many threads tokenize a large source: $OGEN_TOKENIZE_THREADS, else one per core.
+// 1 tokenizes it in one piece, like a small source.
+inline size_t tokenize_threads()
+{
+    if (const char* threads = std::getenv("OGEN_TOKENIZE_THREADS"); threads && *threads) {
+        return std::max<size_t>(std::strtoul(threads, nullptr, 10), 1);
+    }
+    return std::max<size_t>(std::thread::hardware_concurrency(), 1);
+}
+
+// Tokenizes source on up to threads threads, into the same tokens as one Tokenizer. No
+// token goes past the end of a line (comments and strings stop there), so the source is
+// cut after newlines into pieces of about equal size, the pieces are tokenized side by
+// side and their tokens joined in order. Each piece counts lines from where it starts
+// in source. An error is the one of the first bad piece, which is where one Tokenizer
+// would have stopped. Only a source too small to cut writes debug output to log.
+inline std::vector<Token> tokenize_parallel(const std::string& source, size_t threads, std::ostream& log = std::cout)
+{
+    std::vector<std::string_view> pieces;
+    std::vector<uint32_t> first_lines;
+    uint32_t line = 1;
+    size_t piece_size = source.size() / std::max<size_t>(threads, 1) + 1;
+    for (size_t start = 0; start < source.size();) {
+        size_t end = source.find('\n', std::min(start + piece_size, source.size()) - 1);
+        end = end == std::string::npos ? source.size() : end + 1;
+        pieces.push_back(std::string_view(source).substr(start, end - start));
+        first_lines.push_back(line);
+        line += static_cast<uint32_t>(std::count(pieces.back().begin(), pieces.back().end(), '\n'));
+        start = end;
+    }
+    if (pieces.size() <= 1) {
+        return Tokenizer(source, log).tokenize();
+    }
+
+    std::vector<std::vector<Token>> tokens(pieces.size());
+    std::vector<std::exception_ptr> errors(pieces.size());
+    auto tokenize_piece = [&](size_t i) {
+        try {
+            // the pieces' debug output would interleave
+            tokens[i] = Tokenizer(std::string(pieces[i]), null_log(), first_lines[i]).tokenize();
+        } catch (...) {
+            errors[i] = std::current_exception();
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < pieces.size(); i++) {
+        workers.emplace_back(tokenize_piece, i);
+    }
+    tokenize_piece(0);
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < pieces.size(); i++) {
+        if (errors[i]) {
+            std::rethrow_exception(errors[i]);
+        }
+        count += tokens[i].size();
+    }
+    std::vector<Token> joined;
+    joined.reserve(count);
+    for (std::vector<Token>& piece : tokens) {
+        std::move(piece.begin(), piece.end(), std::back_inserter(joined));
+    }
+    return joined;
+}
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <string>
+
+#include "parser.hpp"
+
+// Traversal helpers shared by the AST passes. They only step one level down,
+// the passes decide themselves how to recurse.
+
+// Calls fn(NodeExpr*) for every expression held directly by stmt (conditions,
+// initializers, right hand sides). Statements nested in bodies are not visited.
+template <typename F>
+inline void for_each_expr(const NodeStmt* stmt, F&& fn)
+{
+    struct StmtVisitor {
+        F& fn;
+        void operator()(NodeStmtExit* stmt_exit) const { fn(stmt_exit->expr); }
+        void operator()(NodeStmtLet* stmt_let) const { fn(stmt_let->expr); }
+        void operator()(NodeStmtScope*) const { }
+        void operator()(NodeStmtIf* stmt_if) const { fn(stmt_if->condition); }
+        void operator()(NodeStmtWhile* stmt_while) const { fn(stmt_while->condition); }
+        void operator()(NodeStmtFor* stmt_for) const
+        {
+            if (std::holds_alternative<NodeStmtLet*>(stmt_for->init)) {
+                if (NodeStmtLet* init = std::get<NodeStmtLet*>(stmt_for->init)) {
+                    fn(init->expr);
+                }
+            } else if (NodeStmtAssign* init = std::get<NodeStmtAssign*>(stmt_for->init)) {
+                fn(init->rhs);
+            }
+            fn(stmt_for->condition);
+            if (stmt_for->change) {
+                fn(stmt_for->change->rhs);
+            }
+        }
+        void operator()(NodeStmtAssign* stmt_assign) const { fn(stmt_assign->rhs); }
+        void operator()(NodeStmtFun*) const { }
+        void operator()(NodeStmtPrint* stmt_print) const { fn(stmt_print->expr); }
+        void operator()(NodeStmtReturn* stmt_return) const { fn(stmt_return->expr); }
+    };
+    std::visit(StmtVisitor { .fn = fn }, stmt->var);
+}
+
+// Calls fn(std::vector<NodeStmt*>&) for every statement list nested directly in
+// stmt. The elif arms of an if are handed over as one list of NodeStmtIf.
+template <typename F>
+inline void for_each_body(const NodeStmt* stmt, F&& fn)
+{
+    struct StmtVisitor {
+        F& fn;
+        void operator()(NodeStmtExit*) const { }
+        void operator()(NodeStmtLet*) const { }
+        void operator()(NodeStmtScope* scope) const { fn(scope->stmts); }
+        void operator()(NodeStmtIf* stmt_if) const
+        {
+            fn(stmt_if->body);
+            fn(stmt_if->elif_body);
+            fn(stmt_if->else_body);
+        }
+        void operator()(NodeStmtWhile* stmt_while) const { fn(stmt_while->body); }
+        void operator()(NodeStmtFor* stmt_for) const { fn(stmt_for->body); }
+        void operator()(NodeStmtAssign*) const { }
+        void operator()(NodeStmtFun* stmt_fun) const { fn(stmt_fun->body->stmts); }
+        void operator()(NodeStmtPrint*) const { }
+        void operator()(NodeStmtReturn*) const { }
+    };
+    std::visit(StmtVisitor { .fn = fn }, stmt->var);
+}
+
+// Calls fn(NodeExpr*) for each direct operand of expr: both sides of a binary
+// expression, the inside of parentheses or `!` and the arguments of a call.
+template <typename F>
+inline void for_each_operand(const NodeExpr* expr, F&& fn)
+{
+    if (std::holds_alternative<NodeBinExpr*>(expr->var)) {
+        std::visit([&](auto* bin) {
+            fn(bin->lhs);
+            fn(bin->rhs);
+        }, std::get<NodeBinExpr*>(expr->var)->var);
+        return;
+    }
+    NodeTerm* term = std::get<NodeTerm*>(expr->var);
+    if (std::holds_alternative<NodeTermParen*>(term->var)) {
+        fn(std::get<NodeTermParen*>(term->var)->expr);
+    } else if (std::holds_alternative<NodeTermNot*>(term->var)) {
+        fn(std::get<NodeTermNot*>(term->var)->expr);
+    } else if (std::holds_alternative<NodeTermFunCall*>(term->var)) {
+        for (NodeExpr* arg : std::get<NodeTermFunCall*>(term->var)->args) {
+            fn(arg);
+        }
+    }
+}
+
+// The comparison expr is, or nullptr if it is something else.
+inline const NodeBinExprCmp* as_comparison(const NodeExpr* expr)
+{
+    if (!std::holds_alternative<NodeBinExpr*>(expr->var)
+        || !std::holds_alternative<NodeBinExprCmp*>(std::get<NodeBinExpr*>(expr->var)->var)) {
+        return nullptr;
+    }
+    return std::get<NodeBinExprCmp*>(std::get<NodeBinExpr*>(expr->var)->var);
+}
+
+// Number of nodes in expr, used as a rough measure of code size.
+inline size_t expr_size(const NodeExpr* expr)
+{
+    size_t size = 1;
+    for_each_operand(expr, [&](const NodeExpr* operand) { size += expr_size(operand); });
+    return size;
+}
+
+// Number of times the identifier name is read in expr.
+inline size_t count_uses(const NodeExpr* expr, const std::string& name)
+{
+    if (std::holds_alternative<NodeTerm*>(expr->var)
+        && std::holds_alternative<NodeTermIdent*>(std::get<NodeTerm*>(expr->var)->var)) {
+        return std::get<NodeTermIdent*>(std::get<NodeTerm*>(expr->var)->var)->ident.value.value() == name;
+    }
+    size_t uses = 0;
+    for_each_operand(expr, [&](const NodeExpr* operand) { uses += count_uses(operand, name); });
+    return uses;
+}
+
+// true if evaluating expr calls a function. Everything else an expression can do is free of side effects.
+inline bool has_call(const NodeExpr* expr)
+{
+    if (std::holds_alternative<NodeTerm*>(expr->var)
+        && std::holds_alternative<NodeTermFunCall*>(std::get<NodeTerm*>(expr->var)->var)) {
+        return true;
+    }
+    bool found = false;
+    for_each_operand(expr, [&](const NodeExpr* operand) { found = found || has_call(operand); });
+    return found;
+}
+
+// Calls fn(const std::string&) for every identifier read in expr.
+template <typename F>
+inline void for_each_ident(const NodeExpr* expr, F&& fn)
+{
+    if (std::holds_alternative<NodeTerm*>(expr->var)
+        && std::holds_alternative<NodeTermIdent*>(std::get<NodeTerm*>(expr->var)->var)) {
+        fn(std::get<NodeTermIdent*>(std::get<NodeTerm*>(expr->var)->var)->ident.value.value());
+        return;
+    }
+    for_each_operand(expr, [&](const NodeExpr* operand) { for_each_ident(operand, fn); });
+}
+
+// Number of statement and expression nodes in stmts, including nested bodies.
+inline size_t stmts_size(const std::vector<NodeStmt*>& stmts)
+{
+    size_t size = 0;
+    for (const NodeStmt* stmt : stmts) {
+        size++;
+        for_each_expr(stmt, [&](const NodeExpr* expr) { size += expr_size(expr); });
+        for_each_body(stmt, [&](const std::vector<NodeStmt*>& body) { size += stmts_size(body); });
+    }
+    return size;
+}
+
+// Name for the next variable a pass adds, as `$licm0`, `$licm1`, ... for pass "licm".
+// `$` can't appear in source identifiers, so the name never clashes.
+inline std::string temp_name(const std::string& pass, size_t& counter)
+{
+    return "$" + pass + std::to_string(counter++);
+}
@@ -0,0 +1,253 @@
+#pragma once
+
+#include <chrono>
+#include <poll.h>
+#include <sys/inotify.h>
+
+#include "modules.hpp"
+
+// Splits source into its top-level statements, as the text of each. A statement ends
+// with a `;` or a `}` outside of any parentheses and braces, except for a `}` followed
+// by elif or else. Comments and blank lines go with the statement after them, whatever
+// is left at the end is one more piece. Only finds the pieces, the parser still decides
+// whether they are statements.
+inline std::vector<std::string_view> split_statements(std::string_view source)
+{
+    std::vector<std::string_view> stmts;
+    size_t start = 0;
+    int depth = 0;
+    // the next word at i, after blanks and comments
+    auto next_word = [&](size_t i) {
+        while (i < source.size()) {
+            if (source[i] == '#') {
+                i = std::min(source.find('\n', i), source.size());
+            } else if (std::isspace(static_cast<unsigned char>(source[i]))) {
+                i++;
+            } else {
+                break;
+            }
+        }
+        size_t end = i;
+        while (end < source.size() && (std::isalnum(static_cast<unsigned char>(source[end])) || source[end] == '_')) {
+            end++;
+        }
+        return source.substr(i, end - i);
+    };
+    for (size_t i = 0; i < source.size(); i++) {
+        char c = source[i];
+        if (c == '#') {
+            i = std::min(source.find('\n', i), source.size()) - 1;
+        } else if (c == '"') {
+            i = std::min(source.find('"', i + 1), source.size() - 1);
+        } else if (c == '(' || c == '{') {
+            depth++;
+        } else if (c == ')' || c == '}') {
+            depth = std::max(depth - 1, 0);
+        }
+        bool end = depth == 0 && (c == ';' || (c == '}' && next_word(i + 1) != "elif" && next_word(i + 1) != "else"));
+        if (end) {
+            stmts.push_back(source.substr(start, i + 1 - start));
+            start = i + 1;
+        }
+    }
+    if (source.find_first_not_of(" \t\n\r", start) != std::string_view::npos) {
+        // trailing comments alone parse to nothing, anything else gets its error
+        stmts.push_back(source.substr(start));
+    }
+    return stmts;
+}
+
+// --watch: builds a file, then builds it again every time it is saved. Each build only
+// parses the top-level statements whose text changed and only generates the functions
+// whose statement changed, everything else comes from the previous builds. The pieces
+// are spliced into one program for nasm and ld.
+//
+// For that a function's code must depend on nothing but its own text, so watch builds
+// leave out the interprocedural passes, generate every function whether it is called or
+// not and always include the print runtime. Errors are reported and the watcher waits
+// for the next save.
+class Watcher {
+public:
+    inline Watcher(std::filesystem::path path, Options options, Target target)
+        : m_path(std::move(path))
+        , m_options(options)
+        , m_target(std::move(target))
+        , m_allocator(arena_size)
+    {
+    }
+
+    // watches until the process is killed, returns only if the file can't be watched
+    int run()
+    {
+        std::filesystem::path dir = m_path.parent_path().empty() ? "." : m_path.parent_path();
+        // editors often save by renaming a new file over the old one, so the directory is watched
+        int fd = inotify_init1(IN_CLOEXEC);
+        if (fd < 0 || inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+            std::cerr << "Could not watch " << dir.string() << ": " << std::strerror(errno) << std::endl;
+            return EXIT_FAILURE;
+        }
+        rebuild();
+
+        alignas(inotify_event) char buffer[4096];
+        while (true) {
+            ssize_t size = read(fd, buffer, sizeof(buffer));
+            if (size < 0 && errno == EINTR) {
+                continue;
+            }
+            if (size <= 0) {
+                std::cerr << "Stopped watching " << dir.string() << ": " << std::strerror(errno) << std::endl;
+                return EXIT_FAILURE;
+            }
+            bool changed = false;
+            for (ssize_t at = 0; at < size;) {
+                const auto* event = reinterpret_cast<const inotify_event*>(buffer + at);
+                changed = changed || (event->len > 0 && m_path.filename() == event->name);
+                at += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+            }
+            if (!changed) {
+                continue;
+            }
+            // a save can take several writes, build once they stop coming
+            pollfd pending { .fd = fd, .events = POLLIN, .revents = 0 };
+            while (poll(&pending, 1, settle_ms) > 0 && read(fd, buffer, sizeof(buffer)) > 0) {
+            }
+            rebuild();
+        }
+    }
+
+private:
+    static constexpr int settle_ms = 20;
+
+    void rebuild()
+    {
+        auto begin = std::chrono::steady_clock::now();
+        std::optional<std::string> source = read_file(m_path);
+        if (!source) {
+            std::cerr << "Could not read " << m_path.string() << std::endl;
+            return;
+        }
+        if (has_imports(source.value())) {
+            std::cerr << "--watch doesn't follow imports, build " << m_path.string() << " without it" << std::endl;
+            return;
+        }
+        size_t generated = 0;
+        size_t functions = 0;
+        m_allocator.reset();
+        try {
+            std::string asm_source = compile(source.value(), generated, functions);
+            m_allocator.reset();
+            if (!emit_outputs(asm_source, m_target, m_options.debug_info, nullptr, "", nullptr)) {
+                std::cerr << "Build failed, waiting for changes" << std::endl;
+                return;
+            }
+        } catch (const CompileError& error) {
+            m_allocator.reset();
+            std::cerr << error.what() << std::endl;
+            std::cerr << "Build failed, waiting for changes" << std::endl;
+            return;
+        } catch (const std::bad_alloc&) {
+            m_allocator.reset();
+            std::cerr << "Program too large" << std::endl;
+            return;
+        }
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin);
+        std::cerr << "Built " << m_path.string() << " in " << elapsed.count() / 1000.0 << " ms, generated "
+                  << generated << " of " << functions << " functions" << std::endl;
+    }
+
+    // the spliced assembly of source, counting the functions it had to generate
+    std::string compile(const std::string& source, size_t& generated, size_t& functions)
+    {
+        // every statement as the parser made it, from its text or from the parse of the same
+        // text before, moved to the line it is on now
+        NodeProg prog;
+        std::vector<uint64_t> hashes;
+        std::unordered_set<uint64_t> used;
+        uint32_t line = 1;
+        for (std::string_view text : split_statements(source)) {
+            uint64_t hash = xxh64::hash(text);
+            used.insert(hash);
+            auto it = m_parsed.find(hash);
+            std::vector<NodeStmt*> stmts;
+            if (it == m_parsed.end()) {
+                NodeProg parsed = parse(std::string(text), m_allocator, line);
+                m_parsed.emplace(hash, Parsed { .ast = AstWriter(hash).write(parsed), .line = line });
+                stmts = parsed.stmts;
+            } else {
+                AstFile file { std::string_view(it->second.ast) };
+                int64_t offset = static_cast<int64_t>(line) - it->second.line;
+                std::optional<NodeProg> read = AstReader(file, m_allocator, offset).read();
+                stmts = read.value().stmts;
+            }
+            line += static_cast<uint32_t>(std::count(text.begin(), text.end(), '\n'));
+            for (NodeStmt* stmt : stmts) {
+                prog.stmts.push_back(stmt);
+                hashes.push_back(hash);
+            }
+        }
+        std::erase_if(m_parsed, [&](const auto& entry) { return !used.contains(entry.first); });
+
+        // the call graph still covers the whole program, --auto-memo decisions depend on it
+        Generator generator(prog, m_options, { .incremental = true }, null_log());
+        if (!m_runtime) {
+            m_runtime = generator.gen_runtime_chunk();
+        }
+        std::vector<const Generator::Chunk*> chunks { &m_runtime.value() };
+        std::vector<NodeStmt*> top_level;
+        std::string top_level_key;
+        std::unordered_set<std::string> keys;
+        for (size_t i = 0; i < prog.stmts.size(); i++) {
+            NodeStmt* stmt = prog.stmts[i];
+            if (!std::holds_alternative<NodeStmtFun*>(stmt->var)) {
+                top_level.push_back(stmt);
+                top_level_key += hash_hex(hashes[i]) + line_key(stmt);
+                continue;
+            }
+            functions++;
+            std::string key = hash_hex(hashes[i]) + (generator.memoizes(std::get<NodeStmtFun*>(stmt->var)) ? " memo" : "")
+                + line_key(stmt);
+            keys.insert(key);
+            auto it = m_chunks.find(key);
+            if (it == m_chunks.end()) {
+                NodeProg fun { .stmts = { stmt } };
+                optimize(fun, m_allocator, false);
+                it = m_chunks.emplace(key, generator.gen_fun_chunk(stmt)).first;
+                generated++;
+            }
+            chunks.push_back(&it->second);
+        }
+        // _start is all top-level statements together
+        keys.insert(top_level_key);
+        auto it = m_chunks.find(top_level_key);
+        if (it == m_chunks.end()) {
+            NodeProg start { .stmts = top_level };
+            optimize(start, m_allocator, false);
+            it = m_chunks.emplace(top_level_key, generator.gen_start_chunk(start.stmts)).first;
+        }
+        chunks.push_back(&it->second);
+
+        std::string asm_source = Generator::splice(chunks);
+        std::erase_if(m_chunks, [&](const auto& entry) { return !keys.contains(entry.first); });
+        return asm_source;
+    }
+
+    // with -g a function's code names its lines, it is only reused where it was
+    [[nodiscard]] std::string line_key(const NodeStmt* stmt) const
+    {
+        return m_options.debug_info ? " line " + std::to_string(stmt->line) : "";
+    }
+
+    // the parse of a statement's text, made when it started at line
+    struct Parsed {
+        std::string ast;
+        uint32_t line;
+    };
+
+    std::filesystem::path m_path;
+    Options m_options;
+    Target m_target;
+    ArenaAllocator m_allocator;
+    std::unordered_map<uint64_t, Parsed> m_parsed;                  // text hash -> AST of the statements
+    std::map<std::string, Generator::Chunk> m_chunks;               // function text hash -> code, and _start by the hashes of all top-level statements
+    std::optional<Generator::Chunk> m_runtime;
+};
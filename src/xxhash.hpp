@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+// XXH64 (github.com/Cyan4973/xxHash), the 64 bit non-cryptographic hash. Fast enough
+// to key caches by whole files.
+namespace xxh64 {
+
+inline constexpr uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+inline constexpr uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+inline constexpr uint64_t prime3 = 0x165667B19E3779F9ULL;
+inline constexpr uint64_t prime4 = 0x85EBCA77C2B2AE63ULL;
+inline constexpr uint64_t prime5 = 0x27D4EB2F165667C5ULL;
+
+inline uint64_t rotl(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+inline uint64_t read64(const uint8_t* at)
+{
+    uint64_t value;
+    std::memcpy(&value, at, sizeof(value));
+    return value;
+}
+
+inline uint32_t read32(const uint8_t* at)
+{
+    uint32_t value;
+    std::memcpy(&value, at, sizeof(value));
+    return value;
+}
+
+inline uint64_t round(uint64_t acc, uint64_t input)
+{
+    return rotl(acc + input * prime2, 31) * prime1;
+}
+
+inline uint64_t merge_round(uint64_t acc, uint64_t value)
+{
+    return (acc ^ round(0, value)) * prime1 + prime4;
+}
+
+// little endian hosts only, like the rest of the compiler
+inline uint64_t hash(std::string_view data, uint64_t seed = 0)
+{
+    const auto* at = reinterpret_cast<const uint8_t*>(data.data());
+    const uint8_t* const end = at + data.size();
+    uint64_t h;
+    if (data.size() >= 32) {
+        uint64_t v1 = seed + prime1 + prime2;
+        uint64_t v2 = seed + prime2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - prime1;
+        do {
+            v1 = round(v1, read64(at));
+            v2 = round(v2, read64(at + 8));
+            v3 = round(v3, read64(at + 16));
+            v4 = round(v4, read64(at + 24));
+            at += 32;
+        } while (end - at >= 32);
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge_round(h, v1);
+        h = merge_round(h, v2);
+        h = merge_round(h, v3);
+        h = merge_round(h, v4);
+    } else {
+        h = seed + prime5;
+    }
+    h += data.size();
+
+    for (; end - at >= 8; at += 8) {
+        h ^= round(0, read64(at));
+        h = rotl(h, 27) * prime1 + prime4;
+    }
+    if (end - at >= 4) {
+        h ^= read32(at) * prime1;
+        h = rotl(h, 23) * prime2 + prime3;
+        at += 4;
+    }
+    for (; at < end; at++) {
+        h ^= *at * prime5;
+        h = rotl(h, 11) * prime1;
+    }
+
+    h ^= h >> 33;
+    h *= prime2;
+    h ^= h >> 29;
+    h *= prime3;
+    h ^= h >> 32;
+    return h;
+}
+
+}
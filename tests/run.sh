@@ -0,0 +1,377 @@
+#!/bin/bash
+# Runs every tests/*.og and compares what it prints with the .out file next to it and
+# its exit status with the `# expect: N` line. A `# flags: ...` line is added to every
+# compilation of the program. A `# present: <regex>` line names code that must be in
+# the generated assembly, an `# absent: <regex>` line code that must not.
+# With `# output: summary` the .out file only has the line count and checksum of the
+# output. A `# native: N` line is the exit status of the assembled program when it dies
+# of a signal, where --run and --interpret print an error. Each program runs in memory
+# with --run under every set of flags in variants and, when nasm and ld are installed,
+# is also assembled and linked. Unless it uses --auto-memo it also runs once with
+# --interpret and once more from the .ogb file that run wrote, and a few broken .ogb
+# files check the bytecode checker.
+# Programs are cached in a fresh directory, and one more program is built twice to see
+# the cache miss and then hit. A compile server is started for a --client build, which
+# without one falls back to building locally. -o is tried with each --emit kind. The
+# files tests/*.og import are in tests/modules, where they aren't run by themselves.
+# Those imports are also run from AST files written with --emit=ast. A --watch build is
+# changed once to see that only the edited function is generated again. A generated
+# source over 1MB is tokenized on one thread and on 8 to compare the results, error
+# positions included, and a -g build has to carry line information.
+#
+# usage: tests/run.sh [ogen]     the compiler defaults to build/ogen
+
+ogen=$(realpath "${1:-build/ogen}")
+tests=$(dirname "$(realpath "$0")")
+variants=("" "-fomit-frame-pointer" "--unroll=1" "--unroll=8" "-fomit-frame-pointer --unroll=8")
+native=$(command -v nasm >/dev/null && command -v ld >/dev/null && echo 1)
+[ -n "$native" ] || echo "nasm or ld not found, skipping the assembled programs"
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+export OGEN_CACHE_DIR="$work/cache"
+failed=0
+
+fail() {
+    echo "FAIL $*"
+    failed=1
+}
+
+# check <test> <how> <status> <output file>
+check() {
+    if [ "$summary" ]; then
+        echo "$(wc -l < "$4") lines, cksum $(cksum < "$4" | cut -d' ' -f1)" > "$4.summary"
+        set -- "$1" "$2" "$3" "$4.summary"
+    fi
+    if [ "$3" != "$expect" ]; then
+        fail "$1 ($2): exit status $3, expected $expect"
+    elif ! cmp -s "$4" "$tests/$1.out"; then
+        fail "$1 ($2): output differs from $1.out"
+        diff "$4" "$tests/$1.out" | head -5
+    fi
+}
+
+for source in "$tests"/*.og; do
+    name=$(basename "$source" .og)
+    expect=$(sed -n 's/^# expect: //p' "$source")
+    flags=$(sed -n 's/^# flags: //p' "$source")
+    present=$(sed -n 's/^# present: //p' "$source")
+    absent=$(sed -n 's/^# absent: //p' "$source")
+    summary=$(grep -x '# output: summary' "$source")
+    native_status=$(sed -n 's/^# native: //p' "$source")
+    for variant in "${variants[@]}"; do
+        (cd "$work" && "$ogen" "$source" --run $flags $variant > run.txt 2>&1)
+        check "$name" "--run $flags $variant" $? "$work/run.txt"
+        [ -n "$native" ] || continue
+        rm -f "$work/out"
+        # the shell's message when the program dies of a signal isn't part of the output
+        (cd "$work" && "$ogen" "$source" $flags $variant > /dev/null && ./out > out.txt 2>&1) 2> /dev/null
+        status=$?
+        if [ -z "$native_status" ]; then
+            check "$name" "nasm $flags $variant" $status "$work/out.txt"
+        elif [ $status != "$native_status" ]; then
+            fail "$name (nasm $flags $variant): exit status $status, expected $native_status"
+        fi
+        if [ -n "$present" ] && ! grep -qE "$present" "$work/out.asm"; then
+            fail "$name ($variant): the assembly has no $present"
+        fi
+        if [ -n "$absent" ] && grep -qE "$absent" "$work/out.asm"; then
+            fail "$name ($variant): the assembly has $absent"
+        fi
+    done
+    [[ "$flags" == *--auto-memo* ]] && continue
+    (cd "$work" && "$ogen" "$source" --interpret --emit-bytecode=prog.ogb $flags > interpret.txt 2>&1)
+    check "$name" "--interpret $flags" $? "$work/interpret.txt"
+    (cd "$work" && "$ogen" prog.ogb > ogb.txt 2>&1)
+    check "$name" "prog.ogb" $? "$work/ogb.txt"
+done
+
+# bytecode files the interpreter has to refuse: main pushing in a loop past max_stack,
+# the same loop with room to spare, which still grows the stack, an add on an empty
+# stack, and a call to a function of two parameters with only one argument
+header='\x4f\x47\x42\x43\x01\x00\x00\x00'
+invalid=(
+    '\x01\x00\x00\x00\x04\x00\x00\x00main\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x0e\x00\x00\x00\x00\x07\x00\x00\x00\x00\x00\x00\x00\x0e\x00\x00\x00\x00'
+    '\x01\x00\x00\x00\x04\x00\x00\x00main\x00\x00\x00\x00\x00\x00\x00\x00\x64\x00\x00\x00\x0e\x00\x00\x00\x00\x07\x00\x00\x00\x00\x00\x00\x00\x0e\x00\x00\x00\x00'
+    '\x01\x00\x00\x00\x04\x00\x00\x00main\x00\x00\x00\x00\x00\x00\x00\x00\x04\x00\x00\x00\x0b\x00\x00\x00\x03\x00\x00\x00\x00\x00\x00\x00\x00\x00\x15'
+    '\x02\x00\x00\x00\x04\x00\x00\x00main\x00\x00\x00\x00\x00\x00\x00\x00\x04\x00\x00\x00\x0d\x00\x00\x00\x00\x01\x00\x00\x00\x00\x00\x00\x00\x11\x01\x00\x15\x01\x00\x00\x00f\x02\x00\x00\x00\x02\x00\x00\x00\x01\x00\x00\x00\x0a\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x13'
+)
+for i in "${!invalid[@]}"; do
+    printf "$header${invalid[$i]}" > "$work/invalid.ogb"
+    output=$("$ogen" "$work/invalid.ogb" 2>&1)
+    status=$?
+    if [ $status != 1 ] || [[ "$output" != "Invalid bytecode"* ]]; then
+        fail "invalid bytecode $i: exit status $status, printed ${output:0:80}"
+    fi
+done
+
+# bytecode that can't be written is an error, not a program that silently didn't run
+output=$("$ogen" "$tests/fold.og" --emit-bytecode="$work/none/prog.ogb" 2>&1)
+status=$?
+if [ $status != 1 ] || [ "$output" != "Could not write $work/none/prog.ogb" ]; then
+    fail "--emit-bytecode into a missing directory: exit status $status, printed ${output:0:80}"
+fi
+
+# the first build of a program misses the cache and the second one hits it, in a
+# cache of its own so the counts start from zero
+for i in 1 2; do
+    OGEN_CACHE_DIR="$work/stats" "$ogen" "$tests/fold.og" --run > /dev/null 2>&1
+done
+stats=$(OGEN_CACHE_DIR="$work/stats" "$ogen" --cache-stats)
+if ! grep -qx "hits: 1" <<< "$stats" || ! grep -qx "misses: 1" <<< "$stats" || ! grep -qx "entries: 1" <<< "$stats"; then
+    fail "cache: expected a miss then a hit, --cache-stats printed: $stats"
+fi
+
+# the compile server: a --client build is done by the server, which counts it in its own
+# cache, and reports compile errors like a local build. With no server listening on the
+# socket the client builds by itself.
+OGEN_CACHE_DIR="$work/server-cache" "$ogen" --server --socket="$work/ogen.sock" --workers=2 2> /dev/null &
+server=$!
+for i in $(seq 50); do
+    [ -S "$work/ogen.sock" ] && break
+    sleep 0.1
+done
+mkdir "$work/client"
+printf 'let x = 1;\nexit(x +);\n' > "$work/client/bad.og"
+{ printf 'print('; head -c 200000 /dev/zero | tr '\0' '('; } > "$work/client/deep.og"
+awk 'BEGIN { for (i = 0; i < 100000; i++) print "print(1);" }' > "$work/client/big.og"
+local_error=$(cd "$work/client" && "$ogen" bad.og --no-cache 2>&1 > /dev/null)
+for socket in ogen.sock none.sock; do
+    error=$(cd "$work/client" && "$ogen" bad.og --no-cache --client --socket="$work/$socket" 2>&1 > /dev/null)
+    status=$?
+    if [ $status != 1 ] || [ "$error" != "$local_error" ]; then
+        fail "--client on $socket: a compile error gave exit status $status and $error"
+    fi
+    # too deep for the parser, which must not take the server down
+    error=$(cd "$work/client" && "$ogen" deep.og --no-cache --client --socket="$work/$socket" 2>&1 > /dev/null)
+    status=$?
+    if [ $status != 1 ] || [[ "$error" != *": Nested too deeply" ]]; then
+        fail "--client on $socket: 200000 nested parentheses gave exit status $status and ${error:0:80}"
+    fi
+    # more nodes than the parser's arena holds
+    error=$(cd "$work/client" && "$ogen" big.og --no-cache --client --socket="$work/$socket" 2>&1 > /dev/null)
+    status=$?
+    if [ $status != 1 ] || [ "$error" != "Program too large" ]; then
+        fail "--client on $socket: 100000 statements gave exit status $status and ${error:0:80}"
+    fi
+    rm -f "$work/client/out"
+    (cd "$work/client" && OGEN_CACHE_DIR="$work/client-cache" "$ogen" "$tests/fold.og" --client --socket="$work/$socket" > /dev/null 2>&1)
+    status=$?
+    expected=1      # without nasm both builds fail the same way
+    if [ -n "$native" ]; then
+        "$work/client/out"
+        status="$status $?"
+        expected="0 12"
+    fi
+    if [ "$status" != "$expected" ]; then
+        fail "--client on $socket: exit status $status building fold.og"
+    fi
+done
+kill $server
+wait $server 2> /dev/null
+server_stats=$(OGEN_CACHE_DIR="$work/server-cache" "$ogen" --cache-stats)
+client_stats=$(OGEN_CACHE_DIR="$work/client-cache" "$ogen" --cache-stats)
+if ! grep -qx "misses: 1" <<< "$server_stats" || ! grep -qx "misses: 1" <<< "$client_stats"; then
+    fail "--client: expected one build on the server and one local, the caches have: $server_stats $client_stats"
+fi
+
+# -o with each --emit kind writes that one file and leaves nothing else in the directory,
+# not even a temporary file, and --emit=ast prints nothing. Only the assembly and the AST
+# can be made without nasm and ld.
+for emit in asm obj exe ast; do
+    [[ -z "$native" && ($emit == obj || $emit == exe) ]] && continue
+    dir="$work/emit-$emit"
+    mkdir "$dir"
+    printed=$(cd "$dir" && "$ogen" "$tests/fold.og" --emit=$emit -o prog.$emit 2>&1)
+    status=$?
+    if [ $status != 0 ] || [ "$(ls -A "$dir")" != "prog.$emit" ]; then
+        fail "--emit=$emit -o: exit status $status, the directory has $(ls -A "$dir")"
+        continue
+    fi
+    case $emit in
+        asm) grep -q "^_start:" "$dir/prog.asm" ;;
+        obj) [ "$(head -c 4 "$dir/prog.obj" | od -An -tx1 | tr -d ' ')" = 7f454c46 ] ;;
+        exe) "$dir/prog.exe"; [ $? = 12 ] ;;
+        ast) [ "$(head -c 4 "$dir/prog.ast")" = OGAS ] && [ -z "$printed" ] ;;
+    esac || fail "--emit=$emit -o: prog.$emit is not what it should be"
+done
+
+# modules: imports.og imports a file that imports another one. After a function body in
+# the last one is edited, building again rebuilds only that file's object, which shows as
+# a new inode since objects are renamed into place. Without nasm and ld the build fails
+# like a single file's does. An import cycle is an error.
+mkdir -p "$work/modules/modules" "$work/cycle"
+cp "$tests/imports.og" "$work/modules"
+cp "$tests"/modules/*.og "$work/modules/modules"
+(cd "$work/modules" && "$ogen" imports.og > /dev/null 2>&1)
+status=$?
+if [ $status != "$([ -n "$native" ] && echo 0 || echo 1)" ]; then
+    fail "modules: building imports.og gave exit status $status"
+fi
+if [ -n "$native" ]; then
+    before=$(stat -c '%i %n' "$work"/modules/.ogen/*.o)
+fi
+sed -i 's/return a \* b;/return a * b + 1;/' "$work/modules/modules/arith.og"
+if [ -n "$native" ]; then
+    (cd "$work/modules" && "$ogen" imports.og > /dev/null 2>&1 && ./out > out.txt)
+    status=$?
+    rebuilt=$(diff <(echo "$before") <(stat -c '%i %n' "$work"/modules/.ogen/*.o) | sed -n 's|^> .*/||p')
+    if [ $status != 43 ] || [ "$(cat "$work/modules/out.txt")" != "$(printf '13\n15')" ]; then
+        fail "modules: after the edit the program exits with $status and prints $(cat "$work/modules/out.txt")"
+    elif [[ "$rebuilt" != arith-*.o ]]; then
+        fail "modules: editing arith.og rebuilt $rebuilt"
+    fi
+fi
+(cd "$work/modules" && "$ogen" imports.og --run > run.txt 2>&1)
+status=$?
+if [ $status != 43 ] || [ "$(cat "$work/modules/run.txt")" != "$(printf '13\n15')" ]; then
+    fail "modules: after the edit --run exits with $status and prints $(cat "$work/modules/run.txt")"
+fi
+printf 'import "b.og";\nfun a() {\n    return 1;\n}\n' > "$work/cycle/a.og"
+printf 'import "a.og";\nfun b() {\n    return 2;\n}\n' > "$work/cycle/b.og"
+printf 'import "a.og";\nexit(a());\n' > "$work/cycle/main.og"
+output=$("$ogen" "$work/cycle/main.og" --run 2>&1)
+status=$?
+if [ $status != 1 ] || [[ "$output" != "Import cycle: "* ]]; then
+    fail "modules: an import cycle gave exit status $status and $output"
+fi
+
+# --emit=ast: once both imported files have AST files newer than themselves, imports.og
+# runs from those alone, even with the sources replaced by text that doesn't parse. When
+# a source is newer again it is parsed instead.
+mkdir -p "$work/ast/modules"
+cp "$tests/imports.og" "$work/ast"
+cp "$tests"/modules/*.og "$work/ast/modules"
+for module in area arith; do
+    (cd "$work/ast" && "$ogen" --emit=ast modules/$module.og > /dev/null 2>&1)
+    echo "this is not ogen" > "$work/ast/modules/$module.og"
+    touch -d "1 hour ago" "$work/ast/modules/$module.og"
+done
+(cd "$work/ast" && "$ogen" imports.og --run > run.txt 2>&1)
+status=$?
+if [ $status != 42 ] || ! cmp -s "$work/ast/run.txt" "$tests/imports.out"; then
+    fail "--emit=ast: imports.og exits with $status and prints $(cat "$work/ast/run.txt")"
+fi
+touch "$work/ast/modules/arith.og"
+if (cd "$work/ast" && "$ogen" imports.og --run > /dev/null 2>&1); then
+    fail "--emit=ast: the AST file of arith.og was used after the source changed"
+fi
+
+# --watch: the first build generates both functions, saving the file with the body of one
+# of them changed generates only that one. The elif chain and the comments must not
+# split statements in the wrong places, or the pieces wouldn't parse.
+mkdir "$work/watch"
+cat > "$work/watch/prog.og" << 'EOF'
+# sign(x); } elif {
+fun sign(x) {
+    if (x < 0) {
+        return 0 - 1;
+    } elif (x == 0) {   # } else {
+        return 0;
+    }
+    # ;
+    else {
+        return 1;
+    }
+}
+fun twice(x) {
+    return x + x;
+}
+exit(sign(5) + twice(3));
+EOF
+(cd "$work/watch" && exec "$ogen" prog.og --watch --emit=asm > /dev/null 2> watch.txt) &
+watcher=$!
+built() {
+    for i in $(seq 50); do
+        grep -q "$1" "$work/watch/watch.txt" && return 0
+        sleep 0.1
+    done
+    return 1
+}
+if ! built "generated 2 of 2 functions"; then
+    fail "--watch: the first build printed $(cat "$work/watch/watch.txt")"
+else
+    sed -i 's/return x + x;/return x * 2;/' "$work/watch/prog.og"
+    built "generated 1 of 2 functions" || fail "--watch: the rebuild printed $(cat "$work/watch/watch.txt")"
+fi
+kill $watcher
+wait $watcher 2> /dev/null
+
+# a source over 1MB is tokenized in pieces on 8 threads and must give what one piece does:
+# the same AST and output, and with bad characters at the end of one piece and the start
+# of the next, the error of the first. Lines are 64 bytes so the pieces can be worked out
+# here: each one ends at the line end at or after size / threads + 1 bytes into it. With 8
+# pieces some start at a statement, some inside one and some at a comment.
+awk 'function line(s) { printf "%-63s\n", s }
+BEGIN {
+    line("let x = 0;")
+    for (i = 1; i <= 5500; i++) {
+        line("x = (x +")
+        line("    " i ") - " i - 1 ";   # a statement over two lines")
+        line("# a comment; with } and \" in it")
+    }
+    line("print(x);")
+    line("exit(0);")
+}' > "$work/large.og"
+# parallel <args>: the output and status of ogen on 1 thread, then on 8
+parallel() {
+    for threads in 1 8; do
+        OGEN_TOKENIZE_THREADS=$threads "$ogen" "$@" 2>&1
+        echo "exit status $?"
+    done
+}
+for threads in 1 8; do
+    OGEN_TOKENIZE_THREADS=$threads "$ogen" "$work/large.og" --emit=ast -o "$work/large-$threads.ast" > /dev/null 2>&1
+done
+output=$(parallel "$work/large.og" --interpret)
+if ! cmp -s "$work/large-1.ast" "$work/large-8.ast" || [ "$output" != "$(printf '5500\nexit status 0\n5500\nexit status 0')" ]; then
+    fail "large source: 8 threads differ from one, --interpret printed $output"
+fi
+size=$(stat -c %s "$work/large.og")
+start=0
+while [ $start -lt $size ]; do
+    end=$(( (start + size / 8 + 1 + 63) / 64 * 64 ))
+    end=$(( end < size ? end : size ))
+    if [ $start -gt 0 ]; then
+        first=$((start / 64 + 1))
+        sed "$((first - 1))s/^./@/; ${first}s/^./?/" "$work/large.og" > "$work/bad.og"
+        output=$(parallel "$work/bad.og" --interpret)
+        if [ "$output" != "$(printf '%s: Unknown token: @\nexit status 1\n' $((first - 1)):1{,})" ]; then
+            fail "large source: with errors at lines $((first - 1)) and $first, 1 and 8 threads printed $output"
+        fi
+        # a parse error on the first line of the piece, placed by the tokens' positions
+        sed "${first}s/.*/exit(;/" "$work/large.og" > "$work/bad.og"
+        output=$(parallel "$work/bad.og" --interpret)
+        if [ "$(sed -n 1,2p <<< "$output")" != "$(sed -n 3,4p <<< "$output")" ] || [[ "$output" != "$first:"[16]": "* ]]; then
+            fail "large source: with a parse error at line $first, 1 and 8 threads printed $output"
+        fi
+    fi
+    start=$end
+done
+
+# -g: the assembly has %line directives for the first statement of many() and for the
+# exit, naming the source by its path or as --source-name says. Assembled, the object has
+# a DWARF line table and the program exits as without -g.
+mkdir "$work/debug"
+(cd "$work/debug" && "$ogen" "$tests/many_args.og" -g --emit=asm -o path.asm > /dev/null 2>&1)
+(cd "$work/debug" && "$ogen" "$tests/many_args.og" -g --emit=asm -o named.asm --source-name=many.og > /dev/null 2>&1)
+for lines in "path.asm $tests/many_args.og" "named.asm many.og"; do
+    set -- $lines
+    if ! grep -qx "%line 3+0 $2" "$work/debug/$1" || ! grep -qx "%line 14+0 $2" "$work/debug/$1"; then
+        fail "-g: $1 has no %line directives for lines 3 and 14 of $2"
+    elif grep "^%line" "$work/debug/$1" | grep -qv " $2$"; then
+        fail "-g: $1 has %line directives for other files than $2"
+    fi
+done
+if [ -n "$native" ]; then
+    (cd "$work/debug" && "$ogen" "$tests/many_args.og" -g > /dev/null 2>&1 && ./out)
+    status=$?
+    if [ $status != 58 ]; then
+        fail "-g: many_args exits with $status"
+    elif command -v readelf > /dev/null && ! readelf -S "$work/debug/out.o" | grep -q debug_line; then
+        fail "-g: out.o has no .debug_line section"
+    fi
+fi
+
+[ $failed = 0 ] && echo "all tests passed"
+exit $failed
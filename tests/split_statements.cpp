@@ -0,0 +1,54 @@
+// Checks how --watch splits a file into top-level statements: if/elif/else chains stay
+// one statement, and `;`, `}` and `#` inside comments and strings don't split anything.
+
+#include <iostream>
+#include <string_view>
+#include <vector>
+
+#include "../src/watch.hpp"
+
+namespace {
+
+int failed = 0;
+
+void check(std::string_view source, const std::vector<std::string_view>& expected)
+{
+    std::vector<std::string_view> stmts = split_statements(source);
+    if (stmts == expected) {
+        return;
+    }
+    failed = 1;
+    std::cout << "FAIL split_statements of:\n" << source << "\ngave " << stmts.size() << " statements:\n";
+    for (std::string_view stmt : stmts) {
+        std::cout << "[" << stmt << "]\n";
+    }
+}
+
+}
+
+int main()
+{
+    check("let x = 1;\nexit(x);\n", { "let x = 1;", "\nexit(x);" });
+
+    // a chain ends at the last block, however the elif and else are spaced or commented
+    check("if (x) {\n    a = 1;\n} elif (y) {\n    a = 2;\n}\n# comment\nelif (z) {\n} else {\n    a = 3;\n}\nexit(a);",
+        { "if (x) {\n    a = 1;\n} elif (y) {\n    a = 2;\n}\n# comment\nelif (z) {\n} else {\n    a = 3;\n}", "\nexit(a);" });
+    check("if (x) {\n}\nlet elsewhere = 1;", { "if (x) {\n}", "\nlet elsewhere = 1;" });
+
+    // functions, with nested blocks and a call in the condition
+    check("fun f(a) {\n    if (g(a, 1)) {\n        return 1;\n    } else {\n        return 2;\n    }\n}\nfun g(a, b) {\n    return a;\n}",
+        { "fun f(a) {\n    if (g(a, 1)) {\n        return 1;\n    } else {\n        return 2;\n    }\n}", "\nfun g(a, b) {\n    return a;\n}" });
+
+    // comments go with the statement after them, and trailing ones are a piece of their own
+    check("# a; b }\nlet x = 1; # c; {\nexit(x);\n# done; }\n", { "# a; b }\nlet x = 1;", " # c; {\nexit(x);", "\n# done; }\n" });
+    check("let x = 1;\n\n   \n", { "let x = 1;" });
+
+    // strings
+    check("import \"a;b}.og\";\nimport \"#c.og\";\nexit(0);", { "import \"a;b}.og\";", "\nimport \"#c.og\";", "\nexit(0);" });
+    check("import \"unterminated;", { "import \"unterminated;" });
+
+    if (!failed) {
+        std::cout << "split_statements passed" << std::endl;
+    }
+    return failed;
+}